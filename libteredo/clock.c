@@ -34,6 +34,7 @@
 #include <pthread.h>
 
 #include "clock.h"
+#include "transport.h"
 #include "debug.h"
 
 static clockid_t coarse_clock_id; /* Coarse clock */
@@ -66,6 +67,10 @@ static void teredo_clock_select (void)
 
 unsigned long teredo_clock (void)
 {
+	const teredo_transport *tr = teredo_get_transport ();
+	if ((tr != NULL) && (tr->clock != NULL))
+		return tr->clock (tr->opaque);
+
 	struct timespec ts;
 
 	clock_gettime (coarse_clock_id, &ts);
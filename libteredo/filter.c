@@ -0,0 +1,406 @@
+/*
+ * filter.c - In-kernel early drop of invalid Teredo packets
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
+#ifdef SO_MEMINFO
+# include <linux/sock_diag.h>
+#endif
+
+#include "teredo.h"
+#include "filter.h"
+
+#if defined (HAVE_LINUX_FILTER_H) && defined (SO_ATTACH_FILTER)
+/*
+ * Classic BPF program generation.
+ *
+ * UDP socket filters see the datagram from the UDP header onward; the IPv4
+ * header is reachable through the SKF_NET_OFF negative offset. Out-of-bounds
+ * loads terminate the program with a zero verdict, i.e. drop the packet,
+ * which is exactly what teredo_recv() would do with truncated headers.
+ */
+enum
+{
+	L_NEXT, /* fall through */
+	L_ACCEPT,
+	L_DROP,
+	L_NOAUTH,
+	L_ORIG,
+	L_IPV6,
+	L_BUBBLE,
+	L_SOURCE,
+	L_CLASS_B,
+	L_CLASS_C,
+	L_CLASS_D,
+	L_MAX
+};
+
+#define BPF_MAX_INSNS TEREDO_FILTER_MAX_INSNS
+
+typedef struct bpf_builder
+{
+	struct sock_filter insn[BPF_MAX_INSNS];
+	uint8_t jt[BPF_MAX_INSNS], jf[BPF_MAX_INSNS];
+	unsigned label[L_MAX];
+	unsigned count;
+} bpf_builder;
+
+static void bpf_jump (bpf_builder *b, uint16_t code, uint32_t k,
+                      unsigned jt, unsigned jf)
+{
+	assert (b->count < BPF_MAX_INSNS);
+	b->insn[b->count] = (struct sock_filter)BPF_JUMP (code, k, 0, 0);
+	b->jt[b->count] = jt;
+	b->jf[b->count] = jf;
+	b->count++;
+}
+
+static void bpf_stmt (bpf_builder *b, uint16_t code, uint32_t k)
+{
+	bpf_jump (b, code, k, L_NEXT, L_NEXT);
+}
+
+static void bpf_label (bpf_builder *b, unsigned label)
+{
+	b->label[label] = b->count;
+}
+
+/**
+ * Resolves forward jumps to labels.
+ */
+static void bpf_link (bpf_builder *b)
+{
+	for (unsigned i = 0; i < b->count; i++)
+	{
+		if (b->jt[i] != L_NEXT)
+		{
+			assert (b->label[b->jt[i]] > i);
+			b->insn[i].jt = b->label[b->jt[i]] - (i + 1);
+		}
+		if (b->jf[i] != L_NEXT)
+		{
+			assert (b->label[b->jf[i]] > i);
+			b->insn[i].jf = b->label[b->jf[i]] - (i + 1);
+		}
+
+		/* Unconditional jumps take the offset from k */
+		if (b->insn[i].code == (BPF_JMP|BPF_JA))
+			b->insn[i].k = b->insn[i].jt, b->insn[i].jt = 0;
+	}
+}
+
+#define UDP_HDR_LEN 8
+
+static void bpf_build (bpf_builder *b, enum teredo_filter_mode mode)
+{
+	b->count = 0;
+
+	/* Skips the authentication header, if any (length is variable) */
+	bpf_stmt (b, BPF_LD|BPF_H|BPF_ABS, UDP_HDR_LEN);
+	bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, teredo_auth_hdr, L_NEXT, L_NOAUTH);
+	bpf_stmt (b, BPF_LD|BPF_B|BPF_ABS, UDP_HDR_LEN + 2); /* ID length */
+	bpf_stmt (b, BPF_MISC|BPF_TAX, 0);
+	bpf_stmt (b, BPF_LD|BPF_B|BPF_ABS, UDP_HDR_LEN + 3); /* Auth length */
+	bpf_stmt (b, BPF_ALU|BPF_ADD|BPF_X, 0);
+	bpf_stmt (b, BPF_ALU|BPF_ADD|BPF_K, UDP_HDR_LEN + 13);
+	bpf_stmt (b, BPF_MISC|BPF_TAX, 0);
+	bpf_jump (b, BPF_JMP|BPF_JA, 0, L_ORIG, L_NEXT);
+	bpf_label (b, L_NOAUTH);
+	bpf_stmt (b, BPF_LDX|BPF_W|BPF_IMM, UDP_HDR_LEN);
+
+	/* Skips the origin indication, if any */
+	bpf_label (b, L_ORIG);
+	bpf_stmt (b, BPF_LD|BPF_H|BPF_IND, 0);
+	bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, teredo_orig_ind, L_NEXT, L_IPV6);
+	bpf_stmt (b, BPF_MISC|BPF_TXA, 0);
+	bpf_stmt (b, BPF_ALU|BPF_ADD|BPF_K, 8);
+	bpf_stmt (b, BPF_MISC|BPF_TAX, 0);
+
+	/* X = IPv6 header offset, M[0] = X, M[1] = IPv6 packet length */
+	bpf_label (b, L_IPV6);
+	bpf_stmt (b, BPF_STX, 0);
+	bpf_stmt (b, BPF_LD|BPF_W|BPF_LEN, 0);
+	bpf_stmt (b, BPF_ALU|BPF_SUB|BPF_X, 0);
+	bpf_jump (b, BPF_JMP|BPF_JGE|BPF_K, 40, L_NEXT, L_DROP);
+	bpf_stmt (b, BPF_ST, 1);
+
+	/* IPv6 version */
+	bpf_stmt (b, BPF_LD|BPF_B|BPF_IND, 0);
+	bpf_stmt (b, BPF_ALU|BPF_AND|BPF_K, 0xf0);
+	bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0x60, L_NEXT, L_DROP);
+
+	/* IPv6 payload length must not exceed the UDP payload */
+	bpf_stmt (b, BPF_LD|BPF_H|BPF_IND, 4);
+	bpf_stmt (b, BPF_ALU|BPF_ADD|BPF_K, 40);
+	bpf_stmt (b, BPF_LDX|BPF_W|BPF_MEM, 1);
+	bpf_jump (b, BPF_JMP|BPF_JGT|BPF_X, 0, L_DROP, L_NEXT);
+	bpf_stmt (b, BPF_LDX|BPF_W|BPF_MEM, 0);
+
+	switch (mode)
+	{
+		case TEREDO_FILTER_CLIENT:
+			break;
+
+		case TEREDO_FILTER_RELAY:
+			/* Relays only accept packets from Teredo clients */
+			bpf_stmt (b, BPF_LD|BPF_W|BPF_IND, 8);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, TEREDO_PREFIX,
+			          L_NEXT, L_DROP);
+			/* Multicast destinations are never accepted by relays */
+			bpf_stmt (b, BPF_LD|BPF_B|BPF_IND, 24);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xff, L_DROP, L_ACCEPT);
+			break;
+
+		case TEREDO_FILTER_SERVER:
+			/* Teredo server case number 2: bubble or ICMPv6 only */
+			bpf_stmt (b, BPF_LD|BPF_B|BPF_IND, 6);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_NONE,
+			          L_BUBBLE, L_NEXT);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_ICMPV6,
+			          L_NEXT, L_DROP);
+
+			/*
+			 * ICMPv6 size limit (see teredo_process_packet()), which does
+			 * not apply to router messages (to all-routers or to our
+			 * link-local address).
+			 */
+			bpf_stmt (b, BPF_LD|BPF_H|BPF_IND, 4);
+			bpf_jump (b, BPF_JMP|BPF_JGT|BPF_K, 88, L_NEXT, L_SOURCE);
+			bpf_stmt (b, BPF_LD|BPF_B|BPF_IND, 24);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xff, L_SOURCE, L_NEXT);
+			bpf_stmt (b, BPF_LD|BPF_H|BPF_IND, 24);
+			bpf_stmt (b, BPF_ALU|BPF_AND|BPF_K, 0xffc0);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xfe80, L_SOURCE, L_DROP);
+
+			bpf_label (b, L_BUBBLE);
+			bpf_stmt (b, BPF_LD|BPF_H|BPF_IND, 4);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0, L_NEXT, L_DROP);
+
+			/*
+			 * Teredo server case number 3: source must be IPv4 global
+			 * unicast. This mirrors is_ipv4_global_unicast().
+			 */
+			bpf_label (b, L_SOURCE);
+			bpf_stmt (b, BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12);
+			bpf_stmt (b, BPF_ST, 2);
+			bpf_stmt (b, BPF_ALU|BPF_RSH|BPF_K, 24);
+			bpf_jump (b, BPF_JMP|BPF_JGE|BPF_K, 128, L_CLASS_B, L_NEXT);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0, L_DROP, L_NEXT);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 10, L_DROP, L_NEXT);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 127, L_DROP, L_ACCEPT);
+
+			bpf_label (b, L_CLASS_B);
+			bpf_jump (b, BPF_JMP|BPF_JGE|BPF_K, 192, L_CLASS_C, L_NEXT);
+			bpf_stmt (b, BPF_LD|BPF_MEM, 2);
+			bpf_stmt (b, BPF_ALU|BPF_RSH|BPF_K, 16);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xa9fe, L_DROP, L_NEXT);
+			bpf_stmt (b, BPF_ALU|BPF_RSH|BPF_K, 4);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xac1, L_DROP, L_ACCEPT);
+
+			bpf_label (b, L_CLASS_C);
+			bpf_jump (b, BPF_JMP|BPF_JGE|BPF_K, 224, L_CLASS_D, L_NEXT);
+			bpf_stmt (b, BPF_LD|BPF_MEM, 2);
+			bpf_stmt (b, BPF_ALU|BPF_RSH|BPF_K, 16);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xc0a8, L_DROP, L_NEXT);
+			bpf_stmt (b, BPF_LD|BPF_MEM, 2);
+			bpf_stmt (b, BPF_ALU|BPF_RSH|BPF_K, 8);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xc05862, L_DROP, L_ACCEPT);
+
+			bpf_label (b, L_CLASS_D);
+			bpf_jump (b, BPF_JMP|BPF_JGE|BPF_K, 240, L_NEXT, L_DROP);
+			bpf_stmt (b, BPF_LD|BPF_MEM, 2);
+			bpf_jump (b, BPF_JMP|BPF_JEQ|BPF_K, 0xffffffff, L_DROP, L_ACCEPT);
+			break;
+	}
+
+	bpf_label (b, L_ACCEPT);
+	bpf_stmt (b, BPF_RET|BPF_K, 0xffffffff);
+	bpf_label (b, L_DROP);
+	bpf_stmt (b, BPF_RET|BPF_K, 0);
+	bpf_link (b);
+}
+
+
+int teredo_socket_filter (int fd, enum teredo_filter_mode mode)
+{
+	bpf_builder b;
+
+	bpf_build (&b, mode);
+
+	struct sock_fprog prog =
+	{
+		.len = b.count,
+		.filter = b.insn
+	};
+
+	return setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	                   &prog, sizeof (prog)) ? -1 : 0;
+}
+
+
+unsigned teredo_filter_program (enum teredo_filter_mode mode,
+                                struct sock_filter *prog)
+{
+	bpf_builder b;
+
+	bpf_build (&b, mode);
+	memcpy (prog, b.insn, b.count * sizeof (*prog));
+	return b.count;
+}
+
+
+void teredo_socket_unfilter (int fd)
+{
+	setsockopt (fd, SOL_SOCKET, SO_DETACH_FILTER, &(int){ 0 }, sizeof (int));
+}
+#else
+int teredo_socket_filter (int fd, enum teredo_filter_mode mode)
+{
+	(void)fd;
+	(void)mode;
+	errno = ENOSYS;
+	return -1;
+}
+
+
+void teredo_socket_unfilter (int fd)
+{
+	(void)fd;
+}
+
+
+unsigned teredo_filter_program (enum teredo_filter_mode mode,
+                                struct sock_filter *prog)
+{
+	(void)mode;
+	(void)prog;
+	return 0;
+}
+#endif
+
+
+unsigned long teredo_socket_drops (int fd)
+{
+#ifdef SO_MEMINFO
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof (mem);
+
+	if ((getsockopt (fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0)
+	 && (len > SK_MEMINFO_DROPS * sizeof (mem[0])))
+		return mem[SK_MEMINFO_DROPS];
+#else
+	(void)fd;
+#endif
+	return 0;
+}
+
+
+uint32_t teredo_socket_drops_update (atomic_uint_least32_t *last,
+                                     uint32_t dropped)
+{
+	uint_least32_t prev = atomic_load_explicit (last, memory_order_relaxed);
+
+	do
+		/* Wraps around: compare the difference (modulo 2^32) */
+		if ((int32_t)(dropped - prev) <= 0)
+			return 0;
+	while (!atomic_compare_exchange_weak_explicit (last, &prev, dropped,
+	                                               memory_order_relaxed,
+	                                               memory_order_relaxed));
+	return dropped - prev;
+}
+
+
+#ifndef SO_RCVBUFFORCE
+# define SO_RCVBUFFORCE 0
+# define SO_SNDBUFFORCE 0
+#endif
+
+static int teredo_setbuf (int fd, int force, int opt, unsigned size)
+{
+	int val = (size > INT_MAX) ? INT_MAX : size;
+
+	/* Above the system limit if privileged (Linux) */
+	if (force
+	 && (setsockopt (fd, SOL_SOCKET, force, &val, sizeof (val)) == 0))
+		return 0;
+	return setsockopt (fd, SOL_SOCKET, opt, &val, sizeof (val));
+}
+
+
+int teredo_socket_buffers (int fd, unsigned rcvbuf, unsigned sndbuf)
+{
+	int ret = 0;
+
+	if (rcvbuf && teredo_setbuf (fd, SO_RCVBUFFORCE, SO_RCVBUF, rcvbuf))
+		ret = -1;
+	if (sndbuf && teredo_setbuf (fd, SO_SNDBUFFORCE, SO_SNDBUF, sndbuf))
+		ret = -1;
+	return ret;
+}
+
+
+unsigned teredo_socket_grow (int fd, unsigned max)
+{
+	int cur;
+	socklen_t len = sizeof (cur);
+
+	if (getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &cur, &len) || (cur <= 0))
+		return 0;
+
+	unsigned size = cur;
+#ifdef __linux__
+	/* Linux reports twice the set size (to account for overhead) */
+	size /= 2;
+#endif
+	if (size >= max)
+		return 0;
+
+#ifdef SO_MEMINFO
+	uint32_t mem[SK_MEMINFO_VARS];
+
+	len = sizeof (mem);
+	if ((getsockopt (fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0)
+	 && (len > SK_MEMINFO_RMEM_ALLOC * sizeof (mem[0]))
+	 && (mem[SK_MEMINFO_RMEM_ALLOC] < (unsigned)cur / 2))
+		return 0;
+#endif
+
+	size = (size > max / 2) ? max : (2 * size);
+	if (teredo_setbuf (fd, SO_RCVBUFFORCE, SO_RCVBUF, size))
+		return 0;
+	return size;
+}
@@ -0,0 +1,130 @@
+/*
+ * filter.h - In-kernel early drop of invalid Teredo packets
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_FILTER_H
+# define LIBTEREDO_FILTER_H
+
+# include <stdint.h>
+# include <stdatomic.h>
+
+/**
+ * Socket filter flavours, matching the stateless checks of the code that
+ * will process the packets in userland.
+ */
+enum teredo_filter_mode
+{
+	/** Well-formed IPv6 packets only (Teredo client) */
+	TEREDO_FILTER_CLIENT,
+	/** Client checks, plus Teredo source and unicast destination (relay) */
+	TEREDO_FILTER_RELAY,
+	/** Teredo server cases 1 to 3, plus the ICMPv6 size limit */
+	TEREDO_FILTER_SERVER,
+};
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Attaches a socket filter to a Teredo UDP socket, so that packets which
+ * would be rejected anyway are dropped by the kernel instead of being copied
+ * to userland. The filter skips the Teredo authentication and origin
+ * indication headers, if any, and applies its checks to the IPv6 packet
+ * that follows. The authentication itself is left to userland.
+ *
+ * @param fd socket as returned by teredo_socket()
+ * @param mode filter flavour
+ *
+ * @return 0 on success, -1 on error or if not supported by the system
+ * (packets are then filtered in userland only).
+ */
+int teredo_socket_filter (int fd, enum teredo_filter_mode mode);
+
+/**
+ * Removes any socket filter attached with teredo_socket_filter().
+ */
+void teredo_socket_unfilter (int fd);
+
+struct sock_filter;
+
+/** Maximum number of instructions of a socket filter program */
+# define TEREDO_FILTER_MAX_INSNS 96
+
+/**
+ * Generates the classic BPF program which teredo_socket_filter() attaches
+ * (so that it can be checked against arbitrary packets).
+ *
+ * @param mode filter flavour
+ * @param prog [out] room for TEREDO_FILTER_MAX_INSNS instructions
+ *
+ * @return instructions count, or 0 if not supported by the system.
+ */
+unsigned teredo_filter_program (enum teredo_filter_mode mode,
+                                struct sock_filter *prog);
+
+/**
+ * Returns the number of packets the kernel dropped for a socket.
+ * This includes packets rejected by the socket filter, as well as those
+ * lost to receive buffer overflows.
+ *
+ * @return packets count, or 0 if not supported by the system.
+ */
+unsigned long teredo_socket_drops (int fd);
+
+/**
+ * Accounts for the kernel drops count reported with a received packet
+ * (see teredo_packet.rx_dropped). The packets of a socket may be handled
+ * by several threads, hence out of order: older counts are ignored.
+ *
+ * @param last last count seen for the socket (initially zero)
+ * @param dropped count reported with the packet
+ *
+ * @return number of packets dropped since the previous call.
+ */
+uint32_t teredo_socket_drops_update (atomic_uint_least32_t *last,
+                                     uint32_t dropped);
+
+/**
+ * Sets the receive and send buffer sizes of a socket. If privileged, the
+ * system-wide limits are ignored.
+ *
+ * @param rcvbuf receive buffer size (bytes), or 0 to leave unchanged
+ * @param sndbuf send buffer size (bytes), or 0 to leave unchanged
+ *
+ * @return 0 on success, -1 on error.
+ */
+int teredo_socket_buffers (int fd, unsigned rcvbuf, unsigned sndbuf);
+
+/**
+ * Doubles the receive buffer of a socket, up to a ceiling, after the kernel
+ * dropped packets. Nothing is done unless the receive queue is at least
+ * half full (so that packets rejected by the socket filter do not count).
+ *
+ * @param max buffer size ceiling (bytes)
+ *
+ * @return the new buffer size, or 0 if unchanged.
+ */
+unsigned teredo_socket_grow (int fd, unsigned max);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_FILTER_H */
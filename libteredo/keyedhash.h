@@ -0,0 +1,71 @@
+/*
+ * keyedhash.h - Keyed hash functions used for internal authenticators
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_KEYEDHASH_H
+# define LIBTEREDO_KEYEDHASH_H
+
+# include <stdint.h>
+# include "md5.h"
+
+/** Secret key size (bytes) */
+# define TEREDO_HASH_KEY_LEN 16
+/** Keyed hash output size (bytes) */
+# define TEREDO_HASH_LEN 16
+
+/** SipHash internal state */
+typedef struct teredo_siphash_state
+{
+	uint64_t v[4];
+	uint8_t buf[8]; /* pending partial word */
+	uint64_t len; /* total message length (bytes) */
+} teredo_siphash_state;
+
+/**
+ * Per-message hashing context.
+ */
+typedef union teredo_hash_ctx
+{
+	md5_state_t md5;
+	teredo_siphash_state sip;
+} teredo_hash_ctx;
+
+/**
+ * Keyed hash algorithm.
+ *
+ * The key is process-wide: setkey() is called once when the key is
+ * (re)generated, and may precompute any key-dependent state, so that the
+ * per-message functions only clone it.
+ */
+typedef struct teredo_keyed_hash
+{
+	const char *name;
+	void (*setkey) (const uint8_t *key);
+	void (*init) (teredo_hash_ctx *ctx);
+	void (*update) (teredo_hash_ctx *ctx, const void *data, size_t len);
+	void (*final) (teredo_hash_ctx *ctx, uint8_t *hash);
+} teredo_keyed_hash;
+
+/** HMAC-MD5 (RFC 2104) */
+extern const teredo_keyed_hash teredo_hmac_md5;
+/** SipHash-2-4 with 128-bits output */
+extern const teredo_keyed_hash teredo_siphash;
+
+#endif /* ifndef LIBTEREDO_KEYEDHASH_H */
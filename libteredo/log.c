@@ -0,0 +1,543 @@
+/*
+ * log.c - Non-blocking logging
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "tunnel.h"
+#include "log.h"
+#include "debug.h"
+#include "stats.h"
+
+#define LOG_RING_SIZE 32 /* records per thread, must be a power of two */
+#define LOG_STR_SIZE  96 /* room for copied string arguments */
+
+typedef struct teredo_log_record
+{
+	uint64_t time; /* nanoseconds since the Epoch */
+	uint16_t id;
+	int32_t err;
+	int64_t args[2];
+	char str[LOG_STR_SIZE]; /* nul-separated strings */
+} teredo_log_record;
+
+/* Ring of one thread: only that thread writes, only the drain reads */
+typedef struct teredo_log_ring
+{
+	atomic_uint head; /* next record to write */
+	atomic_uint tail; /* next record to read */
+	atomic_uint dropped; /* messages lost as the ring was full */
+	unsigned reported; /* lost messages already reported */
+	bool dead; /* thread exited */
+	struct teredo_log_ring *next;
+	teredo_log_record rec[LOG_RING_SIZE];
+} teredo_log_ring;
+
+static const struct
+{
+	int priority;
+	const char *fmt;
+} formats[TEREDO_LOG_MAX] =
+{
+	[TEREDO_LOG_AUTH_FAILED] =
+		{ LOG_ERR, N_("Authentication with server failed.") },
+	[TEREDO_LOG_TIME_DRIFT] =
+		{ LOG_WARNING, N_("Too much time drift. Resynchronizing.") },
+	[TEREDO_LOG_RESOLVE_FAILED] =
+		{ LOG_ERR, N_("Cannot resolve Teredo server address \"%s\": %s") },
+	[TEREDO_LOG_SERVER_NOT_GLOBAL] =
+		{ LOG_ERR, N_("Teredo server has a non global IPv4 address.") },
+	[TEREDO_LOG_NEW_ADDRESS] =
+		{ LOG_NOTICE, N_("New Teredo address/MTU") },
+	[TEREDO_LOG_NO_REPLY] =
+		{ LOG_INFO, N_("No reply from Teredo server") },
+	[TEREDO_LOG_LOST] =
+		{ LOG_NOTICE, N_("Lost Teredo connectivity") },
+	[TEREDO_LOG_MULTIPLE_PREFIXES] =
+		{ LOG_ERR, N_("Multiple Teredo prefixes received") },
+	[TEREDO_LOG_FAILOVER] =
+		{ LOG_NOTICE, N_("Switched to Teredo server %s") },
+};
+
+/* The lock serializes the drain, synchronous messages and settings */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static teredo_log_ring *rings = NULL;
+static teredo_log_cb log_cb = NULL;
+static void *log_opaque;
+static bool stopping;
+
+/* Rings of new threads, pushed without the lock */
+static _Atomic (teredo_log_ring *) incoming = NULL;
+static atomic_bool pending = false;
+static atomic_bool running = false;
+
+static pthread_mutex_t startstop = PTHREAD_MUTEX_INITIALIZER;
+static unsigned users = 0;
+static pthread_t drain;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static _Thread_local teredo_log_ring *self = NULL;
+
+
+static void log_emit (int priority, uint64_t time, const char *msg)
+{
+	if (log_cb != NULL)
+	{
+		struct timespec ts = {
+			.tv_sec = time / 1000000000,
+			.tv_nsec = time % 1000000000,
+		};
+
+		log_cb (log_opaque, priority, &ts, msg);
+	}
+	else
+		syslog (priority, "%s", msg);
+}
+
+
+static size_t append (char *buf, size_t len, size_t size, const char *s)
+{
+	while ((*s != '\0') && (len + 1 < size))
+		buf[len++] = *s++;
+	return len;
+}
+
+
+/**
+ * Formats a record. The arguments are consumed in the order of the
+ * (possibly translated) format conversions.
+ */
+static void record_format (const teredo_log_record *r, char *buf, size_t size)
+{
+	const char *fmt = _(formats[r->id].fmt);
+	size_t len = 0, str = 0;
+	unsigned n = 0;
+
+	while (*fmt != '\0')
+	{
+		char tmp[24];
+		const char *s = tmp;
+
+		if (*fmt != '%')
+		{
+			tmp[0] = *(fmt++);
+			tmp[1] = '\0';
+			len = append (buf, len, size, tmp);
+			continue;
+		}
+
+		switch (*(++fmt))
+		{
+			case 's':
+				s = (str < LOG_STR_SIZE) ? (r->str + str) : "";
+				str += strlen (s) + 1;
+				break;
+			case 'd':
+				snprintf (tmp, sizeof (tmp), "%"PRId64,
+				          (n < 2) ? r->args[n] : 0);
+				n++;
+				break;
+			case 'u':
+				snprintf (tmp, sizeof (tmp), "%"PRIu64,
+				          (uint64_t)((n < 2) ? r->args[n] : 0));
+				n++;
+				break;
+			case 'm':
+				s = strerror (r->err);
+				break;
+			case '%':
+				s = "%";
+				break;
+			case '\0':
+				continue;
+			default:
+				s = "";
+		}
+		fmt++;
+		len = append (buf, len, size, s);
+	}
+	buf[len] = '\0';
+}
+
+
+/**
+ * Stores a message and its arguments.
+ */
+static void record_fill (teredo_log_record *r, teredo_log_id id, int err,
+                         va_list ap)
+{
+	size_t len = 0;
+	unsigned n = 0;
+
+	r->time = teredo_stats_now ();
+	r->id = id;
+	r->err = err;
+
+	for (const char *p = formats[id].fmt; (p = strchr (p, '%')) != NULL; p++)
+		switch (*(++p))
+		{
+			case 's':
+			{
+				const char *s = va_arg (ap, const char *);
+
+				if (len < LOG_STR_SIZE)
+				{
+					size_t l = strnlen (s, LOG_STR_SIZE - len - 1);
+
+					memcpy (r->str + len, s, l);
+					r->str[len + l] = '\0';
+					len += l + 1;
+				}
+				break;
+			}
+			case 'd':
+			{
+				int v = va_arg (ap, int);
+				if (n < 2)
+					r->args[n++] = v;
+				break;
+			}
+			case 'u':
+			{
+				unsigned v = va_arg (ap, unsigned);
+				if (n < 2)
+					r->args[n++] = v;
+				break;
+			}
+			case '\0':
+				p--;
+				break;
+		}
+}
+
+
+/**
+ * Formats and emits all pending records (with the lock held).
+ */
+static void log_flush (void)
+{
+	teredo_log_ring *r = atomic_exchange (&incoming, NULL);
+
+	while (r != NULL)
+	{	/* Adopt the rings of new threads */
+		teredo_log_ring *next = r->next;
+
+		r->next = rings;
+		rings = r;
+		r = next;
+	}
+
+	for (teredo_log_ring **pp = &rings; (r = *pp) != NULL;)
+	{
+		unsigned tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+		unsigned head = atomic_load_explicit (&r->head, memory_order_acquire);
+
+		while (tail != head)
+		{
+			const teredo_log_record *rec = r->rec + (tail % LOG_RING_SIZE);
+			char msg[256];
+
+			record_format (rec, msg, sizeof (msg));
+			log_emit (formats[rec->id].priority, rec->time, msg);
+			atomic_store_explicit (&r->tail, ++tail, memory_order_release);
+		}
+
+		unsigned dropped = atomic_load_explicit (&r->dropped,
+		                                         memory_order_relaxed);
+		if (dropped != r->reported)
+		{
+			char msg[64];
+
+			snprintf (msg, sizeof (msg), _("%u log message(s) lost"),
+			          dropped - r->reported);
+			log_emit (LOG_WARNING, teredo_stats_now (), msg);
+			r->reported = dropped;
+		}
+
+		if (r->dead)
+		{
+			*pp = r->next;
+			free (r);
+		}
+		else
+			pp = &r->next;
+	}
+}
+
+
+static void *log_thread (void *data)
+{
+	(void)data;
+
+	pthread_mutex_lock (&lock);
+	while (!stopping)
+	{
+		if (atomic_exchange (&pending, false))
+		{
+			log_flush ();
+			continue;
+		}
+
+		/* Writers do not block on the lock: if one did not get it to
+		 * signal us, its messages are only handled a bit later. */
+		struct timespec ts;
+
+		clock_gettime (CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait (&wakeup, &lock, &ts);
+	}
+	log_flush ();
+	pthread_mutex_unlock (&lock);
+	return NULL;
+}
+
+
+/**
+ * Releases the ring of an exiting thread.
+ */
+static void ring_detach (void *data)
+{
+	teredo_log_ring *r = data;
+
+	pthread_mutex_lock (&lock);
+	r->dead = true;
+	if (atomic_load (&running))
+	{	/* Let the drain handle pending messages */
+		atomic_store (&pending, true);
+		pthread_cond_signal (&wakeup);
+	}
+	else
+		log_flush ();
+	pthread_mutex_unlock (&lock);
+}
+
+
+static void log_init (void)
+{
+	pthread_key_create (&key, ring_detach);
+}
+
+
+static teredo_log_ring *ring_attach (void)
+{
+	teredo_log_ring *r = malloc (sizeof (*r));
+
+	pthread_once (&once, log_init);
+	if (r == NULL)
+		return NULL;
+
+	atomic_init (&r->head, 0);
+	atomic_init (&r->tail, 0);
+	atomic_init (&r->dropped, 0);
+	r->reported = 0;
+	r->dead = false;
+
+	if (pthread_setspecific (key, r))
+	{
+		free (r);
+		return NULL;
+	}
+
+	/* Lock-free push: the drain adopts the ring later */
+	r->next = atomic_load (&incoming);
+	while (!atomic_compare_exchange_weak (&incoming, &r->next, r));
+
+	self = r;
+	return r;
+}
+
+
+void teredo_log (teredo_log_id id, ...)
+{
+	int err = errno;
+	va_list ap;
+
+	assert (id < TEREDO_LOG_MAX);
+
+	if (!atomic_load_explicit (&running, memory_order_acquire))
+	{	/* No background thread: synchronous logging */
+		teredo_log_record rec;
+		char msg[256];
+
+		va_start (ap, id);
+		record_fill (&rec, id, err, ap);
+		va_end (ap);
+		record_format (&rec, msg, sizeof (msg));
+
+		int canc;
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &canc);
+		pthread_mutex_lock (&lock);
+		log_flush ();
+		log_emit (formats[id].priority, rec.time, msg);
+		pthread_mutex_unlock (&lock);
+		pthread_setcancelstate (canc, NULL);
+		errno = err;
+		return;
+	}
+
+	teredo_log_ring *r = (self != NULL) ? self : ring_attach ();
+	if (r == NULL)
+	{
+		teredo_count (TEREDO_LOG_DROPPED);
+		errno = err;
+		return;
+	}
+
+	unsigned head = atomic_load_explicit (&r->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit (&r->tail, memory_order_acquire);
+
+	if (head - tail >= LOG_RING_SIZE)
+	{	/* Full: never wait for the drain */
+		unsigned d = atomic_load_explicit (&r->dropped, memory_order_relaxed);
+		atomic_store_explicit (&r->dropped, d + 1, memory_order_relaxed);
+		teredo_count (TEREDO_LOG_DROPPED);
+		errno = err;
+		return;
+	}
+
+	va_start (ap, id);
+	record_fill (r->rec + (head % LOG_RING_SIZE), id, err, ap);
+	va_end (ap);
+	atomic_store_explicit (&r->head, head + 1, memory_order_release);
+
+	atomic_store (&pending, true);
+	if (pthread_mutex_trylock (&lock) == 0)
+	{
+		pthread_cond_signal (&wakeup);
+		pthread_mutex_unlock (&lock);
+	}
+	errno = err;
+}
+
+
+/**
+ * Replaces %m with the error message in a format string.
+ */
+static void expand_errno (char *buf, const char *fmt, const char *errmsg)
+{
+	while (*fmt != '\0')
+	{
+		if ((fmt[0] == '%') && (fmt[1] == 'm'))
+		{
+			for (const char *s = errmsg; *s != '\0'; s++)
+			{
+				if (*s == '%')
+					*(buf++) = '%';
+				*(buf++) = *s;
+			}
+			fmt += 2;
+			continue;
+		}
+		if ((fmt[0] == '%') && (fmt[1] == '%'))
+			*(buf++) = *(fmt++);
+		*(buf++) = *(fmt++);
+	}
+	*buf = '\0';
+}
+
+
+void teredo_log_now (int priority, const char *fmt, ...)
+{
+	int err = errno, canc;
+	va_list ap;
+
+	va_start (ap, fmt);
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &canc);
+	pthread_mutex_lock (&lock);
+	log_flush ();
+
+	if (log_cb != NULL)
+	{
+		const char *errmsg = strerror (err);
+		char f[strlen (fmt) * (2 * strlen (errmsg) + 1) + 1], msg[256];
+
+		expand_errno (f, fmt, errmsg);
+		vsnprintf (msg, sizeof (msg), f, ap);
+		log_emit (priority, teredo_stats_now (), msg);
+	}
+	else
+	{
+		errno = err;
+		vsyslog (priority, fmt, ap);
+	}
+
+	pthread_mutex_unlock (&lock);
+	pthread_setcancelstate (canc, NULL);
+	va_end (ap);
+	errno = err;
+}
+
+
+void teredo_set_log_callback (teredo_log_cb cb, void *opaque)
+{
+	pthread_mutex_lock (&lock);
+	log_flush (); /* pending messages go to the previous destination */
+	log_cb = cb;
+	log_opaque = opaque;
+	pthread_mutex_unlock (&lock);
+}
+
+
+void teredo_log_start (void)
+{
+	pthread_mutex_lock (&startstop);
+	if (users++ == 0)
+	{
+		stopping = false;
+		if (pthread_create (&drain, NULL, log_thread, NULL) == 0)
+			atomic_store (&running, true);
+	}
+	pthread_mutex_unlock (&startstop);
+}
+
+
+void teredo_log_stop (void)
+{
+	pthread_mutex_lock (&startstop);
+	assert (users > 0);
+	if ((--users == 0) && atomic_load (&running))
+	{
+		atomic_store (&running, false);
+		pthread_mutex_lock (&lock);
+		stopping = true;
+		pthread_cond_signal (&wakeup);
+		pthread_mutex_unlock (&lock);
+		pthread_join (drain, NULL);
+	}
+	pthread_mutex_unlock (&startstop);
+}
@@ -0,0 +1,76 @@
+/*
+ * log.h - Non-blocking logging
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_LOG_H
+# define LIBTEREDO_LOG_H
+
+/*
+ * Messages logged by packet processing and maintenance threads are stored
+ * as compact binary records (message identifier, arguments, errno value and
+ * timestamp) in a lock-free ring of the calling thread. A background thread
+ * formats them and passes them to the log callback (see
+ * teredo_set_log_callback()), or to syslog(). When a ring is full, messages
+ * are dropped and counted, so that logging never blocks.
+ */
+
+/** Asynchronous log messages */
+typedef enum teredo_log_id
+{
+	TEREDO_LOG_AUTH_FAILED,
+	TEREDO_LOG_TIME_DRIFT,
+	TEREDO_LOG_RESOLVE_FAILED, /* server name, error message */
+	TEREDO_LOG_SERVER_NOT_GLOBAL,
+	TEREDO_LOG_NEW_ADDRESS,
+	TEREDO_LOG_NO_REPLY,
+	TEREDO_LOG_LOST,
+	TEREDO_LOG_MULTIPLE_PREFIXES,
+	TEREDO_LOG_FAILOVER, /* server name */
+
+	TEREDO_LOG_MAX
+} teredo_log_id;
+
+/**
+ * Logs a message without blocking. The arguments must match the message
+ * format: %s (strings are copied, and truncated if too long), %d, %u or
+ * %m (errno value at the time of the call).
+ */
+void teredo_log (teredo_log_id id, ...);
+
+/**
+ * Logs a message synchronously, after the pending asynchronous ones.
+ * Meant for setup errors, the format is as for syslog().
+ */
+void teredo_log_now (int priority, const char *fmt, ...);
+
+/**
+ * Starts the background thread formatting asynchronous messages (if not
+ * running yet). Until then, or if it cannot be started, messages are
+ * logged synchronously.
+ */
+void teredo_log_start (void);
+
+/**
+ * Flushes the pending messages, and stops the background thread once
+ * teredo_log_stop() was called as many times as teredo_log_start().
+ */
+void teredo_log_stop (void);
+
+#endif /* ifndef LIBTEREDO_LOG_H */
@@ -53,6 +53,23 @@
 #include "maintain.h"
 #include "v4global.h" // is_ipv4_global_unicast()
 #include "debug.h"
+#include "stats.h"
+#include "log.h"
+
+/* Primary and secondary servers */
+#define MAX_SERVERS 2
+
+typedef struct teredo_server_info
+{
+	char *name;
+	uint32_t ip; /* 0 if not resolved */
+	unsigned char nonce[8];
+	bool solicited; /* router advertisement expected */
+
+	/* name resolution results */
+	uint32_t resolved;
+	int error;
+} teredo_server_info;
 
 struct teredo_maintenance
 {
@@ -67,10 +84,12 @@ struct teredo_maintenance
 		teredo_state_cb cb;
 		void *opaque;
 	} state;
-	char *server;
+
+	teredo_server_info servers[MAX_SERVERS];
+	unsigned server_count;
+	unsigned current; /* server in use (or last used) */
 
 	uint32_t server_ip;
-	unsigned char nonce[8];
 
 	unsigned qualification_delay;
 	unsigned qualification_retries;
@@ -78,6 +97,8 @@ struct teredo_maintenance
 	unsigned restart_delay;
 };
 
+#define NO_SERVER MAX_SERVERS
+
 
 /**
  * Resolves an IPv4 address (thread-safe).
@@ -103,6 +124,22 @@ static int getipv4byname (const char *restrict name, uint32_t *restrict ipv4)
 }
 
 
+/**
+ * Checks that a router advertisement carries the address of one of the
+ * servers, not necessarily the solicited one: ServerAddress2 used to be the
+ * secondary address of the (single) server, whose router advertisements
+ * carry its primary address in any case.
+ * Must be called with the lock held.
+ */
+static bool is_server_ip (const teredo_maintenance *m, uint32_t ip)
+{
+	for (unsigned i = 0; i < m->server_count; i++)
+		if ((m->servers[i].ip != 0) && (m->servers[i].ip == ip))
+			return true;
+	return false;
+}
+
+
 /**
  * Checks and parses a received Router Advertisement.
  *
@@ -130,25 +167,32 @@ int teredo_maintenance_process (teredo_maintenance *restrict m,
 	/* TODO: fail instead of ignoring the packet? */
 	if (packet->auth_fail)
 	{
-		syslog (LOG_ERR, _("Authentication with server failed."));
+		teredo_log (TEREDO_LOG_AUTH_FAILED);
 		return EACCES;
 	}
 
 	pthread_mutex_lock(&m->lock);
-	if (m->state.state.up /* Already up, not expecting message */
-	 || m->server_ip == 0 /* Server not resolved yet */
-	 || memcmp (packet->auth_nonce, m->nonce, 8) /* Nonce mismatch */)
+
+	unsigned i = NO_SERVER;
+	if (!m->state.state.up) /* Already up, not expecting message */
+		for (i = 0; i < m->server_count; i++)
+			if (m->servers[i].solicited
+			 && !memcmp (packet->auth_nonce, m->servers[i].nonce, 8))
+				break;
+
+	if (i >= m->server_count) /* Nonce mismatch */
 		ret = EPERM;
 	else
 	if (teredo_parse_ra (packet, &state.addr, false /*cone*/, &state.mtu)
 	/* TODO: try to work-around incorrect server IP */
-	 || state.addr.teredo.server_ip != m->server_ip)
+	 || !is_server_ip (m, state.addr.teredo.server_ip))
 		ret = EINVAL;
 	else
 	{	/* Valid router advertisement received! */
 		state.ipv4 = packet->dest_ipv4;
 
 		m->state.state = state;
+		m->current = i;
 		pthread_cond_signal(&m->received);
 	}
 	pthread_mutex_unlock(&m->lock);
@@ -170,7 +214,7 @@ checkTimeDrift (struct timespec *ts)
 	 || ((now.tv_sec == ts->tv_sec) && (now.tv_nsec > ts->tv_nsec)))
 	{
 		/* process stopped, CPU starved or system suspended */
-		syslog (LOG_WARNING, _("Too much time drift. Resynchronizing."));
+		teredo_log (TEREDO_LOG_TIME_DRIFT);
 		*ts = now;
 		return false;
 	}
@@ -178,6 +222,107 @@ checkTimeDrift (struct timespec *ts)
 }
 
 
+static void *resolve_thread (void *data)
+{
+	teredo_server_info *s = data;
+
+	s->error = getipv4byname (s->name, &s->resolved);
+	return NULL;
+}
+
+
+typedef struct teredo_resolvers
+{
+	pthread_t threads[MAX_SERVERS];
+	bool running[MAX_SERVERS];
+} teredo_resolvers;
+
+
+static void resolvers_cleanup (void *data)
+{
+	teredo_resolvers *r = data;
+
+	for (unsigned i = 0; i < MAX_SERVERS; i++)
+		if (r->running[i])
+			pthread_cancel (r->threads[i]);
+	for (unsigned i = 0; i < MAX_SERVERS; i++)
+		if (r->running[i])
+			pthread_join (r->threads[i], NULL);
+}
+
+
+/**
+ * Resolves the server names, all at once so that a slow or failing name
+ * does not delay the other one.
+ */
+static void resolve_servers (teredo_maintenance *m)
+{
+	teredo_resolvers r;
+
+	for (unsigned i = 0; i < MAX_SERVERS; i++)
+		r.running[i] = false;
+
+	pthread_cleanup_push (resolvers_cleanup, &r);
+	for (unsigned i = 1; i < m->server_count; i++)
+		r.running[i] = !pthread_create (r.threads + i, NULL, resolve_thread,
+		                                m->servers + i);
+	resolve_thread (m->servers);
+	for (unsigned i = 1; i < m->server_count; i++)
+	{
+		if (r.running[i])
+		{
+			pthread_join (r.threads[i], NULL);
+			r.running[i] = false;
+		}
+		else
+			resolve_thread (m->servers + i);
+	}
+	pthread_cleanup_pop (0);
+}
+
+
+/**
+ * Resolves the server names, and checks the results.
+ * @return the number of usable servers.
+ */
+static unsigned maintenance_resolve (teredo_maintenance *m)
+{
+	unsigned usable = 0;
+
+	resolve_servers (m);
+
+	for (unsigned i = 0; i < m->server_count; i++)
+	{
+		teredo_server_info *srv = m->servers + i;
+
+		srv->ip = 0;
+		if (srv->error != 0)
+			/* DNS resolution failed */
+			teredo_log (TEREDO_LOG_RESOLVE_FAILED, srv->name,
+			            gai_strerror (srv->error));
+		else
+		if (!is_ipv4_global_unicast (srv->resolved))
+			teredo_log (TEREDO_LOG_SERVER_NOT_GLOBAL);
+		else
+		{
+			srv->ip = srv->resolved;
+			if (usable++ == 0)
+				m->server_ip = srv->ip; /* primary server first */
+		}
+	}
+	return usable;
+}
+
+
+static uint64_t maintenance_now (void)
+{
+	struct timespec ts;
+
+	teredo_gettime (&ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
 /*
  * Implementation notes:
  * - Optional Teredo interval determination procedure was never implemented.
@@ -194,12 +339,19 @@ checkTimeDrift (struct timespec *ts)
 
 /*
  * Teredo client maintenance procedure
+ *
+ * When not qualified, router solicitations are sent to all the servers at
+ * once, and the first valid advertisement wins. When qualified, the NAT
+ * binding is refreshed with the server in use only, unless it missed a
+ * reply: then the other server is solicited too, so that the client fails
+ * over as soon as possible.
  */
 static inline LIBTEREDO_NORETURN
 void maintenance_thread (teredo_maintenance *m)
 {
 	struct timespec deadline = { 0, 0 };
 	unsigned retries = 0;
+	uint64_t qual_start = maintenance_now ();
 	enum
 	{
 		TERR_NONE,
@@ -212,31 +364,16 @@ void maintenance_thread (teredo_maintenance *m)
 	for (;;)
 	{
 		int canc;
-		uint32_t server_ip = m->server_ip;
 
 		/* Resolve server IPv4 addresses */
-		while (server_ip == 0)
+		while (m->server_ip == 0)
 		{
-			int val = getipv4byname (m->server, &server_ip);
+			unsigned usable = maintenance_resolve (m);
 			teredo_gettime (&deadline);
 
 			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &canc);
 
-			if (val != 0)
-			{
-				/* DNS resolution failed */
-				syslog (LOG_ERR,
-				        _("Cannot resolve Teredo server address \"%s\": %s"),
-				        m->server, gai_strerror (val));
-			}
-			else
-			if (!is_ipv4_global_unicast (server_ip))
-			{
-				syslog (LOG_ERR,
-				        _("Teredo server has a non global IPv4 address."));
-				server_ip = 0;
-			}
-			else
+			if (usable > 0)
 			{
 				/* DNS resolution succeeded */
 				/* Tells Teredo client about the new server's IP */
@@ -247,7 +384,7 @@ void maintenance_thread (teredo_maintenance *m)
 
 			pthread_setcancelstate (canc, NULL);
 
-			if (server_ip != 0)
+			if (usable > 0)
 				break;
 
 			/* wait some time before next resolution attempt */
@@ -255,7 +392,7 @@ void maintenance_thread (teredo_maintenance *m)
 			teredo_wait (&deadline);
 		}
 
-		/* SEND ROUTER SOLICATION */
+		/* SEND ROUTER SOLICATIONS */
 		do
 			deadline.tv_sec += m->qualification_delay;
 		while (!checkTimeDrift (&deadline));
@@ -263,17 +400,33 @@ void maintenance_thread (teredo_maintenance *m)
 		teredo_state *state = &m->state.state, ostate;
 
 		pthread_mutex_lock(&m->lock);
-		teredo_get_nonce (deadline.tv_sec, server_ip, htons (IPPORT_TEREDO),
-		                  m->nonce);
-		teredo_send_rs (m->fd, server_ip, m->nonce, false);
-		m->server_ip = server_ip;
 		ostate = *state;
 
+		unsigned previous = m->current;
+		bool refresh = ostate.up && (retries == 0);
+
+		for (unsigned i = 0; i < m->server_count; i++)
+		{
+			teredo_server_info *srv = m->servers + i;
+
+			srv->solicited = (srv->ip != 0) && (!refresh || (i == previous));
+			if (!srv->solicited)
+				continue;
+
+			teredo_get_nonce (deadline.tv_sec, srv->ip,
+			                  htons (IPPORT_TEREDO), srv->nonce);
+			teredo_send_rs (m->fd, srv->ip, srv->nonce, false);
+			teredo_count (TEREDO_QUAL_SOLICITS);
+		}
+
 		/* RECEIVE ROUTER ADVERTISEMENT */
 		state->up = false;
 		while (pthread_cond_timedwait (&m->received, &m->lock, &deadline) == 0
 		    && !state->up);
 
+		for (unsigned i = 0; i < m->server_count; i++)
+			m->servers[i].solicited = false;
+
 		unsigned delay = 0;
 
 		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &canc);
@@ -281,7 +434,15 @@ void maintenance_thread (teredo_maintenance *m)
 		/* UPDATE FINITE STATE MACHINE */
 		if (state->up)
 		{	/* Router Advertisement received and parsed succesfully */
+			teredo_count (TEREDO_QUAL_REPLIES);
 			retries = 0;
+			m->server_ip = m->servers[m->current].ip;
+
+			if ((previous != NO_SERVER) && (previous != m->current))
+			{
+				teredo_log (TEREDO_LOG_FAILOVER, m->servers[m->current].name);
+				teredo_count (TEREDO_QUAL_FAILOVERS);
+			}
 
 			/* 12-bits Teredo flags randomization */
 			state->addr.teredo.flags = ostate.addr.teredo.flags;
@@ -291,11 +452,15 @@ void maintenance_thread (teredo_maintenance *m)
 				state->addr.teredo.flags = f & htons (TEREDO_RANDOM_MASK);
 			}
 
+			if (!ostate.up)
+				teredo_hist_add (TEREDO_HIST_QUALIFY,
+				                 maintenance_now () - qual_start);
+
 			if (!ostate.up
 			 || !IN6_ARE_ADDR_EQUAL (&ostate.addr.ip6, &state->addr.ip6)
 			 || ostate.mtu != state->mtu)
 			{
-				syslog (LOG_NOTICE, _("New Teredo address/MTU"));
+				teredo_log (TEREDO_LOG_NEW_ADDRESS);
 				m->state.cb (state, m->state.opaque);
 			}
 
@@ -305,27 +470,35 @@ void maintenance_thread (teredo_maintenance *m)
 		}
 		else
 		{	/* No response */
+			teredo_count (TEREDO_QUAL_TIMEOUTS);
 			if (++retries >= m->qualification_retries)
 			{
 				retries = 0;
 
-				/* No response from server */
+				/* No response from any server */
 				if (last_error != TERR_BLACKHOLE)
 				{
-					syslog (LOG_INFO, _("No reply from Teredo server"));
+					teredo_log (TEREDO_LOG_NO_REPLY);
 					last_error = TERR_BLACKHOLE;
 				}
 
 				if (ostate.up)
 				{
-					syslog (LOG_NOTICE, _("Lost Teredo connectivity"));
+					teredo_log (TEREDO_LOG_LOST);
+					teredo_count (TEREDO_QUAL_LOST);
 					m->state.cb (state, m->state.opaque);
 					m->server_ip = 0;
+					qual_start = maintenance_now ();
 				}
 
 				/* Wait some time before retrying */
 				delay = m->restart_delay;
 			}
+			else
+			if (ostate.up)
+				/* Keep the last known state until the connectivity is
+				 * declared lost */
+				*state = ostate;
 		}
 
 		pthread_setcancelstate (canc, NULL);
@@ -374,20 +547,26 @@ teredo_maintenance_create (int fd, teredo_state_cb cb, void *opaque,
 	m->state.opaque = opaque;
 
 	assert (s1 != NULL);
-	m->server = strdup (s1);
-	(void)s2;
+	m->servers[0].name = strdup (s1);
+	m->server_count = 1;
+	if ((s2 != NULL) && *s2 && strcmp (s1, s2))
+		m->servers[m->server_count++].name = strdup (s2);
+	m->current = NO_SERVER;
 
 	m->qualification_delay = q_sec ?: QualificationDelay;
 	m->qualification_retries = q_retries ?: QualificationRetries;
 	m->refresh_delay = refresh_sec ?: RefreshDelay;
 	m->restart_delay = restart_sec ?: RestartDelay;
 
-	if (m->server == NULL)
-	{
-		free (m);
-		return NULL;
-	}
-	else
+	for (unsigned i = 0; i < m->server_count; i++)
+		if (m->servers[i].name == NULL)
+		{
+			for (unsigned j = 0; j < m->server_count; j++)
+				free (m->servers[j].name);
+			free (m);
+			return NULL;
+		}
+
 	{
 		pthread_condattr_t attr;
 
@@ -407,7 +586,7 @@ int teredo_maintenance_start (teredo_maintenance *m)
 	if (err != 0)
 	{
 		errno = err;
-		syslog (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
+		teredo_log_now (LOG_ALERT, _("Error (%s): %m"), "pthread_create");
 		return -1;
 	}
 	return 0;
@@ -424,6 +603,7 @@ void teredo_maintenance_destroy (teredo_maintenance *m)
 	pthread_cond_destroy (&m->received);
 	pthread_mutex_destroy (&m->lock);
 
-	free (m->server);
+	for (unsigned i = 0; i < m->server_count; i++)
+		free (m->servers[i].name);
 	free (m);
 }
@@ -62,7 +62,7 @@ typedef void (*teredo_state_cb) (const struct teredo_state *s, void *opaque);
  * @param cb status change notification callback
  * @param opaque data for @a cb callback
  * @param s1 primary server address/hostname
- * @param s2 secondary server address/hostname
+ * @param s2 backup server address/hostname, or NULL
  * @param q_sec qualification time out (seconds), 0 = default
  * @param q_retries qualification retries, 0 = default
  * @param refresh_sec qualification refresh interval (seconds), 0 = default
@@ -0,0 +1,204 @@
+/*
+ * md5mb.c - Multi-buffer MD5 block function
+ *
+ * Same algorithm as md5.c (RFC 1321), but computing several independent
+ * digests at once, one per SIMD lane. This is only worth it when many short
+ * messages must be hashed at the same time, e.g. batches of HMACs.
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "md5mb.h"
+
+void md5mb_load (md5mb_state_t *restrict mb, const md5_state_t *restrict pms)
+{
+	for (unsigned i = 0; i < 4; i++)
+		for (unsigned l = 0; l < MD5MB_LANES; l++)
+			mb->abcd[i][l] = pms->abcd[i];
+}
+
+
+void md5mb_digest (const md5mb_state_t *restrict mb, unsigned lane,
+                   md5_byte_t digest[16])
+{
+	for (unsigned i = 0; i < 16; i++)
+		digest[i] = mb->abcd[i >> 2][lane] >> ((i & 3) << 3);
+}
+
+
+#if defined (__GNUC__)
+/*
+ * Generic vector code: the compiler maps it onto whatever SIMD instruction
+ * set is enabled (or splits it into scalar operations if there is none).
+ */
+typedef md5_word_t md5_vec_t
+	__attribute__ ((vector_size (MD5MB_LANES * sizeof (md5_word_t))));
+
+static inline md5_word_t load_le32 (const md5_byte_t *p)
+{
+#ifdef WORDS_BIGENDIAN
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((md5_word_t)p[3] << 24);
+#else
+	md5_word_t v;
+	memcpy (&v, p, 4);
+	return v;
+#endif
+}
+
+void md5mb_process (md5mb_state_t *restrict mb,
+                    const md5_byte_t *const data[MD5MB_LANES])
+{
+	md5_vec_t X[16], a, b, c, d, t;
+
+	/* Transpose the input blocks: lane l of X[k] is word k of block l */
+	for (unsigned k = 0; k < 16; k++)
+		for (unsigned l = 0; l < MD5MB_LANES; l++)
+			X[k][l] = load_le32 (data[l] + 4 * k);
+
+	memcpy (&a, mb->abcd[0], sizeof (a));
+	memcpy (&b, mb->abcd[1], sizeof (b));
+	memcpy (&c, mb->abcd[2], sizeof (c));
+	memcpy (&d, mb->abcd[3], sizeof (d));
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define SET(f, a, b, c, d, k, s, Ti) \
+	t = a + f(b, c, d) + X[k] + (md5_word_t)Ti; \
+	a = ROTATE_LEFT(t, s) + b
+
+	/* Round 1 */
+	SET(F, a, b, c, d,  0,  7, 0xd76aa478);
+	SET(F, d, a, b, c,  1, 12, 0xe8c7b756);
+	SET(F, c, d, a, b,  2, 17, 0x242070db);
+	SET(F, b, c, d, a,  3, 22, 0xc1bdceee);
+	SET(F, a, b, c, d,  4,  7, 0xf57c0faf);
+	SET(F, d, a, b, c,  5, 12, 0x4787c62a);
+	SET(F, c, d, a, b,  6, 17, 0xa8304613);
+	SET(F, b, c, d, a,  7, 22, 0xfd469501);
+	SET(F, a, b, c, d,  8,  7, 0x698098d8);
+	SET(F, d, a, b, c,  9, 12, 0x8b44f7af);
+	SET(F, c, d, a, b, 10, 17, 0xffff5bb1);
+	SET(F, b, c, d, a, 11, 22, 0x895cd7be);
+	SET(F, a, b, c, d, 12,  7, 0x6b901122);
+	SET(F, d, a, b, c, 13, 12, 0xfd987193);
+	SET(F, c, d, a, b, 14, 17, 0xa679438e);
+	SET(F, b, c, d, a, 15, 22, 0x49b40821);
+
+	/* Round 2 */
+	SET(G, a, b, c, d,  1,  5, 0xf61e2562);
+	SET(G, d, a, b, c,  6,  9, 0xc040b340);
+	SET(G, c, d, a, b, 11, 14, 0x265e5a51);
+	SET(G, b, c, d, a,  0, 20, 0xe9b6c7aa);
+	SET(G, a, b, c, d,  5,  5, 0xd62f105d);
+	SET(G, d, a, b, c, 10,  9, 0x02441453);
+	SET(G, c, d, a, b, 15, 14, 0xd8a1e681);
+	SET(G, b, c, d, a,  4, 20, 0xe7d3fbc8);
+	SET(G, a, b, c, d,  9,  5, 0x21e1cde6);
+	SET(G, d, a, b, c, 14,  9, 0xc33707d6);
+	SET(G, c, d, a, b,  3, 14, 0xf4d50d87);
+	SET(G, b, c, d, a,  8, 20, 0x455a14ed);
+	SET(G, a, b, c, d, 13,  5, 0xa9e3e905);
+	SET(G, d, a, b, c,  2,  9, 0xfcefa3f8);
+	SET(G, c, d, a, b,  7, 14, 0x676f02d9);
+	SET(G, b, c, d, a, 12, 20, 0x8d2a4c8a);
+
+	/* Round 3 */
+	SET(H, a, b, c, d,  5,  4, 0xfffa3942);
+	SET(H, d, a, b, c,  8, 11, 0x8771f681);
+	SET(H, c, d, a, b, 11, 16, 0x6d9d6122);
+	SET(H, b, c, d, a, 14, 23, 0xfde5380c);
+	SET(H, a, b, c, d,  1,  4, 0xa4beea44);
+	SET(H, d, a, b, c,  4, 11, 0x4bdecfa9);
+	SET(H, c, d, a, b,  7, 16, 0xf6bb4b60);
+	SET(H, b, c, d, a, 10, 23, 0xbebfbc70);
+	SET(H, a, b, c, d, 13,  4, 0x289b7ec6);
+	SET(H, d, a, b, c,  0, 11, 0xeaa127fa);
+	SET(H, c, d, a, b,  3, 16, 0xd4ef3085);
+	SET(H, b, c, d, a,  6, 23, 0x04881d05);
+	SET(H, a, b, c, d,  9,  4, 0xd9d4d039);
+	SET(H, d, a, b, c, 12, 11, 0xe6db99e5);
+	SET(H, c, d, a, b, 15, 16, 0x1fa27cf8);
+	SET(H, b, c, d, a,  2, 23, 0xc4ac5665);
+
+	/* Round 4 */
+	SET(I, a, b, c, d,  0,  6, 0xf4292244);
+	SET(I, d, a, b, c,  7, 10, 0x432aff97);
+	SET(I, c, d, a, b, 14, 15, 0xab9423a7);
+	SET(I, b, c, d, a,  5, 21, 0xfc93a039);
+	SET(I, a, b, c, d, 12,  6, 0x655b59c3);
+	SET(I, d, a, b, c,  3, 10, 0x8f0ccc92);
+	SET(I, c, d, a, b, 10, 15, 0xffeff47d);
+	SET(I, b, c, d, a,  1, 21, 0x85845dd1);
+	SET(I, a, b, c, d,  8,  6, 0x6fa87e4f);
+	SET(I, d, a, b, c, 15, 10, 0xfe2ce6e0);
+	SET(I, c, d, a, b,  6, 15, 0xa3014314);
+	SET(I, b, c, d, a, 13, 21, 0x4e0811a1);
+	SET(I, a, b, c, d,  4,  6, 0xf7537e82);
+	SET(I, d, a, b, c, 11, 10, 0xbd3af235);
+	SET(I, c, d, a, b,  2, 15, 0x2ad7d2bb);
+	SET(I, b, c, d, a,  9, 21, 0xeb86d391);
+#undef SET
+#undef I
+#undef H
+#undef G
+#undef F
+#undef ROTATE_LEFT
+
+	md5_vec_t v;
+	memcpy (&v, mb->abcd[0], sizeof (v));
+	v += a;
+	memcpy (mb->abcd[0], &v, sizeof (v));
+	memcpy (&v, mb->abcd[1], sizeof (v));
+	v += b;
+	memcpy (mb->abcd[1], &v, sizeof (v));
+	memcpy (&v, mb->abcd[2], sizeof (v));
+	v += c;
+	memcpy (mb->abcd[2], &v, sizeof (v));
+	memcpy (&v, mb->abcd[3], sizeof (v));
+	v += d;
+	memcpy (mb->abcd[3], &v, sizeof (v));
+}
+
+#else
+/* No vector support: one lane at a time, with the scalar block function */
+void md5mb_process (md5mb_state_t *restrict mb,
+                    const md5_byte_t *const data[MD5MB_LANES])
+{
+	for (unsigned l = 0; l < MD5MB_LANES; l++)
+	{
+		md5_state_t ctx;
+
+		md5_init (&ctx);
+		for (unsigned i = 0; i < 4; i++)
+			ctx.abcd[i] = mb->abcd[i][l];
+		md5_append (&ctx, data[l], 64);
+		for (unsigned i = 0; i < 4; i++)
+			mb->abcd[i][l] = ctx.abcd[i];
+	}
+}
+#endif
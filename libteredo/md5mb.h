@@ -0,0 +1,74 @@
+/*
+ * md5mb.h - Multi-buffer MD5 block function
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_MD5MB_H
+# define LIBTEREDO_MD5MB_H
+
+# include "md5.h"
+
+/*
+ * Number of independent MD5 computations processed at once: one per 32-bits
+ * SIMD lane (8 with AVX2, 4 with SSE2, NEON or AltiVec).
+ */
+# if defined (__AVX2__)
+#  define MD5MB_LANES 8
+# else
+#  define MD5MB_LANES 4
+# endif
+
+/**
+ * Interleaved MD5 chaining values (word-major, lane-minor).
+ */
+typedef struct md5mb_state_s
+{
+	md5_word_t abcd[4][MD5MB_LANES];
+} md5mb_state_t;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Sets all lanes to the given (intermediate) MD5 state.
+ * @param pms state to copy; only its chaining value is used, so it must
+ * have processed a whole number of blocks.
+ */
+void md5mb_load (md5mb_state_t *restrict mb, const md5_state_t *restrict pms);
+
+/**
+ * Runs the MD5 block function on MD5MB_LANES independent 64-bytes blocks.
+ * Padding is up to the caller.
+ *
+ * @param data one block per lane (no alignment constraints)
+ */
+void md5mb_process (md5mb_state_t *restrict mb,
+                    const md5_byte_t *const data[MD5MB_LANES]);
+
+/**
+ * Serializes the MD5 digest of one lane.
+ */
+void md5mb_digest (const md5mb_state_t *restrict mb, unsigned lane,
+                   md5_byte_t digest[16]);
+
+# ifdef __cplusplus
+}
+# endif
+#endif /* ifndef LIBTEREDO_MD5MB_H */
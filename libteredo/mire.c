@@ -26,6 +26,9 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -45,24 +48,8 @@
 #include <stdbool.h>
 #include "packets.h"
 #include "debug.h"
-
-//#define MIRE_COUNTER 1
-
-#ifdef MIRE_COUNTER
-#include <signal.h>
-static unsigned long count_pkt = 0;
-static unsigned long count_bytes = 0;
-static void handler (int signum)
-{
-	signal (signum, handler);
-	count_bytes /= 1000;
-	printf ("%lu packets/s, %lu.%03lu Mbits/s\n", count_pkt,
-		count_bytes / 125, count_bytes % 125 * 8);
-	count_pkt = count_bytes = 0;
-	if (signum == SIGALRM)
-		alarm (1);
-}
-#endif
+#include "stats.h"
+#include "tunnel.h"
 
 
 static void
@@ -96,6 +83,8 @@ process_icmpv6 (int fd, struct ip6_hdr *ip6, size_t plen,
 	hdr->icmp6_cksum = 0;
 	hdr->icmp6_cksum = icmp6_checksum (ip6, hdr);
 
+	teredo_count (TEREDO_TX_PACKETS);
+	teredo_count_add (TEREDO_TX_BYTES, sizeof (*ip6) + plen);
 	teredo_send (fd, ip6, sizeof (*ip6) + plen, ipv4, port);
 }
 
@@ -107,6 +96,7 @@ process_none (int fd, const struct ip6_hdr *ip6, size_t plen,
 	if (plen != 0)
 		return;
 
+	teredo_count (TEREDO_TX_BUBBLES);
 	teredo_reply_bubble (fd, ipv4, port, ip6);
 }
 
@@ -143,6 +133,7 @@ process_unknown (int fd, const struct ip6_hdr *in, size_t plen,
 	icmp6.icmp6_cksum = teredo_cksum (&ip6.ip6_src, &ip6.ip6_dst,
 	                                  IPPROTO_ICMPV6, iov + 1, 2);
 
+	teredo_count (TEREDO_ICMP_SENT);
 	teredo_sendv (fd, iov, sizeof (iov) / sizeof (iov[0]), ipv4, port);
 }
 
@@ -163,22 +154,24 @@ recv_packet (int fd, teredo_packet *p)
 	struct ip6_hdr *ip6 = p->ip6;
 	uint16_t plen;
 
+	teredo_count (TEREDO_RX_PACKETS);
+	teredo_count_add (TEREDO_RX_BYTES, p->ip6_len);
+
 	// Check packet size
 	if (p->ip6_len < sizeof (*ip6))
-		return -1;
+		goto malformed;
 
 	// Check packet validity
 	plen = ntohs (ip6->ip6_plen);
-#ifdef MIRE_COUNTER
-	count_pkt++;
-	count_bytes += plen + 40;
-#endif
-
 	if (((ip6->ip6_vfc >> 4) != 6)
 	 || ((plen + sizeof (*ip6)) > p->ip6_len))
-		return -1;
+		goto malformed;
 
 	return plen;
+
+malformed:
+	teredo_count (TEREDO_RX_MALFORMED);
+	return -1;
 }
 
 
@@ -199,8 +192,10 @@ static LIBTEREDO_NORETURN void *server_thread (void *data)
 }
 
 
-static LIBTEREDO_NORETURN int client_thread (int fd)
+static LIBTEREDO_NORETURN void *client_thread (void *data)
 {
+	int fd = *(int *)data;
+
 	for (;;)
 	{
 		struct teredo_packet p;
@@ -230,7 +225,7 @@ static LIBTEREDO_NORETURN int client_thread (int fd)
 
 static int usage (const char *path)
 {
-	printf ("Usage: %s\n", path);
+	printf ("Usage: %s [-s FILE]\n", path);
 	return 0;
 }
 
@@ -245,17 +240,23 @@ int main(int argc, char *argv[])
 	static const struct option opts[] =
 	{
 		{ "help",       no_argument,       NULL, 'h' },
+		{ "stats",      required_argument, NULL, 's' },
 		{ "version",    no_argument,       NULL, 'V' },
 		{ NULL,         no_argument,       NULL, '\0'}
 	};
+	const char *stats_path = NULL;
 
 	int c;
-	while ((c = getopt_long (argc, argv, "hV", opts, NULL)) != -1)
+	while ((c = getopt_long (argc, argv, "hs:V", opts, NULL)) != -1)
 		switch (c)
 		{
 			case 'h':
 				return usage(argv[0]);
 
+			case 's':
+				stats_path = optarg;
+				break;
+
 			case 'V':
 				return version();
 
@@ -264,7 +265,15 @@ int main(int argc, char *argv[])
 		}
 
 	int socks[2] = { -1, -1 }, retval = -1;
-	pthread_t thserv;
+	pthread_t thserv, thcli;
+	sigset_t set;
+
+	/* Termination signals are handled by the main thread only */
+	sigemptyset (&set);
+	sigaddset (&set, SIGHUP);
+	sigaddset (&set, SIGINT);
+	sigaddset (&set, SIGTERM);
+	pthread_sigmask (SIG_BLOCK, &set, NULL);
 
 	socks[0] = teredo_socket (0, htons (IPPORT_TEREDO));
 	if (socks[0] != -1)
@@ -275,11 +284,37 @@ int main(int argc, char *argv[])
 			errno = pthread_create (&thserv, NULL, server_thread, socks);
 			if (errno == 0)
 			{
-#ifdef MIRE_COUNTER
-				signal (SIGALRM, handler);
-				alarm (1);
-#endif
-				retval = -client_thread (socks[1]);
+				errno = pthread_create (&thcli, NULL, client_thread,
+				                        socks + 1);
+				if (errno == 0)
+				{
+					teredo_stats *stats = NULL;
+					int sig;
+
+					if (stats_path != NULL)
+					{
+						stats = teredo_stats_publish (stats_path, 1000);
+						if (stats == NULL)
+							fprintf (stderr, "%s: %s\n", stats_path,
+							         strerror (errno));
+					}
+
+					sigwait (&set, &sig);
+
+					if (stats != NULL)
+					{
+						teredo_stats_unpublish (stats);
+						unlink (stats_path);
+					}
+					pthread_cancel (thcli);
+					pthread_join (thcli, NULL);
+					retval = 0;
+				}
+				else
+					perror ("pthread_create");
+
+				pthread_cancel (thserv);
+				pthread_join (thserv, NULL);
 			}
 			else
 				perror ("pthread_create");
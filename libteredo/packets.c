@@ -47,26 +47,8 @@
 
 #include "packets.h"
 #include "checksum.h"
-
-
-int
-teredo_send_bubble (int fd, uint32_t ip, uint16_t port,
-                    const struct in6_addr *src, const struct in6_addr *dst)
-{
-	static const uint8_t head[] =
-		"\x60\x00\x00\x00" /* flow */
-		"\x00\x00" /* plen = 0 */
-		"\x3b" /* nxt = IPPROTO_NONE */
-		"\x00" /* hlim = 0 */;
-	struct iovec iov[3] =
-	{
-		{ (void *)head, 8 },
-		{ (void *)src, 16 },
-		{ (void *)dst, 16 }
-	};
-
-	return teredo_sendv (fd, iov, 3, ip, port) == 40 ? 0 : -1;
-}
+#include "probe.h"
+#include "log.h"
 
 
 int
@@ -212,7 +194,7 @@ teredo_parse_ra (const teredo_packet *restrict packet,
 			if (newaddr->teredo.server_ip != 0)
 			{
 				/* The Teredo specification excludes multiple prefixes */
-				syslog (LOG_ERR, _("Multiple Teredo prefixes received"));
+				teredo_log (TEREDO_LOG_MULTIPLE_PREFIXES);
 				return -1;
 			}
 
@@ -297,13 +279,22 @@ SendPing (int fd, const union teredo_addr *src, const struct in6_addr *dst)
 
 	ping.icmp6.icmp6_cksum = icmp6_checksum (&ping.ip6, &ping.icmp6);
 
+	TEREDO_PROBE (ping__send, dst);
 	return teredo_send (fd, &ping, sizeof (ping.ip6) + sizeof (ping.icmp6)
 	                    + PING_PAYLOAD, IN6_TEREDO_SERVER(&src->ip6),
 	                    htons (IPPORT_TEREDO)) > 0 ? 0 : -1;
 }
 
 
-int CheckPing (const teredo_packet *packet)
+/**
+ * Checks that the packet is an ICMPv6 Echo reply (or an Unreachable error
+ * quoting an Echo request from us) and locates its ping hash.
+ *
+ * @return 0 if that is the case, -1 otherwise.
+ */
+static int
+PingHeader (const teredo_packet *packet, const struct in6_addr **pme,
+            const struct in6_addr **pit, const uint8_t **phash)
 {
 	const struct ip6_hdr *ip6 = packet->ip6;
 	size_t length = ntohs (ip6->ip6_plen);
@@ -381,9 +372,54 @@ int CheckPing (const teredo_packet *packet)
 	if (icmp6->icmp6_code != 0)
 		return -1;
 
-	return teredo_verify_pinghash ((uint32_t)time (NULL), me, it,
-	                               (const uint8_t *)&icmp6->icmp6_id);
+	*pme = me;
+	*pit = it;
+	*phash = (const uint8_t *)&icmp6->icmp6_id;
 	/* TODO: check the sum(?) */
+	return 0;
+}
+
+
+int CheckPing (const teredo_packet *packet)
+{
+	const struct in6_addr *me, *it;
+	const uint8_t *hash;
+
+	if (PingHeader (packet, &me, &it, &hash))
+		return -1;
+
+	return teredo_verify_pinghash ((uint32_t)time (NULL), me, it, hash);
+}
+
+
+#define PING_BATCH 16
+
+void CheckPingBatch (unsigned n, const teredo_packet *packets, int *res)
+{
+	uint32_t now = time (NULL);
+
+	for (unsigned i = 0; i < n;)
+	{
+		const struct in6_addr *me[PING_BATCH], *it[PING_BATCH];
+		const uint8_t *hash[PING_BATCH];
+		unsigned idx[PING_BATCH], count = 0;
+		int ok[PING_BATCH];
+
+		for (; (i < n) && (count < PING_BATCH); i++)
+		{
+			res[i] = -1;
+			if (PingHeader (packets + i, me + count, it + count,
+			                hash + count) == 0)
+				idx[count++] = i;
+		}
+
+		if (count == 0)
+			continue;
+
+		teredo_verify_pinghash_batch (now, count, me, it, hash, ok);
+		for (unsigned j = 0; j < count; j++)
+			res[idx[j]] = ok[j];
+	}
 }
 #endif
 
@@ -33,6 +33,15 @@ struct icmp6_hdr;
  * @return 0 if that is the case, -1 otherwise.
  */
 int CheckPing (const teredo_packet *packet);
+
+/**
+ * Checks a batch of packets as CheckPing() would, but authenticates all
+ * the Echo replies at once, which is faster.
+ *
+ * @param n number of packets
+ * @param res array of @p n results (as from CheckPing())
+ */
+void CheckPingBatch (unsigned n, const teredo_packet *packets, int *res);
 int CheckBubble (const teredo_packet *packet);
 
 
@@ -27,14 +27,20 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h> /* malloc() / free() */
+#include <limits.h> /* UCHAR_MAX */
+#include <stddef.h> /* offsetof() */
 #include <assert.h>
 
 #include <inttypes.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <unistd.h> /* getpid(), pread(), pwrite() */
+#include <arpa/inet.h> /* htonl() */
 #include <pthread.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #ifndef NDEBUG
 # define JUDYERROR_NOTEST 1
@@ -47,9 +53,12 @@
 
 #include "teredo.h"
 #include "teredo-udp.h" // FIXME: ugly
+#include "transport.h"
 #include "debug.h"
 #include "clock.h"
 #include "peerlist.h"
+#include "stats.h"
+#include "probe.h"
 
 /*
  * Packets queueing
@@ -58,85 +67,154 @@ struct teredo_queue
 {
 	teredo_queue *next;
 	size_t length;
+	uint64_t stamp; /* enqueue time (outgoing, latency statistics) */
 	uint32_t ipv4;
 	uint16_t port;
 	bool incoming;
 	uint8_t data[];
 };
 
-static const unsigned teredo_MaxQueueBytes = 1280;
-
-
 static inline void teredo_peer_init (teredo_peer *peer)
 {
-	peer->queue = NULL;
-	peer->queue_left = teredo_MaxQueueBytes;
+	memset (peer, 0, sizeof (*peer));
+	peer->cold = NULL;
 }
 
 
-static inline void teredo_peer_destroy (teredo_peer *peer)
+static void teredo_queue_destroy (teredo_queue *p)
 {
-	teredo_queue *p = peer->queue;
-
 	while (p != NULL)
 	{
 		teredo_queue *buf;
 
 		buf = p->next;
+		teredo_count_sub (TEREDO_QUEUE_BYTES, p->length);
 		free (p);
 		p = buf;
 	}
 }
 
 
+static inline void teredo_peer_destroy (teredo_peer *peer)
+{
+	teredo_peer_cold *cold = peer->cold;
+
+	if (cold != NULL)
+	{
+		teredo_queue_destroy (cold->queue);
+		free (cold);
+	}
+}
+
+
+teredo_peer_cold *teredo_peer_get_cold (teredo_peer *peer)
+{
+	teredo_peer_cold *cold = peer->cold;
+
+	if (cold == NULL)
+	{
+		cold = malloc (sizeof (*cold));
+		if (cold == NULL)
+			return NULL;
+
+		cold->queue = NULL;
+		cold->queue_bytes = 0;
+		cold->last_ping = 0;
+		peer->cold = cold;
+	}
+	return cold;
+}
+
+
 static void teredo_peer_queue (teredo_peer *restrict peer,
                                const void *restrict data, size_t len,
-                               uint32_t ip, uint16_t port, bool incoming)
+                               size_t max, uint32_t ip, uint16_t port,
+                               bool incoming)
 {
+	teredo_peer_cold *cold = teredo_peer_get_cold (peer);
 	teredo_queue *p;
 
-	if (len > peer->queue_left)
-		return;
-	peer->queue_left -= len;
+	if ((cold == NULL) || (cold->queue_bytes + len > max))
+		goto drop;
 
 	p = malloc (sizeof (*p) + len);
+	if (p == NULL)
+		goto drop;
+	cold->queue_bytes += len;
+	teredo_count_add (TEREDO_QUEUE_BYTES, len);
+
 	p->length = len;
 	memcpy (p->data, data, len);
 	p->ipv4 = ip;
 	p->port = port;
 	p->incoming = incoming;
+	p->stamp = incoming ? 0 : teredo_latency_start ();
 
-	p->next = peer->queue;
-	peer->queue = p;
+	p->next = cold->queue;
+	cold->queue = p;
+	return;
+
+drop:
+	TEREDO_PROBE (queue__drop, len, incoming);
 }
 
 
 void teredo_enqueue_in (teredo_peer *restrict peer, const void *restrict data,
-                        size_t len, uint32_t ip, uint16_t port)
+                        size_t len, size_t max, uint32_t ip, uint16_t port)
 {
-	teredo_peer_queue (peer, data, len, ip, port, true);
+	teredo_peer_queue (peer, data, len, max, ip, port, true);
 }
 
 
 void teredo_enqueue_out (teredo_peer *restrict peer,
-                         const void *restrict data, size_t len)
+                         const void *restrict data, size_t len, size_t max)
 {
-	teredo_peer_queue (peer, data, len, 0, 0, false);
+	teredo_peer_queue (peer, data, len, max, 0, 0, false);
 }
 
 
 teredo_queue *teredo_peer_queue_yield (teredo_peer *peer)
 {
-	teredo_queue *q = peer->queue;
-	peer->queue = NULL;
-	peer->queue_left = teredo_MaxQueueBytes;
+	teredo_peer_cold *cold = peer->cold;
+
+	if (cold == NULL)
+		return NULL;
+
+	/* Peer is trusted now: the cold state is not needed anymore */
+	teredo_queue *q = cold->queue;
+	peer->cold = NULL;
+	free (cold);
 	return q;
 }
 
 
+#define TEREDO_EMIT_BATCH 16
+
+static void teredo_queue_flush (teredo_queue **out, const struct iovec *iov,
+                                size_t n, int fd, uint32_t ipv4, uint16_t port)
+{
+	if (n == 0)
+		return;
+
+	teredo_send_batch (fd, iov, n, ipv4, port);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		teredo_latency_end (TEREDO_HIST_QUEUE, out[i]->stamp);
+		teredo_count_sub (TEREDO_QUEUE_BYTES, out[i]->length);
+		free (out[i]);
+	}
+}
+
+
 void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
                         teredo_dequeue_cb cb, void *opaque)
 {
+	/* Outgoing packets all go to the same peer: send them in batches */
+	teredo_queue *out[TEREDO_EMIT_BATCH];
+	struct iovec iov[TEREDO_EMIT_BATCH];
+	size_t n = 0;
+
 	while (q != NULL)
 	{
 		teredo_queue *buf;
@@ -145,13 +223,30 @@ void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
 		if (q->incoming)
 		{
 			if ((ipv4 == q->ipv4) && (port == q->port))
+			{
+				TEREDO_PROBE (queue__emit, q->length, true);
 				cb (opaque, q->data, q->length);
+			}
+			else
+				TEREDO_PROBE (queue__drop, q->length, true);
+			teredo_count_sub (TEREDO_QUEUE_BYTES, q->length);
+			free (q);
 		}
 		else
-			teredo_send (fd, q->data, q->length, ipv4, port);
-		free (q);
+		{
+			TEREDO_PROBE (queue__emit, q->length, false);
+			iov[n].iov_base = q->data;
+			iov[n].iov_len = q->length;
+			out[n++] = q;
+			if (n == TEREDO_EMIT_BATCH)
+			{
+				teredo_queue_flush (out, iov, n, fd, ipv4, port);
+				n = 0;
+			}
+		}
 		q = buf;
 	}
+	teredo_queue_flush (out, iov, n, fd, ipv4, port);
 }
 
 
@@ -161,28 +256,96 @@ typedef struct teredo_listitem
 	union teredo_addr key; /* must be first (for listitem_cmp()) */
 	struct teredo_listitem **pprev, *next;
 	teredo_peer peer;
+	uint32_t touched; /* last lookup (probation only) */
+	bool probation;
+	bool held; /* looked up until the list is released (not evictable) */
 } teredo_listitem;
 
+/* Peer looked up, until the list is released */
+typedef struct teredo_hold
+{
+	teredo_listitem *item;
+	teredo_peer state; /* peer state at lookup */
+	bool created;
+} teredo_hold;
+
+#ifdef HAVE_LIBJUDY
+typedef Pvoid_t teredo_index;
+#else
+typedef void *teredo_index;
+#endif
+
+/*
+ * Peers detached from the list by teredo_list_reset(), with their indexes,
+ * until the garbage collector thread reclaims them.
+ */
+typedef struct teredo_grave
+{
+	struct teredo_grave *next;
+	teredo_listitem *items[3];
+	teredo_index root, proot;
+} teredo_grave;
+
+/*
+ * New peers are first put on probation, in a small table of fixed size with
+ * LRU eviction. They are promoted to the main table only once trusted, so
+ * that floods of unverified destinations or sources cannot evict trusted
+ * peers, nor exhaust the main table and block new legitimate peers.
+ */
 struct teredo_peerlist
 {
+	/* Main table (trusted peers) */
 	teredo_listitem *recent, *old;
-	unsigned left;
+	unsigned count, max;
+	teredo_index root;
+
+	/* Probation table (most recently used first) */
+	teredo_listitem *probation, *ptail;
+	unsigned pcount, pmax;
+	teredo_index proot;
+
+	teredo_hold held[TEREDO_LIST_BATCH_MAX];
+	unsigned nheld;
+
+	/* Negative lookup filter (both tables) */
+	atomic_uchar *filter;
+	uint32_t filter_mask;
+	uint64_t filter_key[2];
 	unsigned expiration;
 	pthread_t gc;
 	pthread_mutex_t lock;
-#ifdef HAVE_LIBJUDY
-	Pvoid_t PJHSArray;
-#else
-        void *root;
-#endif
+
+	/* Flow cache validity (see teredo_list_cache_lookup()) */
+	struct teredo_flowgen *flows;
+
+	/* Garbage collector */
+	pthread_cond_t wake;
+	bool stopping;
+	teredo_grave *grave; /* reset peers, not reclaimed yet */
+	teredo_grave *dying; /* reset peers being reclaimed (GC thread only) */
 };
 
 
+size_t teredo_list_peer_size (void)
+{
+	/* Index node overhead is a rough estimate */
+	return sizeof (teredo_listitem) + 4 * sizeof (void *);
+}
+
+
+/* List items are exactly one cache line (on 64-bits platforms) */
+#define LISTITEM_ALIGN 64
+_Static_assert (sizeof (teredo_listitem) <= LISTITEM_ALIGN,
+                "peer list items must fit in one cache line");
+
 static inline teredo_listitem *listitem_create (void)
 {
-	teredo_listitem *entry = malloc (sizeof (*entry));
-	if (entry != NULL)
-		teredo_peer_init (&entry->peer);
+	void *entry;
+
+	if (posix_memalign (&entry, LISTITEM_ALIGN, sizeof (teredo_listitem)))
+		return NULL;
+	teredo_peer_init (&((teredo_listitem *)entry)->peer);
+	teredo_count (TEREDO_PEERS);
 	return entry;
 }
 
@@ -191,19 +354,35 @@ static inline void listitem_destroy (teredo_listitem *entry)
 {
 	teredo_peer_destroy (&entry->peer);
 	free (entry);
+	teredo_count_sub (TEREDO_PEERS, 1);
 }
 
 
-static void listitem_recdestroy (teredo_listitem *entry)
+static inline void listitem_unlink (teredo_listitem *p)
 {
-	while (entry != NULL)
-	{
-		teredo_listitem *buf = entry->next;
-		listitem_destroy (entry);
-		entry = buf;
-	}
+	assert (*(p->pprev) == p);
+	assert ((p->next == NULL) || (p->next->pprev == &p->next));
+
+	if (p->next != NULL)
+		p->next->pprev = p->pprev;
+	*(p->pprev) = p->next;
+}
+
+
+static inline void listitem_push (teredo_listitem **head, teredo_listitem *p)
+{
+	p->next = *head;
+	if (p->next != NULL)
+		p->next->pprev = &p->next;
+	*head = p;
+	p->pprev = head;
+
+	assert (*(p->pprev) == p);
+	assert ((p->next == NULL) || (p->next->pprev == &p->next));
 }
 
+
+/*** Address index ***/
 #ifndef HAVE_LIBJUDY
 static void listitem_free (void *p)
 {
@@ -218,67 +397,543 @@ static int listitem_cmp (const void *pa, const void *pb)
 }
 #endif
 
-#include <sched.h>
+static teredo_listitem *index_get (teredo_index *root,
+                                   const struct in6_addr *addr)
+{
+#ifdef HAVE_LIBJUDY
+	void *PValue;
+
+	JHSG (PValue, *root, (uint8_t *)addr, 16);
+	return (PValue != NULL) ? *(teredo_listitem **)PValue : NULL;
+#else
+	void **pp = tfind (addr, root, listitem_cmp);
+	return (pp != NULL) ? *pp : NULL;
+#endif
+}
+
 
 /**
- * Peer list garbage collector entry point.
- *
- * @return never ever.
+ * Indexes an item by its key, which must not be in the index already.
+ * @return 0 on success, -1 if out of memory.
  */
-static LIBTEREDO_NORETURN void *garbage_collector (void *data)
+static int index_add (teredo_index *root, teredo_listitem *item)
 {
-	struct teredo_peerlist *l = (struct teredo_peerlist *)data;
+#ifdef HAVE_LIBJUDY
+	void *PValue;
 
-	for (;;)
-	{
-		struct timespec delay = { .tv_sec = l->expiration };
-		teredo_sleep (&delay);
+	JHSI (PValue, *root, (uint8_t *)&item->key, 16);
+	if (PValue == PJERR)
+		return -1;
+	*(teredo_listitem **)PValue = item;
+#else
+	void **pp = tsearch (&item->key.ip6, root, listitem_cmp);
+	if (pp == NULL)
+		return -1;
+	assert (*pp == item);
+#endif
+	return 0;
+}
 
-		int state;
-		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &state);
-		/* cancel-unsafe section starts */
-		pthread_mutex_lock (&l->lock);
 
-		// remove expired peers from hash table
-		for (teredo_listitem *p = l->old; p != NULL; p = p->next)
-		{
+static void index_del (teredo_index *root, teredo_listitem *item)
+{
 #ifdef HAVE_LIBJUDY
-			int Rc_int;
+	int Rc_int;
 
-			JHSD (Rc_int, l->PJHSArray, (uint8_t *)&p->key, 16);
-			assert (Rc_int);
+	JHSD (Rc_int, *root, (uint8_t *)&item->key, 16);
+	assert (Rc_int);
 #else
-                        teredo_listitem **pp;
+	void **pp;
 
-                        pp = tdelete (&p->key.ip6, &l->root, listitem_cmp);
-                        assert (pp != NULL);
+	pp = tdelete (&item->key.ip6, root, listitem_cmp);
+	assert (pp != NULL);
+	(void)pp;
 #endif
-			l->left++;
+}
+
+
+static void index_destroy (teredo_index root)
+{
+#ifdef HAVE_LIBJUDY
+	intptr_t Rc_word;
+	JHSFA (Rc_word, root);
+#else
+	tdestroy (root, listitem_free);
+#endif
+}
+
+
+/*** Negative lookup filter ***/
+/*
+ * Counting Bloom filter of the addresses in the list, so that lookups of
+ * unknown peers can be rejected without locking the list. Counters are
+ * updated atomically, with or without the list lock, and read without it.
+ * Saturated counters are never decremented, which only costs accuracy.
+ *
+ * The hash is keyed so that remote peers cannot easily pick addresses that
+ * defeat the filter, though they would only cause a normal lookup anyway.
+ */
+#define FILTER_HASHES 4
+#define FILTER_MIN_SIZE 64u /* counters */
+#define FILTER_MAX_SIZE (1u << 26)
+
+static inline uint64_t mix64 (uint64_t x)
+{
+	x ^= x >> 33;
+	x *= UINT64_C(0xff51afd7ed558ccd);
+	x ^= x >> 33;
+	x *= UINT64_C(0xc4ceb9fe1a85ec53);
+	x ^= x >> 33;
+	return x;
+}
+
+
+static int filter_init (teredo_peerlist *l, size_t capacity)
+{
+	size_t size = FILTER_MIN_SIZE;
+
+	/* About 8 counters per peer, with 4 hashes: 2 to 3% false positives */
+	while ((size / 8 < capacity) && (size < FILTER_MAX_SIZE))
+		size <<= 1;
+
+	l->filter = calloc (size, sizeof (*l->filter));
+	if (l->filter == NULL)
+		return -1;
+
+	l->filter_mask = size - 1;
+	l->filter_key[0] = mix64 ((uintptr_t)l ^ ((uint64_t)getpid () << 32)
+	                          ^ (uint64_t)time (NULL));
+	l->filter_key[1] = mix64 (l->filter_key[0] ^ (uintptr_t)&l);
+	return 0;
+}
+
+
+static inline uint64_t filter_hash (const teredo_peerlist *l,
+                                    const struct in6_addr *addr)
+{
+	uint64_t a, b;
+
+	memcpy (&a, addr->s6_addr, 8);
+	memcpy (&b, addr->s6_addr + 8, 8);
+	return mix64 (mix64 (a ^ l->filter_key[0]) ^ b ^ l->filter_key[1]);
+}
+
+
+static inline atomic_uchar *filter_counter (const teredo_peerlist *l,
+                                            uint64_t h, unsigned i)
+{
+	/* Double hashing */
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+
+	return l->filter + ((h1 + i * h2) & l->filter_mask);
+}
+
+
+static void filter_add (teredo_peerlist *l, const struct in6_addr *addr)
+{
+	uint64_t h = filter_hash (l, addr);
+
+	for (unsigned i = 0; i < FILTER_HASHES; i++)
+	{
+		atomic_uchar *c = filter_counter (l, h, i);
+		unsigned char v = atomic_load_explicit (c, memory_order_relaxed);
+
+		while ((v < UCHAR_MAX)
+		    && !atomic_compare_exchange_weak_explicit (c, &v, v + 1,
+		                                               memory_order_relaxed,
+		                                               memory_order_relaxed));
+	}
+}
+
+
+static void filter_del (teredo_peerlist *l, const struct in6_addr *addr)
+{
+	uint64_t h = filter_hash (l, addr);
+
+	for (unsigned i = 0; i < FILTER_HASHES; i++)
+	{
+		atomic_uchar *c = filter_counter (l, h, i);
+		unsigned char v = atomic_load_explicit (c, memory_order_relaxed);
+
+		assert (v > 0);
+		while ((v < UCHAR_MAX)
+		    && !atomic_compare_exchange_weak_explicit (c, &v, v - 1,
+		                                               memory_order_relaxed,
+		                                               memory_order_relaxed));
+	}
+}
+
+
+bool teredo_list_may_contain (const teredo_peerlist *list,
+                              const struct in6_addr *addr)
+{
+	uint64_t h = filter_hash (list, addr);
+
+	for (unsigned i = 0; i < FILTER_HASHES; i++)
+		if (atomic_load_explicit (filter_counter (list, h, i),
+		                          memory_order_relaxed) == 0)
+			return false;
+	return true;
+}
+
+
+/**
+ * Destroys a linked list of items that were removed from the list.
+ */
+static void listitem_recdestroy (teredo_peerlist *l, teredo_listitem *entry)
+{
+	while (entry != NULL)
+	{
+		teredo_listitem *buf = entry->next;
+
+		filter_del (l, &entry->key.ip6);
+		listitem_destroy (entry);
+		entry = buf;
+	}
+}
+
+
+/*** Flow cache ***/
+#define FLOW_CACHE_SIZE 64 /* must be a power of two */
+#define FLOW_GEN_SIZE 1024 /* must be a power of two */
+
+static _Thread_local teredo_flow flow_cache[FLOW_CACHE_SIZE];
+
+/*
+ * Cached snapshots are checked against the generation of their list, and
+ * against that of their peer address hash bucket. The latter is incremented
+ * whenever a snapshot of a peer in the bucket may have become wrong, so that
+ * other peers stay cached, and the readers only share cache lines that are
+ * seldom written.
+ */
+typedef struct teredo_flowgen
+{
+	/* Unique among all lists, so that a new list cannot match snapshots from
+	 * a destroyed one at the same address. Changes when the list is reset. */
+	atomic_uint id;
+	_Alignas (LISTITEM_ALIGN) atomic_uint gen[FLOW_GEN_SIZE];
+} teredo_flowgen;
+
+static atomic_uint flow_lists;
+
+static inline unsigned flow_new_id (void)
+{
+	/* Zero is for empty cache slots */
+	unsigned id;
+
+	do
+		id = atomic_fetch_add_explicit (&flow_lists, 1, memory_order_relaxed);
+	while (id == 0);
+	return id;
+}
+
+
+static inline uint32_t flow_hash (const struct in6_addr *addr)
+{
+	uint32_t h = 0;
+
+	for (unsigned i = 0; i < 16; i += 4)
+	{
+		uint32_t w;
+
+		memcpy (&w, addr->s6_addr + i, 4);
+		h ^= w;
+	}
+	return h * 0x9e3779b1;
+}
+
+
+static inline teredo_flow *flow_slot (uint32_t h)
+{
+	return flow_cache + (h >> 26) % FLOW_CACHE_SIZE;
+}
+
+
+static inline atomic_uint *flow_gen (const teredo_peerlist *l, uint32_t h)
+{
+	return l->flows->gen + (h >> 10) % FLOW_GEN_SIZE;
+}
+
+
+static inline void flow_invalidate (teredo_peerlist *l,
+                                    const struct in6_addr *addr)
+{
+	atomic_fetch_add_explicit (flow_gen (l, flow_hash (addr)), 1,
+	                           memory_order_release);
+}
+
+
+static inline bool peer_state_changed (const teredo_peer *a,
+                                       const teredo_peer *b)
+{
+	return (a->trusted != b->trusted) || (a->local != b->local)
+	    || (a->mapped_addr != b->mapped_addr)
+	    || (a->mapped_port != b->mapped_port);
+}
+
+
+/**
+ * Updates the flow cache after a peer has been used (with the list locked).
+ */
+static void flow_update (teredo_peerlist *l, const teredo_hold *h)
+{
+	const teredo_listitem *p = h->item;
+	uint32_t hash = flow_hash (&p->key.ip6);
+	atomic_uint *gen = flow_gen (l, hash);
+
+	if (!h->created && peer_state_changed (&p->peer, &h->state))
+		atomic_fetch_add_explicit (gen, 1, memory_order_release);
+
+	teredo_flow *f = flow_slot (hash);
+	unsigned id = atomic_load_explicit (&l->flows->id, memory_order_relaxed);
+
+	if (!p->peer.trusted)
+	{
+		if (f->list_id == id && IN6_ARE_ADDR_EQUAL (&f->addr, &p->key.ip6))
+			f->list_id = 0;
+		return;
+	}
+
+	f->list_id = id;
+	f->generation = atomic_load_explicit (gen, memory_order_acquire);
+	f->addr = p->key.ip6;
+	f->mapped_addr = p->peer.mapped_addr;
+	f->mapped_port = p->peer.mapped_port;
+	f->local = p->peer.local;
+	f->last_rx = p->peer.last_rx;
+	f->last_tx = p->peer.last_tx;
+}
+
+
+const teredo_flow *teredo_list_cache_lookup (const teredo_peerlist *list,
+                                             const struct in6_addr *addr,
+                                             teredo_clock_t now)
+{
+	uint32_t hash = flow_hash (addr);
+	const teredo_flow *f = flow_slot (hash);
+
+	if ((f->list_id != atomic_load_explicit (&list->flows->id,
+	                                         memory_order_acquire))
+	 || (f->generation != atomic_load_explicit (flow_gen (list, hash),
+	                                            memory_order_acquire))
+	 || !IN6_ARE_ADDR_EQUAL (&f->addr, addr))
+		return NULL;
+
+	/* Same as IsValid() */
+	if (teredo_peer_age (f->last_rx, now) > (f->local ? 600 : 30))
+		return NULL;
+	return f;
+}
+
+
+/*** Probation table ***/
+static void probation_unlink (teredo_peerlist *l, teredo_listitem *p)
+{
+	if (l->ptail == p)
+		l->ptail = (p->pprev == &l->probation) ? NULL
+			: (teredo_listitem *)(((char *)p->pprev)
+			                      - offsetof (teredo_listitem, next));
+	listitem_unlink (p);
+	l->pcount--;
+}
+
+
+static void probation_push (teredo_peerlist *l, teredo_listitem *p)
+{
+	listitem_push (&l->probation, p);
+	if (l->ptail == NULL)
+		l->ptail = p;
+	l->pcount++;
+}
+
+
+/**
+ * Removes the least recently used entry from the probation table.
+ */
+static void probation_evict (teredo_peerlist *l)
+{
+	teredo_listitem *p = l->ptail;
+
+	assert (p != NULL);
+	assert (!p->held);
+	TEREDO_PROBE (peer__evict, &p->key.ip6);
+	if (p->peer.trusted)
+		flow_invalidate (l, &p->key.ip6);
+	index_del (&l->proot, p);
+	probation_unlink (l, p);
+	filter_del (l, &p->key.ip6);
+	listitem_destroy (p);
+}
+
+
+/**
+ * Moves a trusted peer from the probation table to the main one, if there is
+ * room left for it.
+ */
+static void probation_promote (teredo_peerlist *l, teredo_listitem *p)
+{
+	assert (p->probation);
+
+	if (l->count >= l->max)
+		return; /* stays on probation */
+	if (index_add (&l->root, p))
+		return; /* out of memory: ditto */
+
+	index_del (&l->proot, p);
+	probation_unlink (l, p);
+	p->probation = false;
+	listitem_push (&l->recent, p);
+	l->count++;
+}
+
+
+#include <sched.h>
+
+/* Peers reclaimed at once by the garbage collector after a reset */
+#define GRAVE_BATCH 256
+
+/**
+ * Frees up to @a n peers from a grave, without the list lock.
+ * @return true if the grave is now empty, false otherwise.
+ */
+static bool grave_reclaim (teredo_peerlist *l, teredo_grave *g, unsigned n)
+{
+	for (unsigned i = 0; i < 3; i++)
+		while (g->items[i] != NULL)
+		{
+			teredo_listitem *p = g->items[i];
+
+			if (n-- == 0)
+				return false;
+
+			g->items[i] = p->next;
+			index_del (p->probation ? &g->proot : &g->root, p);
+			filter_del (l, &p->key.ip6);
+			listitem_destroy (p);
 		}
 
-		// unlinks old peers
-		teredo_listitem *old = l->old;
+	index_destroy (g->root);
+	index_destroy (g->proot);
+	return true;
+}
+
+
+static void graves_destroy (teredo_peerlist *l, teredo_grave *g)
+{
+	while (g != NULL)
+	{
+		teredo_grave *next = g->next;
+
+		grave_reclaim (l, g, UINT_MAX);
+		free (g);
+		g = next;
+	}
+}
+
+
+/**
+ * Removes expired peers (with the list locked).
+ * @return the removed peers, to be destroyed.
+ */
+static teredo_listitem *list_expire (teredo_peerlist *l)
+{
+	// remove expired peers from hash table
+	for (teredo_listitem *p = l->old; p != NULL; p = p->next)
+	{
+		TEREDO_PROBE (peer__expire, &p->key.ip6);
+		flow_invalidate (l, &p->key.ip6);
+		index_del (&l->root, p);
+		l->count--;
+	}
+
+	// unlinks old peers
+	teredo_listitem *expired = l->old;
+
+	// moves recent peers to old peers area
+	l->old = l->recent;
+	l->recent = NULL;
+	if (l->old != NULL)
+		l->old->pprev = &l->old;
+
+	// unlinks peers that stayed on probation for too long
+	teredo_clock_t now = teredo_clock ();
+
+	while ((l->ptail != NULL)
+	    && (teredo_peer_age (l->ptail->touched, now) >= l->expiration))
+	{
+		teredo_listitem *p = l->ptail;
+
+		TEREDO_PROBE (peer__expire, &p->key.ip6);
+		if (p->peer.trusted)
+			flow_invalidate (l, &p->key.ip6);
+		index_del (&l->proot, p);
+		probation_unlink (l, p);
+		p->next = expired;
+		expired = p;
+	}
+
+	return expired;
+}
 
-		// moves recent peers to old peers area
-		l->old = l->recent;
-		l->recent = NULL;
-		if (l->old != NULL)
-			l->old->pprev = &l->old;
 
+/**
+ * Peer list garbage collector entry point.
+ */
+static void *garbage_collector (void *data)
+{
+	struct teredo_peerlist *l = (struct teredo_peerlist *)data;
+	struct timespec deadline;
+
+	teredo_gettime (&deadline);
+	deadline.tv_sec += l->expiration;
+
+	pthread_mutex_lock (&l->lock);
+	while (!l->stopping)
+	{
+		if ((l->dying == NULL) && (l->grave != NULL))
+		{
+			l->dying = l->grave;
+			l->grave = NULL;
+		}
+
+		if (l->dying != NULL)
+		{
+			/* Reclaim reset peers in small increments, without the lock */
+			pthread_mutex_unlock (&l->lock);
+			if (grave_reclaim (l, l->dying, GRAVE_BATCH))
+			{
+				teredo_grave *g = l->dying;
+
+				l->dying = g->next;
+				free (g);
+			}
+			sched_yield ();
+			pthread_mutex_lock (&l->lock);
+			continue;
+		}
+
+		if (pthread_cond_timedwait (&l->wake, &l->lock,
+		                            &deadline) != ETIMEDOUT)
+			continue;
+
+		teredo_listitem *expired = list_expire (l);
 		pthread_mutex_unlock (&l->lock);
 
 		// Perform possibly expensive memory release without the lock
 		sched_yield ();
-		listitem_recdestroy (old);
+		listitem_recdestroy (l, expired);
 
-		/* cancel-unsafe section ends */
-		pthread_setcancelstate (state, NULL);
-		sched_yield ();
+		teredo_gettime (&deadline);
+		deadline.tv_sec += l->expiration;
+		pthread_mutex_lock (&l->lock);
 	}
+	pthread_mutex_unlock (&l->lock);
+	return NULL;
 }
 
 
-teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
+teredo_peerlist *teredo_list_create (unsigned max, unsigned probation,
+                                     unsigned expiration)
 {
 	/*printf ("Peer size: %u/%u bytes\n",sizeof (teredo_peer),
 	        sizeof (teredo_listitem));*/
@@ -290,16 +945,50 @@ teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
 
 	pthread_mutex_init (&l->lock, NULL);
 	l->recent = l->old = NULL;
-	l->left = max;
-	l->expiration = expiration;
-#ifdef HAVE_LIBJUDY
-	l->PJHSArray = (Pvoid_t)NULL;
-#else
+	l->count = 0;
+	l->max = max;
 	l->root = NULL;
-#endif
+	l->probation = l->ptail = NULL;
+	l->pcount = 0;
+	l->pmax = probation;
+	l->proot = NULL;
+	l->nheld = 0;
+	l->expiration = expiration;
+	l->stopping = false;
+	l->grave = l->dying = NULL;
+
+	void *flows;
+	if (posix_memalign (&flows, LISTITEM_ALIGN, sizeof (*l->flows)))
+	{
+		pthread_mutex_destroy (&l->lock);
+		free (l);
+		return NULL;
+	}
+	l->flows = flows;
+	atomic_init (&l->flows->id, flow_new_id ());
+	for (unsigned i = 0; i < FLOW_GEN_SIZE; i++)
+		atomic_init (l->flows->gen + i, 0);
+
+	if (filter_init (l, (size_t)max + probation))
+	{
+		free (l->flows);
+		pthread_mutex_destroy (&l->lock);
+		free (l);
+		return NULL;
+	}
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, teredo_clock_id);
+	pthread_cond_init (&l->wake, &attr);
+	pthread_condattr_destroy (&attr);
 
 	if (pthread_create (&l->gc, NULL, garbage_collector, l))
 	{
+		pthread_cond_destroy (&l->wake);
+		free (l->filter);
+		free (l->flows);
 		pthread_mutex_destroy (&l->lock);
 		free (l);
 		return NULL;
@@ -311,35 +1000,69 @@ teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration)
 
 void teredo_list_reset (teredo_peerlist *l, unsigned max)
 {
+	teredo_grave *g = malloc (sizeof (*g)), local;
+
 	pthread_mutex_lock (&l->lock);
+	TEREDO_PROBE (peer__reset, l->count, l->pcount);
+
+	// detach old indexes and peers
+	teredo_grave *dst = (g != NULL) ? g : &local;
+
+	dst->root = l->root;
+	dst->proot = l->proot;
+	dst->items[0] = l->old;
+	dst->items[1] = l->recent;
+	dst->items[2] = l->probation;
+	l->root = l->proot = NULL;
+
+	// resets lists
+	l->recent = l->old = l->probation = l->ptail = NULL;
+	l->count = 0;
+	l->max = max;
+	l->pcount = 0;
+	atomic_store_explicit (&l->flows->id, flow_new_id (),
+	                       memory_order_release);
+
+	if (g != NULL)
+	{
+		/* Hand the peers over to the garbage collector */
+		g->next = l->grave;
+		l->grave = g;
+		pthread_cond_signal (&l->wake);
+	}
+	pthread_mutex_unlock (&l->lock);
 
-#ifdef HAVE_LIBJUDY
-	// detach old array
-	Pvoid_t array = l->PJHSArray;
-	l->PJHSArray = (Pvoid_t)NULL;
-#else
-	void *root = l->root;
-	l->root = NULL;
-#endif
+	if (g == NULL)
+		/* Out of memory: release everything synchronously */
+		grave_reclaim (l, &local, UINT_MAX);
+}
 
-	teredo_listitem *recent = l->recent, *old = l->old;
-	// unlinks peers and resets lists
-	l->recent = l->old = NULL;
-	l->left = max;
 
+int teredo_list_set_limits (teredo_peerlist *l, unsigned max,
+                            unsigned probation, unsigned expiration)
+{
+	if ((expiration == 0) || ((probation == 0) != (l->pmax == 0)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock (&l->lock);
+	l->max = max;
+	l->pmax = probation;
+	l->expiration = expiration; /* from the next expiration cycle */
 	pthread_mutex_unlock (&l->lock);
+	return 0;
+}
 
-	/* the mutex is not needed for actual memory release */
-	listitem_recdestroy (old);
-	listitem_recdestroy (recent);
 
-#ifdef HAVE_LIBJUDY
-	// destroy the old array that was detached before unlocking
-	intptr_t Rc_word;
-	JHSFA (Rc_word, array);
-#else
-	tdestroy (root, listitem_free);
-#endif
+void teredo_list_expire (teredo_peerlist *l)
+{
+	pthread_mutex_lock (&l->lock);
+	teredo_listitem *expired = list_expire (l);
+	pthread_mutex_unlock (&l->lock);
+
+	listitem_recdestroy (l, expired);
 }
 
 
@@ -347,140 +1070,442 @@ void teredo_list_destroy (teredo_peerlist *l)
 {
 	teredo_list_reset (l, 0);
 
-	pthread_cancel (l->gc);
+	pthread_mutex_lock (&l->lock);
+	l->stopping = true;
+	pthread_cond_signal (&l->wake);
+	pthread_mutex_unlock (&l->lock);
 	pthread_join (l->gc, NULL);
+
+	/* Reclaim whatever the garbage collector left behind */
+	graves_destroy (l, l->dying);
+	graves_destroy (l, l->grave);
+
+	pthread_cond_destroy (&l->wake);
 	pthread_mutex_destroy (&l->lock);
 
+	free (l->filter);
+	free (l->flows);
 	free (l);
 }
 
 
-teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
-                                 const struct in6_addr *restrict addr,
-                                 bool *restrict create)
+/**
+ * Looks up an existing peer (with the list locked).
+ */
+static teredo_listitem *list_find (teredo_peerlist *l,
+                                   const struct in6_addr *addr)
 {
-	teredo_listitem *p;
+	teredo_listitem *p = index_get (&l->root, addr);
 
-	pthread_mutex_lock (&list->lock);
+	if ((p == NULL) && (l->pmax > 0))
+		p = index_get (&l->proot, addr);
+	return p;
+}
 
-#ifdef HAVE_LIBJUDY
-	teredo_listitem **pp = NULL;
 
-	/* Judy dynamic array-based fast lookup */
+/**
+ * Marks a peer as the most recently used one of its table.
+ */
+static void list_touch (teredo_peerlist *l, teredo_listitem *p)
+{
+	if (p->probation)
 	{
-		void *PValue;
-
-		if (create != NULL)
+		if (l->probation != p)
 		{
-			JHSI (PValue, list->PJHSArray, (uint8_t *)addr, 16);
-			if (PValue == PJERR)
-				goto error; /* out of memory */
-			pp = (teredo_listitem **)PValue;
-			p = *pp;
+			probation_unlink (l, p);
+			probation_push (l, p);
 		}
-		else
+		p->touched = teredo_clock ();
+	}
+	else
+	if (l->recent != p)
+	{
+		/* move peer to the top of the head of the "recent" list */
+		listitem_unlink (p);
+		listitem_push (&l->recent, p);
+	}
+}
+
+
+/**
+ * Adds a new peer, which must not be in the list already.
+ * @return the new entry, or NULL if the list is full or out of memory.
+ */
+static teredo_listitem *list_add (teredo_peerlist *l,
+                                  const struct in6_addr *addr)
+{
+	teredo_listitem *p;
+
+	if (l->pmax > 0)
+	{
+		/* New peers are put on probation, at the expense of older ones */
+		while (l->pcount >= l->pmax)
 		{
-			JHSG (PValue, list->PJHSArray, (uint8_t *)addr, 16);
-			pp = (teredo_listitem **)PValue;
-			p = (pp != NULL) ? *pp : NULL;
+			if (l->ptail->held)
+				return NULL; /* whole table looked up by one batch */
+			probation_evict (l);
 		}
 
-	}
-#else
-	void **pp;
+		p = listitem_create ();
+		if (p == NULL)
+			return NULL; /* out of memory */
 
-	if (create != NULL)
-	{
-		pp = tsearch (addr, &list->root, listitem_cmp);
-		if (pp == NULL)
-			goto error; /* out of memory */
-		p = (*pp != addr) ? *pp : NULL;
+		p->key.ip6 = *addr;
+		if (index_add (&l->proot, p))
+		{
+			listitem_destroy (p);
+			return NULL; /* out of memory */
+		}
+
+		p->probation = true;
+		p->touched = teredo_clock ();
+		probation_push (l, p);
 	}
 	else
 	{
-		pp = tfind (addr, &list->root, listitem_cmp);
-		p = (pp != NULL) ? *pp : NULL;
+		/* Allocates a new peer entry */
+		if (l->count >= l->max)
+			return NULL;
+
+		p = listitem_create ();
+		if (p == NULL)
+			return NULL; /* out of memory */
+
+		p->key.ip6 = *addr;
+		if (index_add (&l->root, p))
+		{
+			listitem_destroy (p);
+			return NULL; /* out of memory */
+		}
+
+		/* Puts new entry at the head of the list */
+		p->probation = false;
+		listitem_push (&l->recent, p);
+		l->count++;
 	}
-#endif
 
-	if (p != NULL)
-	{
-		/* peer was already in list */
-		assert (*(p->pprev) == p);
-		assert ((p->next == NULL) || (p->next->pprev == &p->next));
+	p->held = false;
+	filter_add (l, addr);
+	TEREDO_PROBE (peer__create, addr);
+	return p;
+}
 
-		if (create != NULL)
-			*create = false;
 
-		/* move peer to the top of the head of the "recent" list */
-		if (list->recent != p)
-		{
-			// unlinks
-			if (p->next != NULL)
-				p->next->pprev = p->pprev;
-			*(p->pprev) = p->next;
+/**
+ * Holds a peer until the list is released.
+ */
+static void list_hold (teredo_peerlist *l, teredo_listitem *p, bool created)
+{
+	assert (l->nheld < TEREDO_LIST_BATCH_MAX);
 
-			// inserts at head
-			p->next = list->recent;
-			if (p->next != NULL)
-				p->next->pprev = &p->next;
+	teredo_hold *h = l->held + l->nheld++;
 
-			list->recent = p;
-			p->pprev = &list->recent;
+	h->item = p;
+	h->state = p->peer;
+	h->created = created;
+	p->held = true;
+}
 
-			assert (*(p->pprev) == p);
-			assert ((p->next == NULL) || (p->next->pprev == &p->next));
-		}
 
+teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
+                                 const struct in6_addr *restrict addr,
+                                 bool *restrict create)
+{
+	teredo_listitem *p;
+
+	pthread_mutex_lock (&list->lock);
+	assert (list->nheld == 0);
+
+	p = list_find (list, addr);
+	if (p != NULL)
+	{
+		/* peer was already in list */
+		list_touch (list, p);
+		if (create != NULL)
+			*create = false;
+		list_hold (list, p, false);
 		return &p->peer;
 	}
 
 	/* otherwise, peer was not in list */
-	assert (p == NULL);
 	if (create == NULL)
 		goto error; /* not found and not created */
 	*create = true;
 
-	/* Allocates a new peer entry */
-	if (list->left > 0)
-		p = listitem_create ();
-
+	p = list_add (list, addr);
 	if (p == NULL)
+		goto error;
+
+	list_hold (list, p, true);
+	return &p->peer;
+
+error:
+	pthread_mutex_unlock (&list->lock);
+	return NULL;
+}
+
+
+unsigned teredo_list_lookup_batch (teredo_peerlist *restrict list,
+                                   unsigned n,
+                                   const struct in6_addr *const *addrs,
+                                   teredo_peer **peers, bool *create)
+{
+	teredo_listitem *items[TEREDO_LIST_BATCH_MAX];
+	unsigned found = 0;
+
+	assert (n <= TEREDO_LIST_BATCH_MAX);
+
+	pthread_mutex_lock (&list->lock);
+	assert (list->nheld == 0);
+
+	/*
+	 * Walk the indexes first, prefetching the entries, so that their cache
+	 * misses overlap with the following index walks rather than stall the
+	 * LRU updates one by one.
+	 */
+	for (unsigned i = 0; i < n; i++)
 	{
-#ifdef HAVE_LIBJUDY
-		int Rc_int;
-		JHSD (Rc_int, list->PJHSArray, (uint8_t *)addr, sizeof (*addr));
-#else
-		tdelete (addr, &list->root, listitem_cmp);
+		items[i] = list_find (list, addrs[i]);
+#ifdef __GNUC__
+		if (items[i] != NULL)
+			__builtin_prefetch (items[i], 1);
 #endif
-		goto error; /* out of memory */
 	}
 
-	/* Puts new entry at the head of the list */
-	p->next = list->recent;
-	if (p->next != NULL)
-		p->next->pprev = &p->next;
+	/* Existing peers are held first, so that creations cannot evict them */
+	for (unsigned i = 0; i < n; i++)
+	{
+		teredo_listitem *p = items[i];
 
-	p->pprev = &list->recent;
-	list->recent = p;
-	p->pprev = &list->recent;
+		if (p == NULL)
+			continue;
 
-	list->left--;
+		list_touch (list, p);
+		list_hold (list, p, false);
+		if (create != NULL)
+			create[i] = false;
+		peers[i] = &p->peer;
+		found++;
+	}
 
-	assert (*(p->pprev) == p);
-	assert ((p->next == NULL) || (p->next->pprev == &p->next));
+	for (unsigned i = 0; i < n; i++)
+	{
+		if (items[i] != NULL)
+			continue;
 
-	*pp = p;
-	p->key.ip6 = *addr;
-	return &p->peer;
+		peers[i] = NULL;
+		if (create == NULL)
+			continue;
 
-error:
-	pthread_mutex_unlock (&list->lock);
-	return NULL;
+		/* Same peer may have been created earlier in the batch */
+		teredo_listitem *p = list_find (list, addrs[i]);
+		if (p != NULL)
+		{
+			list_touch (list, p);
+			create[i] = false;
+		}
+		else
+		{
+			p = list_add (list, addrs[i]);
+			if (p == NULL)
+				continue;
+			create[i] = true;
+		}
+
+		list_hold (list, p, create[i]);
+		peers[i] = &p->peer;
+		found++;
+	}
+
+	return found;
 }
 
 
 void teredo_list_release (teredo_peerlist *l)
 {
+	for (unsigned i = 0; i < l->nheld; i++)
+	{
+		teredo_listitem *p = l->held[i].item;
+
+		flow_update (l, l->held + i);
+
+		/* Peers get out of probation once trusted */
+		if (p->probation && p->peer.trusted)
+			probation_promote (l, p);
+		p->held = false;
+	}
+	l->nheld = 0;
+
 	pthread_mutex_unlock (&l->lock);
 }
+
+
+/*** Persistence ***/
+/*
+ * Saved peers file: a header, followed by one record per peer.
+ * Timestamps are saved as ages relative to the save time, as the clock of
+ * another process cannot be assumed to be the same.
+ */
+#define SAVED_MAGIC "MRDp"
+#define SAVED_VERSION 1
+
+typedef struct teredo_saved_header
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t count;
+	uint32_t saved; /* wall clock time (seconds) */
+} teredo_saved_header;
+
+typedef struct teredo_saved_peer
+{
+	uint8_t addr[16];
+	uint32_t mapped_addr;
+	uint16_t mapped_port;
+	uint8_t flags;
+	uint8_t reserved;
+	uint32_t rx_age; /* seconds since last reception */
+	uint32_t tx_age; /* seconds since last transmission */
+} teredo_saved_peer;
+
+#define SAVED_FLAG_LOCAL 0x01
+
+/* Integers are in network byte order, like mapped addresses and ports. */
+
+int teredo_list_save (teredo_peerlist *l, int fd)
+{
+	teredo_saved_header hdr;
+	teredo_saved_peer *recs = NULL;
+	size_t count = 0, max = 0;
+
+	pthread_mutex_lock (&l->lock);
+
+	teredo_clock_t now = teredo_clock ();
+	teredo_listitem *lists[2] = { l->recent, l->old };
+
+	for (unsigned i = 0; i < 2; i++)
+		for (const teredo_listitem *p = lists[i]; p != NULL; p = p->next)
+		{
+			if (!p->peer.trusted || !IsValid (&p->peer, now))
+				continue;
+
+			if (count >= max)
+			{
+				max = max ? 2 * max : 256;
+
+				void *buf = realloc (recs, max * sizeof (*recs));
+				if (buf == NULL)
+				{
+					pthread_mutex_unlock (&l->lock);
+					free (recs);
+					return -1;
+				}
+				recs = buf;
+			}
+
+			teredo_saved_peer *r = recs + count++;
+
+			memcpy (r->addr, &p->key.ip6, 16);
+			r->mapped_addr = p->peer.mapped_addr;
+			r->mapped_port = p->peer.mapped_port;
+			r->flags = p->peer.local ? SAVED_FLAG_LOCAL : 0;
+			r->reserved = 0;
+			r->rx_age = htonl (teredo_peer_age (p->peer.last_rx, now));
+			r->tx_age = htonl (teredo_peer_age (p->peer.last_tx, now));
+		}
+
+	pthread_mutex_unlock (&l->lock);
+
+	memcpy (hdr.magic, SAVED_MAGIC, 4);
+	hdr.version = htons (SAVED_VERSION);
+	hdr.record_size = htons (sizeof (teredo_saved_peer));
+	hdr.count = htonl (count);
+	hdr.saved = htonl (time (NULL));
+
+	size_t len = count * sizeof (*recs);
+	int ret = -1;
+
+	if ((ftruncate (fd, 0) == 0)
+	 && (pwrite (fd, &hdr, sizeof (hdr), 0) == sizeof (hdr))
+	 && ((len == 0)
+	  || (pwrite (fd, recs, len, sizeof (hdr)) == (ssize_t)len)))
+		ret = count;
+
+	free (recs);
+	return ret;
+}
+
+
+int teredo_list_restore (teredo_peerlist *l, int fd)
+{
+	teredo_saved_header hdr;
+
+	ssize_t val = pread (fd, &hdr, sizeof (hdr), 0);
+	if (val == 0)
+		return 0; /* nothing saved */
+	if ((val != sizeof (hdr)) || memcmp (hdr.magic, SAVED_MAGIC, 4)
+	 || (ntohs (hdr.version) != SAVED_VERSION)
+	 || (ntohs (hdr.record_size) != sizeof (teredo_saved_peer)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint32_t elapsed = time (NULL) - ntohl (hdr.saved);
+	uint32_t count = ntohl (hdr.count);
+	off_t offset = sizeof (hdr);
+	teredo_clock_t now = teredo_clock ();
+	int restored = 0;
+
+	while (count > 0)
+	{
+		teredo_saved_peer recs[64];
+		unsigned n = (count < 64) ? count : 64;
+
+		val = pread (fd, recs, n * sizeof (recs[0]), offset);
+		if (val < (ssize_t)sizeof (recs[0]))
+			break; /* truncated */
+
+		n = val / sizeof (recs[0]);
+		offset += n * sizeof (recs[0]);
+		count -= n;
+
+		for (unsigned i = 0; i < n; i++)
+		{
+			const teredo_saved_peer *r = recs + i;
+			bool local = r->flags & SAVED_FLAG_LOCAL;
+			uint32_t rx_age = ntohl (r->rx_age) + elapsed;
+			uint32_t tx_age = ntohl (r->tx_age) + elapsed;
+
+			/* Skip malformed or expired peers */
+			if ((r->mapped_port == 0) || (r->mapped_addr == 0)
+			 || (rx_age < elapsed) || (rx_age > (local ? 600 : 30)))
+				continue;
+			if (tx_age < elapsed)
+				tx_age = UINT32_MAX; /* overflow */
+
+			struct in6_addr addr;
+			bool create;
+
+			memcpy (&addr, r->addr, 16);
+			teredo_peer *p = teredo_list_lookup (l, &addr, &create);
+			if (p == NULL)
+				continue; /* list full */
+
+			if (create)
+			{
+				p->mapped_addr = r->mapped_addr;
+				p->mapped_port = r->mapped_port;
+				p->local = local;
+				p->trusted = 1;
+				p->last_rx = now - rx_age;
+				p->last_tx = now - tx_age;
+				restored++;
+			}
+			teredo_list_release (l);
+		}
+	}
+
+	return restored;
+}
@@ -24,17 +24,31 @@
 # define LIBTEREDO_PEERLIST_H
 
 # define TEREDO_TIMEOUT 30 // seconds
-# define MAXQUEUE 1280u // bytes
+# define MAXQUEUE 1280u // default bytes queued per peer
 
 typedef struct teredo_queue teredo_queue;
 
-typedef struct teredo_peer
+/**
+ * Peer state that is only needed until the peer is trusted (i.e. while
+ * packets are queued and pings are sent). It is allocated on demand, and
+ * released once the queue is yielded.
+ */
+typedef struct teredo_peer_cold
 {
 	teredo_queue *queue;
-	size_t queue_left;
-	teredo_clock_t last_rx;
-	teredo_clock_t last_tx;
-	teredo_clock_t last_ping;
+	size_t queue_bytes;
+	uint32_t last_ping;
+} teredo_peer_cold;
+
+/*
+ * Peer state, kept small so that the whole list item fits in a single cache
+ * line. Timestamps are truncated teredo_clock_t values.
+ */
+typedef struct teredo_peer
+{
+	teredo_peer_cold *cold;
+	uint32_t last_rx;
+	uint32_t last_tx;
 	uint32_t mapped_addr;
 	uint16_t mapped_port;
 	unsigned trusted:1;
@@ -46,15 +60,37 @@ typedef struct teredo_peer
 
 typedef void (*teredo_dequeue_cb) (void *, const void *, size_t);
 
+/**
+ * Queues a packet received from a peer, unless that would exceed @p max
+ * bytes queued for that peer.
+ */
 void teredo_enqueue_in (teredo_peer *restrict peer, const void *restrict data,
-                        size_t len, uint32_t ip, uint16_t port);
+                        size_t len, size_t max, uint32_t ip, uint16_t port);
 
+/**
+ * Queues a packet to be sent to a peer, unless that would exceed @p max
+ * bytes queued for that peer.
+ */
 void teredo_enqueue_out (teredo_peer *restrict peer,
-                         const void *restrict data, size_t len);
+                         const void *restrict data, size_t len, size_t max);
 teredo_queue *teredo_peer_queue_yield (teredo_peer *peer);
 void teredo_queue_emit (teredo_queue *q, int fd, uint32_t ipv4, uint16_t port,
                         teredo_dequeue_cb cb, void *r);
 
+/**
+ * @return the cold part of a peer state, allocated if needed, or NULL if out
+ * of memory.
+ */
+teredo_peer_cold *teredo_peer_get_cold (teredo_peer *peer);
+
+/**
+ * @return the number of seconds elapsed from a peer timestamp to @p now.
+ */
+static inline uint32_t teredo_peer_age (uint32_t stamp, teredo_clock_t now)
+{
+	return (uint32_t)now - stamp;
+}
+
 static inline void SetMapping (teredo_peer *peer, uint32_t ip, uint16_t port)
 {
 	peer->mapped_addr = ip;
@@ -75,7 +111,7 @@ static inline void TouchTransmit (teredo_peer *peer, teredo_clock_t now)
 static inline
 bool IsValid (const teredo_peer *peer, teredo_clock_t now)
 {
-	return (now - peer->last_rx) <= (peer->local ? 600 : 30);
+	return teredo_peer_age (peer->last_rx, now) <= (peer->local ? 600 : 30);
 }
 
 
@@ -86,13 +122,26 @@ struct in6_addr;
 /**
  * Creates an empty peer list.
  *
- * @param max maximum number of peers in the list
+ * @param max maximum number of (trusted) peers in the list
+ * @param probation maximum number of new peers on probation; once full, the
+ * least recently used one is dropped to make room for a new one. Peers are
+ * promoted out of probation by teredo_list_release() once trusted.
+ * If 0, there is no probation: new peers are directly added to the list,
+ * until it is full.
  * @param expiration minimum delay (seconds) before a peer can be removed
  * by the garbage collector. Must not be 0.
  *
  * @return NULL on error (see errno for actual problem).
  */
-teredo_peerlist *teredo_list_create (unsigned max, unsigned expiration);
+teredo_peerlist *teredo_list_create (unsigned max, unsigned probation,
+                                     unsigned expiration);
+
+
+/**
+ * @return the approximate memory usage of one (trusted) peer, in bytes,
+ * not including its queue.
+ */
+size_t teredo_list_peer_size (void);
 
 
 /**
@@ -104,12 +153,39 @@ void teredo_list_destroy (teredo_peerlist *list);
 
 /**
  * Empties an existing unlocked list. Always succeeds.
+ * This takes constant time: the former peers become invisible immediately,
+ * and are freed in the background by the garbage collector thread.
  *
  * @param list list to be reset
  * @param max new value for maximum number of items allowed.
+ * The number of peers on probation is unchanged.
  */
 void teredo_list_reset (teredo_peerlist *list, unsigned max);
 
+/**
+ * Removes expired peers now, as the garbage collector thread does every
+ * expiration delay: peers not used since the previous expiry, and peers
+ * on probation for longer than the delay. This is meant for tests and
+ * benchmarks.
+ *
+ * @param list unlocked list
+ */
+void teredo_list_expire (teredo_peerlist *list);
+
+/**
+ * Changes the limits of an unlocked list. Lowering them does not remove
+ * any peer: the excess ones are removed as they expire.
+ * The probation table can neither be enabled nor disabled this way.
+ *
+ * @param max new maximum number of trusted peers
+ * @param probation new maximum number of peers on probation
+ * @param expiration new minimum delay before an unused peer is removed (s)
+ *
+ * @return 0 on success, -1 on error (errno = EINVAL).
+ */
+int teredo_list_set_limits (teredo_peerlist *list, unsigned max,
+                            unsigned probation, unsigned expiration);
+
 
 /**
  * Locks the list and looks up a peer in an unlocked list.
@@ -131,10 +207,104 @@ teredo_peer *teredo_list_lookup (teredo_peerlist *restrict list,
                                  const struct in6_addr *restrict addr,
                                  bool *restrict create);
 
+/** Maximum number of peers looked up by teredo_list_lookup_batch() */
+# define TEREDO_LIST_BATCH_MAX 32
+
+/**
+ * Locks the list once and looks up several peers, e.g. the destinations or
+ * sources of a batch of packets. Unlike teredo_list_lookup(), the list is
+ * always locked on return, even if no peers were found, and must be unlocked
+ * with teredo_list_release() after all the peers have been processed.
+ *
+ * The same address may appear more than once, in which case the same peer
+ * is returned each time.
+ *
+ * @param n number of addresses (at most TEREDO_LIST_BATCH_MAX)
+ * @param addrs IPv6 addresses of the peers to search for
+ * @param peers array of @a n peers set on return, NULL where the peer was
+ * not found (or could not be created)
+ * @param create if not NULL, array of @a n booleans: missing peers are
+ * added to the list as with teredo_list_lookup(), and create[i] tells
+ * whether peers[i] was created (undefined where peers[i] is NULL).
+ *
+ * @return the number of peers found or created.
+ */
+unsigned teredo_list_lookup_batch (teredo_peerlist *restrict list,
+                                   unsigned n,
+                                   const struct in6_addr *const *addrs,
+                                   teredo_peer **peers, bool *create);
+
 /**
- * Unlocks a list that was locked by teredo_list_lookup().
+ * Checks whether a peer may be in the list, without locking it.
+ * This is approximate: it may (rarely) return true for a missing peer,
+ * and races with concurrent insertions.
+ *
+ * @return false if the peer is definitely not in the list, true otherwise.
+ */
+bool teredo_list_may_contain (const teredo_peerlist *list,
+                              const struct in6_addr *addr);
+
+/**
+ * Snapshot of a trusted peer, as cached by teredo_list_release().
+ */
+typedef struct teredo_flow
+{
+	unsigned list_id; /* 0 if unused */
+	unsigned generation;
+	struct in6_addr addr;
+	uint32_t mapped_addr;
+	uint16_t mapped_port;
+	bool local;
+	uint32_t last_rx;
+	uint32_t last_tx;
+} teredo_flow;
+
+/**
+ * Looks up a trusted and valid peer in the calling thread's flow cache,
+ * without locking the list. The cache is filled by teredo_list_release().
+ * A snapshot is invalidated whenever its peer (or one with the same hash
+ * bucket) is removed or its trust or mapping changes, and when the list is
+ * reset, so this is only useful for back-to-back packets of the same flow.
+ *
+ * As the snapshot may be slightly outdated, it must only be used if it is
+ * as recent as the caller's clock value (i.e. the relevant last_rx or last_tx
+ * field equals @p now, truncated), so that the peer state need not be
+ * updated.
+ *
+ * @return the cached snapshot, or NULL if the peer is not in the cache.
+ */
+const teredo_flow *teredo_list_cache_lookup (const teredo_peerlist *list,
+                                             const struct in6_addr *addr,
+                                             teredo_clock_t now);
+
+/**
+ * Unlocks a list that was locked by teredo_list_lookup() or
+ * teredo_list_lookup_batch().
+ * If a peer that was looked up is on probation and has been marked as
+ * trusted in the mean time, it is promoted to the main list.
  * @param list peers list
  */
 void teredo_list_release (teredo_peerlist *list);
 
+/**
+ * Saves the trusted and valid peers of the list to a file, overwriting it,
+ * so that another process can restore them with teredo_list_restore().
+ * Peers on probation are not saved.
+ *
+ * @param fd file descriptor (must be seekable, the file offset is unused)
+ * @return the number of saved peers, or -1 on error (see errno).
+ */
+int teredo_list_save (teredo_peerlist *list, int fd);
+
+/**
+ * Restores peers saved by teredo_list_save() into an unlocked list.
+ * Peers that have expired in the mean time are skipped, as well as peers
+ * that are already in the list.
+ *
+ * @param fd file descriptor (the file offset is unused)
+ * @return the number of restored peers (0 if the file is empty), or -1 if
+ * the file is not valid.
+ */
+int teredo_list_restore (teredo_peerlist *list, int fd);
+
 #endif /* ifndef LIBTEREDO_PEERLIST_H */
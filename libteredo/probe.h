@@ -0,0 +1,63 @@
+/*
+ * probe.h - Static tracing probes
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_PROBE_H
+# define LIBTEREDO_PROBE_H
+
+/*
+ * User-level statically defined tracing probes (USDT, provider "teredo"),
+ * for use with perf, bpftrace or SystemTap. A probe is a single no-op
+ * instruction until a tracer attaches to it; its arguments should thus be
+ * cheap to compute. Addresses are passed as pointers to struct in6_addr,
+ * IPv4 addresses and UDP ports in network byte order.
+ *
+ * Peers:
+ *  peer__create (addr)              peer added to the list
+ *  peer__trust (addr, ipv4, port)   peer trusted, with its mapping
+ *  peer__expire (addr)              unused peer removed
+ *  peer__evict (addr)               untrusted peer removed to make room
+ *  peer__reset (count, probation)   all peers removed (e.g. new address)
+ *
+ * Packets:
+ *  bubble__send (ipv4, port, dst)   bubble sent to a peer (or its server)
+ *  bubble__throttle (addr, res)     bubble not sent: later (1), never (-1)
+ *  ping__send (addr)                ICMPv6 echo request sent
+ *  ping__verify (addr)              ICMPv6 echo reply authenticated
+ *  queue__emit (len, incoming)      queued packet sent or delivered
+ *  queue__drop (len, incoming)      packet not queued or not delivered
+ *
+ * Server:
+ *  server__accept (ipv4, port, src, dst)  packet accepted
+ *  server__drop (ipv4, port, reason)      packet dropped (teredo_counter)
+ */
+# ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define TEREDO_PROBE(...) STAP_PROBEV (teredo, __VA_ARGS__)
+# else
+/* Arguments are still type-checked, then optimized out */
+static inline void teredo_no_probe (int dummy, ...)
+{
+	(void)dummy;
+}
+#  define TEREDO_PROBE(name, ...) teredo_no_probe (0, __VA_ARGS__)
+# endif
+
+#endif /* ifndef LIBTEREDO_PROBE_H */
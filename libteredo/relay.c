@@ -28,13 +28,18 @@
 
 
 #include <stdbool.h>
+#include <string.h>
 #include <time.h>
 #include <stdlib.h> // malloc()
+#include <limits.h> // UINT_MAX
+#include <errno.h>
 #include <assert.h>
 #include <inttypes.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h> // getsockname()
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/ip6.h> // struct ip6_hdr
 #include <netinet/icmp6.h> // ICMP6_DST_UNREACH_*
@@ -51,11 +56,16 @@
 #include "clock.h"
 #include "peerlist.h"
 #include "thread.h"
+#include "filter.h"
+#include "transport.h"
 #ifdef MIREDO_TEREDO_CLIENT
 # include "security.h"
 # include "discovery.h"
 #endif
 #include "debug.h"
+#include "stats.h"
+#include "probe.h"
+#include "log.h"
 #ifndef NDEBUG
 # include <sys/socket.h>
 #endif
@@ -88,8 +98,14 @@ struct teredo_tunnel
 
 	// Asynchronous packet reception
 	teredo_thread *recv;
+	struct teredo_packet *rx_batch;
 
+	teredo_tunables tunables;
 	int fd;
+
+	// Kernel drops accounting
+	atomic_uint_least32_t rx_dropped;
+	atomic_uint rcvbuf_max;
 };
 
 #ifdef HAVE_LIBJUDY
@@ -97,18 +113,60 @@ struct teredo_tunnel
 #else
 # define MAX_PEERS 1024
 #endif
+/* Peers awaiting a bubble or ping reply */
+#define PROBATION_PEERS (MAX_PEERS / 8)
 #define ICMP_RATE_LIMIT_MS 100
 
-#if 0
-static unsigned QualificationRetries; // maintain.c
-static unsigned QualificationTimeOut; // maintain.c
-static unsigned ServerNonceLifetime;  // maintain.c
-static unsigned RestartDelay;         // maintain.c
-
-static unsigned MaxQueueBytes;        // peerlist.c
-static unsigned MaxPeers;             // here
-static unsigned IcmpRateLimitMs;      // here
-#endif
+void teredo_tunables_init (teredo_tunables *t)
+{
+	memset (t, 0, sizeof (*t));
+	t->max_peers = MAX_PEERS;
+	t->probation_peers = PROBATION_PEERS;
+	t->relay_expiration = 30;
+	/* longer expiration time to handle local peers */
+	t->client_expiration = 600;
+	t->icmp_rate_limit_ms = ICMP_RATE_LIMIT_MS;
+	t->max_queue_bytes = MAXQUEUE;
+}
+
+
+/**
+ * Checks tunables, and computes the number of peers from the memory budget.
+ */
+static int teredo_tunables_apply (teredo_tunables *restrict t,
+                                  const teredo_tunables *restrict in)
+{
+	if (in == NULL)
+		teredo_tunables_init (t);
+	else
+		*t = *in;
+
+	if ((t->relay_expiration == 0) || (t->client_expiration == 0))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (t->peer_memory)
+	{
+		/*
+		 * Keeps one probation peer (with a full queue) for every 8 trusted
+		 * peers, as with the defaults.
+		 */
+		uint64_t budget = (uint64_t)t->peer_memory * 1024;
+		uint64_t cost = 9 * teredo_list_peer_size ()
+		                + sizeof (teredo_peer_cold) + t->max_queue_bytes;
+		uint64_t n = 8 * budget / cost;
+
+		if (n > UINT_MAX)
+			n = UINT_MAX;
+		t->max_peers = n;
+		t->probation_peers = n / 8;
+		debug ("Peer memory %u kB: %u peers, %u on probation",
+		       t->peer_memory, t->max_peers, t->probation_peers);
+	}
+	return 0;
+}
 
 /**
  * Rate limiter around ICMPv6 unreachable error packet emission callback.
@@ -132,15 +190,17 @@ teredo_send_unreach (teredo_tunnel *restrict tunnel, uint8_t code,
 	pthread_mutex_lock (&tunnel->ratelimit.lock);
 	if (now != tunnel->ratelimit.last)
 	{
+		unsigned ms = tunnel->tunables.icmp_rate_limit_ms;
+
 		tunnel->ratelimit.last = now;
-		tunnel->ratelimit.count =
-			ICMP_RATE_LIMIT_MS ? (int)(1000 / ICMP_RATE_LIMIT_MS) : -1;
+		tunnel->ratelimit.count = ms ? (int)((ms < 1000) ? 1000 / ms : 1) : -1;
 	}
 
 	if (tunnel->ratelimit.count == 0)
 	{
 		/* rate limit exceeded */
 		pthread_mutex_unlock (&tunnel->ratelimit.lock);
+		teredo_count (TEREDO_ICMP_RATE_LIMITED);
 		return;
 	}
 	if (tunnel->ratelimit.count > 0)
@@ -149,6 +209,7 @@ teredo_send_unreach (teredo_tunnel *restrict tunnel, uint8_t code,
 
 	len = BuildICMPv6Error (&buf.hdr, ICMP6_DST_UNREACH, code, in, len);
 	tunnel->icmpv6_cb (tunnel->opaque, &buf.hdr, len, &in->ip6_src);
+	teredo_count (TEREDO_ICMP_SENT);
 }
 
 #if 0
@@ -198,7 +259,7 @@ teredo_state_change (const teredo_state *state, void *self)
 		 * the peer list is locked is STRICTLY FORBIDDEN to avoid an obvious
 		 * inter-locking deadlock.
 		 */
-		teredo_list_reset (tunnel->list, MAX_PEERS);
+		teredo_list_reset (tunnel->list, tunnel->tunables.max_peers);
 		tunnel->up_cb (tunnel->opaque,
 		               &tunnel->state.addr.ip6, tunnel->state.mtu);
 
@@ -235,8 +296,12 @@ teredo_state_change (const teredo_state *state, void *self)
  */
 static int CountPing (teredo_peer *peer, teredo_clock_t now)
 {
+	teredo_peer_cold *cold = teredo_peer_get_cold (peer);
 	int res;
 
+	if (cold == NULL)
+		return -1;
+
 	if (peer->pings == 0)
 		res = 0;
 	// don't test more than 4 times (once + 3 repeats)
@@ -244,14 +309,14 @@ static int CountPing (teredo_peer *peer, teredo_clock_t now)
 		res = -1;
 	// test must be separated by at least 2 seconds
 	else
-	if (now - peer->last_ping <= 2)
+	if (teredo_peer_age (cold->last_ping, now) <= 2)
 		res = 1;
 	else
 		res = 0; // can test again!
 
 	if (res == 0)
 	{
-		peer->last_ping = now;
+		cold->last_ping = now;
 		peer->pings++;
 	}
 
@@ -280,7 +345,7 @@ static int CountBubble (teredo_peer *peer, teredo_clock_t now)
 		if (peer->bubbles >= 4)
 		{
 			// don't send if 4 bubbles already sent within 300 seconds
-			if ((now - peer->last_tx) <= 300)
+			if (teredo_peer_age (peer->last_tx, now) <= 300)
 				res = -1;
 			else
 			{
@@ -291,7 +356,7 @@ static int CountBubble (teredo_peer *peer, teredo_clock_t now)
 		}
 		else
 		// don't send if last tx was 2 seconds ago or fewer
-		if ((now - peer->last_tx) <= 2)
+		if (teredo_peer_age (peer->last_tx, now) <= 2)
 			res = 1;
 		else
 			res = 0;
@@ -332,24 +397,36 @@ int teredo_encap (teredo_tunnel *restrict tunnel, teredo_peer *restrict peer,
 	TouchTransmit (peer, now);
 	teredo_list_release (tunnel->list);
 
-	return (teredo_send (tunnel->fd,
-	                     data, len, ipv4, port) == (int)len) ? 0 : -1;
+	teredo_count (TEREDO_TX_TRUSTED);
+	if (teredo_send (tunnel->fd, data, len, ipv4, port) != (int)len)
+	{
+		teredo_count (TEREDO_TX_ERRORS);
+		return -1;
+	}
+	return 0;
 }
 
 
-int teredo_transmit (teredo_tunnel *restrict tunnel,
-                     const struct ip6_hdr *restrict packet, size_t length)
+static
+int teredo_transmit_packet (teredo_tunnel *restrict tunnel,
+                            const struct ip6_hdr *restrict packet,
+                            size_t length)
 {
-	assert (tunnel != NULL);
 
 	const struct in6_addr *dst = &packet->ip6_dst;
 #ifndef NDEBUG
    	char b[INET6_ADDRSTRLEN];
 #endif
 
+	teredo_count (TEREDO_TX_PACKETS);
+	teredo_count_add (TEREDO_TX_BYTES, length);
+
 	/* Drops multicast destination, we cannot handle these */
 	if (dst->s6_addr[0] == 0xff)
+	{
+		teredo_count (TEREDO_TX_MULTICAST);
 		return 0;
+	}
 
 	teredo_state s;
 	pthread_rwlock_rdlock (&tunnel->state_lock);
@@ -364,6 +441,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	if (IsClient (tunnel) && !s.up)
 	{
 		/* Client not qualified */
+		teredo_count (TEREDO_TX_NOT_QUALIFIED);
 		teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR, packet, length);
 		return 0;
 	}
@@ -381,6 +459,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			{
 				// Teredo servers and relays would reject the packet
 				// if it does not have a Teredo source.
+				teredo_count (TEREDO_TX_BAD_DESTINATION);
 				teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADMIN,
 				                     packet, length);
 				return 0;
@@ -393,6 +472,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			// The routing table must be misconfigured.
 			debug ("Unacceptable destination: %s",
 			       inet_ntop(AF_INET6, dst->s6_addr, b, sizeof (b)));
+			teredo_count (TEREDO_TX_BAD_DESTINATION);
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
 			                     packet, length);
 			return 0;
@@ -422,6 +502,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			debug ("Non global server address: %s",
 			       inet_ntop (AF_INET, &peer_server, b, sizeof b));
 #endif
+			teredo_count (TEREDO_TX_BAD_SERVER);
 			return 0;
 		}
 	}
@@ -430,9 +511,29 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	teredo_clock_t now = teredo_clock ();
 	struct teredo_peerlist *list = tunnel->list;
 
+	/*
+	 * Fast path for back-to-back packets to a trusted peer (case 1),
+	 * if it was already touched during this very second.
+	 */
+	const teredo_flow *f = teredo_list_cache_lookup (list, dst, now);
+	if ((f != NULL) && (f->last_tx == (uint32_t)now))
+	{
+		teredo_count (TEREDO_TX_FAST_PATH);
+		if (teredo_send (tunnel->fd, packet, length, f->mapped_addr,
+		                 f->mapped_port) != (int)length)
+		{
+			teredo_count (TEREDO_TX_ERRORS);
+			return -1;
+		}
+		return 0;
+	}
+
 	teredo_peer *p = teredo_list_lookup(list, dst, &created);
 	if (p == NULL)
+	{
+		teredo_count (TEREDO_TX_NO_MEMORY);
 		return -1; /* error */
+	}
 
 	if (!created)
 	{
@@ -473,16 +574,24 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			p->mapped_addr = 0;
 		}
 
-		teredo_enqueue_out (p, packet, length);
+		teredo_enqueue_out (p, packet, length,
+		                    tunnel->tunables.max_queue_bytes);
 		res = CountPing (p, now);
 		teredo_list_release (list);
+		teredo_count (TEREDO_TX_QUEUED);
 
 		if (res == 0)
+		{
+			teredo_count (TEREDO_TX_PINGS);
 			res = SendPing(tunnel->fd, &s.addr, dst);
+		}
 
 		if (res == -1)
+		{
+			teredo_count (TEREDO_TX_UNREACHABLE);
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
 			                     packet, length);
+		}
 
 		debug ("%s: ping returned %d",
 		       inet_ntop(AF_INET6, dst, b, sizeof (b)), res);
@@ -492,16 +601,21 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	/* Client case 3: untrusted local peer */
 	if (p->local && IsValid (p, now))
 	{
-		teredo_enqueue_out (p, packet, length);
+		teredo_enqueue_out (p, packet, length,
+		                    tunnel->tunables.max_queue_bytes);
 
 		int res = CountBubble (p, now);
 		uint32_t addr = p->mapped_addr;
 		uint16_t port = p->mapped_port;
 
 		teredo_list_release (list);
+		teredo_count (TEREDO_TX_QUEUED);
 
-		if (res == 0)
+		if (res != 0)
+			TEREDO_PROBE (bubble__throttle, dst, res);
+		else
 		{
+			teredo_count (TEREDO_TX_BUBBLES);
 			teredo_send_bubble(tunnel->fd, addr, port, &s.addr.ip6, dst);
 
 			pthread_rwlock_rdlock (&tunnel->state_lock);
@@ -511,9 +625,12 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 		}
 
 		if (res == -1)
+		{
 			// TODO: blacklist as a local peer ?
+			teredo_count (TEREDO_TX_UNREACHABLE);
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
 			                     packet, length);
+		}
 
 		return 0;
 	}
@@ -530,20 +647,25 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 	if (IN6_IS_TEREDO_ADDR_CONE(dst))
 	{
 		p->trusted = 1;
+		TEREDO_PROBE (peer__trust, dst, p->mapped_addr, p->mapped_port);
 		p->bubbles = /*p->pings -USELESS- =*/ 0;
 		return teredo_encap (tunnel, p, packet, length);
 	}
 #endif
 
 	/* Client case 5 & relay case 3: untrusted non-cone peer */
-	teredo_enqueue_out (p, packet, length);
+	teredo_enqueue_out (p, packet, length, tunnel->tunables.max_queue_bytes);
 
 	// Sends bubble, if rate limit allows
 	int res = CountBubble (p, now);
 	teredo_list_release (list);
+	teredo_count (TEREDO_TX_QUEUED);
+	if (res != 0)
+		TEREDO_PROBE (bubble__throttle, dst, res);
 	switch (res)
 	{
 		case 0:
+			teredo_count (TEREDO_TX_BUBBLES);
 			/*
 			 * Open the return path if we are behind a
 			 * restricted NAT.
@@ -555,6 +677,7 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 			return SendBubbleFromDst(tunnel->fd, dst, true);
 
 		case -1: // Too many bubbles already sent
+			teredo_count (TEREDO_TX_UNREACHABLE);
 			teredo_send_unreach (tunnel, ICMP6_DST_UNREACH_ADDR,
 			                     packet, length);
 
@@ -565,6 +688,18 @@ int teredo_transmit (teredo_tunnel *restrict tunnel,
 }
 
 
+int teredo_transmit (teredo_tunnel *restrict tunnel,
+                     const struct ip6_hdr *restrict packet, size_t length)
+{
+	assert (tunnel != NULL);
+
+	uint64_t start = teredo_latency_start ();
+	int val = teredo_transmit_packet (tunnel, packet, length);
+	teredo_latency_end (TEREDO_HIST_ENCAP, start);
+	return val;
+}
+
+
 #ifdef MIREDO_TEREDO_CLIENT
 /**
  * Checks whether a given packet qualifies as a local one.
@@ -601,15 +736,29 @@ void teredo_predecap (teredo_tunnel *restrict tunnel,
 	TouchReceive (peer, now);
 	peer->bubbles = peer->pings = 0;
 	teredo_queue *q = teredo_peer_queue_yield (peer);
+	uint32_t addr = peer->mapped_addr;
+	uint16_t port = peer->mapped_port;
 	teredo_list_release (tunnel->list);
 
 	if (q != NULL)
-		teredo_queue_emit (q, tunnel->fd,
-		                   peer->mapped_addr, peer->mapped_port,
+		teredo_queue_emit (q, tunnel->fd, addr, port,
 		                   tunnel->recv_cb, tunnel->opaque);
 }
 
 
+/**
+ * Delivers a decapsulated packet to the IPv6 stack.
+ */
+static inline
+void teredo_deliver (teredo_tunnel *restrict tunnel,
+                     const struct teredo_packet *restrict packet,
+                     const struct ip6_hdr *ip6, size_t length)
+{
+	tunnel->recv_cb (tunnel->opaque, ip6, length);
+	teredo_latency_end (TEREDO_HIST_DECAP, packet->rx_time);
+}
+
+
 /**
  * Receives a packet coming from the Teredo tunnel (as specified per
  * paragraph 5.4.2). That's called “Packet reception”.
@@ -621,7 +770,8 @@ void teredo_predecap (teredo_tunnel *restrict tunnel,
  */
 static void
 teredo_recv_process (teredo_tunnel *restrict tunnel,
-                     const struct teredo_packet *restrict packet)
+                     const struct teredo_packet *restrict packet,
+                     const int *ping)
 {
 	assert (tunnel != NULL);
 	assert (packet != NULL);
@@ -631,10 +781,14 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 #endif
 	struct ip6_hdr *ip6 = packet->ip6;
 
+	teredo_count (TEREDO_RX_PACKETS);
+	teredo_count_add (TEREDO_RX_BYTES, packet->ip6_len);
+
 	// Checks packet
 	if (packet->ip6_len < sizeof (*ip6))
      	{
 		debug ("Packet size invalid: %zu bytes.", packet->ip6_len);
+		teredo_count (TEREDO_RX_MALFORMED);
 		return; // invalid packet
 	}
 
@@ -643,6 +797,7 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 	 || (length > packet->ip6_len))
      	{
 	   	debug ("Received malformed IPv6 packet.");
+		teredo_count (TEREDO_RX_MALFORMED);
 		return; // malformatted IPv6 packet
 	}
 
@@ -666,12 +821,14 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 		if (teredo_maintenance_process (tunnel->maintenance, packet) == 0)
 		{
 			debug (" packet passed to maintenance procedure");
+			teredo_count (TEREDO_RX_MAINTENANCE);
 			return;
 		}
 
 		if (!s.up)
 		{
 			debug (" packet dropped because tunnel down");
+			teredo_count (TEREDO_RX_NOT_QUALIFIED);
 			return; /* Not qualified -> do not accept incoming packets */
 		}
 
@@ -698,8 +855,12 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 				/* TODO: record sending of bubble, create a peer, etc ? */
 				teredo_reply_bubble (tunnel->fd, ipv4, port, ip6);
 				debug (" bubble sent");
+				teredo_count (TEREDO_TX_BUBBLES);
 				if (IsBubble (ip6))
+				{
+					teredo_count (TEREDO_RX_SERVER_BUBBLES);
 					return; // don't pass bubble to kernel
+				}
 			}
 		}
 
@@ -730,7 +891,10 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 		 */
 		if (((ip6->ip6_src.s6_addr[0] & 0xff) == 0xfe) &&
 		    ((ip6->ip6_src.s6_addr[1] & 0xc0) == 0x80))
+		{
+			teredo_count (TEREDO_RX_LINK_LOCAL);
 			return;
+		}
 	}
 	else
 #endif /* MIREDO_TEREDO_CLIENT */
@@ -739,6 +903,7 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 	{
 		debug ("Source %s is not a Teredo address.",
 		       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b, sizeof b));
+		teredo_count (TEREDO_RX_NOT_TEREDO);
 		return;
 	}
 
@@ -748,6 +913,40 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 
 	// Checks source IPv6 address / looks up peer in the list:
 	struct teredo_peerlist *list = tunnel->list;
+
+	/* Fast path for client case 1 (see below) */
+	const teredo_flow *f = teredo_list_cache_lookup (list, &ip6->ip6_src,
+	                                                 now);
+	if ((f != NULL) && (f->last_rx == (uint32_t)now)
+	 && (packet->source_ipv4 == f->mapped_addr)
+	 && (packet->source_port == f->mapped_port)
+	 && (ip6->ip6_dst.s6_addr[0] != 0xff)
+#ifdef MIREDO_TEREDO_CLIENT
+	 && !(islocal && IsDiscoveryBubble (packet))
+#endif
+	   )
+	{
+		teredo_count (TEREDO_RX_FAST_PATH);
+		teredo_deliver (tunnel, packet, ip6, length);
+		return;
+	}
+
+	/*
+	 * Relays drop packets from unknown peers (see below): reject most of
+	 * them without locking the list, e.g. in case of a spoofed flood.
+	 */
+	if (
+#ifdef MIREDO_TEREDO_CLIENT
+	    !IsClient (tunnel) &&
+#endif
+	    !teredo_list_may_contain (list, &ip6->ip6_src))
+	{
+		debug ("No peer for %s found. Dropping packet.",
+		       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b, sizeof b));
+		teredo_count (TEREDO_RX_FILTERED);
+		return;
+	}
+
 	teredo_peer *p = teredo_list_lookup (list, &ip6->ip6_src, NULL);
 
 #ifdef MIREDO_TEREDO_CLIENT
@@ -771,6 +970,7 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 			p = teredo_list_lookup (list, &ip6->ip6_src, &(bool){ false });
 			if (p == NULL) {
 				debug ("Out of memory.");
+				teredo_count (TEREDO_RX_NO_MEMORY);
 				return; // memory error
 			}
 			p->trusted = 0;
@@ -784,12 +984,19 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 		SetMappingFromPacket (p, packet);
 		p->local = 1;
 		TouchReceive (p, now);
+
+		int res = CountBubble (p, now);
 		teredo_list_release (list);
+		teredo_count (TEREDO_RX_DISCOVERY);
 
-		if (CountBubble (p, now) != 0)
+		if (res != 0)
+		{
+			TEREDO_PROBE (bubble__throttle, &ip6->ip6_src, res);
 			return;
+		}
 
 		debug ("Replying to discovery bubble");
+		teredo_count (TEREDO_TX_BUBBLES);
 		teredo_send_bubble (tunnel->fd,
 		                    packet->source_ipv4, packet->source_port,
 		                    &s.addr.ip6, &ip6->ip6_src);
@@ -824,6 +1031,7 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 			teredo_list_release (list);
 		debug ("Multicast destination %s not supported.",
 		       inet_ntop (AF_INET6, &ip6->ip6_dst.s6_addr, b, sizeof b));
+		teredo_count (TEREDO_RX_MULTICAST);
 		return;
 	}
 
@@ -836,7 +1044,8 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 		 && (packet->source_port == p->mapped_port))
 		{
 			teredo_predecap (tunnel, p, now);
-			tunnel->recv_cb (tunnel->opaque, ip6, length);
+			teredo_count (TEREDO_RX_TRUSTED);
+			teredo_deliver (tunnel, packet, ip6, length);
 			return;
 		}
 
@@ -846,12 +1055,17 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 		 * Mismatching trusted non-Teredo nodes are also accepted to recover
 		 * faster from a Teredo relay change. This is legal (client case 6).
 		 */
-		if (IsClient (tunnel) && (CheckPing (packet) == 0))
+		if (IsClient (tunnel)
+		 && (((ping != NULL) ? *ping : CheckPing (packet)) == 0))
 		{
 			p->trusted = 1;
 			SetMappingFromPacket (p, packet);
+			TEREDO_PROBE (ping__verify, &ip6->ip6_src);
+			TEREDO_PROBE (peer__trust, &ip6->ip6_src,
+			              p->mapped_addr, p->mapped_port);
 
 			teredo_predecap (tunnel, p, now);
+			teredo_count (TEREDO_RX_PINGS);
 			return; /* don't pass ping to kernel */
 		}
 #endif /* ifdef MIREDO_TEREDO_CLIENT */
@@ -883,6 +1097,7 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 				p = teredo_list_lookup (list, &ip6->ip6_src, &(bool){ false });
 				if (p == NULL) {
 					debug ("Out of memory.");
+					teredo_count (TEREDO_RX_NO_MEMORY);
 					return; // memory error
 				}
 				p->local = islocal;
@@ -900,15 +1115,23 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 				debug ("No peer for %s found. Dropping packet.",
 				       inet_ntop (AF_INET6, &ip6->ip6_src.s6_addr, b,
 				                  sizeof b));
+				teredo_count (TEREDO_RX_UNKNOWN_PEER);
 				return; // list not locked (p = NULL)
 			}
 
 			SetMappingFromPacket (p, packet);
 			p->trusted = 1;
+			TEREDO_PROBE (peer__trust, &ip6->ip6_src,
+			              p->mapped_addr, p->mapped_port);
 			teredo_predecap (tunnel, p, now);
 
-			if (!IsBubble (ip6)) // discard Teredo bubble
-				tunnel->recv_cb (tunnel->opaque, ip6, length);
+			if (IsBubble (ip6)) // discard Teredo bubble
+				teredo_count (TEREDO_RX_BUBBLES);
+			else
+			{
+				teredo_count (TEREDO_RX_NEW_TRUST);
+				teredo_deliver (tunnel, packet, ip6, length);
+			}
 			return;
 		}
 	}
@@ -935,6 +1158,7 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 			if (p == NULL)
 		     	{
 				debug ("Out of memory.");
+				teredo_count (TEREDO_RX_NO_MEMORY);
 				return; // memory error
 			}
 
@@ -953,21 +1177,25 @@ teredo_recv_process (teredo_tunnel *restrict tunnel,
 			}
 		}
 
-		teredo_enqueue_in (p, ip6, length,
+		teredo_enqueue_in (p, ip6, length, tunnel->tunables.max_queue_bytes,
 		                   packet->source_ipv4, packet->source_port);
 		TouchReceive (p, now);
 
 		int res = CountPing (p, now);
 		teredo_list_release (list);
+		teredo_count (TEREDO_RX_QUEUED);
 
 		if (res == 0)
+		{
+			teredo_count (TEREDO_TX_PINGS);
 			SendPing (tunnel->fd, &s.addr, &ip6->ip6_src);
-
+		}
 		return;
 	}
 #endif /* ifdef MIREDO_TEREDO_CLIENT */
 
 	debug ("Dropping packet.");
+	teredo_count (TEREDO_RX_REJECTED);
 	// Rejected packet
 	if (p != NULL)
 		teredo_list_release (list);
@@ -1010,22 +1238,35 @@ static void teredo_dummy_state_down_cb (void *o)
 #endif
 
 
-teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
+/**
+ * Creates a tunnel instance around a bound UDP socket.
+ * The socket is closed on error.
+ */
+static teredo_tunnel *teredo_create_common (int fd, uint32_t ipv4,
+                                            uint16_t port,
+                                            const teredo_tunables *tunables)
 {
 	bindtextdomain (PACKAGE_NAME, LOCALEDIR);
 	teredo_clock_init ();
 
 	if (teredo_init_HMAC ())
-		return NULL;
+		goto error;
 
 	teredo_tunnel *tunnel = malloc (sizeof (*tunnel));
 	if (tunnel == NULL)
 	{
 		teredo_deinit_HMAC ();
-		return NULL;
+		goto error;
 	}
 
 	memset (tunnel, 0, sizeof (*tunnel));
+	if (teredo_tunables_apply (&tunnel->tunables, tunables))
+	{
+		free (tunnel);
+		teredo_deinit_HMAC ();
+		goto error;
+	}
+
 	tunnel->state.addr.teredo.prefix = htonl (TEREDO_PREFIX);
 
 	/*
@@ -1047,23 +1288,69 @@ teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port)
 	tunnel->down_cb = teredo_dummy_state_down_cb;
 #endif
 
-	if ((tunnel->fd = teredo_socket (ipv4, port)) != -1)
+	tunnel->fd = fd;
+	if (teredo_socket_buffers (fd, tunnel->tunables.rcvbuf,
+	                           tunnel->tunables.sndbuf))
+		debug ("Socket buffers size not set: %m");
+	atomic_init (&tunnel->rx_dropped, 0);
+	atomic_init (&tunnel->rcvbuf_max, tunnel->tunables.rcvbuf_max);
+
+	tunnel->list = teredo_list_create (tunnel->tunables.max_peers,
+	                                   tunnel->tunables.probation_peers,
+	                                   tunnel->tunables.relay_expiration);
+	if (tunnel->list != NULL)
 	{
-		if ((tunnel->list = teredo_list_create (MAX_PEERS, 30)) != NULL)
-		{
-			(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
-			(void)pthread_mutex_init (&tunnel->ratelimit.lock, NULL);
-			return tunnel;
-		}
-		teredo_close (tunnel->fd);
+		(void)pthread_rwlock_init (&tunnel->state_lock, NULL);
+		(void)pthread_mutex_init (&tunnel->ratelimit.lock, NULL);
+		teredo_log_start ();
+		return tunnel;
 	}
 
 	free (tunnel);
 	teredo_deinit_HMAC ();
+error:
+	teredo_close (fd);
 	return NULL;
 }
 
 
+teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port,
+                              const teredo_tunables *tunables)
+{
+	int fd = teredo_socket (ipv4, port);
+	if (fd == -1)
+		return NULL;
+
+	return teredo_create_common (fd, ipv4, port, tunables);
+}
+
+
+teredo_tunnel *teredo_create_fd (int fd, const teredo_tunables *tunables)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+
+	if (getsockname (fd, (struct sockaddr *)&addr, &len)
+	 || (len < sizeof (addr)) || (addr.sin_family != AF_INET))
+	{
+		teredo_close (fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+	return teredo_create_common (fd, addr.sin_addr.s_addr, addr.sin_port,
+	                             tunables);
+}
+
+
+int teredo_get_fd (const teredo_tunnel *t)
+{
+	assert (t != NULL);
+	return t->fd;
+}
+
+
 void teredo_destroy (teredo_tunnel *t)
 {
 	assert (t != NULL);
@@ -1090,25 +1377,82 @@ void teredo_destroy (teredo_tunnel *t)
 	pthread_rwlock_destroy (&t->state_lock);
 	pthread_mutex_destroy (&t->ratelimit.lock);
 	teredo_close (t->fd);
+	free (t->rx_batch);
 	free (t);
 	teredo_deinit_HMAC ();
+	teredo_log_stop ();
+}
+
+
+void teredo_receive (teredo_tunnel *restrict t,
+                     const struct teredo_packet *restrict packet)
+{
+	teredo_recv_process (t, packet, NULL);
+}
+
+
+/**
+ * Accounts for packets dropped by the kernel, and grows the receive buffer
+ * if so configured.
+ */
+static void teredo_kernel_drops (teredo_tunnel *tunnel, uint32_t dropped)
+{
+	uint32_t n = teredo_socket_drops_update (&tunnel->rx_dropped, dropped);
+	if (n == 0)
+		return;
+
+	teredo_count_add (TEREDO_RX_KERNEL_DROPS, n);
+
+	unsigned max = atomic_load_explicit (&tunnel->rcvbuf_max,
+	                                     memory_order_relaxed);
+	if (max)
+	{
+		unsigned size = teredo_socket_grow (tunnel->fd, max);
+		if (size)
+			debug ("Receive buffer grown to %u bytes", size);
+	}
 }
 
 
+/* Datagrams received per wake-up */
+#define RECV_BATCH 8
+
 static LIBTEREDO_NORETURN void teredo_recv_loop (void *data, int fd)
 {
 	teredo_tunnel *tunnel = data;
+	struct teredo_packet *batch = tunnel->rx_batch;
 
 	for (;;)
 	{
-		struct teredo_packet packet;
+		unsigned n = 0;
+
+		/* Waits for one datagram, then takes whatever else is pending */
+		if (teredo_wait_recv (fd, batch) == 0)
+			n++;
+		while ((n < RECV_BATCH) && (teredo_recv (fd, batch + n) == 0))
+			n++;
 
-		if (teredo_wait_recv (fd, &packet) == 0)
+		if (n == 0)
+			continue;
+
+		pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+		int pings[RECV_BATCH], *ping = NULL;
+#ifdef MIREDO_TEREDO_CLIENT
+		/* Authenticates all the Echo replies of the batch at once */
+		if (IsClient (tunnel))
+		{
+			CheckPingBatch (n, batch, pings);
+			ping = pings;
+		}
+#endif
+		for (unsigned i = 0; i < n; i++)
 		{
-			pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
-			teredo_recv_process (tunnel, &packet);
-			pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+			teredo_kernel_drops (tunnel, batch[i].rx_dropped);
+			teredo_recv_process (tunnel, batch + i,
+			                     (ping != NULL) ? (ping + i) : NULL);
 		}
+		pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
 	}
 }
 
@@ -1128,6 +1472,22 @@ int teredo_run_async (teredo_tunnel *t)
 	if (t->recv)
 		return -1;
 
+	/* Early drop, in the kernel, of packets we would reject anyway */
+	enum teredo_filter_mode mode = TEREDO_FILTER_RELAY;
+#ifdef MIREDO_TEREDO_CLIENT
+	if (IsClient (t))
+		mode = TEREDO_FILTER_CLIENT;
+#endif
+	if (teredo_socket_filter (t->fd, mode))
+		debug ("Socket filter not available: %m");
+
+	if (t->rx_batch == NULL)
+	{
+		t->rx_batch = malloc (RECV_BATCH * sizeof (*t->rx_batch));
+		if (t->rx_batch == NULL)
+			return -1;
+	}
+
 	t->recv = teredo_thread_start (teredo_recv_thread, t);
 	if (t->recv == NULL)
 		return -1;
@@ -1143,6 +1503,41 @@ int teredo_run_async (teredo_tunnel *t)
 }
 
 
+unsigned long teredo_get_filtered (const teredo_tunnel *t)
+{
+	assert (t != NULL);
+	return teredo_socket_drops (t->fd);
+}
+
+
+int teredo_save_peers (teredo_tunnel *t, int fd)
+{
+	assert (t != NULL);
+#ifdef MIREDO_TEREDO_CLIENT
+	if (IsClient (t))
+		return 0; /* peers depend on the client's Teredo address */
+#endif
+	int val = teredo_list_save (t->list, fd);
+	if (val >= 0)
+		debug ("Saved %d peer(s)", val);
+	return val;
+}
+
+
+int teredo_restore_peers (teredo_tunnel *t, int fd)
+{
+	assert (t != NULL);
+#ifdef MIREDO_TEREDO_CLIENT
+	if (IsClient (t))
+		return 0;
+#endif
+	int val = teredo_list_restore (t->list, fd);
+	if (val >= 0)
+		debug ("Restored %d peer(s)", val);
+	return val;
+}
+
+
 int teredo_set_cone_flag (teredo_tunnel *t, bool cone)
 {
 	assert (t != NULL);
@@ -1170,30 +1565,50 @@ int teredo_set_relay_mode (teredo_tunnel *t)
 
 
 int teredo_set_client_mode (teredo_tunnel *restrict t,
-                            const char *s, const char *s2)
+                            const char *s, const char *s2,
+                            const teredo_tunables *tunables)
 {
 	assert (t != NULL);
 #ifdef MIREDO_TEREDO_CLIENT
 	if (t->maintenance != NULL)
 		return -1;
 
+	teredo_tunables tun;
+	if (teredo_tunables_apply (&tun, (tunables != NULL) ? tunables
+	                                                    : &t->tunables))
+		return -1;
+
 	/* expand the list's expiration time to handle local peers */
-	teredo_peerlist *newlist = teredo_list_create (MAX_PEERS, 600);
+	teredo_peerlist *newlist = teredo_list_create (tun.max_peers,
+	                                               tun.probation_peers,
+	                                               tun.client_expiration);
 	if (newlist == NULL)
 	{
 		debug ("Could not create new list for client mode.");
 		return -1;
 	}
-	teredo_list_destroy (t->list);
-	t->list = newlist;
 
 	t->maintenance = teredo_maintenance_create (t->fd, teredo_state_change,
-	                                            t, s, s2, 0, 0, 0, 0);
-	return (t->maintenance != NULL) ? 0 : -1;
+	                                            t, s, s2,
+	                                            tun.qualification_timeout,
+	                                            tun.qualification_retries,
+	                                            tun.refresh_interval,
+	                                            tun.restart_delay);
+	if (t->maintenance == NULL)
+	{
+		teredo_list_destroy (newlist);
+		return -1;
+	}
+
+	teredo_list_destroy (t->list);
+	t->list = newlist;
+	t->tunables = tun;
+	return 0;
 #else
 	(void)t;
 	(void)s;
 	(void)s2;
+	(void)tunables;
 	return -1;
 #endif
 }
@@ -1203,7 +1618,24 @@ void teredo_set_local_discovery (teredo_tunnel *restrict t, bool on)
 {
 	assert (t != NULL);
 #ifdef MIREDO_TEREDO_CLIENT
+	struct teredo_discovery *stale = NULL;
+
+	pthread_rwlock_wrlock (&t->state_lock);
 	t->disc = on;
+	if (!on)
+	{
+		stale = t->discovery;
+		t->discovery = NULL;
+	}
+	else
+	if (t->state.up && (t->discovery == NULL))
+		t->discovery = teredo_discovery_start (t->fd, &t->state.addr.ip6,
+		                                       teredo_recv_loop, t);
+	pthread_rwlock_unlock (&t->state_lock);
+
+	/* Discovery threads may need the state lock: stop them without it */
+	if (stale != NULL)
+		teredo_discovery_stop (stale);
 #else
 	(void)t;
 	(void)on;
@@ -1211,6 +1643,57 @@ void teredo_set_local_discovery (teredo_tunnel *restrict t, bool on)
 }
 
 
+int teredo_set_tunables (teredo_tunnel *restrict t,
+                         const teredo_tunables *restrict tunables)
+{
+	assert (t != NULL);
+
+	teredo_tunables tun;
+	if (teredo_tunables_apply (&tun, tunables))
+		return -1;
+
+	bool client = false;
+#ifdef MIREDO_TEREDO_CLIENT
+	client = (t->maintenance != NULL);
+#endif
+
+	/* Parameters that are only used when creating the tunnel */
+	if ((tun.max_queue_bytes != t->tunables.max_queue_bytes)
+	 || (client
+	  && ((tun.qualification_timeout != t->tunables.qualification_timeout)
+	   || (tun.qualification_retries != t->tunables.qualification_retries)
+	   || (tun.refresh_interval != t->tunables.refresh_interval)
+	   || (tun.restart_delay != t->tunables.restart_delay))))
+	{
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (teredo_list_set_limits (t->list, tun.max_peers, tun.probation_peers,
+	                            client ? tun.client_expiration
+	                                   : tun.relay_expiration))
+		return -1;
+
+	if (((tun.rcvbuf != t->tunables.rcvbuf)
+	  || (tun.sndbuf != t->tunables.sndbuf))
+	 && teredo_socket_buffers (t->fd,
+	                           (tun.rcvbuf != t->tunables.rcvbuf) ? tun.rcvbuf
+	                                                              : 0,
+	                           (tun.sndbuf != t->tunables.sndbuf) ? tun.sndbuf
+	                                                              : 0))
+		debug ("Socket buffers size not set: %m");
+	atomic_store (&t->rcvbuf_max, tun.rcvbuf_max);
+
+	pthread_rwlock_wrlock (&t->state_lock);
+	pthread_mutex_lock (&t->ratelimit.lock);
+	t->tunables = tun;
+	t->ratelimit.last = 0; /* applies the new ICMPv6 rate limit */
+	pthread_mutex_unlock (&t->ratelimit.lock);
+	pthread_rwlock_unlock (&t->state_lock);
+	return 0;
+}
+
+
 void *teredo_set_privdata (teredo_tunnel *t, void *opaque)
 {
 	assert (t != NULL);
@@ -1229,6 +1712,24 @@ void *teredo_get_privdata (const teredo_tunnel *t)
 }
 
 
+void teredo_set_latency_stats (teredo_tunnel *restrict t, bool on)
+{
+	assert (t != NULL);
+#ifdef SO_TIMESTAMPNS
+	int val = on;
+
+	setsockopt (t->fd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof (val));
+#endif
+	teredo_latency_enable (on);
+}
+
+
+int teredo_set_keyed_hash (const char *name)
+{
+	return teredo_hash_select (name);
+}
+
+
 void teredo_set_recv_callback (teredo_tunnel *restrict t, teredo_recv_cb cb)
 {
 	assert (t != NULL);
@@ -25,6 +25,7 @@
 
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h> /* strcasecmp() */
 #include <inttypes.h>
 #include <limits.h>
 #include <assert.h>
@@ -33,12 +34,15 @@
 #include <fcntl.h> /* open() */
 #include <unistd.h> /* read(), close() */
 #include <pthread.h>
+#include <stdatomic.h>
 #include <netinet/in.h> /* struct in6_addr */
 #include <errno.h>
 
 #include "security.h"
 #include "debug.h"
 #include "md5.h"
+#include "md5mb.h"
+#include "keyedhash.h"
 
 #if defined (__OpenBSD__) || defined (__OpenBSD_kernel__)
 static const char randfile[] = "/dev/srandom";
@@ -48,68 +52,149 @@ static const char randfile[] = "/dev/random";
 
 
 /* HMAC authentication */
-#define LIBTEREDO_KEY_LEN 16
 #define HMAC_BLOCK_LEN 64 /* block size in bytes for MD5 (or SHA1) */
-#if LIBTEREDO_KEY_LEN > HMAC_BLOCK_LEN
+#if TEREDO_HASH_KEY_LEN > HMAC_BLOCK_LEN
 # error HMAC key too long.
 #endif
 
-static union
+/* MD5 states after the inner and outer key pads */
+static md5_state_t hmac_inner, hmac_outer;
+
+static void hmac_md5_setkey (const uint8_t *key)
+{
+	unsigned char ipad[HMAC_BLOCK_LEN], opad[HMAC_BLOCK_LEN];
+
+	/* Precomputes HMAC padding */
+	memset (ipad, 0, sizeof (ipad));
+	memcpy (ipad, key, TEREDO_HASH_KEY_LEN);
+	memcpy (opad, ipad, sizeof (opad));
+
+	for (unsigned i = 0; i < sizeof (ipad); i++)
+	{
+		ipad[i] ^= 0x36;
+		opad[i] ^= 0x5c;
+	}
+
+	/* The pads never change: hash them once for all */
+	md5_init (&hmac_inner);
+	md5_append (&hmac_inner, ipad, sizeof (ipad));
+	md5_init (&hmac_outer);
+	md5_append (&hmac_outer, opad, sizeof (opad));
+}
+
+static void hmac_md5_init (teredo_hash_ctx *ctx)
 {
-	unsigned char key[LIBTEREDO_KEY_LEN];
-	unsigned char ipad[HMAC_BLOCK_LEN];
-} inner_key;
+	ctx->md5 = hmac_inner;
+}
 
-static union
+static void hmac_md5_update (teredo_hash_ctx *ctx, const void *data,
+                             size_t len)
 {
-	unsigned char key[LIBTEREDO_KEY_LEN];
-	unsigned char opad[HMAC_BLOCK_LEN];
-} outer_key;
+	md5_append (&ctx->md5, data, len);
+}
+
+static void hmac_md5_final (teredo_hash_ctx *ctx, uint8_t *hash)
+{
+	md5_finish (&ctx->md5, hash);
+
+	ctx->md5 = hmac_outer;
+	md5_append (&ctx->md5, hash, 16);
+	md5_finish (&ctx->md5, hash);
+}
+
+const teredo_keyed_hash teredo_hmac_md5 =
+{
+	"HMAC-MD5",
+	hmac_md5_setkey,
+	hmac_md5_init,
+	hmac_md5_update,
+	hmac_md5_final
+};
+
+static const teredo_keyed_hash *const keyed_hashes[] =
+{
+#ifdef TEREDO_SIPHASH_DEFAULT
+	&teredo_siphash,
+	&teredo_hmac_md5,
+#else
+	&teredo_hmac_md5,
+	&teredo_siphash,
+#endif
+};
+
+static const teredo_keyed_hash *_Atomic keyed_hash = keyed_hashes[0];
 
 // PID cannot be zero (otherwise, have fun using fork()!)
 static uint16_t hmac_pid = 0;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-int teredo_init_HMAC (void)
+/**
+ * Generates a new key for a keyed hash function, then makes it the current
+ * one. The key state is complete before the function is switched, so that
+ * concurrent hashing never uses an unkeyed function.
+ * Must be called with the mutex held.
+ */
+static int hash_rekey (const teredo_keyed_hash *h)
 {
-	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-	int retval = -1;
+	uint8_t key[TEREDO_HASH_KEY_LEN];
 
-#define return YOU_DONT_MEAN_return
-	pthread_mutex_lock (&mutex);
+	/* Get a non-predictable random key from the kernel PRNG */
+	int fd = open (randfile, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
 
-	if (hmac_pid != htons ((uint16_t)getpid ()))
+	for (unsigned len = 0; len < sizeof (key);)
 	{
-		/* Get a non-predictable random key from the kernel PRNG */
-		int fd = open (randfile, O_RDONLY|O_CLOEXEC);
-		if (fd == -1)
-			goto error;
+		int val = read (fd, key + len, sizeof (key) - len);
+		if (val > 0)
+			len += val;
+	}
+	close (fd);
 
-		memset (&inner_key, 0, sizeof (inner_key));
+	h->setkey (key);
+	memset (key, 0, sizeof (key));
 
-		for (unsigned len = 0; len < LIBTEREDO_KEY_LEN;)
-		{
-			int val = read (fd, inner_key.key + len, LIBTEREDO_KEY_LEN - len);
-			if (val > 0)
-				len -= val;
-		}
-		close (fd);
+	atomic_store_explicit (&keyed_hash, h, memory_order_release);
+	hmac_pid = htons ((uint16_t)getpid ());
+	return 0;
+}
 
-		/* Precomputes HMAC padding */
-		memcpy (&outer_key, &inner_key, sizeof (outer_key));
-	
-		for (unsigned i = 0; i < sizeof (inner_key); i++)
-		{
-			inner_key.ipad[i] ^= 0x36;
-			outer_key.opad[i] ^= 0x5c;
-		}
 
-		hmac_pid = htons ((uint16_t)getpid ());
-	}
-	retval = 0;
+int teredo_hash_select (const char *name)
+{
+	const teredo_keyed_hash *h = NULL;
+
+	if (name == NULL)
+		h = keyed_hashes[0];
+	else
+		for (unsigned i = 0;
+		     i < sizeof (keyed_hashes) / sizeof (keyed_hashes[0]); i++)
+			if (!strcasecmp (name, keyed_hashes[i]->name))
+				h = keyed_hashes[i];
+
+	if (h == NULL)
+		return -1;
 
-error:
+	pthread_mutex_lock (&mutex);
+	int val = 0;
+	if (keyed_hash != h)
+		val = hash_rekey (h);
+	pthread_mutex_unlock (&mutex);
+
+	if (val == 0)
+		debug ("Using %s for authenticators", h->name);
+	return val;
+}
+
+
+int teredo_init_HMAC (void)
+{
+	int retval = 0;
+
+	pthread_mutex_lock (&mutex);
+	if (hmac_pid != htons ((uint16_t)getpid ()))
+		retval = hash_rekey (keyed_hash);
 	pthread_mutex_unlock (&mutex);
-#undef return
 
 	return retval;
 }
@@ -120,26 +205,21 @@ void teredo_deinit_HMAC (void)
 }
 
 
-#define LIBTEREDO_HASH_LEN 16
-
 static void
 teredo_hash (const void *src, size_t slen, const void *dst, size_t dlen,
              uint8_t *restrict hash, uint32_t timestamp)
 {
 	/* compute hash */
-	md5_state_t ctx;
-	md5_init (&ctx);
-	md5_append (&ctx, inner_key.ipad, sizeof (inner_key.ipad));
-	md5_append (&ctx, (const unsigned char *)src, slen);
-	md5_append (&ctx, (const unsigned char *)dst, dlen);
-	md5_append (&ctx, (const unsigned char *)&hmac_pid, sizeof (hmac_pid));
-	md5_append (&ctx, (const unsigned char *)&timestamp, sizeof (timestamp));
-	md5_finish (&ctx, hash);
-
-	md5_init (&ctx);
-	md5_append (&ctx, outer_key.opad, sizeof (outer_key.opad));
-	md5_append (&ctx, hash, LIBTEREDO_HASH_LEN);
-	md5_finish (&ctx, hash);
+	teredo_hash_ctx ctx;
+	const teredo_keyed_hash *h = atomic_load_explicit (&keyed_hash,
+	                                                   memory_order_acquire);
+
+	h->init (&ctx);
+	h->update (&ctx, src, slen);
+	h->update (&ctx, dst, dlen);
+	h->update (&ctx, &hmac_pid, sizeof (hmac_pid));
+	h->update (&ctx, &timestamp, sizeof (timestamp));
+	h->final (&ctx, hash);
 }
 
 
@@ -168,11 +248,11 @@ typedef struct teredo_hmac
 	uint16_t pid;  /* ICMPv6 Echo id */
 	uint16_t time; /* ICMPv6 Echo sequence */
 	uint16_t epoch;
-	unint8_t hash[LIBTEREDO_HASH_LEN]; /* ICMPv6 Echo payload */
+	unint8_t hash[TEREDO_HASH_LEN]; /* ICMPv6 Echo payload */
 } teredo_hmac;
 #endif
 
-#if (LIBTEREDO_HASH_LEN + 6) != LIBTEREDO_HMAC_LEN
+#if (TEREDO_HASH_LEN + 6) != LIBTEREDO_HMAC_LEN
 # error Inconsistent hash and HMAC length
 #endif
 
@@ -215,17 +295,197 @@ teredo_verify_pinghash (uint32_t now, const struct in6_addr *src,
 	if (((now - ntohl (timestamp)) & 0xffffffff) >= 30)
 		return -1; /* replay attack */
 
-	unsigned char h1[LIBTEREDO_HASH_LEN];
+	unsigned char h1[TEREDO_HASH_LEN];
 	teredo_pinghash (src, dst, h1, timestamp);
 
 	/* compare HMAC hash */
-	return memcmp (h1, hash, LIBTEREDO_HASH_LEN) ? -1 : 0;
+	return memcmp (h1, hash, TEREDO_HASH_LEN) ? -1 : 0;
+}
+
+
+/*
+ * Batch ping hashes computation.
+ *
+ * The HMAC messages for ping hashes all have the same length, so that they
+ * can be hashed in parallel with the multi-buffer MD5 block function:
+ * each inner and outer hash is exactly one block after the key pad block.
+ */
+#define PINGHASH_MSG_LEN \
+	(2 * sizeof (struct in6_addr) + sizeof (hmac_pid) + sizeof (uint32_t))
+
+static void md5_pad_block (md5_byte_t *block, size_t len, size_t total)
+{
+	uint64_t bits = (uint64_t)total * 8;
+
+	assert (len < 56);
+	block[len] = 0x80;
+	memset (block + len + 1, 0, 56 - (len + 1));
+	for (unsigned i = 0; i < 8; i++)
+		block[56 + i] = bits >> (8 * i);
+}
+
+static void
+teredo_pinghash_batch (unsigned n, const struct in6_addr *const *src,
+                       const struct in6_addr *const *dst,
+                       const uint32_t *timestamp,
+                       uint8_t (*hash)[TEREDO_HASH_LEN])
+{
+	md5mb_state_t inner, outer;
+
+	if (keyed_hash != &teredo_hmac_md5)
+	{
+		/* Other keyed hashes are fast enough one at a time */
+		for (unsigned i = 0; i < n; i++)
+			teredo_pinghash (src[i], dst[i], hash[i], timestamp[i]);
+		return;
+	}
+
+	/* Chaining values after the key pads, common to all messages */
+	md5mb_load (&inner, &hmac_inner);
+	md5mb_load (&outer, &hmac_outer);
+
+	for (unsigned i = 0; i < n; i += MD5MB_LANES)
+	{
+		md5_byte_t blocks[MD5MB_LANES][64];
+		const md5_byte_t *data[MD5MB_LANES];
+		md5mb_state_t st;
+
+		for (unsigned l = 0; l < MD5MB_LANES; l++)
+		{
+			/* Spare lanes recompute the first message of the batch */
+			unsigned j = (i + l < n) ? (i + l) : i;
+			md5_byte_t *p = blocks[l];
+
+			memcpy (p, src[j], sizeof (*src[j]));
+			p += sizeof (*src[j]);
+			memcpy (p, dst[j], sizeof (*dst[j]));
+			p += sizeof (*dst[j]);
+			memcpy (p, &hmac_pid, sizeof (hmac_pid));
+			p += sizeof (hmac_pid);
+			memcpy (p, timestamp + j, sizeof (timestamp[j]));
+			md5_pad_block (blocks[l], PINGHASH_MSG_LEN,
+			               HMAC_BLOCK_LEN + PINGHASH_MSG_LEN);
+			data[l] = blocks[l];
+		}
+
+		st = inner;
+		md5mb_process (&st, data);
+
+		for (unsigned l = 0; l < MD5MB_LANES; l++)
+		{
+			md5mb_digest (&st, l, blocks[l]);
+			md5_pad_block (blocks[l], TEREDO_HASH_LEN,
+			               HMAC_BLOCK_LEN + TEREDO_HASH_LEN);
+		}
+
+		st = outer;
+		md5mb_process (&st, data);
+
+		for (unsigned l = 0; (l < MD5MB_LANES) && (i + l < n); l++)
+			md5mb_digest (&st, l, hash[i + l]);
+	}
+}
+
+
+void
+teredo_get_pinghash_batch (uint32_t timestamp, unsigned n,
+                           const struct in6_addr *const *src,
+                           const struct in6_addr *const *dst,
+                           uint8_t *const *hash)
+{
+	uint32_t stamps[MD5MB_LANES];
+	uint8_t h[MD5MB_LANES][TEREDO_HASH_LEN];
+
+	timestamp = htonl (timestamp);
+	for (unsigned l = 0; l < MD5MB_LANES; l++)
+		stamps[l] = timestamp;
+
+	for (unsigned i = 0; i < n; i += MD5MB_LANES)
+	{
+		unsigned count = n - i;
+		if (count > MD5MB_LANES)
+			count = MD5MB_LANES;
+
+		teredo_pinghash_batch (count, src + i, dst + i, stamps, h);
+
+		for (unsigned l = 0; l < count; l++)
+		{
+			uint8_t *p = hash[i + l];
+
+			memcpy (p, &hmac_pid, sizeof (hmac_pid));
+			p += sizeof (hmac_pid);
+			memcpy (p, ((uint8_t *)&timestamp) + 2, 2);
+			p += 2;
+			memcpy (p, &timestamp, 2);
+			p += 2;
+			memcpy (p, h[l], TEREDO_HASH_LEN);
+		}
+	}
+}
+
+
+unsigned
+teredo_verify_pinghash_batch (uint32_t now, unsigned n,
+                              const struct in6_addr *const *src,
+                              const struct in6_addr *const *dst,
+                              const uint8_t *const *hash, int *res)
+{
+	unsigned valid = 0;
+
+	for (unsigned i = 0; i < n; i += MD5MB_LANES)
+	{
+		const struct in6_addr *s[MD5MB_LANES], *d[MD5MB_LANES];
+		const uint8_t *ref[MD5MB_LANES];
+		uint32_t stamps[MD5MB_LANES];
+		uint8_t h[MD5MB_LANES][TEREDO_HASH_LEN];
+		unsigned count = 0;
+
+		/* Cheap checks first, only hash the plausible ones */
+		for (unsigned j = i; (j < n) && (j < i + MD5MB_LANES); j++)
+		{
+			const uint8_t *p = hash[j];
+			uint32_t timestamp;
+
+			res[j] = -1;
+			if (memcmp (p, &hmac_pid, sizeof (hmac_pid)))
+				continue;
+			p += sizeof (hmac_pid);
+
+			memcpy (((uint8_t *)&timestamp) + 2, p, 2);
+			p += 2;
+			memcpy (&timestamp, p, 2);
+			p += 2;
+
+			if (((now - ntohl (timestamp)) & 0xffffffff) >= 30)
+				continue; /* replay attack */
+
+			s[count] = src[j];
+			d[count] = dst[j];
+			stamps[count] = timestamp;
+			ref[count] = p;
+			res[j] = count++;
+		}
+
+		teredo_pinghash_batch (count, s, d, stamps, h);
+
+		for (unsigned j = i; (j < n) && (j < i + MD5MB_LANES); j++)
+		{
+			if (res[j] == -1)
+				continue;
+
+			unsigned l = res[j];
+			res[j] = memcmp (h[l], ref[l], TEREDO_HASH_LEN) ? -1 : 0;
+			if (res[j] == 0)
+				valid++;
+		}
+	}
+	return valid;
 }
 
 
 uint16_t teredo_get_flbits (uint32_t timestamp)
 {
-	uint8_t buf[LIBTEREDO_HASH_LEN];
+	uint8_t buf[TEREDO_HASH_LEN];
 
 	teredo_hash (NULL, 0, NULL, 0, buf, timestamp);
 	return (buf[0] << 8) | buf[1];
@@ -234,14 +494,14 @@ uint16_t teredo_get_flbits (uint32_t timestamp)
 #endif /* MIREDO_TEREDO_CLIENT */
 
 
-#if LIBTEREDO_HASH_LEN < LIBTEREDO_NONCE_LEN
+#if TEREDO_HASH_LEN < LIBTEREDO_NONCE_LEN
 # error Inconsistent hash size
 #endif
 void
 teredo_get_nonce (uint32_t timestamp, uint32_t ipv4, uint16_t port,
                   uint8_t *restrict nonce)
 {
-	uint8_t buf[LIBTEREDO_HASH_LEN];
+	uint8_t buf[TEREDO_HASH_LEN];
 
 	teredo_hash (&ipv4, 4, &port, 2, buf, timestamp);
 	memcpy (nonce, buf, LIBTEREDO_NONCE_LEN);
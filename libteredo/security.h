@@ -28,6 +28,21 @@ struct in6_addr;
 #define LIBTEREDO_HMAC_LEN 22
 
 int teredo_init_HMAC (void);
+
+/**
+ * Selects the keyed hash function for ping hashes, nonces and flag bits.
+ * If it changes, a new key is generated before the switch, so concurrent
+ * callers hash either with the old function or with the new keyed one.
+ * This invalidates any previously issued value, so this should be called
+ * before any tunnel is created.
+ *
+ * @param name "HMAC-MD5" or "SipHash-2-4" (case-insensitive),
+ * or NULL for the build-time default
+ *
+ * @return 0 on success, -1 if the name is unknown or on key error.
+ */
+int teredo_hash_select (const char *name);
+
 void teredo_deinit_HMAC (void);
 void teredo_get_pinghash (uint32_t timestamp, const struct in6_addr *src,
                           const struct in6_addr *dst, uint8_t *restrict hash);
@@ -35,6 +50,33 @@ int teredo_verify_pinghash (uint32_t now, const struct in6_addr *src,
                             const struct in6_addr *dst,
                             const uint8_t *restrict hash);
 
+/**
+ * Computes several ping hashes at once, as teredo_get_pinghash() would.
+ * This is faster than computing them one by one.
+ *
+ * @param n number of hashes
+ * @param src array of @p n source addresses
+ * @param dst array of @p n destination addresses
+ * @param hash array of @p n buffers of LIBTEREDO_HMAC_LEN bytes
+ */
+void teredo_get_pinghash_batch (uint32_t timestamp, unsigned n,
+                                const struct in6_addr *const *src,
+                                const struct in6_addr *const *dst,
+                                uint8_t *const *hash);
+
+/**
+ * Verifies several ping hashes at once, as teredo_verify_pinghash() would.
+ *
+ * @param res array of @p n results (0 if valid, -1 if not)
+ *
+ * @return the number of valid hashes.
+ */
+unsigned teredo_verify_pinghash_batch (uint32_t now, unsigned n,
+                                       const struct in6_addr *const *src,
+                                       const struct in6_addr *const *dst,
+                                       const uint8_t *const *hash,
+                                       int *res);
+
 void teredo_get_nonce (uint32_t timestamp, uint32_t ipv4, uint16_t port,
                        uint8_t *restrict nonce);
 uint16_t teredo_get_flbits (uint32_t timestamp);
@@ -53,9 +53,14 @@
 #include "checksum.h"
 #include "debug.h"
 #include "packets.h"
+#include "filter.h"
+#include "stats.h"
+#include "probe.h"
+#include "log.h"
+#include "transport.h"
 
 static pthread_mutex_t raw_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int raw_fd; // raw IPv6 socket
+static int raw_fd = -1; // raw IPv6 socket
 static unsigned raw_users = 0;
 
 struct teredo_server
@@ -68,6 +73,11 @@ struct teredo_server
 	uint32_t server_ip, server_ip2, advLinkMTU;
 
 	union teredo_addr lladdr; // server link-local IPv6 address
+
+	// kernel drops last seen on each socket
+	atomic_uint_least32_t dropped_primary, dropped_secondary;
+
+	bool raw; // uses the shared raw IPv6 socket
 };
 
 /**
@@ -214,6 +224,10 @@ teredo_send_ipv6 (const struct ip6_hdr *p, size_t len)
 #endif
 	dst.sin6_addr = p->ip6_dst;
 
+	const teredo_transport *tr = teredo_get_transport ();
+	if ((tr != NULL) && (tr->send_ipv6 != NULL))
+		return tr->send_ipv6 (tr->opaque, p, len) == (int)len;
+
 	for (int tries = 0; tries < 10; tries++)
 	{
 		ssize_t res = sendto (raw_fd, p, len, 0,
@@ -279,6 +293,20 @@ static void debug_error_header (const uint32_t *v4src,
 # define debug_error_header(a, b, c) (void)0
 #endif
 
+/**
+ * Accounts for a discarded packet.
+ * @return -2 (see teredo_server_process())
+ */
+static inline int teredo_drop (const struct teredo_packet *packet,
+                               teredo_counter reason)
+{
+	TEREDO_PROBE (server__drop, packet->source_ipv4, packet->source_port,
+	              reason);
+	teredo_count (reason);
+	return -2;
+}
+
+
 /**
  * Checks and handles an Teredo-encapsulated packet.
  * Thread-safety note: prefix and advLinkMTU might be changed by another
@@ -288,30 +316,28 @@ static void debug_error_header (const uint32_t *v4src,
  * 2 if it was processed as a request for direct IPv6 connectivity check,
  * 3 if it was forwarded over UDP/IPv4 (hole punching).
  */
-static int
-teredo_process_packet (const teredo_server *s, bool sec)
+int teredo_server_process (const teredo_server *s,
+                           const struct teredo_packet *packet, bool sec)
 {
-	struct teredo_packet packet;
-
-	if (teredo_wait_recv (sec ? s->fd_secondary : s->fd_primary, &packet))
-		return -1;
+	teredo_count (TEREDO_SRV_PACKETS);
+	teredo_count_add (TEREDO_SRV_RX_BYTES, packet->ip6_len);
 
 	// Check IPv6 packet (Teredo server case number 1)
-	const struct ip6_hdr *ip6 = packet.ip6;
-	if (packet.ip6_len < sizeof (*ip6))
+	const struct ip6_hdr *ip6 = packet->ip6;
+	if (packet->ip6_len < sizeof (*ip6))
      	{
-		debug_error_header (&packet.source_ipv4, NULL, NULL);
-		debug ("Packet too small: %d bytes", packet.ip6_len);
-		return -2; // too small
+		debug_error_header (&packet->source_ipv4, NULL, NULL);
+		debug ("Packet too small: %d bytes", packet->ip6_len);
+		return teredo_drop (packet, TEREDO_SRV_MALFORMED); // too small
 	}
 
 	size_t plen = ntohs (ip6->ip6_plen);
 	if (((ip6->ip6_vfc >> 4) != 6)
-	 || ((sizeof (*ip6) + plen) > packet.ip6_len))
+	 || ((sizeof (*ip6) + plen) > packet->ip6_len))
      	{
-		debug_error_header (&packet.source_ipv4, NULL, NULL);
+		debug_error_header (&packet->source_ipv4, NULL, NULL);
 		debug ("Not an IPv6 packet: Version %d", ip6->ip6_vfc >> 4);
-		return -2; // not an IPv6 packet
+		return teredo_drop (packet, TEREDO_SRV_MALFORMED);
 	}
 
 	// NOTE: ptr is not aligned => read single bytes only
@@ -320,19 +346,19 @@ teredo_process_packet (const teredo_server *s, bool sec)
 	if (!IsBubble (ip6) // neither a bubble...
 	 && (ip6->ip6_nxt != IPPROTO_ICMPV6)) // nor an ICMPv6 message
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Packet not allowed: Protocol %d", ip6->ip6_nxt);
-		return -2; // packet not allowed through server
+		return teredo_drop (packet, TEREDO_SRV_PROTOCOL);
 	}
 
 	// Teredo server case number 3
-	if (!is_ipv4_global_unicast (packet.source_ipv4))
+	if (!is_ipv4_global_unicast (packet->source_ipv4))
      	{
-	   	debug_error_header (&packet.source_ipv4,
+	   	debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Source is not IPv4 unicast.");
-		return -2;
+		return teredo_drop (packet, TEREDO_SRV_SOURCE);
 	}
 
 	// Teredo server case number 4
@@ -347,8 +373,8 @@ teredo_process_packet (const teredo_server *s, bool sec)
 	{
 		/** Source address is Teredo **/
 		// Teredo server case number 5
-		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet.source_ipv4,
-		                               packet.source_port))
+		if (IN6_MATCHES_TEREDO_CLIENT (&ip6->ip6_src, packet->source_ipv4,
+		                               packet->source_port))
 			goto accept;
 	}
 	else
@@ -361,23 +387,25 @@ teredo_process_packet (const teredo_server *s, bool sec)
 	}
 
 	// Teredo server case number 7
-	debug_error_header (&packet.source_ipv4, &ip6->ip6_src, &ip6->ip6_dst);
+	debug_error_header (&packet->source_ipv4, &ip6->ip6_src, &ip6->ip6_dst);
 	debug ("Drop packet.");
-	return -2;
+	return teredo_drop (packet, TEREDO_SRV_UNMATCHED);
 
 accept:
 	/** Packet "accepted" for processing **/
+	TEREDO_PROBE (server__accept, packet->source_ipv4, packet->source_port,
+	              &ip6->ip6_src, &ip6->ip6_dst);
 
 	/* Security fix: Prevent infinite local UDP packet loops */
-	if (((packet.source_ipv4 == s->server_ip)
-	  || (packet.source_ipv4 == s->server_ip2))
-	 && (packet.source_port == htons (IPPORT_TEREDO)))
+	if (((packet->source_ipv4 == s->server_ip)
+	  || (packet->source_ipv4 == s->server_ip2))
+	 && (packet->source_port == htons (IPPORT_TEREDO)))
      	{
-	   	debug_error_header (&packet.source_ipv4, &ip6->ip6_src,
+	   	debug_error_header (&packet->source_ipv4, &ip6->ip6_src,
 		                    &ip6->ip6_dst);
 		debug ("Prevent infinite local UDP packet loops from port %d",
-		       ntohs (packet.source_port));
-		return -2;
+		       ntohs (packet->source_port));
+		return teredo_drop (packet, TEREDO_SRV_LOOP);
 	}
 
 	if (IN6_ARE_ADDR_EQUAL (&in6addr_allrouters, &ip6->ip6_dst)
@@ -388,29 +416,37 @@ accept:
 		if ((ip6->ip6_nxt == IPPROTO_ICMPV6)
 		 && (plen >= sizeof (struct nd_router_solicit))
 		 && (icmp->icmp6_type == ND_ROUTER_SOLICIT))
-			return SendRA (s, &packet, &ip6->ip6_src, sec) ? 1 : -1;
+		{
+			if (!SendRA (s, packet, &ip6->ip6_src, sec))
+			{
+				teredo_count (TEREDO_SRV_ERRORS);
+				return -1;
+			}
+			teredo_count (TEREDO_SRV_SOLICITS);
+			return 1;
+		}
 		if(ip6->ip6_nxt == IPPROTO_ICMPV6)
 	     	{
-			debug_error_header(&packet.source_ipv4,
-			                   &ip6->ip6_src, &ip6->ip6_dst);
+			debug_error_header (&packet->source_ipv4,
+			                    &ip6->ip6_src, &ip6->ip6_dst);
 			debug ("Unhandled router message: ICMP type %d",
 			       icmp->icmp6_type);
 		} else {
-			debug_error_header(&packet.source_ipv4,
-			                   &ip6->ip6_src, &ip6->ip6_dst);
+			debug_error_header (&packet->source_ipv4,
+			                    &ip6->ip6_src, &ip6->ip6_dst);
 			debug ("Unhandled router message: Protocol %d",
 			       ip6->ip6_nxt);
 		}	   
-		return -2;
+		return teredo_drop (packet, TEREDO_SRV_ROUTER_OTHER);
 	}
 
 	/* Servers must not forward packets with non-global destination */
 	if (!IN6_IS_ADDR_GLOBAL (&ip6->ip6_dst))
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("Destination is no global IPv6 address");
-		return -2;
+		return teredo_drop (packet, TEREDO_SRV_DESTINATION);
 	}
 
 	/*
@@ -429,19 +465,58 @@ accept:
 	 */
 	if ((ip6->ip6_nxt != IPPROTO_NONE) && (plen > 88))
      	{
-		debug_error_header (&packet.source_ipv4,
+		debug_error_header (&packet->source_ipv4,
 		                    &ip6->ip6_src, &ip6->ip6_dst);
 		debug ("ICMPv6 too large (%zu bytes)", plen);
-		return -2;
+		return teredo_drop (packet, TEREDO_SRV_TOO_LARGE);
 	}
 
 	if (IN6_TEREDO_PREFIX (&ip6->ip6_dst) != htonl (TEREDO_PREFIX))
-		return teredo_send_ipv6 (packet.ip6,
-		                         sizeof (*ip6) + plen) ? 2 : -1;
+	{
+		if (!teredo_send_ipv6 (packet->ip6, sizeof (*ip6) + plen))
+		{
+			teredo_count (TEREDO_SRV_ERRORS);
+			return -1;
+		}
+		teredo_count (TEREDO_SRV_IPV6);
+		teredo_count_add (TEREDO_SRV_TX_BYTES, sizeof (*ip6) + plen);
+		return 2;
+	}
 
 	// Forwards packet over Teredo (destination is a Teredo IPv6 address)
-	return teredo_forward_udp (s->fd_primary, &packet,
-		IN6_TEREDO_SERVER (&ip6->ip6_dst) == s->server_ip) ? 3 : -1;
+	if (!teredo_forward_udp (s->fd_primary, packet,
+	                         IN6_TEREDO_SERVER (&ip6->ip6_dst) == s->server_ip))
+	{
+		teredo_count (TEREDO_SRV_ERRORS);
+		return -1;
+	}
+	teredo_count (TEREDO_SRV_UDP);
+	teredo_count_add (TEREDO_SRV_TX_BYTES, packet->ip6_len);
+	return 3;
+}
+
+
+
+
+/**
+ * Receives and handles a packet from one of the server sockets.
+ * @return see teredo_server_process().
+ */
+static int
+teredo_process_packet (teredo_server *s, bool sec)
+{
+	struct teredo_packet packet;
+
+	if (teredo_wait_recv (sec ? s->fd_secondary : s->fd_primary, &packet))
+	{
+		teredo_count (TEREDO_SRV_ERRORS);
+		return -1;
+	}
+	teredo_count_add (TEREDO_SRV_KERNEL_DROPS,
+	                  teredo_socket_drops_update (sec ? &s->dropped_secondary
+	                                                  : &s->dropped_primary,
+	                                              packet.rx_dropped));
+	return teredo_server_process (s, &packet, sec);
 }
 
 
@@ -465,6 +540,22 @@ static LIBTEREDO_NORETURN void *thread_secondary (void *data)
 }
 
 
+static void teredo_server_init (teredo_server *s, uint32_t ip1, uint32_t ip2)
+{
+	memset (s, 0, sizeof (*s));
+	atomic_init (&s->dropped_primary, 0);
+	atomic_init (&s->dropped_secondary, 0);
+	s->server_ip = ip1;
+	s->server_ip2 = ip2;
+	s->advLinkMTU = htonl (1280);
+	s->lladdr.teredo.prefix = htonl (0xfe800000);
+	//s->lladdr.teredo.server_ip = 0;
+	s->lladdr.teredo.flags = htons (TEREDO_FLAG_CONE);
+	s->lladdr.teredo.client_port = ~htons (IPPORT_TEREDO);
+	s->lladdr.teredo.client_ip = ~s->server_ip;
+}
+
+
 teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 {
 	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
@@ -499,15 +590,15 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 
 	if (raw_fd == -1)
 	{
-		syslog (LOG_ERR, _("Raw IPv6 socket not working: %m"));
+		teredo_log_now (LOG_ERR, _("Raw IPv6 socket not working: %m"));
 		return NULL;
 	}
 
 	/* Initializes exclusive UDP/IPv4 sockets */
 	if (!is_ipv4_global_unicast (ip1) || !is_ipv4_global_unicast (ip2))
 	{
-		syslog (LOG_ERR, _("Teredo server UDP socket error: "
-		        "Server IPv4 addresses must be global unicast."));
+		teredo_log_now (LOG_ERR, _("Teredo server UDP socket error: "
+		                "Server IPv4 addresses must be global unicast."));
 		return NULL;
 	}
 
@@ -517,28 +608,29 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 	{
 		int fd;
 
-		memset (s, 0, sizeof (*s));
-		s->server_ip = ip1;
-		s->server_ip2 = ip2;
-		s->advLinkMTU = htonl (1280);
-		s->lladdr.teredo.prefix = htonl (0xfe800000);
-		//s->lladdr.teredo.server_ip = 0;
-		s->lladdr.teredo.flags = htons (TEREDO_FLAG_CONE);
-		s->lladdr.teredo.client_port = ~htons (IPPORT_TEREDO);
-		s->lladdr.teredo.client_ip = ~s->server_ip;
+		teredo_server_init (s, ip1, ip2);
+		s->raw = true;
 
 		fd = s->fd_primary = teredo_socket (ip1, htons (IPPORT_TEREDO));
 		if (fd != -1)
 		{
 			fd = s->fd_secondary = teredo_socket (ip2, htons (IPPORT_TEREDO));
 			if (fd != -1)
+			{
+				/* Early drop of junk traffic (cases 1 to 3) */
+				if (teredo_socket_filter (s->fd_primary,
+				                          TEREDO_FILTER_SERVER)
+				 || teredo_socket_filter (s->fd_secondary,
+				                          TEREDO_FILTER_SERVER))
+					debug ("Socket filter not available: %m");
 				return s;
+			}
 			else
 			{
 				char str[INET_ADDRSTRLEN];
 
 				inet_ntop (AF_INET, &ip2, str, sizeof (str));
-				syslog (LOG_ERR, _("Error (%s): %m"), str);
+				teredo_log_now (LOG_ERR, _("Error (%s): %m"), str);
 			}
 
 			teredo_close (s->fd_primary);
@@ -548,7 +640,7 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 			char str[INET_ADDRSTRLEN];
 
 			inet_ntop (AF_INET, &ip1, str, sizeof (str));
-			syslog (LOG_ERR, _("Error (%s): %m"), str);
+			teredo_log_now (LOG_ERR, _("Error (%s): %m"), str);
 		}
 
 		free (s);
@@ -557,6 +649,25 @@ teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2)
 }
 
 
+teredo_server *teredo_server_create_fd (int fd1, int fd2,
+                                        uint32_t ip1, uint32_t ip2)
+{
+	teredo_server *s = malloc (sizeof (*s));
+
+	if (s == NULL)
+	{
+		teredo_close (fd1);
+		teredo_close (fd2);
+		return NULL;
+	}
+
+	teredo_server_init (s, ip1, ip2);
+	s->fd_primary = fd1;
+	s->fd_secondary = fd2;
+	return s;
+}
+
+
 int teredo_server_set_MTU (teredo_server *s, uint16_t mtu)
 {
 	if (mtu < 1280)
@@ -587,6 +698,13 @@ int teredo_server_start (teredo_server *s)
 }
 
 
+unsigned long teredo_server_get_filtered (const teredo_server *s)
+{
+	return teredo_socket_drops (s->fd_primary)
+	     + teredo_socket_drops (s->fd_secondary);
+}
+
+
 void teredo_server_stop (teredo_server *s)
 {
 	pthread_cancel (s->t1);
@@ -598,12 +716,20 @@ void teredo_server_stop (teredo_server *s)
 
 void teredo_server_destroy (teredo_server *s)
 {
+	bool raw = s->raw;
+
 	teredo_close (s->fd_primary);
 	teredo_close (s->fd_secondary);
 	free (s);
 
+	if (!raw)
+		return;
+
 	pthread_mutex_lock (&raw_mutex);
 	if (--raw_users == 0)
+	{
 		close (raw_fd);
+		raw_fd = -1;
+	}
 	pthread_mutex_unlock (&raw_mutex);
 }
@@ -29,6 +29,8 @@ typedef struct teredo_server teredo_server;
 /**
  * Creates a Teredo server handler. You should then drop your
  * privileges and call teredo_server_start().
+ * Where supported, a socket filter is attached to the server sockets, so
+ * that packets failing the stateless checks are dropped by the kernel.
  *
  * @note Only one thread should use a given server handle at a time 
  *
@@ -39,6 +41,37 @@ typedef struct teredo_server teredo_server;
  */
 teredo_server *teredo_server_create (uint32_t ip1, uint32_t ip2);
 
+/**
+ * Creates a Teredo server handler from two UDP/IPv4 sockets, which it takes
+ * ownership of (they are closed on error). No raw IPv6 socket is opened:
+ * native IPv6 packets are only sent through a replacement transport (see
+ * teredo_set_transport()). Meant for tests and benchmarks.
+ *
+ * @param fd1 socket for the primary address
+ * @param fd2 socket for the secondary address
+ * @param ip1 server primary IPv4 address (network byte order),
+ * @param ip2 server secondary IPv4 address (network byte order).
+ *
+ * @return NULL on error.
+ */
+teredo_server *teredo_server_create_fd (int fd1, int fd2,
+                                        uint32_t ip1, uint32_t ip2);
+
+struct teredo_packet;
+
+/**
+ * Handles a Teredo packet as if received by the server, synchronously.
+ *
+ * @param s server handler
+ * @param packet parsed packet (see teredo_parse())
+ * @param sec whether the packet was received on the secondary address
+ *
+ * @return -1 on I/O error, -2 if the packet was discarded, a positive
+ * value if it was answered or forwarded.
+ */
+int teredo_server_process (const teredo_server *s,
+                           const struct teredo_packet *packet, bool sec);
+
 /**
  * Changes the link MTU advertised by the Teredo server.
  * If not set, the internal default will be used (currently 1280 bytes).
@@ -66,6 +99,15 @@ uint16_t teredo_server_get_MTU (const teredo_server *s);
  */
 int teredo_server_start (teredo_server *s);
 
+/**
+ * Returns the number of packets dropped by the kernel on the server sockets,
+ * mostly packets rejected by the socket filter before they would have been
+ * discarded by the server anyway (see teredo_server_create()).
+ *
+ * @param s server handler as returned from teredo_server_create(),
+ */
+unsigned long teredo_server_get_filtered (const teredo_server *s);
+
 /**
  * Stops a Teredo server. Behavior is not defined if it was not started first.
  *
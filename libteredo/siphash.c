@@ -0,0 +1,159 @@
+/*
+ * siphash.c - SipHash-2-4 keyed hash function
+ *
+ * See "SipHash: a fast short-input PRF", J.-P. Aumasson and D. J. Bernstein.
+ * This is the 128-bits output variant.
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "keyedhash.h"
+
+#if TEREDO_HASH_KEY_LEN != 16 || TEREDO_HASH_LEN != 16
+# error SipHash key and output are 128-bits.
+#endif
+
+static uint64_t sip_k0, sip_k1;
+
+static inline uint64_t load_le64 (const uint8_t *p)
+{
+	uint64_t v = 0;
+
+	for (unsigned i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+static inline void store_le64 (uint8_t *p, uint64_t v)
+{
+	for (unsigned i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline void sipround (teredo_siphash_state *s)
+{
+	s->v[0] += s->v[1];
+	s->v[1] = ROTL (s->v[1], 13);
+	s->v[1] ^= s->v[0];
+	s->v[0] = ROTL (s->v[0], 32);
+	s->v[2] += s->v[3];
+	s->v[3] = ROTL (s->v[3], 16);
+	s->v[3] ^= s->v[2];
+	s->v[0] += s->v[3];
+	s->v[3] = ROTL (s->v[3], 21);
+	s->v[3] ^= s->v[0];
+	s->v[2] += s->v[1];
+	s->v[1] = ROTL (s->v[1], 17);
+	s->v[1] ^= s->v[2];
+	s->v[2] = ROTL (s->v[2], 32);
+}
+
+static inline void sip_compress (teredo_siphash_state *s, uint64_t m)
+{
+	s->v[3] ^= m;
+	sipround (s);
+	sipround (s);
+	s->v[0] ^= m;
+}
+
+
+static void siphash_setkey (const uint8_t *key)
+{
+	sip_k0 = load_le64 (key);
+	sip_k1 = load_le64 (key + 8);
+}
+
+
+static void siphash_init (teredo_hash_ctx *ctx)
+{
+	teredo_siphash_state *s = &ctx->sip;
+
+	s->v[0] = sip_k0 ^ UINT64_C(0x736f6d6570736575);
+	s->v[1] = sip_k1 ^ UINT64_C(0x646f72616e646f6d) ^ 0xee;
+	s->v[2] = sip_k0 ^ UINT64_C(0x6c7967656e657261);
+	s->v[3] = sip_k1 ^ UINT64_C(0x7465646279746573);
+	s->len = 0;
+}
+
+
+static void siphash_update (teredo_hash_ctx *ctx, const void *data,
+                            size_t len)
+{
+	teredo_siphash_state *s = &ctx->sip;
+	const uint8_t *p = data;
+	unsigned fill = s->len & 7;
+
+	s->len += len;
+
+	/* Complete the pending partial word */
+	if (fill)
+	{
+		while ((fill < 8) && len)
+		{
+			s->buf[fill++] = *p++;
+			len--;
+		}
+		if (fill < 8)
+			return;
+		sip_compress (s, load_le64 (s->buf));
+	}
+
+	for (; len >= 8; len -= 8, p += 8)
+		sip_compress (s, load_le64 (p));
+
+	memcpy (s->buf, p, len);
+}
+
+
+static void siphash_final (teredo_hash_ctx *ctx, uint8_t *hash)
+{
+	teredo_siphash_state *s = &ctx->sip;
+	unsigned fill = s->len & 7;
+
+	memset (s->buf + fill, 0, 8 - fill);
+	sip_compress (s, load_le64 (s->buf) | ((uint64_t)s->len << 56));
+
+	s->v[2] ^= 0xee;
+	for (unsigned i = 0; i < 4; i++)
+		sipround (s);
+	store_le64 (hash, s->v[0] ^ s->v[1] ^ s->v[2] ^ s->v[3]);
+
+	s->v[1] ^= 0xdd;
+	for (unsigned i = 0; i < 4; i++)
+		sipround (s);
+	store_le64 (hash + 8, s->v[0] ^ s->v[1] ^ s->v[2] ^ s->v[3]);
+}
+
+
+const teredo_keyed_hash teredo_siphash =
+{
+	"SipHash-2-4",
+	siphash_setkey,
+	siphash_init,
+	siphash_update,
+	siphash_final
+};
@@ -0,0 +1,435 @@
+/*
+ * stats.c - Packet processing counters
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "tunnel.h"
+
+#define COUNTERS_ALIGN 64
+#define COUNTERS_SIZE \
+	((sizeof (teredo_counters) + COUNTERS_ALIGN - 1) & ~(COUNTERS_ALIGN - 1))
+
+_Thread_local teredo_counters *teredo_tls_counters = NULL;
+atomic_bool teredo_latency_on = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+/* Counters of live threads, and totals of exited ones */
+static teredo_counters *threads = NULL;
+static uint64_t retired[TEREDO_COUNTER_MAX];
+static uint64_t retired_hist[TEREDO_HIST_MAX][TEREDO_HIST_BUCKETS];
+
+
+/**
+ * Folds the counters of an exiting thread into the totals.
+ */
+static void counters_detach (void *data)
+{
+	teredo_counters *t = data;
+
+	pthread_mutex_lock (&lock);
+	for (teredo_counters **pp = &threads; *pp != NULL; pp = &(*pp)->next)
+		if (*pp == t)
+		{
+			*pp = t->next;
+			break;
+		}
+
+	for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+		retired[i] += atomic_load_explicit (&t->value[i],
+		                                    memory_order_relaxed);
+	for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+		for (unsigned j = 0; j < TEREDO_HIST_BUCKETS; j++)
+			retired_hist[i][j] += atomic_load_explicit (&t->hist[i][j],
+			                                            memory_order_relaxed);
+	pthread_mutex_unlock (&lock);
+	free (t);
+}
+
+
+static void counters_init (void)
+{
+	pthread_key_create (&key, counters_detach);
+}
+
+
+/**
+ * Allocates the counters of the calling thread.
+ * @return NULL on error.
+ */
+teredo_counters *teredo_counters_attach (void)
+{
+	teredo_counters *t;
+
+	pthread_once (&once, counters_init);
+
+	if (posix_memalign ((void **)&t, COUNTERS_ALIGN, COUNTERS_SIZE))
+		return NULL;
+
+	for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+		atomic_init (&t->value[i], 0);
+	for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+		for (unsigned j = 0; j < TEREDO_HIST_BUCKETS; j++)
+			atomic_init (&t->hist[i][j], 0);
+
+	if (pthread_setspecific (key, t))
+	{
+		free (t);
+		return NULL;
+	}
+
+	pthread_mutex_lock (&lock);
+	t->next = threads;
+	threads = t;
+	pthread_mutex_unlock (&lock);
+
+	teredo_tls_counters = t;
+	return t;
+}
+
+
+void teredo_counters_read (uint64_t *values)
+{
+	pthread_mutex_lock (&lock);
+	memcpy (values, retired, sizeof (retired));
+
+	for (const teredo_counters *t = threads; t != NULL; t = t->next)
+		for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+			values[i] += atomic_load_explicit (&t->value[i],
+			                                   memory_order_relaxed);
+	pthread_mutex_unlock (&lock);
+}
+
+
+void teredo_histograms_read (uint64_t (*values)[TEREDO_HIST_BUCKETS])
+{
+	pthread_mutex_lock (&lock);
+	memcpy (values, retired_hist, sizeof (retired_hist));
+
+	for (const teredo_counters *t = threads; t != NULL; t = t->next)
+		for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+			for (unsigned j = 0; j < TEREDO_HIST_BUCKETS; j++)
+				values[i][j] += atomic_load_explicit (&t->hist[i][j],
+				                                      memory_order_relaxed);
+	pthread_mutex_unlock (&lock);
+}
+
+
+void teredo_latency_enable (bool on)
+{
+	atomic_store_explicit (&teredo_latency_on, on, memory_order_relaxed);
+}
+
+
+static const char names[TEREDO_COUNTER_MAX][20] =
+{
+	"rx_packets",
+	"rx_bytes",
+	"rx_malformed",
+	"rx_maintenance",
+	"rx_not_qualified",
+	"rx_server_bubbles",
+	"rx_link_local",
+	"rx_not_teredo",
+	"rx_fast_path",
+	"rx_filtered",
+	"rx_discovery",
+	"rx_multicast",
+	"rx_trusted",
+	"rx_pings",
+	"rx_bubbles",
+	"rx_new_trust",
+	"rx_unknown_peer",
+	"rx_queued",
+	"rx_no_memory",
+	"rx_rejected",
+	"rx_kernel_drops",
+
+	"tx_packets",
+	"tx_bytes",
+	"tx_multicast",
+	"tx_not_qualified",
+	"tx_bad_destination",
+	"tx_bad_server",
+	"tx_fast_path",
+	"tx_trusted",
+	"tx_no_memory",
+	"tx_queued",
+	"tx_bubbles",
+	"tx_pings",
+	"tx_unreachable",
+	"tx_errors",
+
+	"icmp_sent",
+	"icmp_rate_limited",
+
+	"qual_solicits",
+	"qual_replies",
+	"qual_timeouts",
+	"qual_lost",
+	"qual_failovers",
+
+	"srv_packets",
+	"srv_rx_bytes",
+	"srv_malformed",
+	"srv_protocol",
+	"srv_source",
+	"srv_unmatched",
+	"srv_loop",
+	"srv_solicits",
+	"srv_router_other",
+	"srv_destination",
+	"srv_too_large",
+	"srv_ipv6",
+	"srv_udp",
+	"srv_tx_bytes",
+	"srv_errors",
+	"srv_kernel_drops",
+
+	"log_dropped",
+
+	"peers",
+	"queue_bytes",
+};
+
+
+const char *teredo_counter_name (unsigned c)
+{
+	return (c < TEREDO_COUNTER_MAX) ? names[c] : NULL;
+}
+
+
+static const char hist_names[TEREDO_HIST_MAX][16] =
+{
+	"decap_latency",
+	"encap_latency",
+	"queue_latency",
+	"qualify_time",
+};
+
+
+const char *teredo_histogram_name (unsigned h)
+{
+	return (h < TEREDO_HIST_MAX) ? hist_names[h] : NULL;
+}
+
+
+/*** Statistics segment ***/
+#ifndef O_NOFOLLOW
+# define O_NOFOLLOW 0
+#endif
+
+#define STATS_NAMES  sizeof (teredo_stats_header)
+#define STATS_VALUES \
+	((STATS_NAMES + TEREDO_COUNTER_MAX * sizeof (teredo_stats_name) \
+	  + COUNTERS_ALIGN - 1) & ~(COUNTERS_ALIGN - 1))
+#define STATS_HIST_NAMES \
+	(STATS_VALUES + TEREDO_COUNTER_MAX * sizeof (atomic_uint_least64_t))
+#define STATS_HIST_VALUES \
+	((STATS_HIST_NAMES + TEREDO_HIST_MAX * sizeof (teredo_stats_name) \
+	  + COUNTERS_ALIGN - 1) & ~(COUNTERS_ALIGN - 1))
+#define STATS_SIZE \
+	(STATS_HIST_VALUES \
+	 + TEREDO_HIST_MAX * TEREDO_HIST_BUCKETS * sizeof (atomic_uint_least64_t))
+
+struct teredo_stats
+{
+	teredo_stats_header *hdr;
+	pthread_t thread;
+	unsigned interval;
+};
+
+
+/**
+ * Copies the current counters values to the segment.
+ */
+static void stats_update (teredo_stats *st)
+{
+	teredo_stats_header *h = st->hdr;
+	atomic_uint_least64_t *values =
+		(atomic_uint_least64_t *)(((char *)h) + STATS_VALUES);
+	atomic_uint_least64_t *buckets =
+		(atomic_uint_least64_t *)(((char *)h) + STATS_HIST_VALUES);
+	uint64_t v[TEREDO_COUNTER_MAX];
+	uint64_t hv[TEREDO_HIST_MAX][TEREDO_HIST_BUCKETS];
+
+	teredo_counters_read (v);
+	teredo_histograms_read (hv);
+
+	uint_least32_t seq = atomic_load_explicit (&h->seq,
+	                                           memory_order_relaxed);
+	atomic_store_explicit (&h->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence (memory_order_release);
+
+	for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+		atomic_store_explicit (values + i, v[i], memory_order_relaxed);
+	for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+		for (unsigned j = 0; j < TEREDO_HIST_BUCKETS; j++)
+			atomic_store_explicit (buckets++, hv[i][j], memory_order_relaxed);
+	atomic_store_explicit (&h->timestamp, teredo_stats_now (),
+	                       memory_order_relaxed);
+
+	atomic_store_explicit (&h->seq, seq + 2, memory_order_release);
+}
+
+
+static void *stats_thread (void *data)
+{
+	teredo_stats *st = data;
+	struct timespec deadline;
+
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+
+	for (;;)
+	{
+		deadline.tv_sec += st->interval / 1000;
+		deadline.tv_nsec += (st->interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+		                        NULL) == EINTR);
+		stats_update (st);
+	}
+	return NULL;
+}
+
+
+teredo_stats *teredo_stats_publish (const char *path, unsigned interval)
+{
+	if (interval == 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	teredo_stats *st = malloc (sizeof (*st));
+	if (st == NULL)
+		return NULL;
+
+	/* The segment is initialized, then renamed to its final path */
+	char tmp[strlen (path) + sizeof (".new")];
+	snprintf (tmp, sizeof (tmp), "%s.new", path);
+	unlink (tmp);
+
+	int fd = open (tmp, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0644);
+	if (fd == -1)
+		goto error;
+
+	void *map = MAP_FAILED;
+	if (ftruncate (fd, STATS_SIZE) == 0)
+		map = mmap (NULL, STATS_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED,
+		            fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		goto error_unlink;
+
+	teredo_stats_header *h = map;
+	teredo_stats_name *desc = (teredo_stats_name *)(((char *)h) + STATS_NAMES);
+
+	h->version = TEREDO_STATS_VERSION;
+	h->header_size = sizeof (*h);
+	h->size = STATS_SIZE;
+	h->count = TEREDO_COUNTER_MAX;
+	h->names = STATS_NAMES;
+	h->values = STATS_VALUES;
+	h->pid = getpid ();
+	h->interval = interval;
+	h->started = teredo_stats_now ();
+	atomic_init (&h->seq, 0);
+	atomic_init (&h->stopped, 0);
+	atomic_init (&h->timestamp, 0);
+	h->histograms = TEREDO_HIST_MAX;
+	h->buckets = TEREDO_HIST_BUCKETS;
+	h->sub_bits = TEREDO_HIST_SUB_BITS;
+	h->hist_names = STATS_HIST_NAMES;
+	h->hist_values = STATS_HIST_VALUES;
+
+	for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+	{
+		strcpy (desc[i].name, teredo_counter_name (i));
+		desc[i].type = (i >= TEREDO_GAUGE_FIRST) ? TEREDO_STATS_GAUGE
+		                                          : TEREDO_STATS_COUNTER;
+	}
+
+	desc = (teredo_stats_name *)(((char *)h) + STATS_HIST_NAMES);
+	for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+	{
+		strcpy (desc[i].name, teredo_histogram_name (i));
+		desc[i].type = TEREDO_STATS_HISTOGRAM;
+	}
+
+	st->hdr = h;
+	st->interval = interval;
+	stats_update (st);
+	h->magic = TEREDO_STATS_MAGIC;
+
+	if (rename (tmp, path))
+		goto error_unmap;
+
+	if (pthread_create (&st->thread, NULL, stats_thread, st) == 0)
+		return st;
+
+	atomic_store_explicit (&h->stopped, 1, memory_order_release);
+	munmap (map, STATS_SIZE);
+	free (st);
+	return NULL;
+
+error_unmap:
+	munmap (map, STATS_SIZE);
+error_unlink:
+	unlink (tmp);
+error:
+	free (st);
+	return NULL;
+}
+
+
+void teredo_stats_unpublish (teredo_stats *st)
+{
+	pthread_cancel (st->thread);
+	pthread_join (st->thread, NULL);
+
+	stats_update (st);
+	atomic_store_explicit (&st->hdr->stopped, 1, memory_order_release);
+	munmap (st->hdr, STATS_SIZE);
+	free (st);
+}
@@ -0,0 +1,375 @@
+/*
+ * stats.h - Packet processing counters
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_STATS_H
+# define LIBTEREDO_STATS_H
+
+# include <stdint.h>
+# include <stdbool.h>
+# include <stdatomic.h>
+# include <time.h>
+
+/**
+ * Packet processing counters: one for each decision point of the relay,
+ * client and server packet handling.
+ */
+typedef enum teredo_counter
+{
+	/* Relay and client packet reception */
+	TEREDO_RX_PACKETS, /**< Teredo packets received */
+	TEREDO_RX_BYTES, /**< Teredo packets received (bytes) */
+	TEREDO_RX_MALFORMED, /**< dropped: invalid IPv6 packet */
+	TEREDO_RX_MAINTENANCE, /**< qualification packets */
+	TEREDO_RX_NOT_QUALIFIED, /**< dropped: client not qualified */
+	TEREDO_RX_SERVER_BUBBLES, /**< indirect bubbles from our server */
+	TEREDO_RX_LINK_LOCAL, /**< dropped: link-local source */
+	TEREDO_RX_NOT_TEREDO, /**< dropped: non-Teredo source (relay) */
+	TEREDO_RX_FAST_PATH, /**< delivered through the flow cache */
+	TEREDO_RX_FILTERED, /**< dropped: unknown peer (negative filter) */
+	TEREDO_RX_DISCOVERY, /**< local discovery bubbles */
+	TEREDO_RX_MULTICAST, /**< dropped: multicast destination */
+	TEREDO_RX_TRUSTED, /**< delivered from a trusted peer */
+	TEREDO_RX_PINGS, /**< direct IPv6 connectivity test replies */
+	TEREDO_RX_BUBBLES, /**< bubbles from a newly trusted peer */
+	TEREDO_RX_NEW_TRUST, /**< delivered from a newly trusted peer */
+	TEREDO_RX_UNKNOWN_PEER, /**< dropped: unknown peer */
+	TEREDO_RX_QUEUED, /**< queued until a ping reply */
+	TEREDO_RX_NO_MEMORY, /**< dropped: peer list full or out of memory */
+	TEREDO_RX_REJECTED, /**< dropped: other reason */
+	TEREDO_RX_KERNEL_DROPS, /**< dropped by the kernel (filter or overflow) */
+
+	/* Relay and client packet transmission */
+	TEREDO_TX_PACKETS, /**< IPv6 packets to be transmitted */
+	TEREDO_TX_BYTES, /**< IPv6 packets to be transmitted (bytes) */
+	TEREDO_TX_MULTICAST, /**< dropped: multicast destination */
+	TEREDO_TX_NOT_QUALIFIED, /**< dropped: client not qualified */
+	TEREDO_TX_BAD_DESTINATION, /**< dropped: unacceptable destination */
+	TEREDO_TX_BAD_SERVER, /**< dropped: non-global Teredo server */
+	TEREDO_TX_FAST_PATH, /**< sent through the flow cache */
+	TEREDO_TX_TRUSTED, /**< sent to a trusted peer */
+	TEREDO_TX_NO_MEMORY, /**< dropped: peer list full or out of memory */
+	TEREDO_TX_QUEUED, /**< queued until the peer is trusted */
+	TEREDO_TX_BUBBLES, /**< bubbles sent */
+	TEREDO_TX_PINGS, /**< direct IPv6 connectivity tests sent */
+	TEREDO_TX_UNREACHABLE, /**< dropped: too many bubbles or pings */
+	TEREDO_TX_ERRORS, /**< UDP send errors */
+
+	/* ICMPv6 errors emission */
+	TEREDO_ICMP_SENT, /**< ICMPv6 errors sent */
+	TEREDO_ICMP_RATE_LIMITED, /**< ICMPv6 errors dropped by rate limit */
+
+	/* Client qualification and maintenance */
+	TEREDO_QUAL_SOLICITS, /**< router solicitations sent */
+	TEREDO_QUAL_REPLIES, /**< valid router advertisements received */
+	TEREDO_QUAL_TIMEOUTS, /**< router solicitations without reply */
+	TEREDO_QUAL_LOST, /**< Teredo connectivity losses */
+	TEREDO_QUAL_FAILOVERS, /**< qualified with another Teredo server */
+
+	/* Server (numbers refer to the "Teredo server cases") */
+	TEREDO_SRV_PACKETS, /**< Teredo packets received */
+	TEREDO_SRV_RX_BYTES, /**< Teredo packets received (bytes) */
+	TEREDO_SRV_MALFORMED, /**< dropped: invalid IPv6 packet (1) */
+	TEREDO_SRV_PROTOCOL, /**< dropped: not a bubble nor ICMPv6 (2) */
+	TEREDO_SRV_SOURCE, /**< dropped: non-unicast IPv4 source (3) */
+	TEREDO_SRV_UNMATCHED, /**< dropped: no matching case (7) */
+	TEREDO_SRV_LOOP, /**< dropped: packet from ourselves */
+	TEREDO_SRV_SOLICITS, /**< router solicitations answered */
+	TEREDO_SRV_ROUTER_OTHER, /**< dropped: other router message */
+	TEREDO_SRV_DESTINATION, /**< dropped: non-global destination */
+	TEREDO_SRV_TOO_LARGE, /**< dropped: large non-bubble packet */
+	TEREDO_SRV_IPV6, /**< forwarded to IPv6 */
+	TEREDO_SRV_UDP, /**< forwarded over Teredo */
+	TEREDO_SRV_TX_BYTES, /**< forwarded packets (bytes) */
+	TEREDO_SRV_ERRORS, /**< I/O errors */
+	TEREDO_SRV_KERNEL_DROPS, /**< dropped by the kernel (filter or overflow) */
+
+	TEREDO_LOG_DROPPED, /**< log messages lost (log ring full) */
+
+	/* Gauges: increments and decrements, which add up modulo 2^64 */
+	TEREDO_PEERS, /**< peer list entries */
+	TEREDO_QUEUE_BYTES, /**< packets queued until peers are trusted (bytes) */
+
+	TEREDO_COUNTER_MAX
+} teredo_counter;
+
+# define TEREDO_GAUGE_FIRST TEREDO_PEERS
+
+/**
+ * Latency histograms (nanoseconds). Except for the qualification time,
+ * they are only recorded if enabled with teredo_latency_enable().
+ */
+typedef enum teredo_histogram
+{
+	TEREDO_HIST_DECAP, /**< UDP reception (kernel) to tunnel delivery */
+	TEREDO_HIST_ENCAP, /**< tunnel reception to UDP transmission */
+	TEREDO_HIST_QUEUE, /**< queueing until the peer is trusted */
+	TEREDO_HIST_QUALIFY, /**< start or connectivity loss to qualification */
+
+	TEREDO_HIST_MAX
+} teredo_histogram;
+
+/*
+ * Histograms have log-linear buckets: values below 2^(B+1) each have their
+ * own bucket, then each power of two is split in 2^B buckets of equal
+ * width (relative error below 2^-B). Values from 2^40 ns (about 18 minutes)
+ * go to the last bucket.
+ */
+# define TEREDO_HIST_SUB_BITS 3
+# define TEREDO_HIST_LINEAR   (2 << TEREDO_HIST_SUB_BITS)
+# define TEREDO_HIST_BUCKETS \
+	(TEREDO_HIST_LINEAR \
+	 + (40 - TEREDO_HIST_SUB_BITS - 1) * (1 << TEREDO_HIST_SUB_BITS))
+
+/**
+ * @return the bucket of a value.
+ */
+static inline unsigned teredo_hist_bucket (uint64_t v)
+{
+	if (v < TEREDO_HIST_LINEAR)
+		return v;
+
+	unsigned e;
+# ifdef __GNUC__
+	e = 63 - __builtin_clzll (v);
+# else
+	for (e = 0; (v >> e) > 1; e++);
+# endif
+	unsigned i = TEREDO_HIST_LINEAR
+		+ ((e - TEREDO_HIST_SUB_BITS - 1) << TEREDO_HIST_SUB_BITS)
+		+ ((v >> (e - TEREDO_HIST_SUB_BITS))
+		   & ((1 << TEREDO_HIST_SUB_BITS) - 1));
+	return (i < TEREDO_HIST_BUCKETS) ? i : (TEREDO_HIST_BUCKETS - 1);
+}
+
+/**
+ * @return the smallest value of a bucket, given the number of sub-buckets
+ * bits of the histogram (TEREDO_HIST_SUB_BITS for the current layout).
+ */
+static inline uint64_t teredo_hist_value (unsigned i, unsigned bits)
+{
+	unsigned linear = 2 << bits;
+
+	if (i < linear)
+		return i;
+
+	i -= linear;
+	return ((UINT64_C(1) << bits) + (i & ((1 << bits) - 1)))
+		<< ((i >> bits) + 1);
+}
+
+/**
+ * Counters of one thread. Only that thread updates them, so that
+ * increments are plain loads and stores, and they take whole cache lines
+ * so that threads do not share lines.
+ */
+typedef struct teredo_counters
+{
+	atomic_uint_least64_t value[TEREDO_COUNTER_MAX];
+	atomic_uint_least64_t hist[TEREDO_HIST_MAX][TEREDO_HIST_BUCKETS];
+	struct teredo_counters *next;
+} teredo_counters;
+
+extern _Thread_local teredo_counters *teredo_tls_counters;
+extern atomic_bool teredo_latency_on;
+
+teredo_counters *teredo_counters_attach (void);
+
+/**
+ * @return the counters of the calling thread, or NULL if out of memory.
+ */
+static inline teredo_counters *teredo_counters_self (void)
+{
+	teredo_counters *t = teredo_tls_counters;
+
+	if (t == NULL)
+		t = teredo_counters_attach ();
+	return t;
+}
+
+static inline void teredo_counter_inc (atomic_uint_least64_t *c,
+                                       uint_least64_t n)
+{
+	uint_least64_t v = atomic_load_explicit (c, memory_order_relaxed);
+	atomic_store_explicit (c, v + n, memory_order_relaxed);
+}
+
+/**
+ * Adds to a counter of the calling thread.
+ */
+static inline void teredo_count_add (teredo_counter c, uint_least64_t n)
+{
+	teredo_counters *t = teredo_counters_self ();
+
+	if (t != NULL) /* otherwise, out of memory: not counted */
+		teredo_counter_inc (&t->value[c], n);
+}
+
+/**
+ * Increments a counter of the calling thread.
+ */
+static inline void teredo_count (teredo_counter c)
+{
+	teredo_count_add (c, 1);
+}
+
+/**
+ * Subtracts from a gauge from the calling thread.
+ */
+static inline void teredo_count_sub (teredo_counter c, uint_least64_t n)
+{
+	teredo_count_add (c, -n);
+}
+
+/**
+ * Records a value in a histogram of the calling thread.
+ */
+static inline void teredo_hist_add (teredo_histogram h, uint64_t v)
+{
+	teredo_counters *t = teredo_counters_self ();
+
+	if (t != NULL)
+		teredo_counter_inc (&t->hist[h][teredo_hist_bucket (v)], 1);
+}
+
+/** @return the current time (nanoseconds since the Epoch) */
+static inline uint64_t teredo_stats_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Starts a latency measurement.
+ * @return the start time, or 0 if latency histograms are disabled.
+ */
+static inline uint64_t teredo_latency_start (void)
+{
+	if (!atomic_load_explicit (&teredo_latency_on, memory_order_relaxed))
+		return 0;
+	return teredo_stats_now ();
+}
+
+/**
+ * Ends a latency measurement and records it in a histogram.
+ * @param start start time (as from teredo_latency_start()), or 0 to ignore
+ */
+static inline void teredo_latency_end (teredo_histogram h, uint64_t start)
+{
+	if (start == 0)
+		return;
+
+	uint64_t now = teredo_stats_now ();
+	teredo_hist_add (h, (now > start) ? (now - start) : 0);
+}
+
+/*
+ * Statistics segment: a memory-mapped file where a daemon publishes its
+ * counters periodically, for other processes to read without interacting
+ * with it. All integers are in host byte order.
+ *
+ * The layout is self-describing: readers must check the magic and version
+ * numbers, and then use the offsets and sizes from the header, so that
+ * values can be added without breaking them.
+ *
+ * The names table and the header (but its sequence number and timestamp)
+ * are written once before the magic number. The values and the timestamp
+ * are updated under a sequence lock: the sequence number is odd while an
+ * update is in progress. Readers copy them, and retry if the sequence
+ * number was odd or changed in the mean time.
+ */
+# define TEREDO_STATS_MAGIC   0x5344524d /* "MRDS" in little endian */
+# define TEREDO_STATS_VERSION 1
+
+/** Value types */
+enum
+{
+	TEREDO_STATS_COUNTER, /**< monotonic counter */
+	TEREDO_STATS_GAUGE, /**< instantaneous value */
+	TEREDO_STATS_HISTOGRAM, /**< histogram (see teredo_hist_value()) */
+};
+
+typedef struct teredo_stats_header
+{
+	uint32_t magic; /**< TEREDO_STATS_MAGIC, once initialized */
+	uint16_t version; /**< TEREDO_STATS_VERSION */
+	uint16_t header_size; /**< size of this header */
+	uint32_t size; /**< total segment size */
+	uint32_t count; /**< number of values */
+	uint32_t names; /**< offset of the names table */
+	uint32_t values; /**< offset of the values (aligned on 64 bytes) */
+	uint32_t pid; /**< publishing process ID */
+	uint32_t interval; /**< update interval (milliseconds) */
+	uint64_t started; /**< start time (nanoseconds since the Epoch) */
+	atomic_uint_least32_t seq; /**< sequence lock */
+	atomic_uint_least32_t stopped; /**< non-zero once the publisher exited */
+	atomic_uint_least64_t timestamp; /**< last update (ns since the Epoch) */
+	uint32_t histograms; /**< number of histograms */
+	uint16_t buckets; /**< number of buckets per histogram */
+	uint16_t sub_bits; /**< histogram sub-buckets bits */
+	uint32_t hist_names; /**< offset of the histograms names table */
+	uint32_t hist_values; /**< offset of the histograms buckets */
+} teredo_stats_header;
+
+typedef struct teredo_stats_name
+{
+	char name[28]; /**< nul-terminated value name */
+	uint32_t type; /**< TEREDO_STATS_COUNTER or TEREDO_STATS_GAUGE */
+} teredo_stats_name;
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+/**
+ * Aggregates the counters of all threads, including the exited ones.
+ * @param values [out] TEREDO_COUNTER_MAX values, indexed by teredo_counter
+ */
+void teredo_counters_read (uint64_t *values);
+
+/**
+ * @return the (short, lower case) name of a counter, or NULL if out of range.
+ */
+const char *teredo_counter_name (unsigned c);
+
+/**
+ * Aggregates the histograms of all threads, including the exited ones.
+ * @param values [out] TEREDO_HIST_MAX histograms
+ */
+void teredo_histograms_read (uint64_t (*values)[TEREDO_HIST_BUCKETS]);
+
+/**
+ * @return the name of a histogram, or NULL if out of range.
+ */
+const char *teredo_histogram_name (unsigned h);
+
+/**
+ * Enables or disables the recording of latency histograms (disabled by
+ * default), as it requires reading the clock for each packet.
+ */
+void teredo_latency_enable (bool on);
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif /* ifndef LIBTEREDO_STATS_H */
@@ -0,0 +1,958 @@
+/*
+ * swarm.c - Teredo client swarm load generator
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+/*
+ * Each virtual client owns a UDP socket, hence a distinct mapped port, and
+ * goes through:
+ *  1. qualification (router solicitation/advertisement with the server),
+ *  2. hole punching with another client (indirect bubble through the
+ *     server, direct bubble in reply),
+ *  3. if a target is given, an ICMPv6 Echo Request to it through the server,
+ *     which must come back through a relay, after a bubble exchange,
+ *  4. steady state: bursts of Echo Requests to the target through the
+ *     relay, or of indirect bubbles to the other client.
+ * Clients are spread over threads, each with its own epoll instance.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h> // htons()
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libteredo/teredo-udp.h>
+#include <libteredo/checksum.h>
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+
+#include <libteredo/teredo.h>
+#include "packets.h"
+#include "stats.h"
+
+#define RX_BATCH 16
+#define TX_BATCH 64
+#define ECHO_MIN (sizeof (struct icmp6_hdr) + sizeof (uint64_t))
+
+static const struct in6_addr in6addr_allrouters =
+	{ { { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2 } } };
+
+enum
+{
+	CLIENT_QUALIFY,
+	CLIENT_BUBBLE,
+	CLIENT_PING,
+	CLIENT_READY,
+	CLIENT_FAILED
+};
+
+typedef struct swarm_client
+{
+	int      fd;
+	uint8_t  state;
+	uint8_t  tries;
+	uint16_t seq;
+	uint32_t relay_ip;
+	uint16_t relay_port;
+	uint8_t  nonce[8];
+	union teredo_addr addr;
+	uint64_t sent; /* handshake start */
+	uint64_t deadline; /* next action */
+} swarm_client;
+
+enum
+{
+	HIST_QUALIFY,
+	HIST_BUBBLE,
+	HIST_PING,
+	HIST_RTT,
+	HIST_MAX
+};
+
+static const char *const hist_names[HIST_MAX] =
+	{ "qualification", "hole punching", "ping", "data round trip" };
+
+enum
+{
+	COUNT_TX,
+	COUNT_RX,
+	COUNT_TX_ERRORS,
+	COUNT_MALFORMED,
+	COUNT_UNEXPECTED,
+	COUNT_BAD_RA,
+	COUNT_QUAL_TIMEOUTS,
+	COUNT_BUBBLE_TIMEOUTS,
+	COUNT_PING_TIMEOUTS,
+	COUNT_DATA_TX,
+	COUNT_DATA_RX,
+	COUNT_MAX
+};
+
+typedef struct swarm_thread
+{
+	pthread_t thread;
+	unsigned  first, count;
+	int       epfd;
+	uint64_t  counts[COUNT_MAX];
+	uint64_t  hist[HIST_MAX][TEREDO_HIST_BUCKETS];
+} swarm_thread;
+
+static struct
+{
+	uint32_t server_ip;
+	uint32_t bind_ip;
+	struct in6_addr target;
+	bool     has_target;
+	unsigned clients;
+	unsigned threads;
+	unsigned duration; /* seconds */
+	unsigned interval; /* milliseconds */
+	unsigned burst;
+	unsigned length;
+	unsigned ramp; /* new clients per second */
+} cfg =
+{
+	.clients = 1000,
+	.duration = 10,
+	.interval = 1000,
+	.burst = 4,
+	.length = 64,
+	.ramp = 1000,
+};
+
+static swarm_client *clients;
+static uint64_t test_start, test_end;
+
+
+static uint64_t now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+static int swarm_send (swarm_thread *th, swarm_client *c,
+                       const struct iovec *iov, size_t count,
+                       uint32_t ip, uint16_t port)
+{
+	th->counts[COUNT_TX]++;
+	if (teredo_sendv (c->fd, iov, count, ip, port) > 0)
+		return 0;
+	th->counts[COUNT_TX_ERRORS]++;
+	return -1;
+}
+
+
+static void send_rs (swarm_thread *th, swarm_client *c)
+{
+	uint8_t auth[13] = { 0, 1 };
+	struct
+	{
+		struct ip6_hdr ip6;
+		struct nd_router_solicit rs;
+	} rs;
+	struct iovec iov[] =
+	{
+		{ auth, sizeof (auth) },
+		{ &rs, sizeof (rs) }
+	};
+
+	memcpy (auth + 4, c->nonce, sizeof (c->nonce));
+
+	memset (&rs, 0, sizeof (rs));
+	rs.ip6.ip6_flow = htonl (0x60000000);
+	rs.ip6.ip6_plen = htons (sizeof (rs.rs));
+	rs.ip6.ip6_nxt = IPPROTO_ICMPV6;
+	rs.ip6.ip6_hlim = 255;
+	rs.ip6.ip6_src = teredo_restrict;
+	rs.ip6.ip6_dst = in6addr_allrouters;
+	rs.rs.nd_rs_type = ND_ROUTER_SOLICIT;
+	rs.rs.nd_rs_cksum = icmp6_checksum (&rs.ip6,
+	                                    (struct icmp6_hdr *)&rs.rs);
+
+	swarm_send (th, c, iov, 2, cfg.server_ip, htons (IPPORT_TEREDO));
+}
+
+
+/**
+ * Checks a router advertisement from the server, and infers the client
+ * Teredo address from it.
+ */
+static int parse_ra (swarm_client *c, const teredo_packet *p)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+	size_t len = ntohs (ip6->ip6_plen);
+
+	if (!p->auth_present
+	 || memcmp (p->auth_nonce, c->nonce, sizeof (c->nonce))
+	 || (p->orig_ipv4 == 0)
+	 || !IN6_ARE_ADDR_EQUAL (&ip6->ip6_dst, &teredo_restrict)
+	 || (ip6->ip6_nxt != IPPROTO_ICMPV6)
+	 || (len < sizeof (struct nd_router_advert)))
+		return -1;
+
+	const uint8_t *ra = (const uint8_t *)(ip6 + 1);
+	if (ra[0] != ND_ROUTER_ADVERT)
+		return -1;
+
+	/* Looks for the prefix information option */
+	for (size_t off = sizeof (struct nd_router_advert); off + 8 <= len;)
+	{
+		size_t optlen = ra[off + 1] * 8;
+
+		if ((optlen == 0) || (off + optlen > len))
+			break;
+
+		if ((ra[off] == ND_OPT_PREFIX_INFORMATION)
+		 && (optlen >= sizeof (struct nd_opt_prefix_info))
+		 && (ra[off + 2] == 64))
+		{
+			const struct nd_opt_prefix_info *pi =
+				(const struct nd_opt_prefix_info *)(ra + off);
+
+			memcpy (&c->addr, &pi->nd_opt_pi_prefix, 8);
+			if (c->addr.teredo.prefix != htonl (TEREDO_PREFIX))
+				return -1;
+			c->addr.teredo.flags = 0;
+			c->addr.teredo.client_port = ~p->orig_port;
+			c->addr.teredo.client_ip = ~p->orig_ipv4;
+			return 0;
+		}
+		off += optlen;
+	}
+	return -1;
+}
+
+
+static void send_bubble (swarm_thread *th, swarm_client *c,
+                         const struct in6_addr *dst, uint32_t ip,
+                         uint16_t port)
+{
+	struct ip6_hdr ip6;
+	struct iovec iov = { &ip6, sizeof (ip6) };
+
+	memset (&ip6, 0, sizeof (ip6));
+	ip6.ip6_flow = htonl (0x60000000);
+	ip6.ip6_nxt = IPPROTO_NONE;
+	ip6.ip6_hlim = 255;
+	ip6.ip6_src = c->addr.ip6;
+	ip6.ip6_dst = *dst;
+
+	swarm_send (th, c, &iov, 1, ip, port);
+}
+
+
+/**
+ * Builds an ICMPv6 Echo Request to the target, carrying the send time.
+ * @return packet length.
+ */
+static size_t build_echo (swarm_client *c, uint8_t *buf, uint64_t now)
+{
+	struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+	struct icmp6_hdr *icmp6 = (struct icmp6_hdr *)(ip6 + 1);
+	size_t plen = cfg.length;
+
+	memset (ip6, 0, sizeof (*ip6) + plen);
+	ip6->ip6_flow = htonl (0x60000000);
+	ip6->ip6_plen = htons (plen);
+	ip6->ip6_nxt = IPPROTO_ICMPV6;
+	ip6->ip6_hlim = 64;
+	ip6->ip6_src = c->addr.ip6;
+	ip6->ip6_dst = cfg.target;
+	icmp6->icmp6_type = ICMP6_ECHO_REQUEST;
+	icmp6->icmp6_id = htons ((uint16_t)(c - clients));
+	icmp6->icmp6_seq = htons (c->seq++);
+	memcpy (icmp6 + 1, &now, sizeof (now));
+	icmp6->icmp6_cksum = icmp6_checksum (ip6, icmp6);
+	return sizeof (*ip6) + plen;
+}
+
+
+static swarm_client *peer_of (const swarm_thread *th, const swarm_client *c)
+{
+	unsigned i = c - clients;
+
+	return clients + ((i > th->first) ? (i - 1) : (th->first + 1));
+}
+
+
+static void send_ping (swarm_thread *th, swarm_client *c, uint64_t now)
+{
+	uint8_t buf[sizeof (struct ip6_hdr) + 1232]
+		__attribute__ ((aligned (8)));
+	struct iovec iov = { buf, build_echo (c, buf, now) };
+
+	swarm_send (th, c, &iov, 1, cfg.server_ip, htons (IPPORT_TEREDO));
+}
+
+
+/**
+ * Sends a burst of data packets with a single system call.
+ */
+static void send_burst (swarm_thread *th, swarm_client *c, uint64_t now)
+{
+	static __thread uint8_t bufs[TX_BATCH][sizeof (struct ip6_hdr) + 1232]
+		__attribute__ ((aligned (8)));
+	struct mmsghdr msgs[TX_BATCH];
+	struct iovec iov[TX_BATCH];
+	struct sockaddr_in dst =
+	{
+		.sin_family = AF_INET,
+		.sin_addr = { c->relay_ip },
+		.sin_port = c->relay_port,
+	};
+	bool relayed = c->relay_port != 0;
+	swarm_client *peer = peer_of (th, c);
+	unsigned n = cfg.burst;
+
+	if (!relayed)
+	{
+		if (peer->state < CLIENT_BUBBLE)
+			return;
+		dst.sin_addr.s_addr = cfg.server_ip;
+		dst.sin_port = htons (IPPORT_TEREDO);
+	}
+
+	memset (msgs, 0, sizeof (msgs));
+	for (unsigned i = 0; i < n; i++)
+	{
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)bufs[i];
+
+		if (relayed)
+			iov[i].iov_len = build_echo (c, bufs[i], now);
+		else
+		{
+			memset (ip6, 0, sizeof (*ip6));
+			ip6->ip6_flow = htonl (0x60000000);
+			ip6->ip6_nxt = IPPROTO_NONE;
+			ip6->ip6_hlim = 255;
+			ip6->ip6_src = c->addr.ip6;
+			ip6->ip6_dst = peer->addr.ip6;
+			iov[i].iov_len = sizeof (*ip6);
+		}
+		iov[i].iov_base = bufs[i];
+		msgs[i].msg_hdr.msg_name = &dst;
+		msgs[i].msg_hdr.msg_namelen = sizeof (dst);
+		msgs[i].msg_hdr.msg_iov = iov + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int val = sendmmsg (c->fd, msgs, n, MSG_DONTWAIT);
+	if (val < 0)
+		val = 0;
+	th->counts[COUNT_TX] += n;
+	th->counts[COUNT_DATA_TX] += val;
+	th->counts[COUNT_TX_ERRORS] += n - val;
+}
+
+
+static void record (swarm_thread *th, unsigned h, uint64_t ns)
+{
+	th->hist[h][teredo_hist_bucket (ns)]++;
+}
+
+
+/**
+ * Advances the client state machine on timers.
+ */
+static void client_timer (swarm_thread *th, swarm_client *c, uint64_t now)
+{
+	switch (c->state)
+	{
+		case CLIENT_QUALIFY:
+			if (c->tries >= 3)
+			{
+				th->counts[COUNT_QUAL_TIMEOUTS]++;
+				c->state = CLIENT_FAILED;
+				c->deadline = UINT64_MAX;
+				return;
+			}
+			if (c->tries++ == 0)
+				c->sent = now;
+			send_rs (th, c);
+			c->deadline = now + 1000000000;
+			break;
+
+		case CLIENT_BUBBLE:
+		{
+			const swarm_client *peer = peer_of (th, c);
+
+			if (peer->state == CLIENT_FAILED)
+				goto next;
+			if (peer->state == CLIENT_QUALIFY)
+			{	/* wait for the peer to be qualified */
+				c->deadline = now + 10000000;
+				return;
+			}
+			if (c->tries >= 3)
+			{
+				th->counts[COUNT_BUBBLE_TIMEOUTS]++;
+				goto next;
+			}
+			c->tries++;
+			c->sent = now;
+			send_bubble (th, c, &peer->addr.ip6, cfg.server_ip,
+			             htons (IPPORT_TEREDO));
+			c->deadline = now + 1000000000;
+			break;
+		next:
+			c->tries = 0;
+			c->state = cfg.has_target ? CLIENT_PING : CLIENT_READY;
+			c->deadline = now;
+			break;
+		}
+
+		case CLIENT_PING:
+			if (c->tries >= 3)
+			{
+				th->counts[COUNT_PING_TIMEOUTS]++;
+				c->state = CLIENT_READY;
+				c->deadline = now;
+				return;
+			}
+			if (c->tries++ == 0)
+				c->sent = now;
+			send_ping (th, c, now);
+			c->deadline = now + 2000000000;
+			break;
+
+		case CLIENT_READY:
+			send_burst (th, c, now);
+			c->deadline += cfg.interval * UINT64_C(1000000);
+			if (c->deadline < now)
+				c->deadline = now;
+			break;
+	}
+}
+
+
+static void client_ready (swarm_client *c, uint64_t now, unsigned next)
+{
+	c->state = next;
+	c->tries = 0;
+	c->deadline = now;
+}
+
+
+/**
+ * Handles a received packet.
+ */
+static void client_process (swarm_thread *th, swarm_client *c,
+                            const teredo_packet *p, uint64_t now)
+{
+	const struct ip6_hdr *ip6 = p->ip6;
+	bool from_server = (p->source_ipv4 == cfg.server_ip)
+	                && (p->source_port == htons (IPPORT_TEREDO));
+
+	if (c->state == CLIENT_QUALIFY)
+	{
+		if (!from_server || parse_ra (c, p))
+		{
+			th->counts[COUNT_BAD_RA]++;
+			return;
+		}
+		record (th, HIST_QUALIFY, now - c->sent);
+		client_ready (c, now, CLIENT_BUBBLE);
+		return;
+	}
+
+	if (c->state == CLIENT_FAILED)
+		goto unexpected;
+
+	if (IsBubble (ip6))
+	{
+		if (from_server)
+		{
+			/* Indirect bubble: reply directly */
+			if (p->orig_ipv4 == 0)
+				goto unexpected;
+			send_bubble (th, c, &ip6->ip6_src, p->orig_ipv4, p->orig_port);
+			return;
+		}
+
+		const swarm_client *peer = peer_of (th, c);
+		if (!IN6_ARE_ADDR_EQUAL (&ip6->ip6_src, &peer->addr.ip6))
+			return; /* direct bubble from a relay */
+
+		if (c->state == CLIENT_BUBBLE)
+		{
+			record (th, HIST_BUBBLE, now - c->sent);
+			client_ready (c, now, cfg.has_target ? CLIENT_PING
+			                                     : CLIENT_READY);
+		}
+		else
+		if (c->state == CLIENT_READY)
+			th->counts[COUNT_DATA_RX]++;
+		return;
+	}
+
+	const struct icmp6_hdr *icmp6 = (const struct icmp6_hdr *)(ip6 + 1);
+	uint64_t sent;
+
+	if ((ip6->ip6_nxt != IPPROTO_ICMPV6)
+	 || (ntohs (ip6->ip6_plen) < ECHO_MIN)
+	 || (icmp6->icmp6_type != ICMP6_ECHO_REPLY)
+	 || (icmp6->icmp6_id != htons ((uint16_t)(c - clients))))
+		goto unexpected;
+
+	memcpy (&sent, icmp6 + 1, sizeof (sent));
+
+	if (c->state == CLIENT_PING)
+	{
+		record (th, HIST_PING, now - c->sent);
+		c->relay_ip = p->source_ipv4;
+		c->relay_port = p->source_port;
+		client_ready (c, now, CLIENT_READY);
+		return;
+	}
+	if (c->state == CLIENT_READY)
+	{
+		th->counts[COUNT_DATA_RX]++;
+		record (th, HIST_RTT, now - sent);
+		return;
+	}
+
+unexpected:
+	th->counts[COUNT_UNEXPECTED]++;
+}
+
+
+/**
+ * Receives all pending packets of a client, in batches.
+ */
+static void client_recv (swarm_thread *th, swarm_client *c,
+                         teredo_packet *pkts)
+{
+	struct mmsghdr msgs[RX_BATCH];
+	struct iovec iov[RX_BATCH];
+	struct sockaddr_in names[RX_BATCH];
+	int n;
+
+	do
+	{
+		memset (msgs, 0, sizeof (msgs));
+		for (unsigned i = 0; i < RX_BATCH; i++)
+		{
+			iov[i].iov_base = pkts[i].buf.fill;
+			iov[i].iov_len = sizeof (pkts[i].buf.fill);
+			msgs[i].msg_hdr.msg_name = names + i;
+			msgs[i].msg_hdr.msg_namelen = sizeof (names[i]);
+			msgs[i].msg_hdr.msg_iov = iov + i;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg (c->fd, msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			return;
+
+		uint64_t now = now_ns ();
+
+		for (int i = 0; i < n; i++)
+		{
+			teredo_packet *p = pkts + i;
+
+			th->counts[COUNT_RX]++;
+			p->source_ipv4 = names[i].sin_addr.s_addr;
+			p->source_port = names[i].sin_port;
+			p->dest_ipv4 = 0;
+			p->rx_time = 0;
+			p->rx_dropped = 0;
+
+			if (teredo_parse (p, msgs[i].msg_len)
+			 || (p->ip6_len < sizeof (struct ip6_hdr))
+			 || ((p->ip6->ip6_vfc >> 4) != 6)
+			 || (sizeof (struct ip6_hdr) + ntohs (p->ip6->ip6_plen)
+			       > p->ip6_len))
+			{
+				th->counts[COUNT_MALFORMED]++;
+				continue;
+			}
+			client_process (th, c, p, now);
+		}
+	}
+	while (n == RX_BATCH);
+}
+
+
+static void *swarm_thread_main (void *data)
+{
+	swarm_thread *th = data;
+	teredo_packet *pkts = malloc (RX_BATCH * sizeof (*pkts));
+	struct epoll_event ev[64];
+	uint64_t next_scan = 0;
+
+	if (pkts == NULL)
+		return NULL;
+
+	for (;;)
+	{
+		int n = epoll_wait (th->epfd, ev, 64, 1);
+
+		for (int i = 0; i < n; i++)
+			client_recv (th, clients + ev[i].data.u32, pkts);
+
+		uint64_t now = now_ns ();
+		if (now >= test_end + 200000000) /* grace period for late replies */
+			break;
+		if ((now < next_scan) || (now >= test_end))
+			continue;
+
+		for (unsigned i = 0; i < th->count; i++)
+		{
+			swarm_client *c = clients + th->first + i;
+
+			if (now >= c->deadline)
+				client_timer (th, c, now);
+		}
+		next_scan = now + 1000000;
+	}
+
+	free (pkts);
+	return NULL;
+}
+
+
+static uint64_t percentile (const uint64_t *hist, uint64_t total, double q)
+{
+	uint64_t rank = (uint64_t)(q * total), sum = 0;
+
+	if (rank >= total)
+		rank = total - 1;
+
+	for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+	{
+		sum += hist[i];
+		if (sum > rank)
+			return teredo_hist_value (i, TEREDO_HIST_SUB_BITS);
+	}
+	return 0;
+}
+
+
+static void report (const swarm_thread *threads, uint64_t elapsed)
+{
+	uint64_t counts[COUNT_MAX] = { 0 };
+	static uint64_t hist[HIST_MAX][TEREDO_HIST_BUCKETS];
+	unsigned states[CLIENT_FAILED + 1] = { 0 };
+	double secs = elapsed / 1e9;
+
+	for (unsigned t = 0; t < cfg.threads; t++)
+	{
+		for (unsigned i = 0; i < COUNT_MAX; i++)
+			counts[i] += threads[t].counts[i];
+		for (unsigned h = 0; h < HIST_MAX; h++)
+			for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+				hist[h][i] += threads[t].hist[h][i];
+	}
+	for (unsigned i = 0; i < cfg.clients; i++)
+		states[clients[i].state]++;
+
+	printf ("Clients:  %u (%u ready, %u failed, %u in progress)\n",
+	        cfg.clients, states[CLIENT_READY], states[CLIENT_FAILED],
+	        cfg.clients - states[CLIENT_READY] - states[CLIENT_FAILED]);
+	printf ("Packets:  %"PRIu64" sent (%.0f/s), %"PRIu64" received"
+	        " (%.0f/s)\n", counts[COUNT_TX], counts[COUNT_TX] / secs,
+	        counts[COUNT_RX], counts[COUNT_RX] / secs);
+	if (counts[COUNT_DATA_TX] > 0)
+		printf ("Data:     %"PRIu64" sent, %"PRIu64" answered (%.2f%% lost)\n",
+		        counts[COUNT_DATA_TX], counts[COUNT_DATA_RX],
+		        100. * (counts[COUNT_DATA_TX] - counts[COUNT_DATA_RX])
+		             / counts[COUNT_DATA_TX]);
+	printf ("Errors:   %"PRIu64" send, %"PRIu64" malformed, %"PRIu64
+	        " unexpected, %"PRIu64" invalid advertisements\n",
+	        counts[COUNT_TX_ERRORS], counts[COUNT_MALFORMED],
+	        counts[COUNT_UNEXPECTED], counts[COUNT_BAD_RA]);
+	printf ("Timeouts: %"PRIu64" qualification, %"PRIu64" hole punching,"
+	        " %"PRIu64" ping\n", counts[COUNT_QUAL_TIMEOUTS],
+	        counts[COUNT_BUBBLE_TIMEOUTS], counts[COUNT_PING_TIMEOUTS]);
+
+	printf ("\n%-16s %9s %10s %10s %10s %10s\n", "Latency (ms)", "count",
+	        "median", "90%", "99%", "max");
+	for (unsigned h = 0; h < HIST_MAX; h++)
+	{
+		uint64_t total = 0;
+
+		for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+			total += hist[h][i];
+		if (total == 0)
+			continue;
+
+		printf ("%-16s %9"PRIu64" %10.3f %10.3f %10.3f %10.3f\n",
+		        hist_names[h], total,
+		        percentile (hist[h], total, 0.5) / 1e6,
+		        percentile (hist[h], total, 0.9) / 1e6,
+		        percentile (hist[h], total, 0.99) / 1e6,
+		        percentile (hist[h], total, 1.) / 1e6);
+	}
+}
+
+
+static int usage (const char *path)
+{
+	printf (
+"Usage: %s [OPTIONS] SERVER\n"
+"Emulates many Teredo clients against a Teredo server (and relay).\n"
+"\n"
+"  -b, --bind     local IPv4 address of the clients\n"
+"  -B, --burst    packets per client burst in steady state (default: 4)\n"
+"  -c, --clients  number of virtual clients (default: 1000)\n"
+"  -d, --duration test duration in seconds (default: 10)\n"
+"  -h, --help     display this help and exit\n"
+"  -i, --interval milliseconds between client bursts (default: 1000)\n"
+"  -j, --threads  number of threads (default: one per CPU)\n"
+"  -l, --length   ICMPv6 payload length in bytes (default: 64)\n"
+"  -R, --ramp     clients started per second (default: 1000, 0: all)\n"
+"  -t, --target   IPv6 node to ping through a Teredo relay\n"
+"  -V, --version  display program version and exit\n", path);
+	return 0;
+}
+
+static int version (void)
+{
+	puts (PACKAGE_NAME" v"PACKAGE_VERSION);
+	return 0;
+}
+
+static bool parse_uint (const char *str, unsigned *res, unsigned min,
+                        unsigned max)
+{
+	char *end;
+	unsigned long val = strtoul (str, &end, 0);
+
+	if (*end || (val < min) || (val > max))
+		return false;
+	*res = val;
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	static const struct option opts[] =
+	{
+		{ "bind",       required_argument, NULL, 'b' },
+		{ "burst",      required_argument, NULL, 'B' },
+		{ "clients",    required_argument, NULL, 'c' },
+		{ "duration",   required_argument, NULL, 'd' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ "interval",   required_argument, NULL, 'i' },
+		{ "threads",    required_argument, NULL, 'j' },
+		{ "length",     required_argument, NULL, 'l' },
+		{ "ramp",       required_argument, NULL, 'R' },
+		{ "target",     required_argument, NULL, 't' },
+		{ "version",    no_argument,       NULL, 'V' },
+		{ NULL,         no_argument,       NULL, '\0'}
+	};
+
+	int c;
+	while ((c = getopt_long (argc, argv, "b:B:c:d:hi:j:l:R:t:V", opts,
+	                         NULL)) != -1)
+	{
+		bool ok = true;
+
+		switch (c)
+		{
+			case 'b':
+				ok = inet_pton (AF_INET, optarg, &cfg.bind_ip) == 1;
+				break;
+			case 'B':
+				ok = parse_uint (optarg, &cfg.burst, 1, TX_BATCH);
+				break;
+			case 'c':
+				ok = parse_uint (optarg, &cfg.clients, 2, 65535);
+				break;
+			case 'd':
+				ok = parse_uint (optarg, &cfg.duration, 1, 86400);
+				break;
+			case 'h':
+				return usage (argv[0]);
+			case 'i':
+				ok = parse_uint (optarg, &cfg.interval, 1, 3600000);
+				break;
+			case 'j':
+				ok = parse_uint (optarg, &cfg.threads, 1, 1024);
+				break;
+			case 'l':
+				ok = parse_uint (optarg, &cfg.length, ECHO_MIN, 1232);
+				break;
+			case 'R':
+				ok = parse_uint (optarg, &cfg.ramp, 0, 1000000);
+				break;
+			case 't':
+				ok = inet_pton (AF_INET6, optarg, &cfg.target) == 1;
+				cfg.has_target = ok;
+				break;
+			case 'V':
+				return version ();
+			default:
+				return 1;
+		}
+
+		if (!ok)
+		{
+			fprintf (stderr, "%s: invalid value \"%s\"\n", argv[0], optarg);
+			return 1;
+		}
+	}
+
+	if ((optind != argc - 1)
+	 || (inet_pton (AF_INET, argv[optind], &cfg.server_ip) != 1))
+	{
+		usage (argv[0]);
+		return 1;
+	}
+
+	if (cfg.threads == 0)
+	{
+		long n = sysconf (_SC_NPROCESSORS_ONLN);
+		cfg.threads = (n > 0) ? n : 1;
+	}
+	/* Each thread needs at least two clients (one and its peer) */
+	if (cfg.threads > cfg.clients / 2)
+		cfg.threads = cfg.clients / 2;
+
+	/* One socket per client */
+	struct rlimit lim;
+	rlim_t needed = cfg.clients + cfg.threads + 16;
+	if ((getrlimit (RLIMIT_NOFILE, &lim) == 0) && (lim.rlim_cur < needed))
+	{
+		lim.rlim_cur = (lim.rlim_max < needed) ? lim.rlim_max : needed;
+		setrlimit (RLIMIT_NOFILE, &lim);
+		if (lim.rlim_cur < needed)
+		{
+			fprintf (stderr, "%s: too many clients for the file "
+			         "descriptors limit (%lu)\n", argv[0],
+			         (unsigned long)lim.rlim_cur);
+			return 1;
+		}
+	}
+
+	clients = calloc (cfg.clients, sizeof (*clients));
+	swarm_thread *threads = calloc (cfg.threads, sizeof (*threads));
+	if ((clients == NULL) || (threads == NULL))
+	{
+		perror (argv[0]);
+		return 1;
+	}
+
+	int retval = 1;
+	unsigned opened = 0;
+
+	test_start = now_ns () + 100000000;
+	test_end = test_start + cfg.duration * UINT64_C(1000000000);
+	srandom (test_start);
+
+	for (unsigned t = 0; t < cfg.threads; t++)
+		threads[t].epfd = -1;
+
+	for (unsigned t = 0; t < cfg.threads; t++)
+	{
+		swarm_thread *th = threads + t;
+
+		th->first = (uint64_t)cfg.clients * t / cfg.threads;
+		th->count = (uint64_t)cfg.clients * (t + 1) / cfg.threads
+		            - th->first;
+		th->epfd = epoll_create1 (EPOLL_CLOEXEC);
+		if (th->epfd == -1)
+		{
+			perror ("epoll_create1");
+			goto out;
+		}
+	}
+
+	for (unsigned t = 0; t < cfg.threads; t++)
+	{
+		const swarm_thread *th = threads + t;
+
+		for (unsigned i = th->first; i < th->first + th->count; i++)
+		{
+			swarm_client *cl = clients + i;
+
+			cl->fd = teredo_socket (cfg.bind_ip, 0);
+			if (cl->fd == -1)
+			{
+				perror ("teredo_socket");
+				goto out;
+			}
+			opened++;
+
+			struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+			if (epoll_ctl (th->epfd, EPOLL_CTL_ADD, cl->fd, &ev))
+			{
+				perror ("epoll_ctl");
+				goto out;
+			}
+
+			for (unsigned j = 0; j < sizeof (cl->nonce); j++)
+				cl->nonce[j] = random ();
+			cl->state = CLIENT_QUALIFY;
+			cl->deadline = test_start;
+			if (cfg.ramp)
+				cl->deadline += i * UINT64_C(1000000000) / cfg.ramp;
+		}
+	}
+
+	unsigned started = 0;
+	for (; started < cfg.threads; started++)
+		if ((errno = pthread_create (&threads[started].thread, NULL,
+		                             swarm_thread_main, threads + started)))
+		{
+			perror ("pthread_create");
+			break;
+		}
+	for (unsigned t = 0; t < started; t++)
+		pthread_join (threads[t].thread, NULL);
+
+	if (started == cfg.threads)
+	{
+		report (threads, test_end - test_start);
+		retval = 0;
+	}
+
+out:
+	for (unsigned i = 0; i < opened; i++)
+		teredo_close (clients[i].fd);
+	for (unsigned t = 0; t < cfg.threads; t++)
+		if (threads[t].epfd != -1)
+			close (threads[t].epfd);
+	free (threads);
+	free (clients);
+	return retval;
+}
@@ -67,6 +67,14 @@ typedef struct teredo_packet
 	/** Authentication nonce, if present */
 	uint8_t  auth_nonce[8];
 
+	/** Kernel reception time (nanoseconds since the Epoch), or 0 if unknown */
+	uint64_t rx_time;
+	/**
+	 * Packets dropped by the kernel on the socket so far (SO_RXQ_OVFL),
+	 * or 0 if unknown
+	 */
+	uint32_t rx_dropped;
+
 	/** Internal buffer for UDP datagram reception */
 	union
 	{
@@ -144,6 +152,19 @@ int teredo_recv (int fd, struct teredo_packet *p);
  */
 int teredo_wait_recv (int fd, struct teredo_packet *p);
 
+/**
+ * Parses a Teredo UDP datagram already stored in the receive buffer of a
+ * packet (p->buf), e.g. one read from a capture file. The source,
+ * destination and reception time fields are left to the caller.
+ * Thread-safe, cancellation-safe.
+ *
+ * @param p teredo_packet holding the datagram
+ * @param len datagram byte length (at most TEREDO_PACKET_SIZE)
+ *
+ * @return 0 on success, -1 if the datagram is malformed.
+ */
+int teredo_parse (struct teredo_packet *p, size_t len);
+
 /**
  * Computes an IPv6 layer-3 checksum.
  * The input buffers do not need to be aligned neither of even length.
@@ -31,6 +31,7 @@
 #include <assert.h>
 
 #include <inttypes.h> /* for Mac OS X */
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/uio.h>
@@ -47,6 +48,9 @@
 
 #include "teredo.h"
 #include "teredo-udp.h"
+#include "transport.h"
+#include "packets.h"
+#include "probe.h"
 
 /*
  * Teredo addresses
@@ -112,6 +116,10 @@ int teredo_socket (uint32_t bind_ip, uint16_t port)
 #elif defined(IP_RECVDSTADDR)
 	setsockopt (fd, SOL_IP, IP_RECVDSTADDR, &(int){ 1 }, sizeof (int));
 #endif
+#ifdef SO_RXQ_OVFL
+	/* Reports receive queue drops with each packet */
+	setsockopt (fd, SOL_SOCKET, SO_RXQ_OVFL, &(int){ 1 }, sizeof (int));
+#endif
 
 	/*
 	 * Teredo multicast packets always have a TTL of 1.
@@ -137,10 +145,28 @@ teredo_recverr (int fd)
 #endif
 }
 
-		
+
+static const teredo_transport *transport = NULL;
+
+void teredo_set_transport (const teredo_transport *tr)
+{
+	transport = tr;
+}
+
+
+const teredo_transport *teredo_get_transport (void)
+{
+	return transport;
+}
+
+
 int teredo_sendv (int fd, const struct iovec *iov, size_t count,
                   uint32_t dest_ip, uint16_t dest_port)
 {
+	if (transport != NULL)
+		return transport->sendv (transport->opaque, fd, iov, count,
+		                         dest_ip, dest_port);
+
 	struct sockaddr_in addr =
 	{
 		.sin_family = AF_INET,
@@ -170,6 +196,61 @@ int teredo_sendv (int fd, const struct iovec *iov, size_t count,
 }
 
 
+int teredo_send_batch (int fd, const struct iovec *dgrams, size_t count,
+                       uint32_t ip, uint16_t port)
+{
+	if ((transport != NULL) && (transport->send_batch != NULL))
+		return transport->send_batch (transport->opaque, fd, dgrams, count,
+		                              ip, port);
+
+#ifdef HAVE_SENDMMSG
+	if (transport == NULL)
+	{
+		struct sockaddr_in addr =
+		{
+			.sin_family = AF_INET,
+#ifdef HAVE_SA_LEN
+			.sin_len = sizeof (struct sockaddr_in),
+#endif
+			.sin_port = port,
+			.sin_addr.s_addr = ip
+		};
+		struct mmsghdr msgs[count];
+
+		memset (msgs, 0, sizeof (msgs));
+		for (size_t i = 0; i < count; i++)
+		{
+			msgs[i].msg_hdr.msg_name = &addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof (addr);
+			msgs[i].msg_hdr.msg_iov = (struct iovec *)(dgrams + i);
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		size_t done = 0, failed = 0;
+		while (done < count)
+		{
+			int val = sendmmsg (fd, msgs + done, count - done, 0);
+			if (val > 0)
+				done += val;
+			else
+			if (teredo_recverr (fd) == -1)
+			{	/* Skips the failing datagram, as the fallback would */
+				done++;
+				failed++;
+			}
+		}
+		return (done > failed) ? (int)(done - failed) : -1;
+	}
+#endif
+
+	size_t sent = 0;
+	for (size_t i = 0; i < count; i++)
+		if (teredo_sendv (fd, dgrams + i, 1, ip, port) >= 0)
+			sent++;
+	return sent ? (int)sent : -1;
+}
+
+
 int teredo_send (int fd, const void *packet, size_t plen,
                  uint32_t dest_ip, uint16_t dest_port)
 {
@@ -178,13 +259,60 @@ int teredo_send (int fd, const void *packet, size_t plen,
 }
 
 
+int
+teredo_send_bubble (int fd, uint32_t ip, uint16_t port,
+                    const struct in6_addr *src, const struct in6_addr *dst)
+{
+	static const uint8_t head[] =
+		"\x60\x00\x00\x00" /* flow */
+		"\x00\x00" /* plen = 0 */
+		"\x3b" /* nxt = IPPROTO_NONE */
+		"\x00" /* hlim = 0 */;
+	struct iovec iov[3] =
+	{
+		{ (void *)head, 8 },
+		{ (void *)src, 16 },
+		{ (void *)dst, 16 }
+	};
+
+	TEREDO_PROBE (bubble__send, ip, port, dst);
+	return teredo_sendv (fd, iov, 3, ip, port) == 40 ? 0 : -1;
+}
+
+
+#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR) \
+ || defined(SO_TIMESTAMPNS) || defined(SO_RXQ_OVFL)
+# define TEREDO_RECV_CMSG 1
+#endif
+
 static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 {
+	if ((transport != NULL) && (transport->recv != NULL))
+	{
+		ssize_t length = transport->recv (transport->opaque, fd, p,
+		                                  !(flags & MSG_DONTWAIT));
+		return (length >= 0) ? teredo_parse (p, length) : -1;
+	}
+
 	struct sockaddr_in ad;
-#ifdef IP_PKTINFO
-	char cbuf[CMSG_SPACE (sizeof (struct in_pktinfo))];
-#elif defined(IP_RECVDSTADDR)
-	char cbuf[CMSG_SPACE (sizeof (struct in_addr))];
+#ifdef TEREDO_RECV_CMSG
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[0
+# ifdef IP_PKTINFO
+			+ CMSG_SPACE (sizeof (struct in_pktinfo))
+# elif defined(IP_RECVDSTADDR)
+			+ CMSG_SPACE (sizeof (struct in_addr))
+# endif
+# ifdef SO_TIMESTAMPNS
+			+ CMSG_SPACE (sizeof (struct timespec))
+# endif
+# ifdef SO_RXQ_OVFL
+			+ CMSG_SPACE (sizeof (uint32_t))
+# endif
+		];
+	} cbuf;
 #endif
 	struct iovec iov =
 	{
@@ -197,9 +325,9 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 		.msg_iovlen = 1,
 		.msg_name = &ad,
 		.msg_namelen = sizeof (ad),
-#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
-		.msg_control = cbuf,
-		.msg_controllen = sizeof (cbuf),
+#ifdef TEREDO_RECV_CMSG
+		.msg_control = cbuf.buf,
+		.msg_controllen = sizeof (cbuf.buf),
 #endif
 	};
 
@@ -213,10 +341,14 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 	p->source_ipv4 = ad.sin_addr.s_addr;
 	p->source_port = ad.sin_port;
 	p->dest_ipv4 = 0;
+	p->rx_time = 0;
+	p->rx_dropped = 0;
 
-#if defined(IP_PKTINFO) || defined(IP_RECVDSTADDR)
+#ifdef TEREDO_RECV_CMSG
 	// Internal outer destination IPv4 address
-	// (mostly useful for funky multi-homed hosts)
+	// (mostly useful for funky multi-homed hosts),
+	// kernel reception time (if enabled, for latency statistics)
+	// and kernel drops count
 	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
 	     cmsg != NULL;
 	     cmsg = CMSG_NXTHDR (&msg, cmsg))
@@ -237,11 +369,36 @@ static int teredo_recv_inner (int fd, struct teredo_packet *p, int flags)
 				 (struct in_addr *)CMSG_DATA (cmsg);
 			p->dest_ipv4 = addr->s_addr;
 		}
+# endif
+# ifdef SO_TIMESTAMPNS
+		if ((cmsg->cmsg_level == SOL_SOCKET)
+		 && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+		{
+			struct timespec ts;
+
+			memcpy (&ts, CMSG_DATA (cmsg), sizeof (ts));
+			p->rx_time = ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+		}
+# endif
+# ifdef SO_RXQ_OVFL
+		if ((cmsg->cmsg_level == SOL_SOCKET)
+		 && (cmsg->cmsg_type == SO_RXQ_OVFL))
+			memcpy (&p->rx_dropped, CMSG_DATA (cmsg), sizeof (uint32_t));
 # endif
 	}
 #endif
 
+	return teredo_parse (p, length);
+}
+
+
+int teredo_parse (struct teredo_packet *p, size_t len)
+{
 	uint8_t *ptr = p->buf.fill;
+	ssize_t length = len;
+
+	if (length < 2) // too small
+		return -1;
 
 	p->auth_present = false;
 	p->orig_ipv4 = 0;
@@ -0,0 +1,866 @@
+/*
+ * bench.c - libteredo primitives microbenchmarks
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+/*
+ * Times the hot primitives of libteredo, one by one. Each benchmark is run
+ * with enough operations to last a minimum time, several times over, and
+ * the best time per operation is kept. For the multi-threaded ones, that is
+ * the wall time divided by the total number of operations of all threads.
+ *
+ * Results are printed as tab-separated values: name, nanoseconds per
+ * operation and operations per second. Given the results of an earlier run
+ * (-b), the relative change is appended, and the exit status is 1 if any
+ * benchmark got slower than the threshold (-t).
+ *
+ * "make bench" runs this, and saves the results to bench.tsv. To catch a
+ * regression, keep the bench.tsv of the reference tree, and pass it as
+ * BENCH_BASELINE to "make bench" in the modified tree.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "transport.h"
+#include "clock.h"
+#include "peerlist.h"
+#include "security.h"
+#include "keyedhash.h"
+#include "v4global.h"
+
+typedef struct bench
+{
+	const char *name;
+	/* Performs n operations, returns the elapsed time (ns) */
+	uint64_t (*run) (const struct bench *, unsigned long n);
+	unsigned long arg;
+	const char *str;
+} bench;
+
+static volatile uintptr_t sink; /* defeats dead code elimination */
+
+
+static uint64_t now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+static uint64_t xorshift (uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+
+/* Random Teredo addresses */
+static struct in6_addr *make_addresses (unsigned long n, uint64_t seed)
+{
+	struct in6_addr *addrs = malloc (n * sizeof (*addrs));
+	assert (addrs != NULL);
+
+	for (unsigned long i = 0; i < n; i++)
+	{
+		uint64_t a = xorshift (&seed), b = xorshift (&seed);
+
+		memcpy (addrs[i].s6_addr, &a, 8);
+		memcpy (addrs[i].s6_addr + 8, &b, 8);
+		memcpy (addrs[i].s6_addr, "\x20\x01\x00\x00", 4);
+	}
+	return addrs;
+}
+
+
+/*** Checksum ***/
+static uint64_t bench_cksum (const bench *b, unsigned long n)
+{
+	static uint8_t buf[65536 + 1];
+	const struct in6_addr *a = make_addresses (2, 1);
+	size_t len = b->arg;
+	struct iovec iov[2];
+	size_t iovcnt = 1;
+
+	for (size_t i = 0; i < sizeof (buf); i++)
+		buf[i] = i * 7;
+
+	if ((b->str != NULL) && !strcmp (b->str, "unaligned"))
+	{
+		iov[0].iov_base = buf + 1;
+		iov[0].iov_len = len;
+	}
+	else if ((b->str != NULL) && !strcmp (b->str, "iov"))
+	{	/* UDP/ICMPv6 header and payload apart, as teredo_sendv() does */
+		iov[0].iov_base = buf;
+		iov[0].iov_len = 8;
+		iov[1].iov_base = buf + 8;
+		iov[1].iov_len = len - 8;
+		iovcnt = 2;
+	}
+	else
+	{
+		iov[0].iov_base = buf;
+		iov[0].iov_len = len;
+	}
+
+	uint64_t start = now ();
+	uintptr_t sum = 0;
+	for (unsigned long i = 0; i < n; i++)
+		sum += teredo_cksum (a, a + 1, 58, iov, iovcnt);
+	uint64_t end = now ();
+
+	sink = sum;
+	free ((void *)a);
+	return end - start;
+}
+
+
+/*** Keyed hashes ***/
+static const teredo_keyed_hash *hash_by_name (const char *name)
+{
+	if (!strcmp (name, teredo_siphash.name))
+		return &teredo_siphash;
+	return &teredo_hmac_md5;
+}
+
+
+static uint64_t bench_keyed_hash (const bench *b, unsigned long n)
+{
+	const teredo_keyed_hash *h = hash_by_name (b->str);
+	uint8_t key[TEREDO_HASH_KEY_LEN], data[64], hash[TEREDO_HASH_LEN];
+
+	memset (key, 0x5a, sizeof (key));
+	memset (data, 0xa5, sizeof (data));
+	assert (b->arg <= sizeof (data));
+	h->setkey (key);
+
+	uint64_t start = now ();
+	for (unsigned long i = 0; i < n; i++)
+	{
+		teredo_hash_ctx ctx;
+
+		data[0] = i;
+		h->init (&ctx);
+		h->update (&ctx, data, b->arg);
+		h->final (&ctx, hash);
+	}
+	uint64_t end = now ();
+
+	sink = hash[0];
+	return end - start;
+}
+
+
+static uint64_t bench_nonce (const bench *b, unsigned long n)
+{
+	uint8_t nonce[LIBTEREDO_NONCE_LEN];
+
+	assert (teredo_hash_select (b->str) == 0);
+
+	uint64_t start = now ();
+	for (unsigned long i = 0; i < n; i++)
+		teredo_get_nonce (1000, htonl (0xc6336401 + i), htons (3544), nonce);
+	uint64_t end = now ();
+
+	sink = nonce[0];
+	return end - start;
+}
+
+
+#ifdef MIREDO_TEREDO_CLIENT
+static uint64_t bench_pinghash (const bench *b, unsigned long n)
+{
+	struct in6_addr *a = make_addresses (64, 2);
+	uint8_t hash[LIBTEREDO_HMAC_LEN];
+	uintptr_t valid = 0;
+	uint64_t start, end;
+
+	assert (teredo_hash_select (b->str) == 0);
+
+	switch (b->arg)
+	{
+		case 0: /* generation */
+			start = now ();
+			for (unsigned long i = 0; i < n; i++)
+				teredo_get_pinghash (1000, a + (i & 31), a + 32, hash);
+			end = now ();
+			break;
+
+		case 1: /* verification */
+			teredo_get_pinghash (1000, a, a + 32, hash);
+			start = now ();
+			for (unsigned long i = 0; i < n; i++)
+				valid += !teredo_verify_pinghash (1000 + (i & 15), a, a + 32,
+				                                  hash);
+			end = now ();
+			assert (valid == n);
+			break;
+
+		default: /* batch generation */
+		{
+			const struct in6_addr *src[32], *dst[32];
+			uint8_t hashes[32][LIBTEREDO_HMAC_LEN], *out[32];
+
+			for (unsigned i = 0; i < 32; i++)
+			{
+				src[i] = a + i;
+				dst[i] = a + 32;
+				out[i] = hashes[i];
+			}
+
+			start = now ();
+			for (unsigned long i = 0; i < n; i += 32)
+				teredo_get_pinghash_batch (1000, 32, src, dst, out);
+			end = now ();
+			hash[0] = hashes[0][0];
+			break;
+		}
+	}
+
+	sink = hash[0] + valid;
+	free (a);
+	return end - start;
+}
+#endif
+
+
+/*** Header parsing ***/
+static uint64_t bench_parse (const bench *b, unsigned long n)
+{
+	static teredo_packet p;
+	uint8_t dgram[13 + 8 + 1280];
+	size_t len = 0;
+
+	if (b->arg >= 2)
+	{	/* Authentication header (no ID, no authentication value) */
+		memcpy (dgram, "\x00\x01\x00\x00" "ABCDEFGH" "\x00", 13);
+		len += 13;
+	}
+	if (b->arg >= 1)
+	{	/* Origin indication */
+		memcpy (dgram + len, "\x00\x00\xf2\x27\x39\xcc\x9b\xfe", 8);
+		len += 8;
+	}
+
+	size_t plen = (b->str != NULL) ? strtoul (b->str, NULL, 10) : 40;
+	memset (dgram + len, 0, plen);
+	dgram[len] = 0x60;
+	dgram[len + 6] = 59; /* no next header */
+	len += plen;
+
+	uint64_t start = now ();
+	uintptr_t total = 0;
+	for (unsigned long i = 0; i < n; i++)
+	{
+		/* Copy as teredo_recv() would (the authentication header is
+		 * removed in place) */
+		memcpy (p.buf.fill, dgram, len);
+		if (teredo_parse (&p, len) == 0)
+			total += p.ip6_len;
+	}
+	uint64_t end = now ();
+
+	assert (total == (uintptr_t)n * plen);
+	sink = total;
+	return end - start;
+}
+
+
+/*** IPv4 address classification ***/
+static uint64_t bench_v4global (const bench *b, unsigned long n)
+{
+	uint32_t addrs[4096];
+	uint64_t seed = 3;
+
+	(void)b;
+	for (unsigned i = 0; i < 4096; i++)
+		addrs[i] = xorshift (&seed);
+
+	uint64_t start = now ();
+	uintptr_t count = 0;
+	for (unsigned long i = 0; i < n; i++)
+		count += is_ipv4_global_unicast (addrs[i & 4095]);
+	uint64_t end = now ();
+
+	sink = count;
+	return end - start;
+}
+
+
+/*** Peer list ***/
+#define LOOKUP_PEERS 65536
+
+typedef struct list_job
+{
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	teredo_peerlist *list;
+	const struct in6_addr *addrs;
+	unsigned long count;
+	unsigned long range; /* for random lookups, 0 = sequential insertions */
+	unsigned batch; /* random lookups per lock, 0 = teredo_list_lookup() */
+	uint64_t seed;
+} list_job;
+
+
+/* Peers looked up per lock, as by a receive thread (see teredo_recv_loop) */
+#define LOOKUP_BATCH 8
+
+static void list_batch (list_job *job)
+{
+	uintptr_t found = 0;
+
+	for (unsigned long i = 0; i < job->count; i += job->batch)
+	{
+		const struct in6_addr *addrs[TEREDO_LIST_BATCH_MAX];
+		teredo_peer *peers[TEREDO_LIST_BATCH_MAX];
+		unsigned n = job->batch;
+
+		if (n > job->count - i)
+			n = job->count - i;
+		for (unsigned j = 0; j < n; j++)
+			addrs[j] = job->addrs + xorshift (&job->seed) % job->range;
+
+		unsigned val = teredo_list_lookup_batch (job->list, n, addrs, peers,
+		                                         NULL);
+		assert (val == n);
+		found += (uintptr_t)peers[n - 1];
+		teredo_list_release (job->list);
+	}
+
+	sink = found;
+}
+
+
+static void *list_thread (void *data)
+{
+	list_job *job = data;
+	uintptr_t found = 0;
+
+	pthread_barrier_wait (job->barrier);
+
+	if (job->batch)
+	{
+		list_batch (job);
+		return NULL;
+	}
+
+	for (unsigned long i = 0; i < job->count; i++)
+	{
+		teredo_peer *p;
+
+		if (job->range == 0)
+		{
+			bool create;
+
+			p = teredo_list_lookup (job->list, job->addrs + i, &create);
+			assert ((p != NULL) && create);
+		}
+		else
+		{
+			unsigned long j = xorshift (&job->seed) % job->range;
+
+			p = teredo_list_lookup (job->list, job->addrs + j, NULL);
+			assert (p != NULL);
+		}
+		found += (uintptr_t)p;
+		teredo_list_release (job->list);
+	}
+
+	sink = found;
+	return NULL;
+}
+
+
+static void list_fill (teredo_peerlist *l, const struct in6_addr *addrs,
+                       unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++)
+	{
+		bool create;
+
+		assert (teredo_list_lookup (l, addrs + i, &create) != NULL);
+		teredo_list_release (l);
+	}
+}
+
+
+/* arg = threads, str = "insert", "lookup" or "lookup_batch" */
+static uint64_t bench_list (const bench *b, unsigned long n)
+{
+	unsigned threads = b->arg;
+	bool insert = !strcmp (b->str, "insert");
+	unsigned long npeers = insert ? n : LOOKUP_PEERS;
+	struct in6_addr *addrs = make_addresses (npeers, 4);
+	teredo_peerlist *l = teredo_list_create (npeers, 0, 3600);
+	list_job jobs[threads];
+	pthread_barrier_t barrier;
+
+	assert (l != NULL);
+	if (!insert)
+		list_fill (l, addrs, npeers);
+
+	pthread_barrier_init (&barrier, NULL, threads + 1);
+	for (unsigned i = 0; i < threads; i++)
+	{
+		list_job *job = jobs + i;
+
+		job->barrier = &barrier;
+		job->list = l;
+		job->count = n / threads;
+		job->addrs = insert ? addrs + i * job->count : addrs;
+		job->range = insert ? 0 : npeers;
+		job->batch = strcmp (b->str, "lookup_batch") ? 0 : LOOKUP_BATCH;
+		job->seed = 5 + i;
+		assert (pthread_create (&job->thread, NULL, list_thread, job) == 0);
+	}
+
+	pthread_barrier_wait (&barrier);
+	uint64_t start = now ();
+	for (unsigned i = 0; i < threads; i++)
+		pthread_join (jobs[i].thread, NULL);
+	uint64_t end = now ();
+
+	pthread_barrier_destroy (&barrier);
+	teredo_list_destroy (l);
+	free (addrs);
+	return (end - start) * n / ((n / threads) * threads);
+}
+
+
+/* Peers kept alive by concurrent lookups during the expiry */
+#define EXPIRE_LIVE_PEERS 4096
+
+typedef struct expire_job
+{
+	pthread_t thread;
+	pthread_barrier_t *barrier;
+	teredo_peerlist *list;
+	const struct in6_addr *addrs;
+	const atomic_bool *stop;
+	uint64_t seed;
+} expire_job;
+
+
+static void *expire_thread (void *data)
+{
+	expire_job *job = data;
+	uintptr_t found = 0;
+
+	pthread_barrier_wait (job->barrier);
+
+	while (!atomic_load_explicit (job->stop, memory_order_relaxed))
+	{
+		unsigned long j = xorshift (&job->seed) % EXPIRE_LIVE_PEERS;
+		teredo_peer *p = teredo_list_lookup (job->list, job->addrs + j, NULL);
+
+		assert (p != NULL);
+		found += (uintptr_t)p;
+		teredo_list_release (job->list);
+	}
+
+	sink = found;
+	return NULL;
+}
+
+
+/*
+ * Garbage collection of expired peers, with arg - 1 threads looking up
+ * other peers concurrently.
+ */
+static uint64_t bench_list_expire (const bench *b, unsigned long n)
+{
+	unsigned threads = b->arg - 1;
+	struct in6_addr *addrs = make_addresses (n + EXPIRE_LIVE_PEERS, 6);
+	const struct in6_addr *live = addrs + n;
+	teredo_peerlist *l = teredo_list_create (n + EXPIRE_LIVE_PEERS, 0, 3600);
+	expire_job jobs[threads ? threads : 1];
+	pthread_barrier_t barrier;
+	atomic_bool stop;
+
+	assert (l != NULL);
+	list_fill (l, addrs, n + EXPIRE_LIVE_PEERS);
+
+	/* Ages all peers, then uses the live ones again */
+	teredo_list_expire (l);
+	list_fill (l, live, EXPIRE_LIVE_PEERS);
+
+	atomic_init (&stop, false);
+	pthread_barrier_init (&barrier, NULL, threads + 1);
+	for (unsigned i = 0; i < threads; i++)
+	{
+		expire_job *job = jobs + i;
+
+		job->barrier = &barrier;
+		job->list = l;
+		job->addrs = live;
+		job->stop = &stop;
+		job->seed = 7 + i;
+		assert (pthread_create (&job->thread, NULL, expire_thread, job) == 0);
+	}
+
+	pthread_barrier_wait (&barrier);
+	uint64_t start = now ();
+	teredo_list_expire (l);
+	uint64_t end = now ();
+
+	atomic_store (&stop, true);
+	for (unsigned i = 0; i < threads; i++)
+		pthread_join (jobs[i].thread, NULL);
+	pthread_barrier_destroy (&barrier);
+
+	teredo_list_destroy (l);
+	free (addrs);
+	return end - start;
+}
+
+
+/*** Queue emission ***/
+static int null_sendv (void *opaque, int fd, const struct iovec *iov,
+                       size_t count, uint32_t ip, uint16_t port)
+{
+	size_t len = 0;
+
+	(void)opaque; (void)fd; (void)ip; (void)port;
+	for (size_t i = 0; i < count; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+
+static int null_send_batch (void *opaque, int fd, const struct iovec *dgrams,
+                            size_t count, uint32_t ip, uint16_t port)
+{
+	(void)opaque; (void)fd; (void)dgrams; (void)ip; (void)port;
+	return count;
+}
+
+
+/* Enqueues then emits packets to a peer, arg packets at a time */
+static uint64_t bench_queue (const bench *b, unsigned long n)
+{
+	static const teredo_transport null_transport =
+	{
+		.sendv = null_sendv,
+		.send_batch = null_send_batch,
+	};
+	uint8_t packet[1280];
+	unsigned burst = b->arg;
+
+	memset (packet, 0, sizeof (packet));
+	teredo_set_transport (&null_transport);
+
+	uint64_t start = now ();
+	for (unsigned long i = 0; i < n; i += burst)
+	{
+		teredo_peer peer;
+
+		memset (&peer, 0, sizeof (peer));
+		for (unsigned j = 0; j < burst; j++)
+			teredo_enqueue_out (&peer, packet, sizeof (packet), SIZE_MAX);
+		teredo_queue_emit (teredo_peer_queue_yield (&peer), 0,
+		                   htonl (0xc6336401), htons (3544), NULL, NULL);
+	}
+	uint64_t end = now ();
+
+	teredo_set_transport (NULL);
+	return end - start;
+}
+
+
+static const bench benches[] =
+{
+	{ "cksum/20",            bench_cksum, 20, NULL },
+	{ "cksum/64",            bench_cksum, 64, NULL },
+	{ "cksum/256",           bench_cksum, 256, NULL },
+	{ "cksum/1280",          bench_cksum, 1280, NULL },
+	{ "cksum/1280/unaligned", bench_cksum, 1280, "unaligned" },
+	{ "cksum/1280/iov",      bench_cksum, 1280, "iov" },
+	{ "cksum/65507",         bench_cksum, 65507, NULL },
+	{ "hash/hmac-md5/38",    bench_keyed_hash, 38, "HMAC-MD5" },
+	{ "hash/siphash/38",     bench_keyed_hash, 38, "SipHash-2-4" },
+	{ "nonce/hmac-md5",      bench_nonce, 0, "HMAC-MD5" },
+	{ "nonce/siphash",       bench_nonce, 0, "SipHash-2-4" },
+#ifdef MIREDO_TEREDO_CLIENT
+	{ "pinghash/hmac-md5",   bench_pinghash, 0, "HMAC-MD5" },
+	{ "pinghash/siphash",    bench_pinghash, 0, "SipHash-2-4" },
+	{ "pinghash/verify/hmac-md5", bench_pinghash, 1, "HMAC-MD5" },
+	{ "pinghash/verify/siphash", bench_pinghash, 1, "SipHash-2-4" },
+	{ "pinghash/batch/hmac-md5", bench_pinghash, 2, "HMAC-MD5" },
+	{ "pinghash/batch/siphash", bench_pinghash, 2, "SipHash-2-4" },
+#endif
+	{ "parse/plain",         bench_parse, 0, "40" },
+	{ "parse/plain/1280",    bench_parse, 0, "1280" },
+	{ "parse/origin",        bench_parse, 1, "40" },
+	{ "parse/auth+origin",   bench_parse, 2, "40" },
+	{ "v4global",            bench_v4global, 0, NULL },
+	{ "list/insert/1",       bench_list, 1, "insert" },
+	{ "list/insert/2",       bench_list, 2, "insert" },
+	{ "list/insert/4",       bench_list, 4, "insert" },
+	{ "list/insert/8",       bench_list, 8, "insert" },
+	{ "list/lookup/1",       bench_list, 1, "lookup" },
+	{ "list/lookup/2",       bench_list, 2, "lookup" },
+	{ "list/lookup/4",       bench_list, 4, "lookup" },
+	{ "list/lookup/8",       bench_list, 8, "lookup" },
+	{ "list/lookup_batch/1", bench_list, 1, "lookup_batch" },
+	{ "list/lookup_batch/2", bench_list, 2, "lookup_batch" },
+	{ "list/lookup_batch/4", bench_list, 4, "lookup_batch" },
+	{ "list/lookup_batch/8", bench_list, 8, "lookup_batch" },
+	{ "list/expire/1",       bench_list_expire, 1, NULL },
+	{ "list/expire/2",       bench_list_expire, 2, NULL },
+	{ "list/expire/4",       bench_list_expire, 4, NULL },
+	{ "list/expire/8",       bench_list_expire, 8, NULL },
+	{ "queue/emit/1",        bench_queue, 1, NULL },
+	{ "queue/emit/8",        bench_queue, 8, NULL },
+	{ "queue/emit/32",       bench_queue, 32, NULL },
+};
+
+
+/*** Baseline ***/
+typedef struct result
+{
+	char name[64];
+	double ns;
+} result;
+
+static result *baseline;
+static size_t baseline_count;
+
+
+static int baseline_load (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	if (f == NULL)
+	{
+		perror (path);
+		return -1;
+	}
+
+	char line[256];
+	while (fgets (line, sizeof (line), f) != NULL)
+	{
+		result r;
+
+		if ((line[0] == '#')
+		 || (sscanf (line, "%63s %lf", r.name, &r.ns) != 2) || (r.ns <= 0.))
+			continue;
+
+		result *nb = realloc (baseline, (baseline_count + 1) * sizeof (r));
+		if (nb == NULL)
+			break;
+		baseline = nb;
+		baseline[baseline_count++] = r;
+	}
+	fclose (f);
+	return 0;
+}
+
+
+static const result *baseline_find (const char *name)
+{
+	for (size_t i = 0; i < baseline_count; i++)
+		if (!strcmp (baseline[i].name, name))
+			return baseline + i;
+	return NULL;
+}
+
+
+/*** Harness ***/
+static double measure (const bench *b, uint64_t min_ns, unsigned repeat)
+{
+	unsigned long n = 256;
+
+	/* Calibration */
+	while (b->run (b, n) < min_ns && (n < (ULONG_MAX / 2)))
+		n *= 2;
+
+	double best = HUGE_VAL;
+	for (unsigned i = 0; i < repeat; i++)
+	{
+		uint64_t elapsed = b->run (b, n);
+		double ns = (double)elapsed / n;
+		if (ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+
+static void usage (const char *path)
+{
+	printf ("Usage: %s [OPTIONS] [PATTERNS...]\n"
+	        "Benchmarks libteredo primitives (those matching any of the\n"
+	        "shell PATTERNS, or all).\n"
+	        "\n"
+	        "  -b  compare with an earlier output file\n"
+	        "  -d  minimum time per measurement (ms, default: 50)\n"
+	        "  -l  list the benchmarks and exit\n"
+	        "  -o  also write the results to a file\n"
+	        "  -r  measurements per benchmark (default: 5)\n"
+	        "  -t  regression threshold (%%, default: 15)\n", path);
+}
+
+
+int main (int argc, char *argv[])
+{
+	const char *outpath = NULL;
+	unsigned min_ms = 50, repeat = 5;
+	double threshold = 15.;
+	int c;
+
+	while ((c = getopt (argc, argv, "b:d:hlo:r:t:")) != -1)
+		switch (c)
+		{
+			case 'b':
+				if (baseline_load (optarg))
+					return 2;
+				break;
+			case 'd':
+				min_ms = strtoul (optarg, NULL, 10);
+				break;
+			case 'l':
+				for (size_t i = 0; i < sizeof (benches) / sizeof (benches[0]);
+				     i++)
+					puts (benches[i].name);
+				return 0;
+			case 'o':
+				outpath = optarg;
+				break;
+			case 'r':
+				repeat = strtoul (optarg, NULL, 10);
+				break;
+			case 't':
+				threshold = strtod (optarg, NULL);
+				break;
+			case 'h':
+				usage (argv[0]);
+				return 0;
+			default:
+				usage (argv[0]);
+				return 2;
+		}
+
+	if (repeat == 0)
+		repeat = 1;
+
+	FILE *out = NULL;
+	if (outpath != NULL)
+	{
+		out = fopen (outpath, "w");
+		if (out == NULL)
+		{
+			perror (outpath);
+			return 2;
+		}
+		fputs ("# name\tns/op\top/s\n", out);
+	}
+
+	teredo_clock_init ();
+	if (teredo_init_HMAC ())
+		return 2;
+
+	printf ("# name\tns/op\top/s%s\n",
+	        (baseline != NULL) ? "\tbaseline\tchange%\tstatus" : "");
+
+	unsigned regressions = 0;
+	for (size_t i = 0; i < sizeof (benches) / sizeof (benches[0]); i++)
+	{
+		const bench *b = benches + i;
+		bool selected = optind >= argc;
+
+		for (int j = optind; (j < argc) && !selected; j++)
+			selected = !fnmatch (argv[j], b->name, 0);
+		if (!selected)
+			continue;
+
+		double ns = measure (b, min_ms * UINT64_C(1000000), repeat);
+
+		printf ("%s\t%.3f\t%.0f", b->name, ns, 1e9 / ns);
+		if (out != NULL)
+			fprintf (out, "%s\t%.3f\t%.0f\n", b->name, ns, 1e9 / ns);
+
+		if (baseline != NULL)
+		{
+			const result *r = baseline_find (b->name);
+
+			if (r != NULL)
+			{
+				double change = (ns - r->ns) * 100. / r->ns;
+				const char *status = "ok";
+
+				if (change > threshold)
+				{
+					status = "REGRESSION";
+					regressions++;
+				}
+				else if (change < -threshold)
+					status = "improved";
+				printf ("\t%.3f\t%+.1f\t%s", r->ns, change, status);
+			}
+			else
+				printf ("\t-\t-\tnew");
+		}
+		putchar ('\n');
+		fflush (stdout);
+	}
+
+	if (out != NULL)
+		fclose (out);
+	teredo_deinit_HMAC ();
+	free (baseline);
+
+	if (regressions > 0)
+	{
+		fprintf (stderr, "%u benchmark(s) slower by more than %g%%\n",
+		         regressions, threshold);
+		return 1;
+	}
+	return 0;
+}
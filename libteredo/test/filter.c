@@ -0,0 +1,482 @@
+/*
+ * filter.c - Teredo socket filter test
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#ifdef HAVE_LINUX_FILTER_H
+# include <linux/filter.h>
+#endif
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "filter.h"
+#include "v4global.h"
+
+static uint16_t port;
+static int txfd;
+
+static void send_raw (const void *data, size_t len)
+{
+	int val = teredo_send (txfd, data, len, htonl (INADDR_LOOPBACK), port);
+	assert (val == (int)len);
+}
+
+/**
+ * Sends a bubble with optional Teredo headers in front of it.
+ */
+static void send_bubble (const char *src, const char *dst, unsigned plen,
+                         const uint8_t *hdr, size_t hlen)
+{
+	struct
+	{
+		uint8_t hdr[32];
+		struct ip6_hdr ip6;
+	} buf;
+
+	assert (hlen <= sizeof (buf.hdr));
+	memset (&buf, 0, sizeof (buf));
+	buf.ip6.ip6_flow = htonl (0x60000000);
+	buf.ip6.ip6_plen = htons (plen);
+	buf.ip6.ip6_nxt = IPPROTO_NONE;
+	buf.ip6.ip6_hlim = 255;
+	inet_pton (AF_INET6, src, &buf.ip6.ip6_src);
+	inet_pton (AF_INET6, dst, &buf.ip6.ip6_dst);
+
+	uint8_t *ptr = buf.hdr + sizeof (buf.hdr) - hlen;
+	memcpy (ptr, hdr, hlen);
+	send_raw (ptr, hlen + sizeof (buf.ip6));
+}
+
+static unsigned count_received (int fd)
+{
+	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	struct teredo_packet packet;
+	unsigned n = 0;
+
+	while (poll (&ufd, 1, 200) > 0)
+		if (teredo_recv (fd, &packet) == 0)
+			n++;
+	return n;
+}
+
+static int open_filtered (enum teredo_filter_mode mode)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+
+	int fd = teredo_socket (htonl (INADDR_LOOPBACK), 0);
+	assert (fd != -1);
+	if (teredo_socket_filter (fd, mode))
+	{
+		teredo_close (fd);
+		return -1;
+	}
+
+	getsockname (fd, (struct sockaddr *)&addr, &len);
+	port = addr.sin_port;
+	return fd;
+}
+
+static const char teredo_src[] = "2001:0:5ef5:79fb:0:59d9:a0e5:8d1b";
+static const char teredo_dst[] = "2001:0:5ef5:79fd:3cc4:1f3c:a0e5:8d1b";
+static const char native_src[] = "2001:db8::1";
+
+#ifdef HAVE_LINUX_FILTER_H
+/*
+ * Loopback sockets only ever see loopback IPv4 sources, which the server
+ * filter rejects. Server verdicts are thus checked by running the program
+ * through a classic BPF interpreter, with forged IPv4 sources.
+ */
+static bool bpf_load (const uint8_t *ip4, size_t len, int32_t off,
+                      unsigned size, uint32_t *val)
+{
+	const uint8_t *ptr = ip4 + 20; /* socket filters start from UDP */
+
+	len -= 20;
+	if (off < 0)
+	{
+		if (off < SKF_NET_OFF)
+			return false;
+		ptr = ip4;
+		len += 20;
+		off -= SKF_NET_OFF;
+	}
+	if ((size_t)off + size > len)
+		return false;
+
+	*val = 0;
+	for (unsigned i = 0; i < size; i++)
+		*val = (*val << 8) | ptr[off + i];
+	return true;
+}
+
+static uint32_t bpf_run (const struct sock_filter *prog, unsigned count,
+                         const uint8_t *ip4, size_t len)
+{
+	uint32_t a = 0, x = 0, mem[BPF_MEMWORDS] = { 0 };
+	static const unsigned sizes[] = {
+		[BPF_W] = 4, [BPF_H] = 2, [BPF_B] = 1,
+	};
+
+	for (unsigned pc = 0; pc < count; pc++)
+	{
+		const struct sock_filter *in = prog + pc;
+		uint32_t src = (BPF_SRC (in->code) == BPF_X) ? x : in->k;
+
+		switch (BPF_CLASS (in->code))
+		{
+			case BPF_LD:
+				switch (BPF_MODE (in->code))
+				{
+					case BPF_ABS:
+					case BPF_IND:
+					{
+						int32_t off = in->k;
+
+						if (BPF_MODE (in->code) == BPF_IND)
+							off += x;
+						if (!bpf_load (ip4, len, off,
+						               sizes[BPF_SIZE (in->code)], &a))
+							return 0;
+						break;
+					}
+					case BPF_LEN:
+						a = len - 20;
+						break;
+					case BPF_MEM:
+						a = mem[in->k];
+						break;
+					default:
+						assert (0);
+				}
+				break;
+
+			case BPF_LDX:
+				switch (BPF_MODE (in->code))
+				{
+					case BPF_IMM:
+						x = in->k;
+						break;
+					case BPF_MEM:
+						x = mem[in->k];
+						break;
+					default:
+						assert (0);
+				}
+				break;
+
+			case BPF_ST:
+				mem[in->k] = a;
+				break;
+
+			case BPF_STX:
+				mem[in->k] = x;
+				break;
+
+			case BPF_ALU:
+				switch (BPF_OP (in->code))
+				{
+					case BPF_ADD:
+						a += src;
+						break;
+					case BPF_SUB:
+						a -= src;
+						break;
+					case BPF_AND:
+						a &= src;
+						break;
+					case BPF_RSH:
+						a >>= src;
+						break;
+					default:
+						assert (0);
+				}
+				break;
+
+			case BPF_JMP:
+			{
+				bool cond;
+
+				switch (BPF_OP (in->code))
+				{
+					case BPF_JA:
+						pc += in->k;
+						continue;
+					case BPF_JEQ:
+						cond = a == src;
+						break;
+					case BPF_JGT:
+						cond = a > src;
+						break;
+					case BPF_JGE:
+						cond = a >= src;
+						break;
+					default:
+						assert (0);
+				}
+				pc += cond ? in->jt : in->jf;
+				break;
+			}
+
+			case BPF_RET:
+				assert (BPF_RVAL (in->code) == BPF_K);
+				return in->k;
+
+			case BPF_MISC:
+				if (BPF_MISCOP (in->code) == BPF_TAX)
+					x = a;
+				else
+					a = x;
+				break;
+		}
+	}
+	assert (0); /* programs must end with a return */
+	return 0;
+}
+
+/**
+ * Runs a filter program against an IPv6 packet, received from the given
+ * IPv4 source, with the given next header and payload length.
+ */
+static bool bpf_accept (const struct sock_filter *prog, unsigned count,
+                        const char *ipv4, const char *dst, uint8_t nxt,
+                        unsigned plen)
+{
+	uint8_t buf[20 + 8 + 40 + 128];
+	struct ip6_hdr ip6;
+
+	assert (plen <= sizeof (buf) - (20 + 8 + 40));
+	memset (buf, 0, sizeof (buf));
+	buf[0] = 0x45;
+	inet_pton (AF_INET, ipv4, buf + 12);
+
+	memset (&ip6, 0, sizeof (ip6));
+	ip6.ip6_flow = htonl (0x60000000);
+	ip6.ip6_plen = htons (plen);
+	ip6.ip6_nxt = nxt;
+	ip6.ip6_hlim = 255;
+	inet_pton (AF_INET6, teredo_src, &ip6.ip6_src);
+	inet_pton (AF_INET6, dst, &ip6.ip6_dst);
+	memcpy (buf + 28, &ip6, sizeof (ip6));
+
+	return bpf_run (prog, count, buf, 20 + 8 + 40 + plen) != 0;
+}
+
+static void test_server_program (void)
+{
+	struct sock_filter prog[TEREDO_FILTER_MAX_INSNS];
+	unsigned n = teredo_filter_program (TEREDO_FILTER_SERVER, prog);
+	static const char global[] = "198.51.100.1";
+
+	assert (n > 0);
+	assert (n <= TEREDO_FILTER_MAX_INSNS);
+
+	/* Bubbles: empty only, from global unicast sources only */
+	assert (bpf_accept (prog, n, global, teredo_dst, IPPROTO_NONE, 0));
+	assert (!bpf_accept (prog, n, global, teredo_dst, IPPROTO_NONE, 8));
+	assert (!bpf_accept (prog, n, "10.0.0.1", teredo_dst, IPPROTO_NONE, 0));
+	assert (!bpf_accept (prog, n, "127.0.0.1", teredo_dst, IPPROTO_NONE, 0));
+
+	/* Same verdicts as is_ipv4_global_unicast() */
+	static const char *const sources[] = {
+		"0.1.2.3", "9.255.255.255", "10.0.0.1", "126.0.0.1", "127.0.0.1",
+		"128.0.0.1", "169.253.1.1", "169.254.1.1", "172.15.0.1",
+		"172.16.0.1", "172.31.0.1", "172.32.0.1", "192.0.2.1",
+		"192.88.98.1", "192.88.99.1", "192.168.1.1", "223.255.255.255",
+		"224.0.0.1", "239.255.255.255", "240.0.0.1", "255.255.255.254",
+		"255.255.255.255",
+	};
+
+	for (unsigned i = 0; i < sizeof (sources) / sizeof (sources[0]); i++)
+	{
+		struct in_addr ip;
+
+		inet_pton (AF_INET, sources[i], &ip);
+		assert (bpf_accept (prog, n, sources[i], teredo_dst, IPPROTO_NONE, 0)
+		        == is_ipv4_global_unicast (ip.s_addr));
+	}
+
+	/* ICMPv6 size limit */
+	assert (bpf_accept (prog, n, global, teredo_dst, IPPROTO_ICMPV6, 8));
+	assert (bpf_accept (prog, n, global, teredo_dst, IPPROTO_ICMPV6, 88));
+	assert (!bpf_accept (prog, n, global, teredo_dst, IPPROTO_ICMPV6, 89));
+	assert (!bpf_accept (prog, n, "10.0.0.1", teredo_dst,
+	                     IPPROTO_ICMPV6, 88));
+
+	/* ... except for router messages */
+	assert (bpf_accept (prog, n, global, "ff02::2", IPPROTO_ICMPV6, 89));
+	assert (bpf_accept (prog, n, global, "fe80::1", IPPROTO_ICMPV6, 120));
+	assert (bpf_accept (prog, n, global, "febf::1", IPPROTO_ICMPV6, 89));
+	assert (!bpf_accept (prog, n, global, "fec0::1", IPPROTO_ICMPV6, 89));
+	assert (!bpf_accept (prog, n, "127.0.0.1", "ff02::2",
+	                     IPPROTO_ICMPV6, 89));
+
+	/* Other next headers */
+	assert (!bpf_accept (prog, n, global, teredo_dst, IPPROTO_UDP, 8));
+	assert (!bpf_accept (prog, n, global, teredo_dst, IPPROTO_TCP, 20));
+	assert (!bpf_accept (prog, n, global, "ff02::2", IPPROTO_UDP, 8));
+}
+#endif
+
+int main (void)
+{
+	static const uint8_t auth[13] = { 0, 1, 0, 0 };
+	static const uint8_t auth_id[17] = { 0, 1, 4, 0 };
+	static const uint8_t orig[8] = { 0, 0 };
+	uint8_t junk[40];
+	unsigned n;
+
+	txfd = teredo_socket (htonl (INADDR_LOOPBACK), 0);
+	assert (txfd != -1);
+
+	/* Relay */
+	int fd = open_filtered (TEREDO_FILTER_RELAY);
+	if (fd == -1)
+	{
+		puts ("Socket filter not supported.");
+		teredo_close (txfd);
+		return 77;
+	}
+
+	send_raw ("x", 1);
+	memset (junk, 0x45, sizeof (junk));
+	send_raw (junk, sizeof (junk)); /* not IPv6 */
+	send_bubble (native_src, teredo_dst, 0, NULL, 0);
+	send_bubble (teredo_src, "ff02::1", 0, NULL, 0);
+	send_bubble (teredo_src, teredo_dst, 8, NULL, 0); /* truncated */
+	send_bubble (teredo_src, teredo_dst, 0, auth, 4); /* truncated auth */
+	n = count_received (fd);
+	assert (n == 0);
+	n = teredo_socket_drops (fd);
+	assert ((n == 0) || (n == 6));
+
+	send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	send_bubble (teredo_src, teredo_dst, 0, auth, sizeof (auth));
+	send_bubble (teredo_src, teredo_dst, 0, auth_id, sizeof (auth_id));
+	send_bubble (teredo_src, teredo_dst, 0, orig, sizeof (orig));
+	n = count_received (fd);
+	assert (n == 4);
+
+	teredo_socket_unfilter (fd);
+	send_bubble (native_src, teredo_dst, 0, NULL, 0);
+	n = count_received (fd);
+	assert (n == 1);
+	teredo_close (fd);
+
+	/* Client */
+	fd = open_filtered (TEREDO_FILTER_CLIENT);
+	assert (fd != -1);
+	send_raw (junk, sizeof (junk));
+	send_bubble (native_src, teredo_dst, 0, NULL, 0);
+	send_bubble (teredo_src, "ff02::1", 0, auth, sizeof (auth));
+	n = count_received (fd);
+	assert (n == 2);
+	teredo_close (fd);
+
+	/* Server: loopback is not a global unicast source */
+	fd = open_filtered (TEREDO_FILTER_SERVER);
+	assert (fd != -1);
+	send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	send_bubble (teredo_src, teredo_dst, 0, auth, sizeof (auth));
+	n = count_received (fd);
+	assert (n == 0);
+	teredo_close (fd);
+#ifdef HAVE_LINUX_FILTER_H
+	test_server_program ();
+#endif
+
+	/* Kernel drops accounting */
+	atomic_uint_least32_t last;
+
+	atomic_init (&last, 0);
+	assert (teredo_socket_drops_update (&last, 0) == 0);
+	assert (teredo_socket_drops_update (&last, 5) == 5);
+	assert (teredo_socket_drops_update (&last, 3) == 0); /* out of order */
+	assert (teredo_socket_drops_update (&last, 7) == 2);
+	atomic_store (&last, UINT32_MAX);
+	assert (teredo_socket_drops_update (&last, 1) == 2);
+
+	/* Receive buffer overflow */
+	fd = open_filtered (TEREDO_FILTER_CLIENT);
+	assert (fd != -1);
+	teredo_socket_unfilter (fd);
+	assert (teredo_socket_buffers (fd, 4096, 4096) == 0);
+	for (unsigned i = 0; i < 256; i++)
+		send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	assert (count_received (fd) < 256);
+	/* The queue is empty: no need to grow */
+	assert (teredo_socket_grow (fd, 1 << 20) == 0);
+
+	struct teredo_packet packet;
+
+	send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	assert (teredo_wait_recv (fd, &packet) == 0);
+#ifdef SO_RXQ_OVFL
+	assert (packet.rx_dropped > 0);
+	n = teredo_socket_drops (fd);
+	assert ((n == 0) || (n == packet.rx_dropped));
+#endif
+
+	for (unsigned i = 0; i < 256; i++)
+		send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	n = teredo_socket_grow (fd, 1 << 20);
+	assert (n > 4096);
+	assert (n <= (1 << 20));
+#ifdef __linux__
+	/* The set size doubles, not the (doubled) size reported by Linux */
+	int val;
+	socklen_t len = sizeof (val);
+
+	assert (n == 8192);
+	assert (getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &val, &len) == 0);
+	assert (val == 2 * 8192);
+
+	/* The ceiling applies to the set size */
+	for (unsigned i = 0; i < 256; i++)
+		send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	assert (teredo_socket_grow (fd, 12000) == 12000);
+	assert (getsockopt (fd, SOL_SOCKET, SO_RCVBUF, &val, &len) == 0);
+	assert (val == 2 * 12000);
+	for (unsigned i = 0; i < 256; i++)
+		send_bubble (teredo_src, teredo_dst, 0, NULL, 0);
+	assert (teredo_socket_grow (fd, 12000) == 0);
+#endif
+	teredo_close (fd);
+
+	teredo_close (txfd);
+	return 0;
+}
@@ -0,0 +1,470 @@
+/*
+ * handshake.c - In-memory Teredo handshake benchmark
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+/*
+ * Connects a Teredo server, a Teredo relay and N Teredo clients through an
+ * in-memory network (see memnet.h), inside a single process. Each client
+ * qualifies with the server, then sends a packet to a native IPv6 node,
+ * which requires the complete handshake: ping through the server, echo
+ * reply and indirect bubble through the relay, direct bubble to the relay.
+ * Then data is exchanged both ways through the relay. One client out of
+ * three is given an unreachable primary server, and must qualify with its
+ * secondary server instead. Another one is given the secondary address of
+ * the server as its secondary server (as ServerAddress2 used to mean).
+ *
+ * The qualification and handshake latencies, and the data rates are
+ * reported. Without the network stack, these measure libteredo alone.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "server.h"
+#include "checksum.h"
+#include "memnet.h"
+
+#define SERVER_IP1 0xc0000201 /* 192.0.2.1 */
+#define SERVER_IP2 0xc0000202 /* 192.0.2.2 */
+#define RELAY_IP   0xc0000264 /* 192.0.2.100 */
+#define DEAD_IP    "192.0.2.9" /* no server there */
+#define CLIENT_NET 0xc6336400 /* 198.51.100.0 */
+#define DATA_PORT  9
+
+typedef struct client
+{
+	teredo_tunnel *tunnel;
+	struct in6_addr addr;
+	uint64_t start, up, sent, delivered;
+} client;
+
+static client *clients;
+static unsigned nclients;
+static teredo_tunnel *relay;
+static struct in6_addr native;
+
+static sem_t up_sem, delivered_sem;
+static atomic_ulong to_native, to_clients;
+
+
+static uint64_t now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+
+static int sem_wait_secs (sem_t *sem, unsigned secs)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	ts.tv_sec += secs;
+
+	int val;
+	while (((val = sem_timedwait (sem, &ts)) != 0) && (errno == EINTR));
+	return val;
+}
+
+
+typedef union
+{
+	struct ip6_hdr ip6;
+	uint8_t buf[sizeof (struct ip6_hdr) + sizeof (struct udphdr) + 4];
+} data_packet;
+
+
+static void data_build (data_packet *p, const struct in6_addr *src,
+                        const struct in6_addr *dst, uint32_t idx)
+{
+	struct udphdr *uh = (struct udphdr *)(p->buf + sizeof (p->ip6));
+
+	memset (p, 0, sizeof (*p));
+	p->ip6.ip6_flow = htonl (0x60000000);
+	p->ip6.ip6_plen = htons (sizeof (*uh) + 4);
+	p->ip6.ip6_nxt = IPPROTO_UDP;
+	p->ip6.ip6_hlim = 64;
+	p->ip6.ip6_src = *src;
+	p->ip6.ip6_dst = *dst;
+	uh->uh_sport = uh->uh_dport = htons (DATA_PORT);
+	uh->uh_ulen = p->ip6.ip6_plen;
+	memcpy (uh + 1, &idx, 4);
+}
+
+
+static uint32_t data_index (const void *data, size_t len)
+{
+	const struct ip6_hdr *ip6 = data;
+	uint32_t idx;
+
+	if ((len != sizeof (data_packet)) || (ip6->ip6_nxt != IPPROTO_UDP))
+		return UINT32_MAX;
+	memcpy (&idx, (const uint8_t *)data + len - 4, 4);
+	return (idx < nclients) ? idx : UINT32_MAX;
+}
+
+
+/*** Native IPv6 node, behind the relay ***/
+/* Echo requests (Teredo pings) from the server */
+static void native_from_server (void *opaque, const void *data, size_t len)
+{
+	union
+	{
+		struct ip6_hdr ip6;
+		uint8_t buf[1280];
+	} reply;
+	struct icmp6_hdr *icmp6 = (struct icmp6_hdr *)(reply.buf
+	                                               + sizeof (reply.ip6));
+
+	(void)opaque;
+	if ((len < sizeof (reply.ip6) + sizeof (*icmp6)) || (len > sizeof (reply)))
+		return;
+
+	memcpy (reply.buf, data, len);
+	if ((reply.ip6.ip6_nxt != IPPROTO_ICMPV6)
+	 || (icmp6->icmp6_type != ICMP6_ECHO_REQUEST))
+		return;
+
+	reply.ip6.ip6_dst = reply.ip6.ip6_src;
+	reply.ip6.ip6_src = native;
+	icmp6->icmp6_type = ICMP6_ECHO_REPLY;
+	icmp6->icmp6_cksum = 0;
+	icmp6->icmp6_cksum = icmp6_checksum (&reply.ip6, icmp6);
+	teredo_transmit (relay, &reply.ip6, len);
+}
+
+
+/* Data from the clients, through the relay */
+static void native_from_relay (void *opaque, const void *data, size_t len)
+{
+	uint32_t idx = data_index (data, len);
+
+	(void)opaque;
+	if (idx == UINT32_MAX)
+		return;
+
+	client *c = clients + idx;
+	if (c->delivered == 0)
+	{
+		c->delivered = now ();
+		sem_post (&delivered_sem);
+	}
+	else
+		atomic_fetch_add_explicit (&to_native, 1, memory_order_relaxed);
+}
+
+
+/*** Clients ***/
+static void client_up (void *opaque, const struct in6_addr *addr,
+                       uint16_t mtu)
+{
+	client *c = opaque;
+
+	(void)mtu;
+	if (c->up != 0)
+		return;
+	c->addr = *addr;
+	c->up = now ();
+	sem_post (&up_sem);
+}
+
+
+static void client_recv (void *opaque, const void *data, size_t len)
+{
+	(void)opaque;
+	if (data_index (data, len) != UINT32_MAX)
+		atomic_fetch_add_explicit (&to_clients, 1, memory_order_relaxed);
+}
+
+
+/*** Results ***/
+static int u64_cmp (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void percentiles (const char *name, uint64_t *v, unsigned n)
+{
+	if (n == 0)
+		return;
+
+	qsort (v, n, sizeof (*v), u64_cmp);
+	printf ("%-14s p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n", name,
+	        v[n / 2] / 1e3, v[(n * 9) / 10] / 1e3,
+	        v[((n * 99) / 100 < n) ? (n * 99) / 100 : n - 1] / 1e3,
+	        v[n - 1] / 1e3);
+}
+
+
+static int run (unsigned slots, unsigned count, unsigned timeout)
+{
+	memnet *net = memnet_create (slots);
+	if (net == NULL)
+		return -1;
+
+	inet_pton (AF_INET6, "2001:db8::1", &native);
+	memnet_set_ipv6 (net, native_from_server, NULL);
+	sem_init (&up_sem, 0, 0);
+	sem_init (&delivered_sem, 0, 0);
+
+	/* Server */
+	int fd1 = teredo_socket (htonl (INADDR_LOOPBACK), 0);
+	int fd2 = teredo_socket (htonl (INADDR_LOOPBACK), 0);
+	assert ((fd1 != -1) && (fd2 != -1));
+	assert (memnet_attach (net, fd1, htonl (SERVER_IP1),
+	                       htons (IPPORT_TEREDO)) == 0);
+	assert (memnet_attach (net, fd2, htonl (SERVER_IP2),
+	                       htons (IPPORT_TEREDO)) == 0);
+
+	teredo_server *server = teredo_server_create_fd (fd1, fd2,
+	                                                 htonl (SERVER_IP1),
+	                                                 htonl (SERVER_IP2));
+	assert (server != NULL);
+	assert (teredo_server_start (server) == 0);
+
+	/* Relay, with room for all handshakes at once */
+	teredo_tunables tun;
+	teredo_tunables_init (&tun);
+	if (tun.max_peers < nclients)
+		tun.max_peers = nclients;
+	if (tun.probation_peers < nclients)
+		tun.probation_peers = nclients;
+
+	relay = teredo_create (htonl (INADDR_LOOPBACK), 0, &tun);
+	assert (relay != NULL);
+	assert (memnet_attach (net, teredo_get_fd (relay), htonl (RELAY_IP),
+	                       htons (IPPORT_TEREDO + 1)) == 0);
+	assert (teredo_set_relay_mode (relay) == 0);
+	teredo_set_cone_flag (relay, true);
+	teredo_set_recv_callback (relay, native_from_relay);
+	assert (teredo_run_async (relay) == 0);
+
+	/* Clients */
+	clients = calloc (nclients, sizeof (*clients));
+	assert (clients != NULL);
+
+	for (unsigned i = 0; i < nclients; i++)
+	{
+		client *c = clients + i;
+
+		c->tunnel = teredo_create (htonl (INADDR_LOOPBACK), 0, NULL);
+		assert (c->tunnel != NULL);
+		assert (memnet_attach (net, teredo_get_fd (c->tunnel),
+		                       htonl (CLIENT_NET + 1 + (i >> 16)),
+		                       htons (1024 + (i & 0xffff))) == 0);
+		teredo_set_privdata (c->tunnel, c);
+		teredo_set_state_cb (c->tunnel, client_up, NULL);
+		teredo_set_recv_callback (c->tunnel, client_recv);
+		switch (i % 3)
+		{
+			case 0:
+				assert (teredo_set_client_mode (c->tunnel, "192.0.2.1",
+				                                NULL, NULL) == 0);
+				break;
+			case 1:
+				assert (teredo_set_client_mode (c->tunnel, DEAD_IP,
+				                                "192.0.2.1", NULL) == 0);
+				break;
+			case 2:
+				assert (teredo_set_client_mode (c->tunnel, "192.0.2.1",
+				                                "192.0.2.2", NULL) == 0);
+				break;
+		}
+	}
+
+	/* Qualification */
+	uint64_t start = now ();
+	for (unsigned i = 0; i < nclients; i++)
+	{
+		clients[i].start = now ();
+		assert (teredo_run_async (clients[i].tunnel) == 0);
+	}
+
+	unsigned up = 0, done = 0;
+	while ((up < nclients) && (sem_wait_secs (&up_sem, timeout) == 0))
+		up++;
+	uint64_t qualified = now ();
+
+	/* Handshake, up to the first data packet delivered */
+	for (unsigned i = 0; i < nclients; i++)
+	{
+		client *c = clients + i;
+		data_packet p;
+
+		if (c->up == 0)
+			continue;
+		data_build (&p, &c->addr, &native, i);
+		c->sent = now ();
+		teredo_transmit (c->tunnel, &p.ip6, sizeof (p));
+	}
+
+	while ((done < up) && (sem_wait_secs (&delivered_sem, timeout) == 0))
+		done++;
+	uint64_t connected = now ();
+	unsigned long lost = memnet_dropped (net); /* solicitations to DEAD_IP */
+
+	/* Data */
+	for (unsigned n = 0; n < count; n++)
+		for (unsigned i = 0; i < nclients; i++)
+		{
+			client *c = clients + i;
+			data_packet p;
+
+			if (c->delivered == 0)
+				continue;
+			data_build (&p, &c->addr, &native, i);
+			teredo_transmit (c->tunnel, &p.ip6, sizeof (p));
+			data_build (&p, &native, &c->addr, i);
+			teredo_transmit (relay, &p.ip6, sizeof (p));
+		}
+
+	unsigned long expected = (unsigned long)done * count;
+	for (unsigned ms = 0; ms < timeout * 1000; ms += 10)
+	{
+		if ((atomic_load (&to_native) + atomic_load (&to_clients)
+		       + memnet_dropped (net) - lost) >= 2 * expected)
+			break;
+		usleep (10000);
+	}
+	uint64_t end = now ();
+
+	/* Report */
+	uint64_t *lat = malloc (nclients * sizeof (*lat));
+	assert (lat != NULL);
+
+	unsigned n = 0;
+	for (unsigned i = 0; i < nclients; i++)
+		if (clients[i].up != 0)
+			lat[n++] = clients[i].up - clients[i].start;
+	percentiles ("qualification", lat, n);
+
+	n = 0;
+	for (unsigned i = 0; i < nclients; i++)
+		if (clients[i].delivered != 0)
+			lat[n++] = clients[i].delivered - clients[i].sent;
+	percentiles ("handshake", lat, n);
+	free (lat);
+
+	printf ("%u/%u clients qualified in %.3f ms (%.0f/s)\n", up, nclients,
+	        (qualified - start) / 1e6, up * 1e9 / (qualified - start + 1));
+	printf ("%u/%u handshakes in %.3f ms (%.0f/s)\n", done, up,
+	        (connected - qualified) / 1e6,
+	        done * 1e9 / (connected - qualified + 1));
+	printf ("data: %lu/%lu to native, %lu/%lu to clients in %.3f ms "
+	        "(%.0f packets/s), %lu dropped\n",
+	        atomic_load (&to_native), expected,
+	        atomic_load (&to_clients), expected, (end - connected) / 1e6,
+	        (atomic_load (&to_native) + atomic_load (&to_clients)) * 1e9
+	            / (end - connected + 1), memnet_dropped (net) - lost);
+
+	/* Clean up */
+	for (unsigned i = 0; i < nclients; i++)
+		teredo_destroy (clients[i].tunnel);
+	teredo_destroy (relay);
+	teredo_server_stop (server);
+	teredo_server_destroy (server);
+	memnet_destroy (net);
+	free (clients);
+	sem_destroy (&delivered_sem);
+	sem_destroy (&up_sem);
+
+	return ((up == nclients) && (done == nclients)) ? 0 : -1;
+}
+
+
+static void usage (const char *path)
+{
+	printf ("Usage: %s [OPTIONS]\n"
+	        "Benchmarks Teredo handshakes over an in-memory network.\n"
+	        "\n"
+	        "  -c  number of clients (default: 16)\n"
+	        "  -n  data packets per client and direction (default: 64)\n"
+	        "  -s  datagrams queued per socket (default: 4096)\n"
+	        "  -t  timeout in seconds (default: 10)\n", path);
+}
+
+
+int main (int argc, char *argv[])
+{
+	unsigned slots = 4096, count = 64, timeout = 10;
+	int c;
+
+	nclients = 16;
+	while ((c = getopt (argc, argv, "c:hn:s:t:")) != -1)
+		switch (c)
+		{
+			case 'c':
+				nclients = strtoul (optarg, NULL, 0);
+				break;
+			case 'n':
+				count = strtoul (optarg, NULL, 0);
+				break;
+			case 's':
+				slots = strtoul (optarg, NULL, 0);
+				break;
+			case 't':
+				timeout = strtoul (optarg, NULL, 0);
+				break;
+			case 'h':
+				usage (argv[0]);
+				return 0;
+			default:
+				usage (argv[0]);
+				return 2;
+		}
+
+	if ((nclients == 0) || (nclients > 65536))
+	{
+		usage (argv[0]);
+		return 2;
+	}
+
+	return run (slots, count, timeout) ? 1 : 0;
+}
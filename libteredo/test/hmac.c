@@ -38,6 +38,7 @@
 #include "teredo.h"
 #include "tunnel.h"
 #include "security.h"
+#include "keyedhash.h"
 
 static const uint32_t stamp = 0x12345678;
 
@@ -86,6 +87,59 @@ static int test_ping (void)
 }
 
 
+static int test_ping_batch (void)
+{
+	enum { N = 11 }; /* not a multiple of the number of lanes */
+	struct in6_addr addrs[N + 1];
+	const struct in6_addr *src[N], *dst[N];
+	uint8_t hmacs[N][LIBTEREDO_HMAC_LEN], ref[LIBTEREDO_HMAC_LEN];
+	uint8_t *hash[N];
+	int res[N];
+
+	for (unsigned i = 0; i <= N; i++)
+	{
+		memcpy (addrs + i, "\x20\x01\x00\x00\x8a\xc3\x9d\xdd"
+		                   "\x80\x00\xf2\x27\x75\x3c\x67\x74", 16);
+		addrs[i].s6_addr[15] = i;
+	}
+	for (unsigned i = 0; i < N; i++)
+	{
+		src[i] = addrs + i;
+		dst[i] = addrs + i + 1;
+		hash[i] = hmacs[i];
+	}
+
+	teredo_get_pinghash_batch (stamp, N, src, dst, hash);
+	for (unsigned i = 0; i < N; i++)
+	{
+		/* must match the one-by-one computation */
+		teredo_get_pinghash (stamp, src[i], dst[i], ref);
+		if (memcmp (ref, hmacs[i], sizeof (ref)))
+			return 1;
+		if (teredo_verify_pinghash (stamp, src[i], dst[i], hmacs[i]))
+			return 1;
+	}
+
+	if (teredo_verify_pinghash_batch (stamp + 29, N, src, dst,
+	                                  (const uint8_t *const *)hash, res) != N)
+		return 1;
+
+	/* alter some hashes, expire others */
+	hmacs[3][LIBTEREDO_HMAC_LEN - 1] ^= 1;
+	hmacs[7][0] ^= 1;
+	teredo_get_pinghash (stamp - 30, src[9], dst[9], hmacs[9]);
+	if (teredo_verify_pinghash_batch (stamp, N, src, dst,
+	                                  (const uint8_t *const *)hash, res)
+	     != N - 3)
+		return 1;
+	for (unsigned i = 0; i < N; i++)
+		if ((res[i] != 0) != ((i == 3) || (i == 7) || (i == 9)))
+			return 1;
+
+	return 0;
+}
+
+
 static int test_rs (void)
 {
 	uint8_t nonce[LIBTEREDO_NONCE_LEN], buf[LIBTEREDO_NONCE_LEN];
@@ -102,12 +156,92 @@ static int test_rs (void)
 }
 
 
+/**
+ * RFC 2202 test case 1 (the key length is fixed, so it is the only one that
+ * applies).
+ */
+static int test_hmac_md5 (void)
+{
+	static const uint8_t digest[TEREDO_HASH_LEN] = {
+		0x92, 0x94, 0x72, 0x7a, 0x36, 0x38, 0xbb, 0x1c,
+		0x13, 0xf4, 0x8e, 0xf8, 0x15, 0x8b, 0xfc, 0x9d };
+	uint8_t key[TEREDO_HASH_KEY_LEN], hash[TEREDO_HASH_LEN];
+	teredo_hash_ctx ctx;
+
+	memset (key, 0x0b, sizeof (key));
+	teredo_hmac_md5.setkey (key);
+
+	/* Twice, to check that the key state is not consumed */
+	for (unsigned i = 0; i < 2; i++)
+	{
+		teredo_hmac_md5.init (&ctx);
+		teredo_hmac_md5.update (&ctx, "Hi ", 3);
+		teredo_hmac_md5.update (&ctx, "There", 5);
+		teredo_hmac_md5.final (&ctx, hash);
+		if (memcmp (hash, digest, sizeof (hash)))
+			return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * SipHash-2-4-128 reference vectors, with key 00 01 02 ... 0f and message
+ * 00 01 02 ... of length 0 and 15.
+ */
+static int test_siphash (void)
+{
+	static const uint8_t digests[2][TEREDO_HASH_LEN] = {
+		{ 0xa3, 0x81, 0x7f, 0x04, 0xba, 0x25, 0xa8, 0xe6,
+		  0x6d, 0xf6, 0x72, 0x14, 0xc7, 0x55, 0x02, 0x93 },
+		{ 0x54, 0x93, 0xe9, 0x99, 0x33, 0xb0, 0xa8, 0x11,
+		  0x7e, 0x08, 0xec, 0x0f, 0x97, 0xcf, 0xc3, 0xd9 },
+	};
+	uint8_t key[TEREDO_HASH_KEY_LEN], msg[15], hash[TEREDO_HASH_LEN];
+	teredo_hash_ctx ctx;
+
+	for (unsigned i = 0; i < sizeof (key); i++)
+		key[i] = i;
+	for (unsigned i = 0; i < sizeof (msg); i++)
+		msg[i] = i;
+	teredo_siphash.setkey (key);
+
+	teredo_siphash.init (&ctx);
+	teredo_siphash.final (&ctx, hash);
+	if (memcmp (hash, digests[0], sizeof (hash)))
+		return -1;
+
+	/* Split across partial words */
+	teredo_siphash.init (&ctx);
+	teredo_siphash.update (&ctx, msg, 3);
+	teredo_siphash.update (&ctx, msg + 3, 9);
+	teredo_siphash.update (&ctx, msg + 12, 3);
+	teredo_siphash.final (&ctx, hash);
+	if (memcmp (hash, digests[1], sizeof (hash)))
+		return -1;
+	return 0;
+}
+
+
 int main (void)
 {
+	static const char *const names[] = { "HMAC-MD5", "SipHash-2-4" };
+
+	/* Before teredo_init_HMAC(), which overrides the key */
+	assert (test_hmac_md5 () == 0);
+	assert (test_siphash () == 0);
 	assert (teredo_init_HMAC () == 0);
-	assert (test_ping () == 0);
-	assert (test_rs () == 0);
+	assert (teredo_hash_select ("foobar") == -1);
+
+	for (unsigned i = 0; i < sizeof (names) / sizeof (names[0]); i++)
+	{
+		assert (teredo_hash_select (names[i]) == 0);
+		assert (test_ping () == 0);
+		assert (test_ping_batch () == 0);
+		assert (test_rs () == 0);
+	}
 
+	assert (teredo_hash_select (NULL) == 0);
 	teredo_deinit_HMAC ();
 	return 0;
 }
@@ -155,14 +155,385 @@ static int test_list (teredo_peerlist *l)
 }
 
 
+static bool try_trust (teredo_peerlist *l, struct in6_addr *addr)
+{
+	bool created;
+	teredo_peer *p = teredo_list_lookup (l, addr, &created);
+	if (p == NULL)
+		return false;
+	p->trusted = 1;
+	teredo_list_release (l);
+	return true;
+}
+
+
+static int test_probation (teredo_peerlist *l)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Probation eviction test...");
+	for (unsigned i = 0; i < 4; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+
+	/* 4 peers on probation: 1, 2, 3 remain; 0 was evicted */
+	addr.s6_addr[12] = 0;
+	if (try_lookup (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 1;
+	if (!try_lookup (l, &addr)) // 1 is now the most recent
+		return -1;
+	addr.s6_addr[12] = 4;
+	if (!try_insert (l, &addr)) // evicts 2
+		return -1;
+	addr.s6_addr[12] = 2;
+	if (try_lookup (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 1;
+	if (!try_lookup (l, &addr))
+		return -1;
+
+	puts ("Promotion test...");
+	/* 2 trusted peers make it to the main list, the third does not */
+	for (unsigned i = 10; i < 13; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (!try_trust (l, &addr))
+			return -1;
+	}
+
+	/* flood untrusted peers */
+	addr.s6_addr[0] = 1;
+	for (unsigned i = 0; i < 256; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (!try_insert (l, &addr))
+			return -1;
+	}
+	addr.s6_addr[0] = 0;
+
+	for (unsigned i = 10; i < 13; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (try_lookup (l, &addr) != (i < 12))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+static int test_flow_cache (teredo_peerlist *l, teredo_peerlist *l2)
+{
+	struct in6_addr addr = { { } };
+	teredo_clock_t now = teredo_clock ();
+	const teredo_flow *f;
+	bool created;
+
+	puts ("Flow cache test...");
+	addr.s6_addr[12] = 42;
+	teredo_peer *p = teredo_list_lookup (l, &addr, &created);
+	if (p == NULL)
+		return -1;
+	p->trusted = 1;
+	p->local = 0;
+	SetMapping (p, htonl (0xc0000201), htons (3544));
+	TouchReceive (p, now);
+	TouchTransmit (p, now);
+	teredo_list_release (l);
+
+	f = teredo_list_cache_lookup (l, &addr, now);
+	if ((f == NULL) || (f->mapped_addr != htonl (0xc0000201))
+	 || (f->mapped_port != htons (3544)) || (f->last_tx != (uint32_t)now))
+		return -1;
+	if (teredo_list_cache_lookup (l2, &addr, now) != NULL)
+		return -1; // wrong list
+	if (teredo_list_cache_lookup (l, &addr, now + 31) != NULL)
+		return -1; // expired
+
+	/* unrelated lookup: snapshot remains */
+	addr.s6_addr[12] = 43;
+	if (!try_insert (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 42;
+	if (teredo_list_cache_lookup (l, &addr, now) == NULL)
+		return -1;
+
+	/* unrelated trust change: snapshot remains */
+	addr.s6_addr[12] = 43;
+	if (!try_trust (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 42;
+	if (teredo_list_cache_lookup (l, &addr, now) == NULL)
+		return -1;
+
+	/* mapping changes: snapshot is invalidated */
+	p = teredo_list_lookup (l, &addr, &created);
+	if (p == NULL)
+		return -1;
+	p->mapped_port = htons (3545);
+	teredo_list_release (l);
+	f = teredo_list_cache_lookup (l, &addr, now);
+	if ((f == NULL) || (f->mapped_port != htons (3545)))
+		return -1;
+
+	/* peer loses trust */
+	p = teredo_list_lookup (l, &addr, &created);
+	if (p == NULL)
+		return -1;
+	p->trusted = 0;
+	teredo_list_release (l);
+	if (teredo_list_cache_lookup (l, &addr, now) != NULL)
+		return -1;
+
+	/* trusted again, then reset */
+	if (!try_trust (l, &addr))
+		return -1;
+	if (teredo_list_cache_lookup (l, &addr, now) == NULL)
+		return -1;
+	teredo_list_reset (l, 2);
+	if (teredo_list_cache_lookup (l, &addr, now) != NULL)
+		return -1;
+
+	return 0;
+}
+
+
+static int test_filter (teredo_peerlist *l)
+{
+	struct in6_addr addr = { { } };
+
+	puts ("Negative lookup filter test...");
+	teredo_list_reset (l, 2);
+	for (unsigned i = 0; i < 3; i++)
+	{
+		addr.s6_addr[12] = i;
+		if (teredo_list_may_contain (l, &addr))
+			return -1; // empty list
+		if (!try_insert (l, &addr))
+			return -1;
+		if (!teredo_list_may_contain (l, &addr))
+			return -1;
+	}
+
+	/* Reset peers leave the filter once reclaimed in the background */
+	teredo_list_reset (l, 2);
+	for (unsigned i = 0; i < 3; i++)
+	{
+		unsigned tries = 0;
+
+		addr.s6_addr[12] = i;
+		while (teredo_list_may_contain (l, &addr))
+		{
+			if (++tries > 200)
+				return -1;
+			usleep (10000);
+		}
+	}
+	return 0;
+}
+
+
+static int test_batch (teredo_peerlist *l)
+{
+	struct in6_addr addrs[6] = { { { } } };
+	const struct in6_addr *pa[6];
+	teredo_peer *peers[6];
+	bool created[6];
+
+	puts ("Batch lookup test...");
+	for (unsigned i = 0; i < 6; i++)
+	{
+		addrs[i].s6_addr[12] = i;
+		pa[i] = addrs + i;
+	}
+	pa[5] = pa[1]; // duplicate
+
+	addrs[0].s6_addr[0] = 2;
+	if (!try_insert (l, addrs))
+		return -1;
+
+	/* lookup only */
+	if (teredo_list_lookup_batch (l, 6, pa, peers, NULL) != 1)
+		return -1;
+	teredo_list_release (l);
+	if ((peers[0] == NULL) || (peers[1] != NULL) || (peers[5] != NULL))
+		return -1;
+
+	/* lookup and creation: the probation table has room for 3 peers only */
+	if (teredo_list_lookup_batch (l, 6, pa, peers, created) != 4)
+		return -1;
+	if ((peers[0] == NULL) || created[0])
+		return -1;
+	if ((peers[1] == NULL) || !created[1] || (peers[2] == NULL)
+	 || !created[2] || (peers[3] != NULL) || (peers[4] != NULL))
+		return -1;
+	if ((peers[5] != peers[1]) || created[5])
+		return -1;
+	peers[1]->trusted = 1;
+	teredo_list_release (l);
+
+	/* trusted peer was promoted, others remain */
+	for (unsigned i = 0; i < 3; i++)
+		if (!try_lookup (l, addrs + i))
+			return -1;
+	if (teredo_list_lookup_batch (l, 0, pa, peers, created) != 0)
+		return -1;
+	teredo_list_release (l);
+	return 0;
+}
+
+
+static int test_reset (teredo_peerlist *l)
+{
+	struct in6_addr addr = { { } };
+
+	/* Peers of successive resets are reclaimed in the background */
+	for (unsigned round = 0; round < 3; round++)
+	{
+		teredo_list_reset (l, 2000);
+		for (unsigned i = 0; i < 1000; i++)
+		{
+			addr.s6_addr[11] = i >> 8;
+			addr.s6_addr[12] = i;
+			if (!try_insert (l, &addr))
+				return -1;
+		}
+	}
+
+	teredo_list_reset (l, 2);
+	for (unsigned i = 0; i < 1000; i += 100)
+	{
+		addr.s6_addr[11] = i >> 8;
+		addr.s6_addr[12] = i;
+		if (try_lookup (l, &addr))
+			return -1;
+	}
+	addr.s6_addr[11] = 0;
+	return 0;
+}
+
+
+static int test_limits (teredo_peerlist *l)
+{
+	struct in6_addr addr = { { } };
+
+	/* Probation table cannot be enabled on the fly */
+	if (teredo_list_set_limits (l, 2, 1, 60) == 0)
+		return -1;
+
+	addr.s6_addr[12] = 1;
+	if (!try_insert (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 2;
+	if (!try_insert (l, &addr))
+		return -1;
+
+	/* Lowered limit: existing peers stay, new ones are refused */
+	if (teredo_list_set_limits (l, 1, 0, 60))
+		return -1;
+	addr.s6_addr[12] = 3;
+	if (try_insert (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 1;
+	if (!try_lookup (l, &addr))
+		return -1;
+
+	/* Raised limit */
+	if (teredo_list_set_limits (l, 3, 0, 60))
+		return -1;
+	addr.s6_addr[12] = 3;
+	if (!try_insert (l, &addr))
+		return -1;
+	addr.s6_addr[12] = 4;
+	if (try_insert (l, &addr))
+		return -1;
+	return 0;
+}
+
+
+static int test_persist (teredo_peerlist *l, teredo_peerlist *l2)
+{
+	struct in6_addr addr = { { } };
+	teredo_clock_t now = teredo_clock ();
+	bool created;
+	int ret = -1;
+
+	puts ("Persistence test...");
+	FILE *file = tmpfile ();
+	if (file == NULL)
+		return -1;
+
+	int fd = fileno (file);
+	if (teredo_list_restore (l2, fd) != 0)
+		goto out; // empty file
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		addr.s6_addr[12] = i;
+		teredo_peer *p = teredo_list_lookup (l, &addr, &created);
+		if (p == NULL)
+			goto out;
+		p->trusted = (i != 1); // untrusted peers are not saved
+		p->local = 0;
+		SetMapping (p, htonl (0xc0000201), htons (1000 + i));
+		TouchReceive (p, now);
+		TouchTransmit (p, now - 5);
+		teredo_list_release (l);
+	}
+
+	if (teredo_list_save (l, fd) != 2)
+		goto out;
+	if (teredo_list_restore (l2, fd) != 2)
+		goto out;
+	if (teredo_list_restore (l2, fd) != 0)
+		goto out; // already present
+
+	for (unsigned i = 0; i < 3; i++)
+	{
+		addr.s6_addr[12] = i;
+		teredo_peer *p = teredo_list_lookup (l2, &addr, NULL);
+		if (i == 1)
+		{
+			if (p != NULL)
+				goto out;
+			continue;
+		}
+		if (p == NULL)
+			goto out;
+
+		bool ok = p->trusted && (p->mapped_port == htons (1000 + i))
+		       && (p->mapped_addr == htonl (0xc0000201))
+		       && IsValid (p, now)
+		       && (teredo_peer_age (p->last_tx, now) >= 5);
+		teredo_list_release (l2);
+		if (!ok)
+			goto out;
+	}
+
+	/* Invalid file */
+	if ((pwrite (fd, "junk", 4, 0) != 4)
+	 || (teredo_list_restore (l2, fd) != -1))
+		goto out;
+	ret = 0;
+out:
+	fclose (file);
+	return ret;
+}
+
+
 int main (void)
 {
 	struct in6_addr addr = { { } };
 
 	putenv ((char *)"MALLOC_CHECK_=2");
+	teredo_clock_init ();
 
 	puts ("Basic empty list test...");
-	teredo_peerlist *l = teredo_list_create (0, 3);
+	teredo_peerlist *l = teredo_list_create (0, 0, 3);
 	if (l == NULL)
 		return -1;
 	else
@@ -176,7 +547,7 @@ int main (void)
 	}
 
 	puts ("Advanced empty list test...");
-	l = teredo_list_create (0, 3);
+	l = teredo_list_create (0, 0, 3);
 	if (l == NULL)
 		return -1;
 	else
@@ -202,7 +573,7 @@ int main (void)
 	}
 
 	puts ("List creation test...");
-	l = teredo_list_create (255, 2);
+	l = teredo_list_create (255, 0, 2);
 	if (l == NULL)
 		return -1;
 
@@ -211,6 +582,58 @@ int main (void)
 
 	puts ("Final list release...");
 	teredo_list_destroy (l);
+
+	puts ("Probation list creation test...");
+	l = teredo_list_create (2, 3, 60);
+	if (l == NULL)
+		return -1;
+
+	if (test_probation (l))
+		return 1;
+
+	teredo_peerlist *l2 = teredo_list_create (2, 0, 60);
+	if (l2 == NULL)
+		return -1;
+	if (test_flow_cache (l, l2))
+		return 1;
+	teredo_list_destroy (l2);
+
+	if (test_filter (l))
+		return 1;
+
+	teredo_list_reset (l, 2);
+	if (test_batch (l))
+		return 1;
+
+	l2 = teredo_list_create (10, 0, 60);
+	if (l2 == NULL)
+		return -1;
+	teredo_list_reset (l, 2);
+	if (test_persist (l, l2))
+		return 1;
+	teredo_list_destroy (l2);
+
+	puts ("List limits test...");
+	l2 = teredo_list_create (2, 0, 60);
+	if ((l2 == NULL) || test_limits (l2))
+		return 1;
+	teredo_list_destroy (l2);
+
+	puts ("Large list reset test...");
+	l2 = teredo_list_create (2000, 0, 60);
+	if ((l2 == NULL) || test_reset (l2))
+		return 1;
+	teredo_list_destroy (l2);
+
+	puts ("Probation list reset test...");
+	teredo_list_reset (l, 2);
+	addr.s6_addr[12] = 10;
+	if (try_lookup (l, &addr))
+		return 1;
+	if (!try_insert (l, &addr))
+		return 1;
+
+	teredo_list_destroy (l);
 	puts ("Done.");
 
 	return 0;
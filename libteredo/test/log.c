@@ -0,0 +1,151 @@
+/*
+ * log.c - Libteredo logging tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <semaphore.h>
+#include <netinet/in.h>
+#include "tunnel.h"
+#include "log.h"
+#include "stats.h"
+
+#define FLOOD 100
+
+static char last[256];
+static int last_priority;
+static unsigned received, lost;
+static bool blocking;
+static sem_t entered, release;
+
+static void log_cb (void *opaque, int priority, const struct timespec *ts,
+                    const char *msg)
+{
+	assert (opaque == &received);
+	assert (ts->tv_sec > 0);
+
+	if (strstr (msg, "lost") != NULL)
+	{
+		assert (priority == LOG_WARNING);
+		lost += strtoul (msg, NULL, 10);
+		return;
+	}
+
+	if (blocking)
+	{
+		blocking = false;
+		sem_post (&entered);
+		sem_wait (&release);
+	}
+
+	snprintf (last, sizeof (last), "%s", msg);
+	last_priority = priority;
+	received++;
+}
+
+int main (void)
+{
+	char buf[256];
+
+	sem_init (&entered, 0, 0);
+	sem_init (&release, 0, 0);
+	teredo_set_log_callback (log_cb, &received);
+
+	/* Synchronous logging */
+	teredo_log (TEREDO_LOG_NO_REPLY);
+	assert (received == 1);
+	assert (last_priority == LOG_INFO);
+	assert (!strcmp (last, "No reply from Teredo server"));
+
+	teredo_log (TEREDO_LOG_RESOLVE_FAILED, "teredo.example.com", "failure");
+	assert (received == 2);
+	assert (last_priority == LOG_ERR);
+	assert (!strcmp (last, "Cannot resolve Teredo server address "
+	                       "\"teredo.example.com\": failure"));
+
+	/* Long strings are truncated */
+	memset (buf, 'x', sizeof (buf) - 1);
+	buf[sizeof (buf) - 1] = '\0';
+	teredo_log (TEREDO_LOG_RESOLVE_FAILED, buf, "failure");
+	assert (received == 3);
+	assert (strlen (last) < sizeof (buf));
+
+	errno = EINVAL;
+	teredo_log_now (LOG_ALERT, "Error (%s): %m, 100%%", "test");
+	assert (errno == EINVAL);
+	assert (received == 4);
+	assert (last_priority == LOG_ALERT);
+	snprintf (buf, sizeof (buf), "Error (test): %s, 100%%",
+	          strerror (EINVAL));
+	assert (!strcmp (last, buf));
+
+	/* Asynchronous logging, flushed in order when stopping */
+	received = 0;
+	teredo_log_start ();
+	teredo_log_start ();
+	for (unsigned i = 0; i < 10; i++)
+	{
+		snprintf (buf, sizeof (buf), "%u", i);
+		teredo_log (TEREDO_LOG_RESOLVE_FAILED, "server", buf);
+	}
+	teredo_log_stop ();
+	teredo_log (TEREDO_LOG_LOST);
+	teredo_log_stop ();
+	assert (received == 11);
+	assert (last_priority == LOG_NOTICE);
+	assert (!strcmp (last, "Lost Teredo connectivity"));
+
+	/* Messages are dropped rather than waiting for a slow callback */
+	uint64_t values[TEREDO_COUNTER_MAX];
+
+	received = 0;
+	blocking = true;
+	teredo_log_start ();
+	teredo_log (TEREDO_LOG_NEW_ADDRESS);
+	sem_wait (&entered);
+
+	for (unsigned i = 0; i < FLOOD; i++)
+		teredo_log (TEREDO_LOG_TIME_DRIFT);
+
+	teredo_counters_read (values);
+	assert (values[TEREDO_LOG_DROPPED] > 0);
+	assert (values[TEREDO_LOG_DROPPED] < FLOOD);
+
+	sem_post (&release);
+	teredo_log_stop ();
+	assert (lost == values[TEREDO_LOG_DROPPED]);
+	assert (received + lost == 1 + FLOOD);
+	assert (last_priority == LOG_WARNING);
+
+	teredo_set_log_callback (NULL, NULL);
+	sem_destroy (&release);
+	sem_destroy (&entered);
+	return 0;
+}
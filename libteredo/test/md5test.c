@@ -45,7 +45,12 @@
   2002-04-13 lpd Splits off main program into a separate file, md5main.c.
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include "md5.h"
+#include "md5mb.h"
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
@@ -97,9 +102,64 @@ do_test(void)
     return status;
 }
 
+/* Check the multi-buffer block function against the reference one. */
+static int
+do_test_mb(void)
+{
+    static const char *const test[] = {
+	"", "a", "abc", "message digest", "abcdefghijklmnopqrstuvwxyz",
+	"Hello world", "1234567890123456789012345678901234567890",
+	"The quick brown fox jumps over the lazy dog"
+    };
+    const unsigned ntests = sizeof(test) / sizeof(test[0]);
+    md5_byte_t blocks[MD5MB_LANES][64];
+    const md5_byte_t *data[MD5MB_LANES];
+    md5_state_t state;
+    md5mb_state_t mb;
+    unsigned i, l;
+    int status = 0;
+
+    for (i = 0; i < ntests; i += MD5MB_LANES) {
+	md5_init(&state);
+	md5mb_load(&mb, &state);
+
+	for (l = 0; l < MD5MB_LANES; l++) {
+	    /* single block messages, padded by hand */
+	    const char *str = test[(i + l) % ntests];
+	    size_t len = strlen(str);
+
+	    memset(blocks[l], 0, 64);
+	    memcpy(blocks[l], str, len);
+	    blocks[l][len] = 0x80;
+	    blocks[l][56] = (len * 8) & 0xff;
+	    blocks[l][57] = (len * 8) >> 8;
+	    data[l] = blocks[l];
+	}
+	md5mb_process(&mb, data);
+
+	for (l = 0; l < MD5MB_LANES; l++) {
+	    const char *str = test[(i + l) % ntests];
+	    md5_byte_t ref[16], digest[16];
+
+	    md5_init(&state);
+	    md5_append(&state, (const md5_byte_t *)str, strlen(str));
+	    md5_finish(&state, ref);
+	    md5mb_digest(&mb, l, digest);
+	    if (memcmp(ref, digest, 16)) {
+		printf("**** ERROR, lane %u mismatch for \"%s\"\n", l, str);
+		status = 1;
+	    }
+	}
+    }
+    if (status == 0)
+	printf("md5 %u-lanes self-test completed successfully.\n",
+	       MD5MB_LANES);
+    return status;
+}
+
 /* Main program */
 int
 main(void)
 {
-    return do_test();
+    return do_test() | do_test_mb();
 }
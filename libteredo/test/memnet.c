@@ -0,0 +1,345 @@
+/*
+ * memnet.c - In-memory UDP/IPv4 network for tests and benchmarks
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "teredo-udp.h"
+#include "transport.h"
+#include "memnet.h"
+
+#define MEMNET_MTU     2048
+#define MEMNET_MAX_FD  65536
+#define MEMNET_BUCKETS 1024
+
+typedef struct memnet_slot
+{
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint16_t src_port;
+	uint16_t len;
+	uint8_t  data[MEMNET_MTU];
+} memnet_slot;
+
+typedef struct memnet_socket
+{
+	struct memnet_socket *next; /* same hash bucket */
+	uint32_t ip;
+	uint16_t port;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  wait;
+	unsigned head, count;
+	memnet_slot slots[];
+} memnet_socket;
+
+struct memnet
+{
+	teredo_transport ops;
+	unsigned slots;
+	memnet_socket *by_fd[MEMNET_MAX_FD];
+	memnet_socket *by_addr[MEMNET_BUCKETS];
+
+	memnet_ipv6_cb ipv6_cb;
+	void *ipv6_opaque;
+
+	atomic_ulong offset; /* clock offset (seconds) */
+	atomic_ulong dropped;
+};
+
+
+static unsigned memnet_hash (uint32_t ip, uint16_t port)
+{
+	return ((ip * 0x9e3779b1u) ^ port) % MEMNET_BUCKETS;
+}
+
+
+static memnet_socket *memnet_find (const memnet *net, uint32_t ip,
+                                   uint16_t port)
+{
+	for (memnet_socket *s = net->by_addr[memnet_hash (ip, port)]; s != NULL;
+	     s = s->next)
+		if ((s->ip == ip) && (s->port == port))
+			return s;
+	return NULL;
+}
+
+
+static memnet_socket *memnet_fd (const memnet *net, int fd)
+{
+	return ((unsigned)fd < MEMNET_MAX_FD) ? net->by_fd[fd] : NULL;
+}
+
+
+/**
+ * Copies datagrams into the ring of the destination socket.
+ * @return how many were not dropped.
+ */
+static size_t memnet_deliver (memnet *net, const memnet_socket *src,
+                              const struct iovec *iov, size_t count,
+                              bool batch, uint32_t ip, uint16_t port)
+{
+	memnet_socket *dst = memnet_find (net, ip, port);
+	size_t n = batch ? count : 1, done = 0;
+
+	if (dst == NULL)
+		goto out;
+
+	pthread_mutex_lock (&dst->lock);
+	for (size_t i = 0; i < n; i++)
+	{
+		if (dst->count >= net->slots)
+			break;
+
+		memnet_slot *slot = dst->slots
+		                    + ((dst->head + dst->count) % net->slots);
+		const struct iovec *v = iov + (batch ? i : 0);
+		size_t len = 0;
+
+		for (size_t j = 0; j < (batch ? 1 : count); j++)
+		{
+			if (len + v[j].iov_len > MEMNET_MTU)
+				goto full;
+			memcpy (slot->data + len, v[j].iov_base, v[j].iov_len);
+			len += v[j].iov_len;
+		}
+
+		slot->src_ip = src->ip;
+		slot->src_port = src->port;
+		slot->dst_ip = ip;
+		slot->len = len;
+		dst->count++;
+		done++;
+	}
+full:
+	if (done > 0)
+		pthread_cond_signal (&dst->wait);
+	pthread_mutex_unlock (&dst->lock);
+out:
+	if (done < n)
+		atomic_fetch_add_explicit (&net->dropped, n - done,
+		                           memory_order_relaxed);
+	return done;
+}
+
+
+static int memnet_sendv (void *opaque, int fd, const struct iovec *iov,
+                         size_t count, uint32_t ip, uint16_t port)
+{
+	memnet *net = opaque;
+	const memnet_socket *src = memnet_fd (net, fd);
+
+	if (src == NULL)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; i < count; i++)
+		len += iov[i].iov_len;
+
+	/* Like UDP, a lost datagram is not an error */
+	memnet_deliver (net, src, iov, count, false, ip, port);
+	return len;
+}
+
+
+static int memnet_send_batch (void *opaque, int fd, const struct iovec *dg,
+                              size_t count, uint32_t ip, uint16_t port)
+{
+	memnet *net = opaque;
+	const memnet_socket *src = memnet_fd (net, fd);
+
+	if (src == NULL)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	memnet_deliver (net, src, dg, count, true, ip, port);
+	return count;
+}
+
+
+static void memnet_unlock (void *data)
+{
+	pthread_mutex_unlock (data);
+}
+
+
+static ssize_t memnet_recv (void *opaque, int fd, struct teredo_packet *p,
+                            bool wait)
+{
+	memnet *net = opaque;
+	memnet_socket *s = memnet_fd (net, fd);
+
+	if (s == NULL)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock (&s->lock);
+	pthread_cleanup_push (memnet_unlock, &s->lock);
+	while (wait && (s->count == 0))
+		pthread_cond_wait (&s->wait, &s->lock);
+	pthread_cleanup_pop (0);
+
+	ssize_t len = -1;
+
+	if (s->count > 0)
+	{
+		const memnet_slot *slot = s->slots + s->head;
+
+		memcpy (p->buf.fill, slot->data, slot->len);
+		p->source_ipv4 = slot->src_ip;
+		p->source_port = slot->src_port;
+		p->dest_ipv4 = slot->dst_ip;
+		p->rx_time = 0;
+		p->rx_dropped = 0;
+		len = slot->len;
+
+		s->head = (s->head + 1) % net->slots;
+		s->count--;
+	}
+	else
+		errno = EAGAIN;
+	pthread_mutex_unlock (&s->lock);
+	return len;
+}
+
+
+static int memnet_send_ipv6 (void *opaque, const void *packet, size_t len)
+{
+	memnet *net = opaque;
+
+	if (net->ipv6_cb != NULL)
+		net->ipv6_cb (net->ipv6_opaque, packet, len);
+	return len;
+}
+
+
+static unsigned long memnet_clock (void *opaque)
+{
+	memnet *net = opaque;
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + atomic_load_explicit (&net->offset,
+	                                         memory_order_relaxed);
+}
+
+
+memnet *memnet_create (unsigned slots)
+{
+	memnet *net = calloc (1, sizeof (*net));
+	if (net == NULL)
+		return NULL;
+
+	net->ops.sendv = memnet_sendv;
+	net->ops.send_batch = memnet_send_batch;
+	net->ops.recv = memnet_recv;
+	net->ops.send_ipv6 = memnet_send_ipv6;
+	net->ops.clock = memnet_clock;
+	net->ops.opaque = net;
+	net->slots = slots ? slots : 1;
+	atomic_init (&net->offset, 0);
+	atomic_init (&net->dropped, 0);
+
+	teredo_set_transport (&net->ops);
+	return net;
+}
+
+
+void memnet_destroy (memnet *net)
+{
+	teredo_set_transport (NULL);
+
+	for (unsigned i = 0; i < MEMNET_MAX_FD; i++)
+	{
+		memnet_socket *s = net->by_fd[i];
+
+		if (s == NULL)
+			continue;
+		pthread_cond_destroy (&s->wait);
+		pthread_mutex_destroy (&s->lock);
+		free (s);
+	}
+	free (net);
+}
+
+
+int memnet_attach (memnet *net, int fd, uint32_t ip, uint16_t port)
+{
+	if (((unsigned)fd >= MEMNET_MAX_FD) || (net->by_fd[fd] != NULL)
+	 || (memnet_find (net, ip, port) != NULL))
+		return -1;
+
+	memnet_socket *s = malloc (sizeof (*s)
+	                           + net->slots * sizeof (s->slots[0]));
+	if (s == NULL)
+		return -1;
+
+	s->ip = ip;
+	s->port = port;
+	pthread_mutex_init (&s->lock, NULL);
+	pthread_cond_init (&s->wait, NULL);
+	s->head = s->count = 0;
+
+	unsigned h = memnet_hash (ip, port);
+	s->next = net->by_addr[h];
+	net->by_addr[h] = s;
+	net->by_fd[fd] = s;
+	return 0;
+}
+
+
+void memnet_set_ipv6 (memnet *net, memnet_ipv6_cb cb, void *opaque)
+{
+	net->ipv6_cb = cb;
+	net->ipv6_opaque = opaque;
+}
+
+
+void memnet_advance (memnet *net, unsigned seconds)
+{
+	atomic_fetch_add_explicit (&net->offset, seconds, memory_order_relaxed);
+}
+
+
+unsigned long memnet_dropped (const memnet *net)
+{
+	return atomic_load_explicit (&net->dropped, memory_order_relaxed);
+}
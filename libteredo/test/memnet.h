@@ -0,0 +1,78 @@
+/*
+ * memnet.h - In-memory UDP/IPv4 network for tests and benchmarks
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_TEST_MEMNET_H
+# define LIBTEREDO_TEST_MEMNET_H
+
+/*
+ * Teredo sockets (of tunnels and servers alike) are attached to virtual
+ * IPv4 addresses and ports. Datagrams sent from an attached socket are
+ * copied into a fixed-size ring of the destination socket, or dropped if it
+ * is full or if no socket has that address. Native IPv6 packets from a
+ * Teredo server are passed to a callback.
+ */
+
+typedef struct memnet memnet;
+
+/**
+ * Creates an in-memory network, and installs it as the transport of the
+ * process (see teredo_set_transport()).
+ *
+ * @param slots number of datagrams each socket can hold
+ * @return NULL on error.
+ */
+memnet *memnet_create (unsigned slots);
+
+/**
+ * Restores the socket transport and destroys an in-memory network. All
+ * tunnels and servers using it must have been destroyed first.
+ */
+void memnet_destroy (memnet *net);
+
+/**
+ * Attaches a Teredo socket to a virtual address. This must be done before
+ * traffic starts.
+ *
+ * @param ip IPv4 address (network byte order)
+ * @param port UDP port (network byte order)
+ * @return 0 on success, -1 on error.
+ */
+int memnet_attach (memnet *net, int fd, uint32_t ip, uint16_t port);
+
+typedef void (*memnet_ipv6_cb) (void *opaque, const void *packet, size_t len);
+
+/**
+ * Sets the callback for native IPv6 packets sent by Teredo servers.
+ */
+void memnet_set_ipv6 (memnet *net, memnet_ipv6_cb cb, void *opaque);
+
+/**
+ * Moves the coarse clock (see teredo_clock()) forward, e.g. to expire
+ * peers without waiting.
+ */
+void memnet_advance (memnet *net, unsigned seconds);
+
+/**
+ * @return the number of datagrams lost so far (full ring or no socket).
+ */
+unsigned long memnet_dropped (const memnet *net);
+
+#endif /* ifndef LIBTEREDO_TEST_MEMNET_H */
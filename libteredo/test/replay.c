@@ -0,0 +1,1091 @@
+/*
+ * replay.c - Offline packet capture replay benchmark
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+/*
+ * Feeds the UDP/IPv4 datagrams of a pcap or pcapng capture through the relay
+ * or server packet processing, without any socket nor tunnel interface, and
+ * reports the throughput, the per-packet cost and the memory allocations of
+ * each code path. A code path is identified by the set of decision counters
+ * (see stats.h) that the packet moved. Without a capture file, a built-in
+ * synthetic trace is used, and basic sanity is checked.
+ *
+ * Relay mode: datagrams to the relay port are handled as received from the
+ * Internet, non-bubble datagrams from the relay port are unwrapped and
+ * handled as received from the tunnel interface.
+ * Server mode: datagrams to the Teredo port are handled as received on the
+ * primary or secondary server address.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/icmp6.h>
+#include <arpa/inet.h>
+
+#include "teredo.h"
+#include "teredo-udp.h"
+#include "tunnel.h"
+#include "server.h"
+#include "transport.h"
+#include "packets.h"
+#include "stats.h"
+
+/*** Allocation counting ***/
+static atomic_ulong allocs;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+extern void *__libc_memalign (size_t, size_t);
+extern void __libc_free (void *);
+
+void *malloc (size_t size)
+{
+	atomic_fetch_add_explicit (&allocs, 1, memory_order_relaxed);
+	return __libc_malloc (size);
+}
+
+void *calloc (size_t n, size_t size)
+{
+	atomic_fetch_add_explicit (&allocs, 1, memory_order_relaxed);
+	return __libc_calloc (n, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit (&allocs, 1, memory_order_relaxed);
+	return __libc_realloc (ptr, size);
+}
+
+int posix_memalign (void **pp, size_t align, size_t size)
+{
+	atomic_fetch_add_explicit (&allocs, 1, memory_order_relaxed);
+
+	void *ptr = __libc_memalign (align, size);
+	if (ptr == NULL)
+		return ENOMEM;
+	*pp = ptr;
+	return 0;
+}
+
+void free (void *ptr)
+{
+	__libc_free (ptr);
+}
+#endif
+
+
+/*** Captured datagrams ***/
+typedef struct replay_packet
+{
+	uint64_t time; /* nanoseconds */
+	size_t   offset; /* UDP payload offset in the capture buffer */
+	uint32_t src, dst;
+	uint16_t sport, dport;
+	uint16_t len;
+} replay_packet;
+
+typedef struct capture
+{
+	uint8_t       *buf;
+	size_t         size, alloc;
+	replay_packet *pkts;
+	size_t         count, max;
+} capture;
+
+static int capture_add (capture *c, const replay_packet *pk)
+{
+	if (c->count >= c->max)
+	{
+		size_t max = c->max ? (2 * c->max) : 1024;
+		replay_packet *pkts = realloc (c->pkts, max * sizeof (*pkts));
+		if (pkts == NULL)
+			return -1;
+		c->pkts = pkts;
+		c->max = max;
+	}
+	c->pkts[c->count++] = *pk;
+	return 0;
+}
+
+/* Extracts an unfragmented UDP/IPv4 datagram */
+static void capture_ipv4 (capture *c, uint64_t time,
+                          const uint8_t *f, size_t len)
+{
+	if ((len < 20) || ((f[0] >> 4) != 4))
+		return;
+
+	size_t ihl = (f[0] & 0xf) * 4;
+	if ((ihl < 20) || (len < ihl + 8) || (f[9] != IPPROTO_UDP)
+	 || (f[6] & 0x3f) || f[7]) /* fragment */
+		return;
+
+	const uint8_t *udp = f + ihl;
+	size_t ulen = (udp[4] << 8) | udp[5];
+	if ((ulen < 8) || (ulen > len - ihl) /* truncated */
+	 || (ulen - 8 > TEREDO_PACKET_SIZE))
+		return;
+
+	replay_packet pk;
+	pk.time = time;
+	pk.offset = (udp + 8) - c->buf;
+	memcpy (&pk.src, f + 12, 4);
+	memcpy (&pk.dst, f + 16, 4);
+	memcpy (&pk.sport, udp, 2);
+	memcpy (&pk.dport, udp + 2, 2);
+	pk.len = ulen - 8;
+	capture_add (c, &pk);
+}
+
+/* Strips the link-layer header */
+static void capture_frame (capture *c, uint64_t time, unsigned link,
+                           const uint8_t *f, size_t len)
+{
+	unsigned type;
+
+	switch (link)
+	{
+		case 0: /* BSD loopback */
+		case 108: /* OpenBSD loopback */
+		{
+			uint32_t family;
+
+			if (len < 4)
+				return;
+			memcpy (&family, f, 4);
+			if ((family != 2) && (family != 0x02000000))
+				return;
+			f += 4;
+			len -= 4;
+			break;
+		}
+
+		case 1: /* Ethernet */
+			if (len < 14)
+				return;
+			type = (f[12] << 8) | f[13];
+			f += 14;
+			len -= 14;
+			while (((type == 0x8100) || (type == 0x88a8)) && (len >= 4))
+			{
+				type = (f[2] << 8) | f[3];
+				f += 4;
+				len -= 4;
+			}
+			if (type != 0x0800)
+				return;
+			break;
+
+		case 12: /* raw IP */
+		case 14:
+		case 101:
+		case 228: /* raw IPv4 */
+			break;
+
+		case 113: /* Linux cooked */
+			if (len < 16)
+				return;
+			type = (f[14] << 8) | f[15];
+			f += 16;
+			len -= 16;
+			if (type != 0x0800)
+				return;
+			break;
+
+		case 276: /* Linux cooked v2 */
+			if (len < 20)
+				return;
+			type = (f[0] << 8) | f[1];
+			f += 20;
+			len -= 20;
+			if (type != 0x0800)
+				return;
+			break;
+
+		default:
+			return;
+	}
+
+	capture_ipv4 (c, time, f, len);
+}
+
+static uint32_t rd32 (const uint8_t *p, bool swap)
+{
+	uint32_t v;
+
+	memcpy (&v, p, 4);
+	if (swap)
+		v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000)
+		  | (v << 24);
+	return v;
+}
+
+static uint16_t rd16 (const uint8_t *p, bool swap)
+{
+	uint16_t v;
+
+	memcpy (&v, p, 2);
+	return swap ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static int load_pcap (capture *c)
+{
+	const uint8_t *p = c->buf;
+	bool swap;
+	uint64_t frac; /* nanoseconds per fraction unit */
+
+	if (c->size < 24)
+		return -1;
+
+	switch (rd32 (p, false))
+	{
+		case 0xa1b2c3d4:
+			swap = false;
+			frac = 1000;
+			break;
+		case 0xd4c3b2a1:
+			swap = true;
+			frac = 1000;
+			break;
+		case 0xa1b23c4d:
+			swap = false;
+			frac = 1;
+			break;
+		case 0x4d3cb2a1:
+			swap = true;
+			frac = 1;
+			break;
+		default:
+			return -1;
+	}
+
+	unsigned link = rd32 (p + 20, swap) & 0xffff;
+
+	for (size_t off = 24; off + 16 <= c->size;)
+	{
+		uint64_t time = rd32 (p + off, swap) * UINT64_C(1000000000)
+		              + rd32 (p + off + 4, swap) * frac;
+		uint32_t caplen = rd32 (p + off + 8, swap);
+
+		off += 16;
+		if (caplen > c->size - off)
+			break;
+		capture_frame (c, time, link, p + off, caplen);
+		off += caplen;
+	}
+	return 0;
+}
+
+#define PCAPNG_MAX_IF 64
+
+static int load_pcapng (capture *c)
+{
+	const uint8_t *p = c->buf;
+	struct
+	{
+		unsigned link;
+		uint64_t mul, div; /* nanoseconds = timestamp * mul / div */
+	} ifs[PCAPNG_MAX_IF];
+	unsigned nifs = 0;
+	uint64_t time = 0;
+	bool swap = false;
+
+	if ((c->size < 28) || (rd32 (p, false) != 0x0A0D0D0A))
+		return -1;
+
+	for (size_t off = 0; off + 12 <= c->size;)
+	{
+		const uint8_t *b = p + off;
+		uint32_t type = rd32 (b, swap);
+
+		if (type == 0x0A0D0D0A) /* section header */
+		{
+			switch (rd32 (b + 8, false))
+			{
+				case 0x1A2B3C4D:
+					swap = false;
+					break;
+				case 0x4D3C2B1A:
+					swap = true;
+					break;
+				default:
+					return -1;
+			}
+			nifs = 0;
+		}
+
+		uint32_t len = rd32 (b + 4, swap);
+		if ((len < 12) || (len > c->size - off) || (len & 3))
+			break;
+
+		switch (type)
+		{
+			case 1: /* interface description */
+			{
+				if ((len < 20) || (nifs >= PCAPNG_MAX_IF))
+					break;
+
+				ifs[nifs].link = rd16 (b + 8, swap);
+				ifs[nifs].mul = 1000;
+				ifs[nifs].div = 1;
+
+				for (size_t o = 16; o + 4 <= len - 4;)
+				{
+					unsigned code = rd16 (b + o, swap);
+					unsigned olen = rd16 (b + o + 2, swap);
+
+					if ((code == 0) || (o + 4 + olen > len - 4))
+						break;
+					if ((code == 9) && (olen >= 1)) /* if_tsresol */
+					{
+						unsigned v = b[o + 4];
+
+						if (v & 0x80)
+						{
+							ifs[nifs].mul = 1000000000;
+							ifs[nifs].div = UINT64_C(1) << ((v & 0x7f) % 64);
+						}
+						else
+						{
+							ifs[nifs].mul = 1;
+							ifs[nifs].div = 1;
+							for (; v < 9; v++)
+								ifs[nifs].mul *= 10;
+							for (; (v > 9) && (v <= 18); v--)
+								ifs[nifs].div *= 10;
+						}
+					}
+					o += 4 + ((olen + 3) & ~3);
+				}
+				nifs++;
+				break;
+			}
+
+			case 6: /* enhanced packet */
+			{
+				if (len < 32)
+					break;
+
+				uint32_t ifid = rd32 (b + 8, swap);
+				uint32_t caplen = rd32 (b + 20, swap);
+				if ((ifid >= nifs) || (caplen > len - 32))
+					break;
+
+				uint64_t ts = ((uint64_t)rd32 (b + 12, swap) << 32)
+				            | rd32 (b + 16, swap);
+				time = (ts / ifs[ifid].div) * ifs[ifid].mul
+				     + ((ts % ifs[ifid].div) * ifs[ifid].mul) / ifs[ifid].div;
+				capture_frame (c, time, ifs[ifid].link, b + 28, caplen);
+				break;
+			}
+
+			case 3: /* simple packet: no timestamp */
+			{
+				if ((len < 16) || (nifs == 0))
+					break;
+
+				uint32_t caplen = rd32 (b + 8, swap);
+				if (caplen > len - 16)
+					caplen = len - 16;
+				capture_frame (c, time, ifs[0].link, b + 12, caplen);
+				break;
+			}
+		}
+		off += len;
+	}
+	return 0;
+}
+
+static int load_file (capture *c, const char *path)
+{
+	int fd = open (path, O_RDONLY);
+	if (fd == -1)
+	{
+		perror (path);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat (fd, &st) || (st.st_size <= 0)
+	 || ((c->buf = malloc (st.st_size)) == NULL))
+	{
+		fprintf (stderr, "%s: cannot load\n", path);
+		close (fd);
+		return -1;
+	}
+
+	for (c->size = 0; c->size < (size_t)st.st_size;)
+	{
+		ssize_t val = read (fd, c->buf + c->size, st.st_size - c->size);
+		if (val <= 0)
+			break;
+		c->size += val;
+	}
+	close (fd);
+
+	if ((load_pcap (c) == 0) || (load_pcapng (c) == 0))
+		return 0;
+
+	fprintf (stderr, "%s: unknown capture file format\n", path);
+	return -1;
+}
+
+
+/*** Synthetic trace ***/
+#define SYNTH_CLIENTS 64
+#define SYNTH_REPEAT  8
+#define SYNTH_RELAY_PORT 3545
+
+static const uint32_t synth_server = 0xC0000201; /* 192.0.2.1 */
+static const uint32_t synth_relay = 0xC0000264; /* 192.0.2.100 */
+static const uint32_t synth_client = 0xC6336400; /* 198.51.100.0/24 */
+
+static void synth_add (capture *c, uint32_t src, uint16_t sport,
+                       uint32_t dst, uint16_t dport,
+                       const void *hdr, size_t hlen,
+                       const struct ip6_hdr *ip6, size_t plen)
+{
+	size_t len = hlen + sizeof (*ip6) + plen;
+
+	if (c->size + len > c->alloc)
+	{
+		size_t alloc = 2 * (c->alloc + len);
+		uint8_t *buf = realloc (c->buf, alloc);
+		assert (buf != NULL);
+		c->buf = buf;
+		c->alloc = alloc;
+	}
+
+	replay_packet pk;
+	pk.time = c->count * 10000;
+	pk.offset = c->size;
+	pk.src = htonl (src);
+	pk.dst = htonl (dst);
+	pk.sport = htons (sport);
+	pk.dport = htons (dport);
+	pk.len = len;
+
+	uint8_t *d = c->buf + c->size;
+	memcpy (d, hdr, hlen);
+	memcpy (d + hlen, ip6, sizeof (*ip6));
+	memset (d + hlen + sizeof (*ip6), 0, plen);
+	c->size += len;
+	assert (capture_add (c, &pk) == 0);
+}
+
+static void synth_teredo (struct in6_addr *a, uint32_t ip, uint16_t port)
+{
+	uint32_t server = htonl (synth_server);
+	uint16_t obf_port = ~htons (port);
+	uint32_t obf_ip = ~htonl (ip);
+
+	memset (a, 0, sizeof (*a));
+	a->s6_addr[0] = 0x20;
+	a->s6_addr[1] = 0x01;
+	memcpy (a->s6_addr + 4, &server, 4);
+	a->s6_addr[8] = 0x80; /* cone */
+	memcpy (a->s6_addr + 10, &obf_port, 2);
+	memcpy (a->s6_addr + 12, &obf_ip, 4);
+}
+
+static void synth_ip6 (struct ip6_hdr *ip6, const struct in6_addr *src,
+                       const struct in6_addr *dst, uint8_t nxt, uint16_t plen)
+{
+	memset (ip6, 0, sizeof (*ip6));
+	ip6->ip6_flow = htonl (0x60000000);
+	ip6->ip6_plen = htons (plen);
+	ip6->ip6_nxt = nxt;
+	ip6->ip6_hlim = 64;
+	ip6->ip6_src = *src;
+	ip6->ip6_dst = *dst;
+}
+
+static void synth_relay_trace (capture *c)
+{
+	struct in6_addr native, other, client;
+	struct ip6_hdr ip6;
+
+	inet_pton (AF_INET6, "2001:db8::1", &native);
+	inet_pton (AF_INET6, "2001:db8::2", &other);
+
+	for (unsigned i = 0; i < SYNTH_CLIENTS; i++)
+	{
+		uint32_t ip = synth_client + i;
+		uint16_t port = 40000 + i;
+
+		synth_teredo (&client, ip, port);
+
+		/* Native host to client, queued until the client answers */
+		synth_ip6 (&ip6, &native, &client, IPPROTO_UDP, 32);
+		synth_add (c, synth_relay, SYNTH_RELAY_PORT, ip, port,
+		           NULL, 0, &ip6, 32);
+		/* Client bubble */
+		synth_ip6 (&ip6, &client, &native, IPPROTO_NONE, 0);
+		synth_add (c, ip, port, synth_relay, SYNTH_RELAY_PORT,
+		           NULL, 0, &ip6, 0);
+
+		for (unsigned j = 0; j < SYNTH_REPEAT; j++)
+		{
+			synth_ip6 (&ip6, &client, &native, IPPROTO_UDP, 64);
+			synth_add (c, ip, port, synth_relay, SYNTH_RELAY_PORT,
+			           NULL, 0, &ip6, 64);
+			synth_ip6 (&ip6, &native, &client, IPPROTO_UDP, 512);
+			synth_add (c, synth_relay, SYNTH_RELAY_PORT, ip, port,
+			           NULL, 0, &ip6, 512);
+		}
+
+		/* Junk: non-Teredo source, unknown client, truncated */
+		synth_ip6 (&ip6, &other, &native, IPPROTO_UDP, 16);
+		synth_add (c, ip, port, synth_relay, SYNTH_RELAY_PORT,
+		           NULL, 0, &ip6, 16);
+		synth_teredo (&client, ip + 128, port);
+		synth_ip6 (&ip6, &client, &native, IPPROTO_UDP, 16);
+		synth_add (c, ip + 128, port, synth_relay, SYNTH_RELAY_PORT,
+		           NULL, 0, &ip6, 16);
+		synth_add (c, ip, port, synth_relay, SYNTH_RELAY_PORT,
+		           "\x00\x01", 2, &ip6, 0);
+	}
+}
+
+static void synth_server_trace (capture *c)
+{
+	struct in6_addr lladdr, allrouters, native, client, peer;
+	struct ip6_hdr ip6;
+	uint8_t auth[13];
+
+	inet_pton (AF_INET6, "fe80::8000:ffff:ffff:fffe", &lladdr);
+	inet_pton (AF_INET6, "ff02::2", &allrouters);
+	inet_pton (AF_INET6, "2001:db8::1", &native);
+
+	memset (auth, 0, sizeof (auth));
+	auth[1] = 1; /* authentication header, empty identifier and value */
+
+	for (unsigned i = 0; i < SYNTH_CLIENTS; i++)
+	{
+		uint32_t ip = synth_client + i;
+		uint16_t port = 40000 + i;
+
+		synth_teredo (&client, ip, port);
+		synth_teredo (&peer, synth_client + ((i + 1) % SYNTH_CLIENTS),
+		              40000 + ((i + 1) % SYNTH_CLIENTS));
+
+		/* Qualification on both server addresses */
+		synth_ip6 (&ip6, &lladdr, &allrouters, IPPROTO_ICMPV6,
+		           sizeof (struct nd_router_solicit));
+		memcpy (auth + 4, &ip, sizeof (ip));
+		synth_add (c, ip, port, synth_server, IPPORT_TEREDO,
+		           auth, sizeof (auth), &ip6,
+		           sizeof (struct nd_router_solicit));
+		c->buf[c->size - sizeof (struct nd_router_solicit)]
+			= ND_ROUTER_SOLICIT;
+		synth_add (c, ip, port, synth_server + 1, IPPORT_TEREDO,
+		           auth, sizeof (auth), &ip6,
+		           sizeof (struct nd_router_solicit));
+		c->buf[c->size - sizeof (struct nd_router_solicit)]
+			= ND_ROUTER_SOLICIT;
+
+		for (unsigned j = 0; j < SYNTH_REPEAT; j++)
+		{
+			/* Indirect bubbles to another client and to a native host */
+			synth_ip6 (&ip6, &client, &peer, IPPROTO_NONE, 0);
+			synth_add (c, ip, port, synth_server, IPPORT_TEREDO,
+			           NULL, 0, &ip6, 0);
+			synth_ip6 (&ip6, &client, &native, IPPROTO_NONE, 0);
+			synth_add (c, ip, port, synth_server, IPPORT_TEREDO,
+			           NULL, 0, &ip6, 0);
+		}
+
+		/* Junk: forbidden protocol, spoofed source */
+		synth_ip6 (&ip6, &client, &native, IPPROTO_UDP, 16);
+		synth_add (c, ip, port, synth_server, IPPORT_TEREDO,
+		           NULL, 0, &ip6, 16);
+		synth_ip6 (&ip6, &client, &native, IPPROTO_NONE, 0);
+		synth_add (c, ip, port + 1, synth_server, IPPORT_TEREDO,
+		           NULL, 0, &ip6, 0);
+	}
+}
+
+
+/*** Fake socket and tunnel interface ***/
+static atomic_ulong sent_udp, sent_ipv6, delivered, icmp_errors;
+
+static int fake_sendv (void *opaque, int fd, const struct iovec *iov,
+                       size_t count, uint32_t ip, uint16_t port)
+{
+	size_t len = 0;
+
+	(void)opaque; (void)fd; (void)ip; (void)port;
+	for (size_t i = 0; i < count; i++)
+		len += iov[i].iov_len;
+	atomic_fetch_add_explicit (&sent_udp, 1, memory_order_relaxed);
+	return len;
+}
+
+static int fake_send_ipv6 (void *opaque, const void *packet, size_t len)
+{
+	(void)opaque; (void)packet;
+	atomic_fetch_add_explicit (&sent_ipv6, 1, memory_order_relaxed);
+	return len;
+}
+
+static const teredo_transport fake_transport =
+{
+	.sendv = fake_sendv,
+	.send_ipv6 = fake_send_ipv6,
+	.opaque = NULL,
+};
+
+static void fake_recv (void *opaque, const void *data, size_t len)
+{
+	(void)opaque; (void)data; (void)len;
+	atomic_fetch_add_explicit (&delivered, 1, memory_order_relaxed);
+}
+
+static void fake_icmpv6 (void *opaque, const void *data, size_t len,
+                         const struct in6_addr *dst)
+{
+	(void)opaque; (void)data; (void)len; (void)dst;
+	atomic_fetch_add_explicit (&icmp_errors, 1, memory_order_relaxed);
+}
+
+
+/*** Code paths ***/
+#define MAX_PATHS 128
+
+typedef struct replay_path
+{
+	char name[160];
+	uint64_t count, ns, min, max, allocs;
+} replay_path;
+
+static replay_path paths[MAX_PATHS];
+static unsigned npaths;
+
+/* Totals and gauges do not tell which way a packet went */
+static bool is_decision (unsigned i)
+{
+	switch (i)
+	{
+		case TEREDO_RX_PACKETS:
+		case TEREDO_RX_BYTES:
+		case TEREDO_RX_KERNEL_DROPS:
+		case TEREDO_TX_PACKETS:
+		case TEREDO_TX_BYTES:
+		case TEREDO_SRV_PACKETS:
+		case TEREDO_SRV_RX_BYTES:
+		case TEREDO_SRV_TX_BYTES:
+		case TEREDO_SRV_KERNEL_DROPS:
+		case TEREDO_LOG_DROPPED:
+			return false;
+	}
+	return i < TEREDO_GAUGE_FIRST;
+}
+
+static void counters_snapshot (uint64_t *values)
+{
+	teredo_counters *t = teredo_counters_self ();
+
+	for (unsigned i = 0; i < TEREDO_GAUGE_FIRST; i++)
+		values[i] = atomic_load_explicit (&t->value[i],
+		                                  memory_order_relaxed);
+}
+
+static replay_path *path_find (const uint64_t *before, const char *name)
+{
+	char buf[sizeof (paths[0].name)];
+	size_t len = 0;
+
+	if (name == NULL)
+	{
+		uint64_t after[TEREDO_GAUGE_FIRST];
+
+		counters_snapshot (after);
+		buf[0] = '\0';
+		for (unsigned i = 0; i < TEREDO_GAUGE_FIRST; i++)
+			if (is_decision (i) && (after[i] != before[i])
+			 && (len < sizeof (buf)))
+				len += snprintf (buf + len, sizeof (buf) - len, "%s%s",
+				                 len ? "+" : "", teredo_counter_name (i));
+		name = len ? buf : "none";
+	}
+
+	for (unsigned i = 0; i < npaths; i++)
+		if (!strcmp (paths[i].name, name))
+			return paths + i;
+
+	replay_path *p = paths + ((npaths < MAX_PATHS) ? npaths++ : npaths - 1);
+	snprintf (p->name, sizeof (p->name), "%s", name);
+	p->min = UINT64_MAX;
+	return p;
+}
+
+static uint64_t now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void pace (const capture *c, const replay_packet *pk, uint64_t start)
+{
+	uint64_t t = start + (pk->time - c->pkts[0].time);
+	struct timespec ts = { t / 1000000000, t % 1000000000 };
+
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+	                        NULL) == EINTR);
+}
+
+
+/*** Replay ***/
+typedef struct replay_stats
+{
+	uint64_t packets, ignored, parse_errors, ns, allocs;
+} replay_stats;
+
+static int fill_packet (teredo_packet *p, const capture *c,
+                        const replay_packet *pk)
+{
+	memcpy (p->buf.fill, c->buf + pk->offset, pk->len);
+	p->source_ipv4 = pk->src;
+	p->source_port = pk->sport;
+	p->dest_ipv4 = pk->dst;
+	p->rx_time = 0;
+	p->rx_dropped = 0;
+	return teredo_parse (p, pk->len);
+}
+
+static void replay (const capture *c, teredo_tunnel *tunnel,
+                    const teredo_server *server, uint16_t port,
+                    uint32_t ip2, bool paced, replay_stats *st)
+{
+	static teredo_packet packet;
+	uint64_t start = now ();
+
+	for (size_t i = 0; i < c->count; i++)
+	{
+		const replay_packet *pk = c->pkts + i;
+		bool out = false;
+
+		if (pk->dport != port)
+		{
+			if ((tunnel == NULL) || (pk->sport != port))
+			{
+				st->ignored++;
+				continue;
+			}
+			out = true; /* relay to Internet */
+		}
+
+		if (paced)
+			pace (c, pk, start);
+
+		uint64_t before[TEREDO_GAUGE_FIRST];
+		counters_snapshot (before);
+
+		unsigned long a0 = atomic_load (&allocs);
+		uint64_t t0 = now ();
+		int val = fill_packet (&packet, c, pk);
+		bool skip = false;
+
+		if (val == 0)
+		{
+			if (server != NULL)
+				teredo_server_process (server, &packet, pk->dst == ip2);
+			else
+			if (!out)
+				teredo_receive (tunnel, &packet);
+			else
+			if (IsBubble (packet.ip6))
+				skip = true; /* generated by the relay itself */
+			else
+				teredo_transmit (tunnel, packet.ip6, packet.ip6_len);
+		}
+		uint64_t ns = now () - t0;
+		unsigned long na = atomic_load (&allocs) - a0;
+
+		if (skip)
+		{
+			st->ignored++;
+			continue;
+		}
+
+		replay_path *p = path_find (before,
+		                            val ? (out ? "tx_parse_error"
+		                                       : "rx_parse_error") : NULL);
+		p->count++;
+		p->ns += ns;
+		if (ns < p->min)
+			p->min = ns;
+		if (ns > p->max)
+			p->max = ns;
+		p->allocs += na;
+
+		st->packets++;
+		st->ns += ns;
+		st->allocs += na;
+		if (val)
+			st->parse_errors++;
+	}
+}
+
+static int path_cmp (const void *a, const void *b)
+{
+	const replay_path *pa = a, *pb = b;
+
+	return (pa->count < pb->count) - (pa->count > pb->count);
+}
+
+static void report (const replay_stats *st, uint64_t elapsed)
+{
+	printf ("packets:      %"PRIu64" (%"PRIu64" ignored, %"PRIu64
+	        " parse errors)\n", st->packets, st->ignored, st->parse_errors);
+	if (st->packets == 0)
+		return;
+
+	printf ("rate:         %.0f packets/s\n",
+	        st->packets * 1e9 / (elapsed ? elapsed : 1));
+	printf ("cost:         %.1f ns/packet\n",
+	        (double)st->ns / st->packets);
+	printf ("allocations:  %.3f per packet\n",
+	        (double)st->allocs / st->packets);
+	printf ("output:       %lu UDP, %lu IPv6, %lu delivered, %lu ICMPv6\n",
+	        atomic_load (&sent_udp), atomic_load (&sent_ipv6),
+	        atomic_load (&delivered), atomic_load (&icmp_errors));
+
+	qsort (paths, npaths, sizeof (paths[0]), path_cmp);
+	printf ("\n%10s %10s %10s %10s %8s  %s\n", "packets", "avg ns",
+	        "min ns", "max ns", "allocs", "path");
+	for (unsigned i = 0; i < npaths; i++)
+	{
+		const replay_path *p = paths + i;
+
+		printf ("%10"PRIu64" %10.1f %10"PRIu64" %10"PRIu64" %8.3f  %s\n",
+		        p->count, (double)p->ns / p->count, p->min, p->max,
+		        (double)p->allocs / p->count, p->name);
+	}
+}
+
+/* Most frequent value of a field among the datagrams */
+static uint32_t most_common (const capture *c, bool port)
+{
+	uint32_t best = 0;
+	size_t best_count = 0;
+
+	for (size_t i = 0; i < c->count; i += 1 + c->count / 256)
+	{
+		uint32_t v = port ? c->pkts[i].dport : c->pkts[i].dst;
+		size_t count = 0;
+
+		if (port ? (v == htons (IPPORT_TEREDO))
+		         : (c->pkts[i].dport != htons (IPPORT_TEREDO)))
+			continue;
+
+		for (size_t j = 0; j < c->count; j++)
+			if ((port ? c->pkts[j].dport : c->pkts[j].dst) == v)
+				count++;
+		if (count > best_count)
+		{
+			best = v;
+			best_count = count;
+		}
+	}
+	return best;
+}
+
+static int bench (const capture *cap, bool server_mode, bool cone,
+                  bool paced, unsigned passes, uint16_t port, uint32_t ip1,
+                  replay_stats *st)
+{
+	if (server_mode)
+		port = htons (IPPORT_TEREDO);
+	if (port == 0)
+		port = most_common (cap, true);
+	if (server_mode && (ip1 == 0))
+		ip1 = most_common (cap, false);
+	uint32_t ip2 = htonl (ntohl (ip1) + 1);
+
+	teredo_tunnel *tunnel = NULL;
+	teredo_server *server = NULL;
+
+	teredo_set_transport (&fake_transport);
+	if (server_mode)
+	{
+		int fd1 = teredo_socket (htonl (INADDR_LOOPBACK), 0);
+		int fd2 = teredo_socket (htonl (INADDR_LOOPBACK), 0);
+		if ((fd1 == -1) || (fd2 == -1)
+		 || ((server = teredo_server_create_fd (fd1, fd2, ip1, ip2))
+		       == NULL))
+		{
+			fputs ("Cannot create Teredo server\n", stderr);
+			return 1;
+		}
+	}
+	else
+	{
+		tunnel = teredo_create (htonl (INADDR_LOOPBACK), 0, NULL);
+		if ((tunnel == NULL) || teredo_set_relay_mode (tunnel)
+		 || teredo_set_cone_flag (tunnel, cone))
+		{
+			fputs ("Cannot create Teredo relay\n", stderr);
+			return 1;
+		}
+		teredo_set_recv_callback (tunnel, fake_recv);
+		teredo_set_icmpv6_callback (tunnel, fake_icmpv6);
+	}
+
+	memset (st, 0, sizeof (*st));
+	memset (paths, 0, sizeof (paths));
+	npaths = 0;
+	sent_udp = sent_ipv6 = delivered = icmp_errors = 0;
+
+	printf ("%s mode, %zu datagrams, port %u\n",
+	        server_mode ? "Server" : "Relay", cap->count,
+	        (unsigned)ntohs (port));
+
+	uint64_t start = now ();
+	for (unsigned i = 0; i < passes; i++)
+		replay (cap, tunnel, server, port, ip2, paced, st);
+	report (st, now () - start);
+	puts ("");
+
+	if (tunnel != NULL)
+		teredo_destroy (tunnel);
+	if (server != NULL)
+		teredo_server_destroy (server);
+	teredo_set_transport (NULL);
+	return 0;
+}
+
+static void usage (const char *path)
+{
+	fprintf (stderr,
+"Usage: %s [-s] [-r] [-t] [-n passes] [-p port] [-a address] [capture]\n"
+"Replays the UDP/IPv4 datagrams of a pcap or pcapng capture through the\n"
+"Teredo relay (default) or server packet processing.\n"
+"\n"
+"  -s  server mode\n"
+"  -r  restricted relay (default: cone)\n"
+"  -t  replay at the recorded pace\n"
+"  -n  number of passes over the capture (default: 1)\n"
+"  -p  relay UDP port (default: most frequent destination port)\n"
+"  -a  server primary IPv4 address (default: most frequent destination)\n"
+"\n"
+"Without a capture, built-in synthetic traces are replayed and checked.\n",
+	         path);
+}
+
+int main (int argc, char *argv[])
+{
+	bool server_mode = false, cone = true, paced = false;
+	unsigned passes = 1, port = 0;
+	uint32_t ip1 = 0;
+	replay_stats st;
+	int c;
+
+	while ((c = getopt (argc, argv, "a:hn:p:rst")) != -1)
+		switch (c)
+		{
+			case 'a':
+				if (inet_pton (AF_INET, optarg, &ip1) != 1)
+				{
+					usage (argv[0]);
+					return 2;
+				}
+				break;
+			case 'n':
+				passes = strtoul (optarg, NULL, 10);
+				break;
+			case 'p':
+				port = strtoul (optarg, NULL, 10);
+				break;
+			case 'r':
+				cone = false;
+				break;
+			case 's':
+				server_mode = true;
+				break;
+			case 't':
+				paced = true;
+				break;
+			default:
+				usage (argv[0]);
+				return 2;
+		}
+
+	if (optind >= argc)
+	{
+		/* Synthetic traces, as a test */
+		capture cap;
+
+		memset (&cap, 0, sizeof (cap));
+		synth_relay_trace (&cap);
+		assert (bench (&cap, false, cone, paced, passes, 0, 0, &st) == 0);
+		assert (st.packets > 0);
+		assert (st.parse_errors > 0);
+		assert (atomic_load (&delivered) > 0);
+		free (cap.pkts);
+		free (cap.buf);
+
+		memset (&cap, 0, sizeof (cap));
+		synth_server_trace (&cap);
+		assert (bench (&cap, true, cone, paced, passes, 0, 0, &st) == 0);
+		assert (st.packets > 0);
+		assert (st.parse_errors == 0);
+		assert (atomic_load (&sent_udp) > 0);
+		assert (atomic_load (&sent_ipv6) > 0);
+		free (cap.pkts);
+		free (cap.buf);
+		return 0;
+	}
+
+	capture cap;
+	memset (&cap, 0, sizeof (cap));
+	if (load_file (&cap, argv[optind]))
+		return 1;
+
+	int val = bench (&cap, server_mode, cone, paced, passes, htons (port),
+	                 ip1, &st);
+	free (cap.pkts);
+	free (cap.buf);
+	return val;
+}
@@ -0,0 +1,211 @@
+/*
+ * stats.c - Libteredo counters tests
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#undef NDEBUG
+#include <assert.h>
+
+#include <stdlib.h> /* mkstemp() */
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "stats.h"
+#include "tunnel.h"
+
+#define THREADS 8
+#define LOOPS 10000
+
+static pthread_barrier_t barrier;
+
+static void *worker (void *data)
+{
+	(void)data;
+
+	for (unsigned i = 0; i < LOOPS; i++)
+	{
+		teredo_count (TEREDO_RX_PACKETS);
+		teredo_count_add (TEREDO_SRV_ERRORS, 2);
+		teredo_hist_add (TEREDO_HIST_QUEUE, i);
+	}
+
+	/* Live threads are accounted for */
+	pthread_barrier_wait (&barrier);
+	pthread_barrier_wait (&barrier);
+	return NULL;
+}
+
+static uint64_t hist[TEREDO_HIST_MAX][TEREDO_HIST_BUCKETS];
+
+static uint64_t hist_total (teredo_histogram h)
+{
+	uint64_t total = 0;
+
+	for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+		total += hist[h][i];
+	return total;
+}
+
+int main (void)
+{
+	uint64_t values[TEREDO_COUNTER_MAX];
+	pthread_t th[THREADS];
+
+	/* Histogram buckets */
+	for (unsigned i = 0; i < TEREDO_HIST_BUCKETS; i++)
+	{
+		uint64_t v = teredo_hist_value (i, TEREDO_HIST_SUB_BITS);
+
+		assert (teredo_hist_bucket (v) == i);
+		if (i > 0)
+		{
+			assert (teredo_hist_bucket (v - 1) == i - 1);
+			/* Relative error is bounded */
+			if (i >= TEREDO_HIST_LINEAR)
+				assert ((v - teredo_hist_value (i - 1,
+				                                TEREDO_HIST_SUB_BITS)) * 8
+				        <= v);
+		}
+	}
+	assert (teredo_hist_bucket (UINT64_MAX) == TEREDO_HIST_BUCKETS - 1);
+	assert (teredo_hist_bucket (UINT64_C(1) << 40)
+	        == TEREDO_HIST_BUCKETS - 1);
+	assert (teredo_hist_bucket ((UINT64_C(1) << 40) - 1)
+	        == TEREDO_HIST_BUCKETS - 1);
+
+	for (unsigned i = 0; i < TEREDO_HIST_MAX; i++)
+	{
+		const char *name = teredo_histogram_name (i);
+		assert (name != NULL);
+		assert (name[0] != '\0');
+	}
+	assert (teredo_histogram_name (TEREDO_HIST_MAX) == NULL);
+
+	/* Latency is not recorded unless enabled */
+	assert (teredo_latency_start () == 0);
+	teredo_latency_end (TEREDO_HIST_DECAP, 0);
+	teredo_latency_enable (true);
+	uint64_t start = teredo_latency_start ();
+	assert (start != 0);
+	teredo_latency_end (TEREDO_HIST_DECAP, start);
+	teredo_latency_enable (false);
+	teredo_histograms_read (hist);
+	assert (hist_total (TEREDO_HIST_DECAP) == 1);
+
+	for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+	{
+		const char *name = teredo_counter_name (i);
+		assert (name != NULL);
+		assert (name[0] != '\0');
+		for (unsigned j = 0; j < i; j++)
+			assert (strcmp (name, teredo_counter_name (j)));
+	}
+	assert (teredo_counter_name (TEREDO_COUNTER_MAX) == NULL);
+
+	teredo_counters_read (values);
+	for (unsigned i = 0; i < TEREDO_COUNTER_MAX; i++)
+		assert (values[i] == 0);
+
+	pthread_barrier_init (&barrier, NULL, THREADS + 1);
+	for (unsigned i = 0; i < THREADS; i++)
+		assert (pthread_create (th + i, NULL, worker, NULL) == 0);
+
+	pthread_barrier_wait (&barrier);
+	teredo_counters_read (values);
+	assert (values[TEREDO_RX_PACKETS] == THREADS * LOOPS);
+	assert (values[TEREDO_SRV_ERRORS] == 2 * THREADS * LOOPS);
+	teredo_histograms_read (hist);
+	assert (hist_total (TEREDO_HIST_QUEUE) == THREADS * LOOPS);
+	assert (hist[TEREDO_HIST_QUEUE][0] == THREADS);
+	pthread_barrier_wait (&barrier);
+
+	/* Exited threads are not lost */
+	for (unsigned i = 0; i < THREADS; i++)
+		pthread_join (th[i], NULL);
+	pthread_barrier_destroy (&barrier);
+
+	teredo_count (TEREDO_RX_PACKETS);
+	teredo_counters_read (values);
+	assert (values[TEREDO_RX_PACKETS] == THREADS * LOOPS + 1);
+	assert (values[TEREDO_SRV_ERRORS] == 2 * THREADS * LOOPS);
+	assert (values[TEREDO_TX_PACKETS] == 0);
+	teredo_histograms_read (hist);
+	assert (hist_total (TEREDO_HIST_QUEUE) == THREADS * LOOPS);
+	assert (hist_total (TEREDO_HIST_ENCAP) == 0);
+
+	/* Statistics segment */
+	char path[] = "libteredo-stats.XXXXXX";
+	int fd = mkstemp (path);
+	assert (fd != -1);
+	close (fd);
+
+	teredo_stats *st = teredo_stats_publish (path, 60000);
+	assert (st != NULL);
+	teredo_count_sub (TEREDO_PEERS, 3);
+	teredo_stats_unpublish (st);
+
+	fd = open (path, O_RDONLY);
+	assert (fd != -1);
+	unlink (path);
+
+	teredo_stats_header *h = mmap (NULL, sizeof (*h), PROT_READ, MAP_SHARED,
+	                               fd, 0);
+	assert (h != MAP_FAILED);
+	assert (h->magic == TEREDO_STATS_MAGIC);
+	assert (h->version == TEREDO_STATS_VERSION);
+	assert (h->count == TEREDO_COUNTER_MAX);
+	assert (h->pid == (uint32_t)getpid ());
+	assert (atomic_load (&h->stopped));
+	assert ((atomic_load (&h->seq) & 1) == 0);
+
+	size_t size = h->size;
+	munmap (h, sizeof (*h));
+	h = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	assert (h != MAP_FAILED);
+	close (fd);
+
+	const teredo_stats_name *names = (const void *)(((char *)h) + h->names);
+	const atomic_uint_least64_t *v = (const void *)(((char *)h) + h->values);
+
+	assert (!strcmp (names[TEREDO_RX_PACKETS].name, "rx_packets"));
+	assert (names[TEREDO_RX_PACKETS].type == TEREDO_STATS_COUNTER);
+	assert (names[TEREDO_PEERS].type == TEREDO_STATS_GAUGE);
+	assert (atomic_load (v + TEREDO_RX_PACKETS) == THREADS * LOOPS + 1);
+	assert ((int64_t)atomic_load (v + TEREDO_PEERS) == -3);
+
+	assert (h->histograms == TEREDO_HIST_MAX);
+	assert (h->buckets == TEREDO_HIST_BUCKETS);
+	assert (h->sub_bits == TEREDO_HIST_SUB_BITS);
+	names = (const void *)(((char *)h) + h->hist_names);
+	v = (const void *)(((char *)h) + h->hist_values);
+	assert (!strcmp (names[TEREDO_HIST_QUEUE].name, "queue_latency"));
+	assert (names[TEREDO_HIST_QUEUE].type == TEREDO_STATS_HISTOGRAM);
+	v += TEREDO_HIST_QUEUE * TEREDO_HIST_BUCKETS;
+	assert (atomic_load (v) == THREADS);
+	assert (atomic_load (v + teredo_hist_bucket (LOOPS - 1)) > 0);
+	munmap (h, size);
+
+	return 0;
+}
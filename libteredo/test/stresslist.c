@@ -78,7 +78,7 @@ int main (void)
 
 	time (&seed);
 
-	l = teredo_list_create (UINT_MAX, 1000000);
+	l = teredo_list_create (UINT_MAX, 0, 1000000);
 	if (l == NULL)
 		return -1;
 
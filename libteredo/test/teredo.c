@@ -45,10 +45,26 @@ int main (void)
 	void *pval;
 
 	// 192.0.2.1 can never be assigned to any host
-	tunnel = teredo_create (htonl (0xC0000201), 0);
+	tunnel = teredo_create (htonl (0xC0000201), 0, NULL);
 	assert (tunnel == NULL);
 
-	tunnel = teredo_create (0, 0);
+	teredo_tunables tun;
+	teredo_tunables_init (&tun);
+	assert (tun.max_peers > 0);
+	assert (tun.relay_expiration > 0);
+
+	tun.relay_expiration = 0;
+	tunnel = teredo_create (0, 0, &tun);
+	assert (tunnel == NULL);
+
+	/* Peer table sized from a memory budget */
+	teredo_tunables_init (&tun);
+	tun.peer_memory = 1024;
+	tunnel = teredo_create (0, 0, &tun);
+	assert (tunnel != NULL);
+	teredo_destroy (tunnel);
+
+	tunnel = teredo_create (0, 0, NULL);
 	assert (tunnel != NULL);
 
 	val = teredo_set_relay_mode (tunnel);
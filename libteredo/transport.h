@@ -0,0 +1,105 @@
+/*
+ * transport.h - Replaceable packet input and output
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef LIBTEREDO_TRANSPORT_H
+# define LIBTEREDO_TRANSPORT_H
+
+# include <stdbool.h>
+# include <sys/types.h>
+
+struct iovec;
+struct teredo_packet;
+struct teredo_tunnel;
+
+/**
+ * Packet input and output operations. By default, packets go through the
+ * sockets. Test and benchmark programs can substitute their own, e.g. to
+ * process captured traffic without sending anything, or to connect
+ * tunnels and servers within one process (see libteredo/test/memnet.h).
+ * Sockets are still created, and identify the endpoints.
+ */
+typedef struct teredo_transport
+{
+	/** Sends a UDP/IPv4 datagram from a Teredo socket (see teredo_sendv()) */
+	int (*sendv) (void *opaque, int fd, const struct iovec *iov,
+	              size_t count, uint32_t ip, uint16_t port);
+	/**
+	 * Sends several datagrams to the same destination (see
+	 * teredo_send_batch()), or NULL to use sendv() for each.
+	 */
+	int (*send_batch) (void *opaque, int fd, const struct iovec *dgrams,
+	                   size_t count, uint32_t ip, uint16_t port);
+	/**
+	 * Receives a datagram into p->buf, and sets the source, destination,
+	 * reception time and drop count fields of p. When waiting, this must
+	 * be a thread cancellation point. NULL to receive from the socket.
+	 * @return the datagram length, or -1 if none (and not waiting).
+	 */
+	ssize_t (*recv) (void *opaque, int fd, struct teredo_packet *p,
+	                 bool wait);
+	/** Sends a native IPv6 packet (Teredo server) */
+	int (*send_ipv6) (void *opaque, const void *packet, size_t len);
+	/**
+	 * Coarse time in seconds (see teredo_clock()), or NULL for the system
+	 * clock. It must never go backward.
+	 */
+	unsigned long (*clock) (void *opaque);
+	void *opaque;
+} teredo_transport;
+
+/**
+ * Replaces the packet operations of the whole process. This must be done
+ * before any tunnel or server is created.
+ *
+ * @param tr operations (must remain valid while in use), or NULL to restore
+ * the sockets
+ */
+void teredo_set_transport (const teredo_transport *tr);
+
+/**
+ * @return the current packet operations, NULL for the sockets.
+ */
+const teredo_transport *teredo_get_transport (void);
+
+/**
+ * Processes a Teredo packet that was not received from the tunnel socket,
+ * e.g. one read from a capture file (see teredo_parse()), as if it had.
+ *
+ * @param t Teredo tunnel instance
+ * @param packet parsed Teredo packet
+ */
+void teredo_receive (struct teredo_tunnel *restrict t,
+                     const struct teredo_packet *restrict packet);
+
+/**
+ * Sends several UDP/IPv4 datagrams to the same destination, with a single
+ * system call where supported. A datagram that cannot be sent is skipped.
+ *
+ * @param fd Teredo socket
+ * @param dgrams datagrams (one buffer each)
+ * @param count number of datagrams
+ *
+ * @return the number of datagrams sent, -1 if none could be.
+ */
+int teredo_send_batch (int fd, const struct iovec *dgrams, size_t count,
+                       uint32_t ip, uint16_t port);
+
+#endif /* ifndef LIBTEREDO_TRANSPORT_H */
@@ -33,6 +33,7 @@
 
 # include <stdbool.h>
 # include <stddef.h>
+# include <time.h>
 
 # ifdef __cplusplus
 extern "C" {
@@ -58,6 +59,54 @@ struct ip6_hdr;
  */
 typedef struct teredo_tunnel teredo_tunnel;
 
+/**
+ * Tunable parameters of a Teredo tunnel.
+ * Use teredo_tunables_init() to get the default values.
+ */
+typedef struct teredo_tunables
+{
+	/** Maximum number of trusted peers */
+	unsigned max_peers;
+	/** Maximum number of peers being verified (0 = no limit) */
+	unsigned probation_peers;
+	/**
+	 * Memory budget for peers (kibibytes), 0 = unlimited. If set, the
+	 * number of peers is computed from it, and max_peers and
+	 * probation_peers are ignored.
+	 */
+	unsigned peer_memory;
+	/** Minimum delay before an unused peer is removed in relay mode (s) */
+	unsigned relay_expiration;
+	/** Same as relay_expiration, in client mode (s) */
+	unsigned client_expiration;
+	/** Minimum delay between ICMPv6 errors (ms), 0 = unlimited rate */
+	unsigned icmp_rate_limit_ms;
+	/** Maximum bytes queued for each peer being verified */
+	unsigned max_queue_bytes;
+	/** Qualification time out (s), 0 = default */
+	unsigned qualification_timeout;
+	/** Qualification retries, 0 = default */
+	unsigned qualification_retries;
+	/** Qualification refresh interval (s), 0 = default */
+	unsigned refresh_interval;
+	/** Delay before retrying after a qualification failure (s), 0 = default */
+	unsigned restart_delay;
+	/** UDP socket receive buffer size (bytes), 0 = system default */
+	unsigned rcvbuf;
+	/** UDP socket send buffer size (bytes), 0 = system default */
+	unsigned sndbuf;
+	/**
+	 * Ceiling (bytes) up to which the receive buffer is doubled whenever
+	 * the kernel drops packets, 0 = fixed size
+	 */
+	unsigned rcvbuf_max;
+} teredo_tunables;
+
+/**
+ * Sets all tunable parameters to their default values.
+ */
+void teredo_tunables_init (teredo_tunables *tunables);
+
 /**
  * Creates a teredo_tunnel instance. teredo_preinit() must have been
  * called first.
@@ -74,9 +123,33 @@ typedef struct teredo_tunnel teredo_tunnel;
  * same source UDP port number at the same time, so avoid you should
  * paradoxically avoid querying a fixed port.
  *
+ * @param tunables tunable parameters, or NULL for the defaults
+ *
+ * @return NULL in case of failure.
+ */
+teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port,
+                              const teredo_tunables *tunables);
+
+/**
+ * Creates a teredo_tunnel instance from an already bound UDP/IPv4 socket,
+ * typically one that was created by teredo_create() in another process
+ * (see teredo_get_fd()). The tunnel takes ownership of the socket, which is
+ * closed on error.
+ *
+ * @param fd UDP/IPv4 socket
+ * @param tunables tunable parameters, or NULL for the defaults
+ *
  * @return NULL in case of failure.
  */
-teredo_tunnel *teredo_create (uint32_t ipv4, uint16_t port);
+teredo_tunnel *teredo_create_fd (int fd, const teredo_tunables *tunables);
+
+/**
+ * Returns the UDP socket of a Teredo tunnel, e.g. so that it can be passed
+ * to another process. It remains owned by the tunnel.
+ *
+ * @param t Teredo tunnel instance
+ */
+int teredo_get_fd (const teredo_tunnel *t);
 
 /**
  * Releases all resources (sockets, memory chunks...) and terminates all
@@ -108,6 +181,44 @@ void teredo_destroy (teredo_tunnel *t);
  */
 int teredo_run_async (teredo_tunnel *t);
 
+/**
+ * Returns the number of packets dropped by the kernel on the tunnel socket.
+ * Once teredo_run_async() has been called, this mostly counts packets
+ * rejected by the socket filter before they would have been discarded by
+ * the tunnel anyway (malformed or, in relay mode, from non-Teredo sources).
+ * Receive buffer overflows are included as well.
+ *
+ * @param t Teredo tunnel instance
+ *
+ * @return packets count (0 if not supported by the operating system).
+ */
+unsigned long teredo_get_filtered (const teredo_tunnel *t);
+
+/**
+ * Saves the trusted peers of a Teredo relay to a file, so that another
+ * process can restore them with teredo_restore_peers() instead of
+ * authenticating them all over again. This does nothing in client mode.
+ *
+ * @param t Teredo tunnel instance
+ * @param fd file descriptor of a regular file; it is truncated, and the
+ * file offset is neither used nor changed.
+ *
+ * @return the number of saved peers, or -1 on error.
+ */
+int teredo_save_peers (teredo_tunnel *t, int fd);
+
+/**
+ * Restores the peers saved by teredo_save_peers(), skipping those that have
+ * expired in the mean time. This does nothing in client mode.
+ * This should be called before teredo_run_async().
+ *
+ * @param t Teredo tunnel instance
+ * @param fd file descriptor of the saved peers file (empty if none).
+ *
+ * @return the number of restored peers, or -1 if the file is invalid.
+ */
+int teredo_restore_peers (teredo_tunnel *t, int fd);
+
 /**
  * Defines the cone flag of the Teredo tunnel.
  * This only works for Teredo relays.
@@ -148,27 +259,84 @@ int teredo_set_relay_mode (teredo_tunnel *t);
  *
  * @param t Teredo tunnel instance
  * @param s1 Teredo server's host name or “dotted quad” primary IPv4 address.
- * @param s2 Teredo server's secondary address (or host name), or NULL to
- * infer it from @p s1.
+ * @param s2 another Teredo server's host name or address, or NULL (or an
+ * empty string) to use only @p s1. Both servers are solicited in parallel,
+ * and the client fails over from one to the other.
+ * @param tunables tunable parameters, or NULL to keep those given to
+ * teredo_create()
  *
  * @return 0 on success, -1 in case of error.
  * In case of error, the teredo_tunnel instance is not modifed.
  */
 int teredo_set_client_mode (teredo_tunnel *restrict t, const char *s1,
-                            const char *s2);
+                            const char *s2, const teredo_tunables *tunables);
 
 /**
  * Enables the Teredo local client discovery procedure.
  * This function has no effects if the tunnel is not in client mode.
- *
- * @note This function must <b>not</b> be used after teredo_transmit() or
- * teredo_run_async() the specified tunnel. That is undefined.
+ * It can be used while the tunnel is running.
  *
  * @param t Tereo tunnel instance
  * @param on whether to enable (true) or disable (false) local discovery
  */
 void teredo_set_local_discovery (teredo_tunnel *restrict t, bool on);
 
+/**
+ * Enables or disables the latency histograms of the statistics, and the
+ * reception timestamps they need. It can be used while the tunnel is
+ * running.
+ *
+ * @param t Teredo tunnel instance
+ * @param on whether to enable (true) or disable (false) latency statistics
+ */
+void teredo_set_latency_stats (teredo_tunnel *restrict t, bool on);
+
+typedef struct teredo_stats teredo_stats;
+
+/**
+ * Creates a statistics segment file (see miredo-stat(1)), and starts a
+ * thread that publishes the counters of all the tunnels of the process
+ * there periodically. The file is replaced atomically if it exists already.
+ *
+ * @param path file path
+ * @param interval update interval (milliseconds)
+ * @return NULL on error.
+ */
+teredo_stats *teredo_stats_publish (const char *path, unsigned interval);
+
+/**
+ * Publishes the counters a last time, marks the segment as stopped, and
+ * stops publishing. The file is not removed.
+ */
+void teredo_stats_unpublish (teredo_stats *st);
+
+/**
+ * Selects the keyed hash function authenticating pings, router
+ * solicitation nonces and address flags, for all the tunnels of the
+ * process. It should be called before any tunnel is created: the values
+ * issued beforehand are no longer accepted.
+ *
+ * @param name "HMAC-MD5" or "SipHash-2-4" (case-insensitive), or NULL for
+ * the build-time default
+ *
+ * @return 0 on success, -1 if the name is unknown or on error.
+ */
+int teredo_set_keyed_hash (const char *name);
+
+/**
+ * Changes the tunable parameters of a running tunnel. Only the peer table
+ * limits, the peers expiration delay, the ICMPv6 rate limit and the socket
+ * buffers can be changed this way.
+ *
+ * @param t Teredo tunnel instance
+ * @param tunables new parameters, or NULL for the defaults
+ *
+ * @return 0 on success, -1 on error: errno is EBUSY if other parameters
+ * were changed, in which case the tunnel must be re-created.
+ */
+int teredo_set_tunables (teredo_tunnel *restrict t,
+                         const teredo_tunables *restrict tunables);
+
 /**
  * Sets the private data pointer of a Teredo tunnel instance.
  * This value is passed to callbacks.
@@ -291,6 +459,23 @@ typedef void (*teredo_state_down_cb) (void *opaque);
 void teredo_set_state_cb (teredo_tunnel *restrict t, teredo_state_up_cb up,
                           teredo_state_down_cb down);
 
+typedef void (*teredo_log_cb) (void *opaque, int priority,
+                               const struct timespec *ts, const char *msg);
+
+/**
+ * Registers a callback to receive the log messages of libteredo, instead of
+ * syslog(). Messages from packet processing and maintenance threads are
+ * formatted and passed asynchronously, with the time they were logged.
+ *
+ * The callback is called with an internal lock held: it must not call
+ * libteredo functions. When it is too slow, messages are dropped (and
+ * counted) rather than delaying packets.
+ *
+ * @param cb log callback, or NULL to restore logging to syslog()
+ * @param opaque data for the callback
+ */
+void teredo_set_log_callback (teredo_log_cb cb, void *opaque);
+
 # ifdef __cplusplus
 }
 # endif /* ifdef __cplusplus */
@@ -352,6 +352,86 @@ error:
 }
 
 
+/**
+ * Takes over a tunnel interface from another process, e.g. with a file
+ * descriptor received over a UNIX socket. The interface configuration is
+ * left untouched.
+ *
+ * @param fd tunnel device file descriptor (closed on error)
+ */
+tun6 *tun6_adopt (int fd)
+{
+	(void)bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+#if defined (USE_LINUX)
+	tun6 *t = malloc (sizeof (*t));
+	if (t == NULL)
+		goto error;
+	memset (t, 0, sizeof (*t));
+
+	struct ifreq req;
+	memset (&req, 0, sizeof (req));
+	if (ioctl (fd, TUNGETIFF, &req) || !(req.ifr_flags & IFF_TUN))
+	{
+		syslog (LOG_ERR, _("Tunneling driver error (%s): %m"), "TUNGETIFF");
+		free (t);
+		goto error;
+	}
+
+	int id = if_nametoindex (req.ifr_name);
+	if (id == 0)
+	{
+		free (t);
+		goto error;
+	}
+
+	int reqfd = socket (AF_INET6, SOCK_DGRAM, 0);
+	if (reqfd == -1)
+	{
+		free (t);
+		goto error;
+	}
+	fcntl (reqfd, F_SETFD, FD_CLOEXEC);
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+	t->id = id;
+	t->fd = fd;
+	t->reqfd = reqfd;
+	return t;
+#else
+	errno = ENOSYS;
+	goto error;
+#endif
+error:
+	(void)close (fd);
+	return NULL;
+}
+
+
+/**
+ * @return the file descriptor of the tunnel device, which may be passed to
+ * another process for tun6_adopt().
+ */
+int tun6_getFd (const tun6 *t)
+{
+	assert (t != NULL);
+	return t->fd;
+}
+
+
+/**
+ * Releases a tunnel without deconfiguring it, e.g. after handing it over
+ * to another process.
+ */
+void tun6_detach (tun6 *t)
+{
+	assert (t != NULL);
+
+	(void)close (t->fd);
+	(void)close (t->reqfd);
+	free (t);
+}
+
+
 /**
  * Removes a tunnel from the kernel.
  * BEWARE: if you fork, child processes must call tun6_destroy() too.
@@ -75,6 +75,10 @@ int tun6_driver_diagnose (char *errbuf) LIBTUN6_NONNULL;
 tun6 *tun6_create (const char *req_name) LIBTUN6_WARN_UNUSED;
 void tun6_destroy (tun6 *t) LIBTUN6_NONNULL;
 
+tun6 *tun6_adopt (int fd) LIBTUN6_WARN_UNUSED;
+int tun6_getFd (const tun6 *t) LIBTUN6_NONNULL LIBTUN6_PURE;
+void tun6_detach (tun6 *t) LIBTUN6_NONNULL;
+
 int tun6_getId (const tun6 *t) LIBTUN6_NONNULL;
 
 int tun6_setState (tun6 *t, bool up) LIBTUN6_NONNULL;
@@ -59,9 +59,25 @@ static int miredo_checkconf (miredo_conf *conf)
 	if (!miredo_conf_parse_syslog_facility (conf, "SyslogFacility", &i))
 		res = -1;
 
-	bool client = true;
+	bool b;
+	if (!miredo_conf_get_bool (conf, "HandOff", &b, NULL)
+	 || !miredo_conf_get_bool (conf, "LatencyStats", &b, NULL))
+		res = -1;
 
 	unsigned line;
+	char *hash = miredo_conf_get (conf, "KeyedHash", &line);
+	if ((hash != NULL) && strcasecmp (hash, "HMAC-MD5")
+	 && strcasecmp (hash, "SipHash-2-4"))
+	{
+		fprintf (stderr, _("Invalid keyed hash function \"%s\" at line %u"),
+		         hash, line);
+		fputc ('\n', stderr);
+		res = -1;
+	}
+	free (hash);
+
+	bool client = true;
+
 	char *val = miredo_conf_get (conf, "RelayType", &line);
 
 	if (val != NULL)
@@ -113,6 +129,32 @@ static int miredo_checkconf (miredo_conf *conf)
 	 || !miredo_conf_get_int16 (conf, "BindPort", &u16, NULL))
 		res = -1;
 
+	static const char tunables[][24] =
+	{
+		"MaxPeers", "ProbationPeers", "PeerMemory", "IcmpRateLimit",
+		"MaxQueueBytes", "QualificationTimeOut", "QualificationRetries",
+		"RefreshInterval", "RestartDelay", "ReceiveBuffer", "SendBuffer",
+		"MaxReceiveBuffer",
+	};
+	unsigned u;
+
+	for (size_t j = 0; j < sizeof (tunables) / sizeof (tunables[0]); j++)
+		if (!miredo_conf_get_uint (conf, tunables[j], &u, NULL))
+			res = -1;
+
+	line = 0;
+	u = 1;
+	if (!miredo_conf_get_uint (conf, "PeerExpiration", &u, &line))
+		res = -1;
+	else
+	if (u == 0)
+	{
+		fprintf (stderr, _("Invalid peer expiration delay at line %u"),
+		         line);
+		fputc ('\n', stderr);
+		res = -1;
+	}
+
 	char *str = miredo_conf_get (conf, "InterfaceName", NULL);
 	if (str != NULL)
 		free (str);
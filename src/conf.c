@@ -27,12 +27,14 @@
 
 #include <stdio.h>
 #include <stdlib.h> // malloc(), free()
+#include <limits.h> // UINT_MAX
 #include <stdarg.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdbool.h>
 
 #include <errno.h>
+#include <unistd.h> // close()
 #include <syslog.h>
 
 #include <sys/types.h>
@@ -299,6 +301,27 @@ bool miredo_conf_read_file (miredo_conf *conf, const char *path)
 }
 
 
+/* Parses a file from an open file descriptor, which is closed.
+ *
+ * @return false on I/O error, true on success.
+ */
+bool miredo_conf_read_fd (miredo_conf *conf, int fd)
+{
+	FILE *stream = fdopen (fd, "r");
+	if (stream == NULL)
+	{
+		LogError (conf, _("Error reading configuration: %s"),
+		          strerror (errno));
+		close (fd);
+		return false;
+	}
+
+	bool ret = miredo_conf_read_FILE (conf, stream);
+	fclose (stream);
+	return ret;
+}
+
+
 /**
  * Looks up an unsigned 16-bits integer. Returns false if the
  * setting was found but incorrectly formatted.
@@ -332,8 +355,40 @@ bool miredo_conf_get_int16 (miredo_conf *conf, const char *name,
 }
 
 
-#if 0
-/* This is supposedly bad for DSO (but we are not a DSO atm) */
+/**
+ * Looks up an unsigned integer. Returns false if the setting was found but
+ * incorrectly formatted.
+ *
+ * If the setting was not found value, returns true and leave
+ * *value unchanged.
+ */
+bool miredo_conf_get_uint (miredo_conf *conf, const char *name,
+                           unsigned *value, unsigned *line)
+{
+	char *val = miredo_conf_get (conf, name, line);
+
+	if (val == NULL)
+		return true;
+
+	char *end;
+	unsigned long l;
+
+	errno = 0;
+	l = strtoul (val, &end, 0);
+
+	if ((*end) || (*val == '-') || (l > UINT_MAX) || errno)
+	{
+		LogError (conf, _("Invalid integer value \"%s\" for %s: %s"),
+		          val, name, strerror (errno ? errno : ERANGE));
+		free (val);
+		return false;
+	}
+	*value = (unsigned)l;
+	free (val);
+	return true;
+}
+
+
 static const char *true_strings[] = { "yes", "true", "on", "enabled", NULL };
 static const char *false_strings[] =
 	{ "no", "false", "off", "disabled", NULL };
@@ -381,7 +436,6 @@ bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
 	free (val);
 	return false;
 }
-#endif
 
 /* Utilities function */
 
@@ -30,12 +30,15 @@ miredo_conf *miredo_conf_create (miredo_conf_logger logger, void *opaque);
 void miredo_conf_destroy (miredo_conf *conf);
 
 bool miredo_conf_read_file (miredo_conf *conf, const char *path);
+bool miredo_conf_read_fd (miredo_conf *conf, int fd);
 
 void miredo_conf_clear (miredo_conf *conf, int show);
 char *miredo_conf_get (miredo_conf *conf, const char *name, unsigned *line);
 
 bool miredo_conf_get_int16 (miredo_conf *conf, const char *name,
                             uint16_t *value, unsigned *line);
+bool miredo_conf_get_uint (miredo_conf *conf, const char *name,
+                           unsigned *value, unsigned *line);
 bool miredo_conf_get_bool (miredo_conf *conf, const char *name,
                            bool *value, unsigned *line);
 
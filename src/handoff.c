@@ -0,0 +1,164 @@
+/*
+ * handoff.c - Hand-off of resources between daemon processes
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "handoff.h"
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+# define MSG_CMSG_CLOEXEC 0
+#endif
+
+typedef struct miredo_handoff_msg
+{
+	uint32_t seq;
+	uint32_t type;
+} miredo_handoff_msg;
+
+
+int miredo_handoff_send (int sock, unsigned seq, int type,
+                         const int *fds, unsigned nfds)
+{
+	miredo_handoff_msg msg = { .seq = seq, .type = type };
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof (msg) };
+	union
+	{
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (MIREDO_HANDOFF_MAX_FDS * sizeof (int))];
+	} ctrl;
+	struct msghdr hdr =
+	{
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (nfds > MIREDO_HANDOFF_MAX_FDS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nfds > 0)
+	{
+		memset (&ctrl, 0, sizeof (ctrl));
+		hdr.msg_control = ctrl.buf;
+		hdr.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR (&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (nfds * sizeof (int));
+		memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof (int));
+	}
+
+	return (sendmsg (sock, &hdr, MSG_NOSIGNAL) == sizeof (msg)) ? 0 : -1;
+}
+
+
+int miredo_handoff_recv (int sock, unsigned seq, int *fds, unsigned *nfds,
+                         int timeout)
+{
+	for (;;)
+	{
+		struct pollfd ufd = { .fd = sock, .events = POLLIN };
+
+		int val = poll (&ufd, 1, timeout);
+		if (val <= 0)
+		{
+			if ((val == -1) && (errno == EINTR))
+				continue;
+			if (val == 0)
+				errno = ETIMEDOUT;
+			return -1;
+		}
+
+		miredo_handoff_msg msg;
+		struct iovec iov = { .iov_base = &msg, .iov_len = sizeof (msg) };
+		union
+		{
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE (MIREDO_HANDOFF_MAX_FDS * sizeof (int))];
+		} ctrl;
+		struct msghdr hdr =
+		{
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = ctrl.buf,
+			.msg_controllen = sizeof (ctrl.buf),
+		};
+
+		ssize_t len = recvmsg (sock, &hdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+		if (len == -1)
+		{
+			if ((errno == EAGAIN) || (errno == EINTR))
+				continue; /* someone else got it */
+			return -1;
+		}
+
+		unsigned n = 0;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&hdr); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR (&hdr, cmsg))
+		{
+			if ((cmsg->cmsg_level != SOL_SOCKET)
+			 || (cmsg->cmsg_type != SCM_RIGHTS))
+				continue;
+
+			unsigned count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+			const unsigned char *data = CMSG_DATA (cmsg);
+
+			for (unsigned i = 0; i < count; i++)
+			{
+				int fd;
+
+				memcpy (&fd, data + i * sizeof (int), sizeof (int));
+				if (n < *nfds)
+					fds[n++] = fd;
+				else
+					close (fd);
+			}
+		}
+
+		if ((len == sizeof (msg)) && (msg.seq == seq))
+		{
+			*nfds = n;
+			return msg.type;
+		}
+
+		/* Stale message: discard it, and its file descriptors */
+		while (n > 0)
+			close (fds[--n]);
+	}
+}
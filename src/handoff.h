@@ -0,0 +1,80 @@
+/*
+ * handoff.h - Hand-off of resources between daemon processes
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifndef MIREDO_HANDOFF_H
+# define MIREDO_HANDOFF_H
+
+/*
+ * On reload, the supervisor forks the new child process before the previous
+ * one exits, and sends the latter a SIGUSR2 signal (with sigqueue()) carrying
+ * the hand-off sequence number. Then:
+ *  - the previous child sends its file descriptors (MIREDO_HANDOFF_FDS),
+ *    or MIREDO_HANDOFF_NONE if it cannot hand them off,
+ *  - the new child replies with MIREDO_HANDOFF_ACK once it is serving with
+ *    them, after which the previous child exits,
+ *  - otherwise, the new child replies with MIREDO_HANDOFF_NACK and waits
+ *    for the previous child to release its resources and exit, which it
+ *    notifies with MIREDO_HANDOFF_BYE.
+ *
+ * Messages from the previous to the new child are sent on
+ * miredo_handoff_fd[0], and the replies on miredo_handoff_fd[1].
+ *
+ * The same messages are used to reload the configuration in place: the
+ * supervisor sends the configuration file (MIREDO_HANDOFF_CONFIG) on
+ * miredo_reload_fd[0] and a SIGUSR1 signal carrying the sequence number
+ * to the child, which replies on miredo_reload_fd[1] with
+ * MIREDO_HANDOFF_ACK if it applied the new configuration, or with
+ * MIREDO_HANDOFF_NACK if it must be restarted.
+ */
+enum
+{
+	MIREDO_HANDOFF_FDS,
+	MIREDO_HANDOFF_NONE,
+	MIREDO_HANDOFF_ACK,
+	MIREDO_HANDOFF_NACK,
+	MIREDO_HANDOFF_BYE,
+	MIREDO_HANDOFF_CONFIG,
+};
+
+# define MIREDO_HANDOFF_MAX_FDS 4
+
+/**
+ * Sends a hand-off message.
+ * @param fds file descriptors to attach (duplicated, not closed)
+ * @return 0 on success, -1 on error.
+ */
+int miredo_handoff_send (int sock, unsigned seq, int type,
+                         const int *fds, unsigned nfds);
+
+/**
+ * Waits for a hand-off message with the given sequence number.
+ * Messages from other hand-offs are discarded.
+ *
+ * @param fds [out] received file descriptors
+ * @param nfds [in] maximum, [out] actual number of file descriptors
+ * @param timeout maximum time to wait (milliseconds)
+ *
+ * @return the message type, or -1 on error or timeout.
+ */
+int miredo_handoff_recv (int sock, unsigned seq, int *fds, unsigned *nfds,
+                         int timeout);
+
+#endif /* ifndef MIREDO_HANDOFF_H */
@@ -458,7 +458,13 @@ int miredo_main (int argc, char *argv[])
 		fd = start_daemon (pidfile);
 	}
 
+	char statsfile[sizeof (LOCALSTATEDIR"/run/" ".stats")
+	               + strlen (miredo_name)];
+	sprintf (statsfile, LOCALSTATEDIR"/run/%s.stats", miredo_name);
+	miredo_stats_path = statsfile;
+
 	c = miredo (conffile, servername, fd);
+	unlink (statsfile);
 
 	if (fd != -1)
 	{
@@ -27,6 +27,7 @@
 #endif
 
 
+#include <stdio.h> // tmpfile()
 #include <string.h> // memset(), strsignal()
 #include <stdlib.h> // exit()
 #include <inttypes.h>
@@ -41,6 +42,7 @@
 #include <syslog.h>
 #include <unistd.h> // uid_t
 #include <sys/wait.h> // waitpid()
+#include <fcntl.h>
 #ifdef HAVE_SYS_CAPABILITY_H
 # include <sys/capability.h>
 #endif
@@ -51,8 +53,16 @@
 
 #include "miredo.h"
 #include "conf.h"
+#include "handoff.h"
 
 uid_t unpriv_uid = 0;
+int miredo_state_fd = -1;
+bool miredo_handoff_supported = false;
+int miredo_handoff_fd[2] = { -1, -1 };
+unsigned miredo_handoff_seq = 0;
+bool miredo_takeover = false;
+bool miredo_reload_supported = false;
+int miredo_reload_fd[2] = { -1, -1 };
 
 extern int
 drop_privileges (void)
@@ -86,6 +96,98 @@ static void logger (void *dummy, bool error, const char *fmt, va_list ap)
 }
 
 
+/**
+ * (Re)loads the configuration file, and applies the supervisor settings.
+ */
+static void load_conf (miredo_conf *cnf, const char *confpath, bool *handoff)
+{
+	int facility = LOG_DAEMON;
+
+	if (!miredo_conf_read_file (cnf, confpath))
+		syslog (LOG_WARNING, _("Loading configuration from %s failed"),
+		        confpath);
+
+	miredo_conf_parse_syslog_facility (cnf, "SyslogFacility", &facility);
+	if (!miredo_conf_get_bool (cnf, "HandOff", handoff, NULL)
+	 || (miredo_handoff_fd[0] == -1))
+		*handoff = false;
+
+	closelog ();
+	openlog (miredo_name, LOG_PID | LOG_PERROR, facility);
+}
+
+
+/**
+ * Asks the child process to apply the configuration file in place.
+ * @return 0 on success, -1 if it must be restarted instead.
+ */
+static int reload_child (pid_t pid, const char *confpath)
+{
+	static unsigned seq = 0;
+	int sock = miredo_reload_fd[0];
+
+	if (sock == -1)
+		return -1;
+
+	int fd = open (confpath, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	union sigval v = { .sival_int = ++seq };
+	int val = miredo_handoff_send (sock, seq, MIREDO_HANDOFF_CONFIG, &fd, 1);
+	close (fd);
+	if (val || sigqueue (pid, SIGUSR1, v))
+		return -1;
+
+	unsigned n = 0;
+	val = miredo_handoff_recv (sock, seq, NULL, &n, 5000);
+	return (val == MIREDO_HANDOFF_ACK) ? 0 : -1;
+}
+
+
+int miredo_reload (miredo_conf *conf, unsigned seq, miredo_reload_cb cb,
+                   void *opaque)
+{
+	int sock = miredo_reload_fd[1], fd, val = -1;
+	unsigned n = 1;
+
+	if (miredo_handoff_recv (sock, seq, &fd, &n, 1000)
+	     != MIREDO_HANDOFF_CONFIG)
+		return -1; /* no reply: the supervisor gives up */
+
+	if ((n == 1) && miredo_conf_read_fd (conf, fd))
+	{
+		int facility = LOG_DAEMON;
+
+		miredo_conf_parse_syslog_facility (conf, "SyslogFacility",
+		                                   &facility);
+		closelog ();
+		openlog (miredo_name, LOG_PID | LOG_PERROR, facility);
+		/* Supervisor setting */
+		free (miredo_conf_get (conf, "HandOff", NULL));
+
+		val = cb (conf, opaque);
+	}
+	miredo_conf_clear (conf, 5);
+
+	miredo_handoff_send (sock, seq, val ? MIREDO_HANDOFF_NACK
+	                                    : MIREDO_HANDOFF_ACK, NULL, 0);
+	return val;
+}
+
+
+/**
+ * Stops a child process and waits for it.
+ */
+static void stop_child (pid_t pid, int *status)
+{
+	// Tells children to exit */
+	kill (pid, SIGTERM);
+	// Waits until the miredo process terminates
+	while (waitpid (pid, status, 0) != pid);
+}
+
+
 extern int
 miredo (const char *confpath, const char *server_name, int pidfd)
 {
@@ -108,36 +210,82 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 	sigaddset (&set, SIGHUP);
 	reload_set = set;
 
-	/* No-op signal */
+	/* No-op signals (SIGUSR1 and SIGUSR2 are requests to children) */
 	sigaddset (&set, SIGCHLD);
+	sigaddset (&set, SIGUSR1);
+	sigaddset (&set, SIGUSR2);
 
 	pthread_sigmask (SIG_BLOCK, &set, NULL);
 
 	openlog (miredo_name, LOG_PID | LOG_PERROR, LOG_DAEMON);
 
+	/* State handed over from one child process to the next on reload */
+	FILE *state = tmpfile ();
+	if (state != NULL)
+		miredo_state_fd = fileno (state);
+	else
+		syslog (LOG_WARNING, _("Error (%s): %m"), "tmpfile");
+
+	if (miredo_handoff_supported)
+	{
+		if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, miredo_handoff_fd) == 0)
+		{
+			fcntl (miredo_handoff_fd[0], F_SETFD, FD_CLOEXEC);
+			fcntl (miredo_handoff_fd[1], F_SETFD, FD_CLOEXEC);
+		}
+		else
+		{
+			syslog (LOG_WARNING, _("Error (%s): %m"), "socketpair");
+			miredo_handoff_fd[0] = miredo_handoff_fd[1] = -1;
+		}
+	}
+
+	if (miredo_reload_supported)
+	{
+		if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, miredo_reload_fd) == 0)
+		{
+			fcntl (miredo_reload_fd[0], F_SETFD, FD_CLOEXEC);
+			fcntl (miredo_reload_fd[1], F_SETFD, FD_CLOEXEC);
+		}
+		else
+		{
+			syslog (LOG_WARNING, _("Error (%s): %m"), "socketpair");
+			miredo_reload_fd[0] = miredo_reload_fd[1] = -1;
+		}
+	}
+
+	pid_t pid = -1, oldpid = -1;
+	bool handoff = false;
+
 	do
 	{
-		int facility = LOG_DAEMON;
 		retval = 1;
 
-		if (!miredo_conf_read_file (cnf, confpath))
-			syslog (LOG_WARNING, _("Loading configuration from %s failed"),
-			        confpath);
+		load_conf (cnf, confpath, &handoff);
+		syslog (LOG_INFO, _("Starting..."));
 
-		miredo_conf_parse_syslog_facility (cnf, "SyslogFacility",
-		                                   &facility);
+		int status;
 
-		closelog ();
-		openlog (miredo_name, LOG_PID | LOG_PERROR, facility);
-		syslog (LOG_INFO, _("Starting..."));
+		if ((oldpid != -1) && !handoff)
+		{
+			/* Hand-off disabled in the new configuration */
+			stop_child (oldpid, &status);
+			oldpid = -1;
+		}
+
+		miredo_takeover = (oldpid != -1);
+		if (miredo_takeover)
+			miredo_handoff_seq++;
 
 		// Starts the main miredo process
-		pid_t pid = fork ();
+		pid = fork ();
 
 		switch (pid)
 		{
 			case -1:
 				syslog (LOG_ALERT, _("Error (%s): %m"), "fork");
+				if (oldpid != -1)
+					stop_child (oldpid, &status);
 				continue;
 
 			case 0:
@@ -153,15 +301,41 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 				miredo_conf_clear (cnf, 0);
 		}
 
-		int status, signum;
+		if (oldpid != -1)
+		{
+			/* Asks the previous child to hand its resources over */
+			union sigval v = { .sival_int = miredo_handoff_seq };
+			sigqueue (oldpid, SIGUSR2, v);
+		}
+
+		int signum;
 
 		for (;;)
 		{
 			while (sigwait (&set, &signum));
 
-			if (signum == SIGCHLD
-			 && waitpid (pid, &status, WNOHANG) == pid)
-				break; /* child died */
+			if (signum == SIGCHLD)
+			{
+				if ((oldpid != -1)
+				 && (waitpid (oldpid, &status, WNOHANG) == oldpid))
+				{
+					syslog (LOG_INFO, _("Child %d handed over to child %d"),
+					        (int)oldpid, (int)pid);
+					oldpid = -1;
+				}
+
+				if (waitpid (pid, &status, WNOHANG) != pid)
+					continue;
+				if (oldpid == -1)
+					break; /* child died */
+
+				/* Hand-off failed: the previous child keeps running */
+				syslog (LOG_WARNING, _("Child %d failed to take over"),
+				        (int)pid);
+				pid = oldpid;
+				oldpid = -1;
+				continue;
+			}
 
 			if (sigismember (&exit_set, signum))
 			{
@@ -175,18 +349,39 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 				syslog (LOG_NOTICE,
 				        _("Reloading configuration on signal %d (%s)"),
 				        signum, strsignal (signum));
+
+				if ((oldpid == -1) && (reload_child (pid, confpath) == 0))
+				{
+					/* Applied in place */
+					load_conf (cnf, confpath, &handoff);
+					miredo_conf_clear (cnf, 0);
+					syslog (LOG_INFO, _("Configuration reloaded"));
+					continue;
+				}
 				retval = 2;
+
+				if (handoff && (oldpid == -1))
+				{
+					/* The next child will take over from this one */
+					oldpid = pid;
+					break;
+				}
 			}
 			else
 				continue;
 
-			// Tells children to exit */
-			kill (pid, SIGTERM);
-			// Waits until the miredo process terminates
-			while (waitpid (pid, &status, 0) != pid);
+			if (oldpid != -1)
+			{
+				stop_child (oldpid, &status);
+				oldpid = -1;
+			}
+			stop_child (pid, &status);
 			break;
 		}
 
+		if (oldpid == pid)
+			continue; /* still running */
+
 		// At this point, the child process is gone.
 		if (WIFEXITED (status))
 		{
@@ -208,6 +403,8 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 	}
 	while (retval == 2);
 
+	if (state != NULL)
+		fclose (state);
 	miredo_conf_destroy (cnf);
 
 	syslog (LOG_INFO, gettext (retval
@@ -222,6 +419,7 @@ miredo (const char *confpath, const char *server_name, int pidfd)
 int (*miredo_run) (miredo_conf *conf, const char *server);
 
 const char *miredo_name;
+const char *miredo_stats_path = NULL;
 
 #ifdef HAVE_LIBCAP
 const cap_value_t *miredo_capv;
@@ -45,6 +45,58 @@ extern int (*miredo_run) (miredo_conf *conf, const char *server);
 extern uid_t unpriv_uid;
 extern const char *miredo_name;
 
+/**
+ * Path of the statistics segment (see <libteredo/stats.h>) that the child
+ * process publishes. Removed by miredo_main() on exit.
+ */
+extern const char *miredo_stats_path;
+
+/**
+ * File descriptor of an anonymous file that survives reloads, for the
+ * daemon to save its state for the next child process (-1 if none).
+ */
+extern int miredo_state_fd;
+
+# include <stdbool.h>
+
+/**
+ * Whether the daemon can hand its resources over to the next child process
+ * on reload (see handoff.h). Set by the daemon before miredo().
+ */
+extern bool miredo_handoff_supported;
+/** Hand-off channel, or -1 if not available */
+extern int miredo_handoff_fd[2];
+/** Current hand-off sequence number */
+extern unsigned miredo_handoff_seq;
+/** Whether the child process should take over from the previous one */
+extern bool miredo_takeover;
+
+/**
+ * Applies a new configuration in the child process.
+ * @return 0 on success, -1 if the child process must be restarted instead.
+ */
+typedef int (*miredo_reload_cb) (miredo_conf *conf, void *opaque);
+
+/**
+ * Whether the daemon can apply a new configuration without restarting
+ * (see miredo_reload()). Set by the daemon before miredo().
+ */
+extern bool miredo_reload_supported;
+/** Reload channel, or -1 if not available */
+extern int miredo_reload_fd[2];
+
+/**
+ * Handles a reload request (SIGUSR1) from the supervisor, in the child
+ * process: loads the new configuration and applies it with the callback.
+ *
+ * @param conf configuration parser of the child process
+ * @param seq sequence number carried by the signal
+ *
+ * @return 0 on success, -1 if the child process must be restarted.
+ */
+int miredo_reload (miredo_conf *conf, unsigned seq, miredo_reload_cb cb,
+                   void *opaque);
+
 # ifdef HAVE_LIBCAP
 #  include <sys/capability.h>
 extern const cap_value_t *miredo_capv;
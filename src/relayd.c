@@ -28,6 +28,7 @@
 #include <inttypes.h>
 #include <stdlib.h> // free()
 #include <stdio.h> // fputs()
+#include <stddef.h> // offsetof()
 #include <sys/types.h>
 #include <string.h> // strcasecmp()
 #include <errno.h>
@@ -62,6 +63,7 @@
 
 #include "privproc.h"
 #include "miredo.h"
+#include "handoff.h"
 #include "conf.h"
 
 typedef struct miredo_tunnel
@@ -69,6 +71,11 @@ typedef struct miredo_tunnel
 	tun6 *tunnel;
 	int priv_fd;
 	teredo_tunnel *relay;
+
+	/* Reload support */
+	miredo_conf *conf;
+	const char *server_name;
+	struct relay_conf *settings;
 } miredo_tunnel;
 
 static int icmp6_fd = -1;
@@ -215,6 +222,66 @@ ParseLocalDiscovery (miredo_conf *conf, const char *name, bool *restrict on)
 }
 
 
+static const struct
+{
+	char name[24];
+	size_t offset;
+} tunables_directives[] =
+{
+	{ "MaxPeers",             offsetof (teredo_tunables, max_peers) },
+	{ "ProbationPeers",       offsetof (teredo_tunables, probation_peers) },
+	{ "PeerMemory",           offsetof (teredo_tunables, peer_memory) },
+	{ "IcmpRateLimit",        offsetof (teredo_tunables, icmp_rate_limit_ms) },
+	{ "MaxQueueBytes",        offsetof (teredo_tunables, max_queue_bytes) },
+	{ "QualificationTimeOut",
+	  offsetof (teredo_tunables, qualification_timeout) },
+	{ "QualificationRetries",
+	  offsetof (teredo_tunables, qualification_retries) },
+	{ "RefreshInterval",      offsetof (teredo_tunables, refresh_interval) },
+	{ "RestartDelay",         offsetof (teredo_tunables, restart_delay) },
+	{ "ReceiveBuffer",        offsetof (teredo_tunables, rcvbuf) },
+	{ "SendBuffer",           offsetof (teredo_tunables, sndbuf) },
+	{ "MaxReceiveBuffer",     offsetof (teredo_tunables, rcvbuf_max) },
+};
+
+static bool
+ParseTunables (miredo_conf *conf, teredo_tunables *restrict tun)
+{
+	bool ok = true;
+
+	teredo_tunables_init (tun);
+
+	for (size_t i = 0;
+	     i < sizeof (tunables_directives) / sizeof (tunables_directives[0]);
+	     i++)
+	{
+		unsigned *val = (unsigned *)(((char *)tun)
+		                             + tunables_directives[i].offset);
+
+		if (!miredo_conf_get_uint (conf, tunables_directives[i].name,
+		                           val, NULL))
+			ok = false;
+	}
+
+	/* Applies to the current mode */
+	unsigned line = 0, expiration = 0;
+
+	if (!miredo_conf_get_uint (conf, "PeerExpiration", &expiration, &line))
+		ok = false;
+	else
+	if (expiration > 0)
+		tun->relay_expiration = tun->client_expiration = expiration;
+	else
+	if (line)
+	{
+		syslog (LOG_ERR, _("Invalid peer expiration delay at line %u"),
+		        line);
+		ok = false;
+	}
+	return ok;
+}
+
+
 #ifdef MIREDO_TEREDO_CLIENT
 static tun6 *
 create_dynamic_tunnel (const char *ifname, int *pfd)
@@ -342,7 +409,7 @@ setup_client (teredo_tunnel *client, const char *server, const char *server2,
               bool discovery)
 {
 	teredo_set_state_cb (client, miredo_up_callback, miredo_down_callback);
-	if (teredo_set_client_mode (client, server, server2))
+	if (teredo_set_client_mode (client, server, server2, NULL))
 		return -1;
 
 	teredo_set_local_discovery (client, discovery);
@@ -442,50 +509,50 @@ static LIBTEREDO_NORETURN void *miredo_encap_thread (void *d)
 
 
 /**
- * Miredo main daemon function, with UDP datagrams and IPv6 packets
- * receive loop.
+ * Relay or client settings
  */
-static int
-run_tunnel (miredo_tunnel *tunnel)
+typedef struct relay_conf
 {
-	pthread_t encap_th;
-	if (teredo_run_async (tunnel->relay)
-	 || pthread_create (&encap_th, NULL, miredo_encap_thread, tunnel))
-		return -1;
-
-	sigset_t dummyset, set;
-	sigemptyset (&dummyset);
-	pthread_sigmask (SIG_BLOCK, &dummyset, &set);
-	while (sigwait (&set, &(int){ 0 }));
-
-	pthread_cancel (encap_th);
-	pthread_join (encap_th, NULL);
-	return 0;
-}
-
+	int mode;
+	bool cone;
+	bool discovery;
+	bool latency;
+	uint16_t mtu;
+	uint16_t bind_port;
+	uint32_t bind_ip;
+	teredo_tunables tunables;
+	char *ifname;
+	char server[NI_MAXHOST], server2[NI_MAXHOST];
+	char hash[16];
+} relay_conf;
 
 static int
-relay_run (miredo_conf *conf, const char *server_name)
+relay_parse (miredo_conf *conf, const char *server_name,
+             relay_conf *restrict c)
 {
-	/*
-	 * CONFIGURATION
-	 */
-	int mode = TEREDO_CLIENT;
-	if (!ParseRelayType (conf, "RelayType", &mode))
-	{
-		syslog (LOG_ALERT, _("Fatal configuration error"));
-		return -2;
-	}
-
-#ifdef MIREDO_TEREDO_CLIENT
-	const char *server_name2 = NULL;
-	char namebuf[NI_MAXHOST], namebuf2[NI_MAXHOST];
-	bool discovery = false;
+	memset (c, 0, sizeof (*c));
+	c->mode = TEREDO_CLIENT;
+	c->mtu = 1280;
+	c->bind_ip = INADDR_ANY;
+	c->bind_port =
+#if 0
+		/*
+		 * We use 3545 as a Teredo service port.
+		 * It is better to use a fixed port number for the
+		 * purpose of firewalling, rather than a pseudo-random
+		 * one (all the more as it might be a "dangerous"
+		 * often firewalled port, such as 1214 as it happened
+		 * to me once).
+		 */
+		IPPORT_TEREDO + 1;
+#else
+		0;
 #endif
-	uint16_t mtu = 1280;
-	bool cone = false;
 
-	if (mode & TEREDO_CLIENT)
+	if (!ParseRelayType (conf, "RelayType", &c->mode))
+		return -1;
+
+	if (c->mode & TEREDO_CLIENT)
 	{
 #ifdef MIREDO_TEREDO_CLIENT
 		if (server_name == NULL)
@@ -494,72 +561,283 @@ relay_run (miredo_conf *conf, const char *server_name)
 			if (name == NULL)
 			{
 				syslog (LOG_ALERT, _("Server address not specified"));
-				syslog (LOG_ALERT, _("Fatal configuration error"));
-				return -2;
+				return -1;
 			}
-			strlcpy (namebuf, name, sizeof (namebuf));
+			strlcpy (c->server, name, sizeof (c->server));
 			free (name);
-			server_name = namebuf;
 
 			name = miredo_conf_get (conf, "ServerAddress2", NULL);
 			if (name != NULL)
 			{
-				strlcpy (namebuf2, name, sizeof (namebuf2));
+				strlcpy (c->server2, name, sizeof (c->server2));
 				free (name);
-				server_name2 = namebuf2;
 			}
 		}
+		else
+			strlcpy (c->server, server_name, sizeof (c->server));
 
-		if (!ParseLocalDiscovery (conf, "LocalDiscovery", &discovery))
-		{
-			syslog (LOG_ALERT, _("Fatal configuration error"));
-			return -2;
-		}
+		if (!ParseLocalDiscovery (conf, "LocalDiscovery", &c->discovery))
+			return -1;
 #else
 		syslog (LOG_ALERT, _("Unsupported Teredo client mode"));
-		syslog (LOG_ALERT, _("Fatal configuration error"));
-		return -2;
+		return -1;
 #endif
 	}
 	else
 	{
-		server_name = NULL;
-		mtu = 1280;
-		cone = (mode == TEREDO_CONE);
+		c->cone = (c->mode == TEREDO_CONE);
+
+		if (!miredo_conf_get_int16 (conf, "InterfaceMTU", &c->mtu, NULL))
+			return -1;
+	}
+
+	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &c->bind_ip)
+	 || !miredo_conf_get_int16 (conf, "BindPort", &c->bind_port, NULL))
+		return -1;
+
+	c->bind_port = htons (c->bind_port);
+
+	if (!miredo_conf_get_bool (conf, "LatencyStats", &c->latency, NULL))
+		return -1;
+
+	char *hash = miredo_conf_get (conf, "KeyedHash", NULL);
+	if (hash != NULL)
+	{
+		strlcpy (c->hash, hash, sizeof (c->hash));
+		free (hash);
+	}
 
-		if (!miredo_conf_get_int16 (conf, "InterfaceMTU", &mtu, NULL))
+	if (!ParseTunables (conf, &c->tunables))
+		return -1;
+
+	c->ifname = miredo_conf_get (conf, "InterfaceName", NULL);
+	return 0;
+}
+
+
+/**
+ * Applies a new configuration to the running tunnel if possible.
+ * @return 0 on success, -1 if a restart is required.
+ */
+static int
+relay_reload (miredo_conf *conf, void *opaque)
+{
+	miredo_tunnel *data = opaque;
+	relay_conf *cur = data->settings, c;
+
+	if (relay_parse (conf, data->server_name, &c))
+	{
+		syslog (LOG_ERR, _("Invalid configuration: keeping settings"));
+		free (c.ifname);
+		return 0;
+	}
+
+	if ((c.mode != cur->mode) || (c.mtu != cur->mtu)
+	 || (c.bind_ip != cur->bind_ip) || (c.bind_port != cur->bind_port)
+	 || strcmp (c.server, cur->server) || strcmp (c.server2, cur->server2)
+	 || strcasecmp (c.hash, cur->hash)
+	 || ((c.ifname != NULL) != (cur->ifname != NULL))
+	 || ((c.ifname != NULL) && strcmp (c.ifname, cur->ifname))
+	 || teredo_set_tunables (data->relay, &c.tunables))
+	{
+		syslog (LOG_INFO, _("Restart required to apply the configuration"));
+		free (c.ifname);
+		return -1;
+	}
+
+	if (c.mode & TEREDO_CLIENT)
+		teredo_set_local_discovery (data->relay, c.discovery);
+	teredo_set_latency_stats (data->relay, c.latency);
+
+	free (cur->ifname);
+	*cur = c;
+	return 0;
+}
+
+
+#define RUN_EXIT    0 /* normal termination */
+#define RUN_HANDOFF 1 /* resources handed over to the next process */
+#define RUN_RELEASE 2 /* the next process waits for our resources */
+
+/**
+ * Takes the tunnel over from the previous child process, or waits until the
+ * latter has released its own.
+ *
+ * @param ptunnel [out] adopted tunnel interface, or NULL
+ * @param pfd [out] adopted UDP socket, or -1
+ *
+ * @return 0 on success, -1 if the previous process did not answer.
+ */
+static int
+takeover_tunnel (bool relay, uint16_t mtu, tun6 **restrict ptunnel,
+                 int *restrict pfd)
+{
+	int sock = miredo_handoff_fd[1], fds[MIREDO_HANDOFF_MAX_FDS];
+	unsigned n = MIREDO_HANDOFF_MAX_FDS;
+
+	*ptunnel = NULL;
+	*pfd = -1;
+
+	int type = miredo_handoff_recv (sock, miredo_handoff_seq, fds, &n, 5000);
+	if (type == -1)
+		return -1;
+
+	if ((type == MIREDO_HANDOFF_FDS) && relay && (n == 2))
+	{
+		/* tun6_adopt() closes the descriptor on error */
+		tun6 *tunnel = tun6_adopt (fds[1]);
+		n = 1;
+
+		if (tunnel != NULL)
 		{
-			syslog (LOG_ALERT, _("Fatal configuration error"));
-			return -2;
+			if (tun6_setMTU (tunnel, mtu) == 0)
+			{
+				*ptunnel = tunnel;
+				*pfd = fds[0];
+				return 0;
+			}
+			tun6_detach (tunnel);
 		}
 	}
 
-	uint32_t bind_ip = INADDR_ANY;
-	uint16_t bind_port =
-#if 0
-		/*
-		 * We use 3545 as a Teredo service port.
-		 * It is better to use a fixed port number for the
-		 * purpose of firewalling, rather than a pseudo-random
-		 * one (all the more as it might be a "dangerous"
-		 * often firewalled port, such as 1214 as it happened
-		 * to me once).
-		 */
-		IPPORT_TEREDO + 1;
-#else
-		0;
-#endif
+	while (n > 0)
+		close (fds[--n]);
+
+	if (type == MIREDO_HANDOFF_FDS)
+		miredo_handoff_send (sock, miredo_handoff_seq, MIREDO_HANDOFF_NACK,
+		                     NULL, 0);
 
-	if (!miredo_conf_parse_IPv4 (conf, "BindAddress", &bind_ip)
-	 || !miredo_conf_get_int16 (conf, "BindPort", &bind_port, NULL))
+	/* Waits until the previous process has released its resources */
+	type = miredo_handoff_recv (sock, miredo_handoff_seq, NULL, &n, 10000);
+	return (type == MIREDO_HANDOFF_BYE) ? 0 : -1;
+}
+
+
+/**
+ * Hands the tunnel over to the next child process.
+ * @return RUN_HANDOFF if the next process took over, RUN_RELEASE if it
+ * waits for us to exit, -1 if it did not answer (we keep running).
+ */
+static int
+handoff_tunnel (const miredo_tunnel *tunnel, unsigned seq)
+{
+	int sock = miredo_handoff_fd[0];
+
+	if (tunnel->priv_fd != -1)
 	{
-		syslog (LOG_ALERT, _("Fatal configuration error"));
-		return -2;
+		/* Client interfaces belong to the privileged process: no hand-off */
+		miredo_handoff_send (sock, seq, MIREDO_HANDOFF_NONE, NULL, 0);
+		return RUN_RELEASE;
 	}
 
-	bind_port = htons (bind_port);
+	if ((miredo_state_fd != -1)
+	 && (teredo_save_peers (tunnel->relay, miredo_state_fd) < 0))
+		syslog (LOG_WARNING, _("Error (%s): %m"), "teredo_save_peers");
 
-	char *ifname = miredo_conf_get (conf, "InterfaceName", NULL);
+	int fds[2] =
+	{
+		teredo_get_fd (tunnel->relay), tun6_getFd (tunnel->tunnel)
+	};
+	if (miredo_handoff_send (sock, seq, MIREDO_HANDOFF_FDS, fds, 2))
+	{
+		syslog (LOG_WARNING, _("Error (%s): %m"), "miredo_handoff_send");
+		return -1;
+	}
+
+	unsigned n = 0;
+	switch (miredo_handoff_recv (sock, seq, NULL, &n, 10000))
+	{
+		case MIREDO_HANDOFF_ACK:
+			return RUN_HANDOFF;
+		case MIREDO_HANDOFF_NACK:
+			return RUN_RELEASE;
+	}
+
+	syslog (LOG_WARNING, _("Tunnel hand-off timed out"));
+	return -1;
+}
+
+
+/**
+ * Miredo main daemon function, with UDP datagrams and IPv6 packets
+ * receive loop.
+ *
+ * @param adopted whether the tunnel was taken over from the previous process
+ * @param seq [out] hand-off sequence number (if RUN_RELEASE is returned)
+ *
+ * @return RUN_EXIT, RUN_HANDOFF or RUN_RELEASE, or -1 on error.
+ */
+static int
+run_tunnel (miredo_tunnel *tunnel, bool adopted, unsigned *restrict seq)
+{
+	pthread_t encap_th;
+	if (teredo_run_async (tunnel->relay)
+	 || pthread_create (&encap_th, NULL, miredo_encap_thread, tunnel))
+		return -1;
+
+	if (adopted)
+		miredo_handoff_send (miredo_handoff_fd[1], miredo_handoff_seq,
+		                     MIREDO_HANDOFF_ACK, NULL, 0);
+
+	sigset_t dummyset, set;
+	sigemptyset (&dummyset);
+	pthread_sigmask (SIG_BLOCK, &dummyset, &set);
+
+	int val;
+	for (;;)
+	{
+		siginfo_t info;
+
+		if (sigwaitinfo (&set, &info) == -1)
+			continue;
+
+		if (info.si_signo == SIGUSR1)
+		{
+			/* Reload request from the supervisor */
+			if ((info.si_code == SI_QUEUE) && (miredo_reload_fd[1] != -1))
+				miredo_reload (tunnel->conf, info.si_value.sival_int,
+				               relay_reload, tunnel);
+			continue;
+		}
+
+		if (info.si_signo != SIGUSR2)
+		{
+			val = RUN_EXIT;
+			break;
+		}
+
+		/* Hand-off request from the supervisor */
+		if ((info.si_code != SI_QUEUE) || (miredo_handoff_fd[0] == -1))
+			continue;
+
+		*seq = info.si_value.sival_int;
+		val = handoff_tunnel (tunnel, *seq);
+		if (val != -1)
+			break;
+	}
+
+	syslog (LOG_INFO, _("%lu packet(s) dropped by the kernel"),
+	        teredo_get_filtered (tunnel->relay));
+	pthread_cancel (encap_th);
+	pthread_join (encap_th, NULL);
+	return val;
+}
+
+
+static int
+relay_run (miredo_conf *conf, const char *server_name)
+{
+	/*
+	 * CONFIGURATION
+	 */
+	relay_conf c;
+
+	if (relay_parse (conf, server_name, &c))
+	{
+		free (c.ifname);
+		syslog (LOG_ALERT, _("Fatal configuration error"));
+		return -2;
+	}
 
 	miredo_conf_clear (conf, 5);
 
@@ -568,23 +846,40 @@ relay_run (miredo_conf *conf, const char *server_name)
 	 */
 
 	// Tunneling interface initialization
-	int privfd = -1;
-	tun6 *tunnel = (mode & TEREDO_CLIENT)
-		? create_dynamic_tunnel (ifname, &privfd)
-		: create_static_tunnel (ifname, mtu);
+	int privfd = -1, udpfd = -1;
+	tun6 *tunnel = NULL;
+
+	if (miredo_takeover
+	 && takeover_tunnel (!(c.mode & TEREDO_CLIENT), c.mtu, &tunnel, &udpfd))
+	{
+		syslog (LOG_ALERT, _("Miredo setup failure: %s"),
+		        _("Previous process did not release the tunnel"));
+		free (c.ifname);
+		return -1;
+	}
 
-	if (ifname != NULL)
-		free (ifname);
+	if (tunnel == NULL)
+		tunnel = (c.mode & TEREDO_CLIENT)
+			? create_dynamic_tunnel (c.ifname, &privfd)
+			: create_static_tunnel (c.ifname, c.mtu);
 
-	int retval = -1;
+	int retval = -1, val = RUN_EXIT;
+	unsigned seq = 0;
 
 	if (tunnel == NULL)
 	{
 		syslog (LOG_ALERT, _("Miredo setup failure: %s"),
 		        _("Cannot create IPv6 tunnel"));
+		free (c.ifname);
 		return -1;
 	}
 
+	/* Needs privileges to write in the run directory */
+	teredo_stats *stats = teredo_stats_publish (miredo_stats_path, 1000);
+	if (stats == NULL)
+		syslog (LOG_WARNING, _("Cannot publish statistics in %s: %m"),
+		        miredo_stats_path);
+
 	if (miredo_init ())
 		syslog (LOG_ALERT, _("Miredo setup failure: %s"),
 		        _("libteredo cannot be initialized"));
@@ -592,24 +887,50 @@ relay_run (miredo_conf *conf, const char *server_name)
 	{
 		if (drop_privileges () == 0)
 		{
-			teredo_tunnel *relay = teredo_create (bind_ip, bind_port);
+			teredo_tunnel *relay = NULL;
+
+			if (teredo_set_keyed_hash (c.hash[0] ? c.hash : NULL))
+				syslog (LOG_ALERT, _("Invalid keyed hash function \"%s\""),
+				        c.hash);
+			else
+				relay = (udpfd != -1)
+					? teredo_create_fd (udpfd, &c.tunables)
+					: teredo_create (c.bind_ip, c.bind_port, &c.tunables);
 			if (relay != NULL)
 			{
-				miredo_tunnel data = { tunnel, privfd, relay };
+				miredo_tunnel data =
+				{
+					tunnel, privfd, relay, conf, server_name, &c
+				};
 				teredo_set_privdata (relay, &data);
 				teredo_set_recv_callback (relay, miredo_recv_callback);
 				teredo_set_icmpv6_callback (relay, miredo_icmp6_callback);
+				teredo_set_latency_stats (relay, c.latency);
 
-				retval = (mode & TEREDO_CLIENT)
-					? setup_client (relay, server_name, server_name2,
-					                discovery)
-					: setup_relay (relay, cone);
+				retval = (c.mode & TEREDO_CLIENT)
+					? setup_client (relay, c.server,
+					                c.server2[0] ? c.server2 : NULL,
+					                c.discovery)
+					: setup_relay (relay, c.cone);
 
 				/*
 				 * RUN
 				 */
 				if (retval == 0)
-					retval = run_tunnel (&data);
+				{
+					/* Peers saved by the previous process, if any */
+					if ((miredo_state_fd != -1)
+					 && (teredo_restore_peers (relay, miredo_state_fd) < 0))
+						syslog (LOG_WARNING,
+						        _("Ignoring invalid saved peers"));
+
+					val = run_tunnel (&data, udpfd != -1, &seq);
+					retval = (val < 0) ? -1 : 0;
+					if ((val != RUN_HANDOFF) && (miredo_state_fd != -1)
+					 && (teredo_save_peers (relay, miredo_state_fd) < 0))
+						syslog (LOG_WARNING, _("Error (%s): %m"),
+						        "teredo_save_peers");
+				}
 				teredo_destroy (relay);
 			}
 
@@ -620,11 +941,21 @@ relay_run (miredo_conf *conf, const char *server_name)
 		miredo_deinit ();
 	}
 
-	if (mode & TEREDO_CLIENT)
+	if (stats != NULL)
+		teredo_stats_unpublish (stats);
+
+	if (c.mode & TEREDO_CLIENT)
 		destroy_dynamic_tunnel (tunnel, privfd);
+	else
+	if (val == RUN_HANDOFF)
+		tun6_detach (tunnel); /* now owned by the next process */
 	else
 		destroy_static_tunnel (tunnel);
 
+	if (val == RUN_RELEASE)
+		miredo_handoff_send (miredo_handoff_fd[0], seq, MIREDO_HANDOFF_BYE,
+		                     NULL, 0);
+	free (c.ifname);
 	return retval;
 }
 
@@ -644,6 +975,8 @@ int main (int argc, char *argv[])
 
 	miredo_name = "miredo";
 	miredo_run = relay_run;
+	miredo_handoff_supported = true;
+	miredo_reload_supported = true;
 
 	return miredo_main (argc, argv);
 }
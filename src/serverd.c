@@ -48,6 +48,7 @@
 #include "conf.h"
 
 #include <libteredo/server.h>
+#include <libteredo/tunnel.h>
 
 
 static int
@@ -105,8 +106,17 @@ server_run (miredo_conf *conf, const char *server_name)
 	// Sets up server (needs privileges to create raw socket)
 	server = teredo_server_create (server_ip, server_ip2);
 
+	teredo_stats *stats = teredo_stats_publish (miredo_stats_path, 1000);
+	if (stats == NULL)
+		syslog (LOG_WARNING, _("Cannot publish statistics in %s: %m"),
+		        miredo_stats_path);
+
 	if (drop_privileges ())
+	{
+		if (stats != NULL)
+			teredo_stats_unpublish (stats);
 		return -1;
+	}
 
 	if (server != NULL)
 	{
@@ -123,8 +133,12 @@ server_run (miredo_conf *conf, const char *server_name)
 			/* wait for fatal signal */
 			while (sigwait (&set, &dummy) != 0);
 
+			syslog (LOG_INFO, _("%lu packet(s) dropped by the kernel"),
+			        teredo_server_get_filtered (server));
 			teredo_server_stop (server);
 			teredo_server_destroy (server);
+			if (stats != NULL)
+				teredo_stats_unpublish (stats);
 
 			// parent's been signaled or died
 			return 0;
@@ -132,6 +146,9 @@ server_run (miredo_conf *conf, const char *server_name)
 		teredo_server_destroy (server);
 	}
 
+	if (stats != NULL)
+		teredo_stats_unpublish (stats);
+
 	syslog (LOG_ALERT, _("Teredo server fatal error"));
 	syslog (LOG_NOTICE, _("Make sure another instance "
 	        "of the program is not already running."));
@@ -0,0 +1,525 @@
+/*
+ * stat.c - Miredo statistics viewer
+ */
+
+/***********************************************************************
+ *  Copyright © 2026 Rémi Denis-Courmont and contributors.             *
+ *  This program is free software; you can redistribute and/or modify  *
+ *  it under the terms of the GNU General Public License as published  *
+ *  by the Free Software Foundation; version 2 of the license, or (at  *
+ *  your option) any later version.                                    *
+ *                                                                     *
+ *  This program is distributed in the hope that it will be useful,    *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of     *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.               *
+ *  See the GNU General Public License for more details.               *
+ *                                                                     *
+ *  You should have received a copy of the GNU General Public License  *
+ *  along with this program; if not, you can get it from:              *
+ *  http://www.gnu.org/copyleft/gpl.html                               *
+ ***********************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <locale.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_GETOPT_H
+# include <getopt.h>
+#endif
+
+#include <libteredo/stats.h>
+#include "miredo.h"
+
+/**
+ * Mapped statistics segment.
+ */
+typedef struct stats_map
+{
+	teredo_stats_header *hdr;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+} stats_map;
+
+
+/**
+ * @return the number of histograms (0 if the daemon does not provide any).
+ */
+static unsigned stats_histograms (const teredo_stats_header *h)
+{
+	return (h->header_size >= sizeof (*h)) ? h->histograms : 0;
+}
+
+
+/**
+ * @return the number of values in a snapshot.
+ */
+static size_t stats_values (const teredo_stats_header *h)
+{
+	return h->count + (size_t)stats_histograms (h) * h->buckets;
+}
+
+
+static void stats_close (stats_map *m)
+{
+	if (m->hdr != NULL)
+		munmap (m->hdr, m->size);
+	m->hdr = NULL;
+}
+
+
+/**
+ * Maps and validates a statistics segment.
+ * @return 0 on success, -1 on error.
+ */
+static int stats_open (stats_map *m, const char *path)
+{
+	struct stat st;
+
+	m->hdr = NULL;
+
+	int fd = open (path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+	{
+		fprintf (stderr, _("Error (%s): %s\n"), path, strerror (errno));
+		return -1;
+	}
+
+	void *map = MAP_FAILED;
+	if ((fstat (fd, &st) == 0)
+	 && ((size_t)st.st_size >= sizeof (teredo_stats_header)))
+		map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED)
+	{
+		fprintf (stderr, _("Error (%s): %s\n"), path,
+		         _("Invalid statistics file"));
+		return -1;
+	}
+
+	const teredo_stats_header *h = map;
+
+	if ((h->magic != TEREDO_STATS_MAGIC)
+	 || (h->version != TEREDO_STATS_VERSION)
+	 || (h->header_size < offsetof (teredo_stats_header, histograms))
+	 || (h->size > (size_t)st.st_size)
+	 || (h->names > h->size)
+	 || (h->values > h->size)
+	 || (h->values % sizeof (uint64_t))
+	 || ((h->size - h->names) / sizeof (teredo_stats_name) < h->count)
+	 || ((h->size - h->values) / sizeof (uint64_t) < h->count)
+	 || ((stats_histograms (h) > 0)
+	  && ((h->hist_names > h->size)
+	   || (h->hist_values > h->size)
+	   || (h->hist_values % sizeof (uint64_t))
+	   || (h->sub_bits > 16)
+	   || (h->buckets <= (2u << h->sub_bits))
+	   || (((h->buckets - (2u << h->sub_bits)) >> h->sub_bits)
+	       + h->sub_bits >= 63)
+	   || ((h->size - h->hist_names) / sizeof (teredo_stats_name)
+	       < h->histograms)
+	   || ((h->size - h->hist_values) / sizeof (uint64_t) / h->buckets
+	       < h->histograms))))
+	{
+		munmap (map, st.st_size);
+		fprintf (stderr, _("Error (%s): %s\n"), path,
+		         _("Invalid statistics file"));
+		return -1;
+	}
+
+	m->hdr = map;
+	m->size = st.st_size;
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	return 0;
+}
+
+
+/**
+ * @return whether the segment was replaced, e.g. by a new daemon process.
+ */
+static bool stats_replaced (const stats_map *m, const char *path)
+{
+	struct stat st;
+
+	return (stat (path, &st) == 0)
+	    && ((st.st_dev != m->dev) || (st.st_ino != m->ino));
+}
+
+
+static bool stats_running (const stats_map *m)
+{
+	const teredo_stats_header *h = m->hdr;
+
+	if (atomic_load_explicit (&m->hdr->stopped, memory_order_acquire))
+		return false;
+	return (kill (h->pid, 0) == 0) || (errno != ESRCH);
+}
+
+
+/**
+ * Copies a consistent snapshot of the values.
+ */
+static void stats_read (const stats_map *m, uint64_t *values,
+                        uint64_t *timestamp)
+{
+	teredo_stats_header *h = m->hdr;
+	atomic_uint_least64_t *v =
+		(atomic_uint_least64_t *)(((char *)h) + h->values);
+	atomic_uint_least64_t *hv =
+		(atomic_uint_least64_t *)(((char *)h) + h->hist_values);
+	size_t nhist = stats_values (h) - h->count;
+
+	for (;;)
+	{
+		uint_least32_t seq = atomic_load_explicit (&h->seq,
+		                                           memory_order_acquire);
+		if (seq & 1)
+		{	/* update in progress */
+			nanosleep (&(struct timespec){ 0, 100000 }, NULL);
+			continue;
+		}
+
+		for (unsigned i = 0; i < h->count; i++)
+			values[i] = atomic_load_explicit (v + i, memory_order_relaxed);
+		for (size_t i = 0; i < nhist; i++)
+			values[h->count + i] = atomic_load_explicit (hv + i,
+			                                             memory_order_relaxed);
+		*timestamp = atomic_load_explicit (&h->timestamp,
+		                                   memory_order_relaxed);
+
+		atomic_thread_fence (memory_order_acquire);
+		if (atomic_load_explicit (&h->seq, memory_order_relaxed) == seq)
+			break;
+	}
+}
+
+
+static void print_duration (uint64_t secs)
+{
+	if (secs >= 86400)
+		printf ("%"PRIu64"d ", secs / 86400);
+	printf ("%02u:%02u:%02u", (unsigned)(secs / 3600 % 24),
+	        (unsigned)(secs / 60 % 60), (unsigned)(secs % 60));
+}
+
+
+/**
+ * @return the largest value of a histogram bucket.
+ */
+static uint64_t hist_upper (const teredo_stats_header *h, unsigned i)
+{
+	if (i + 1u >= h->buckets)
+		return teredo_hist_value (i, h->sub_bits);
+	return teredo_hist_value (i + 1, h->sub_bits) - 1;
+}
+
+
+/**
+ * Computes the percentiles and maximum of a histogram.
+ * @param q percentiles (in increasing order)
+ * @param res [out] values for each percentile, followed by the maximum
+ * @return the number of samples.
+ */
+static uint64_t hist_summary (const teredo_stats_header *h,
+                              const uint64_t *buckets, const double *q,
+                              unsigned n, uint64_t *res)
+{
+	uint64_t total = 0, sum = 0;
+	unsigned k = 0;
+
+	for (unsigned i = 0; i < h->buckets; i++)
+		total += buckets[i];
+	memset (res, 0, (n + 1) * sizeof (*res));
+
+	for (unsigned i = 0; i < h->buckets; i++)
+	{
+		if (buckets[i] == 0)
+			continue;
+
+		sum += buckets[i];
+		while ((k < n) && (sum >= q[k] * total))
+			res[k++] = hist_upper (h, i);
+		res[n] = hist_upper (h, i);
+	}
+	return total;
+}
+
+
+static const double percentiles[] = { .5, .9, .99, .999 };
+static const char percentile_names[][5] = { "p50", "p90", "p99", "p999" };
+#define PERCENTILES (sizeof (percentiles) / sizeof (percentiles[0]))
+
+
+/**
+ * Prints a snapshot.
+ * @param prev previous snapshot of the same process, or NULL
+ * @param elapsed time since the previous snapshot (nanoseconds)
+ */
+static void stats_print (const stats_map *m, const uint64_t *values,
+                         uint64_t timestamp, const uint64_t *prev,
+                         uint64_t elapsed, bool raw, bool all)
+{
+	const teredo_stats_header *h = m->hdr;
+	const teredo_stats_name *names =
+		(const teredo_stats_name *)(((const char *)h) + h->names);
+	bool running = stats_running (m);
+
+	if (raw)
+	{
+		printf ("timestamp %"PRIu64"\n" "pid %"PRIu32"\n" "running %d\n",
+		        timestamp, h->pid, running);
+	}
+	else
+	{
+		printf (_("Process %u (%s), up "), (unsigned)h->pid,
+		        running ? _("running") : _("stopped"));
+		print_duration ((timestamp - h->started) / 1000000000);
+		puts ("");
+	}
+
+	for (unsigned i = 0; i < h->count; i++)
+	{
+		char name[sizeof (names[i].name) + 1];
+		bool counter = names[i].type == TEREDO_STATS_COUNTER;
+
+		memcpy (name, names[i].name, sizeof (names[i].name));
+		name[sizeof (names[i].name)] = '\0';
+
+		if (raw)
+		{
+			printf ("%s %"PRIu64"\n", name, values[i]);
+			continue;
+		}
+
+		if (!all && (values[i] == 0))
+			continue;
+
+		if (counter)
+			printf ("%-24s %20"PRIu64, name, values[i]);
+		else
+			printf ("%-24s %20"PRId64, name, (int64_t)values[i]);
+
+		if (counter && (prev != NULL) && (elapsed > 0))
+			printf (" %14.1f/s", (values[i] - prev[i]) * 1e9 / elapsed);
+		puts ("");
+	}
+
+	const teredo_stats_name *hnames =
+		(const teredo_stats_name *)(((const char *)h) + h->hist_names);
+	unsigned nhist = stats_histograms (h);
+
+	for (unsigned i = 0; i < nhist; i++)
+	{
+		char name[sizeof (hnames[i].name) + 1];
+		const uint64_t *b = values + h->count + i * h->buckets;
+		uint64_t delta[h->buckets], res[PERCENTILES + 1];
+
+		memcpy (name, hnames[i].name, sizeof (hnames[i].name));
+		name[sizeof (hnames[i].name)] = '\0';
+
+		/* Percentiles of the last interval, if any */
+		if (!raw && (prev != NULL))
+		{
+			const uint64_t *pb = prev + h->count + i * h->buckets;
+
+			for (unsigned j = 0; j < h->buckets; j++)
+				delta[j] = b[j] - pb[j];
+			b = delta;
+		}
+
+		uint64_t total = hist_summary (h, b, percentiles, PERCENTILES, res);
+
+		if (raw)
+		{
+			printf ("%s_count %"PRIu64"\n", name, total);
+			for (unsigned j = 0; j < PERCENTILES; j++)
+				printf ("%s_%s %"PRIu64"\n", name, percentile_names[j],
+				        res[j]);
+			printf ("%s_max %"PRIu64"\n", name, res[PERCENTILES]);
+			continue;
+		}
+
+		if (!all && (total == 0))
+			continue;
+
+		printf ("%-24s %20"PRIu64, name, total);
+		for (unsigned j = 0; j <= PERCENTILES; j++)
+			printf (" %s %.1f", (j < PERCENTILES) ? percentile_names[j]
+			                                      : "max", res[j] / 1e3);
+		puts (" us");
+	}
+
+	if (raw)
+		puts ("");
+	fflush (stdout);
+}
+
+
+static int usage (const char *path)
+{
+	printf (_(
+"Usage: %s [OPTIONS] [NAME|FILE]\n"
+"Displays the statistics of a Miredo daemon.\n"
+"\n"
+"  -a, --all       display null values too\n"
+"  -c, --count     number of reports (default: one, or unlimited with -i)\n"
+"  -h, --help      display this help and exit\n"
+"  -i, --interval  repeat every given number of seconds, with rates\n"
+"  -r, --raw       machine-readable output\n"
+"  -V, --version   display program version and exit\n"), path);
+	return 0;
+}
+
+
+int main (int argc, char *argv[])
+{
+	setlocale (LC_ALL, "");
+	bindtextdomain (PACKAGE_NAME, LOCALEDIR);
+
+	static const struct option opts[] =
+	{
+		{ "all",        no_argument,       NULL, 'a' },
+		{ "count",      required_argument, NULL, 'c' },
+		{ "help",       no_argument,       NULL, 'h' },
+		{ "interval",   required_argument, NULL, 'i' },
+		{ "raw",        no_argument,       NULL, 'r' },
+		{ "version",    no_argument,       NULL, 'V' },
+		{ NULL,         no_argument,       NULL, '\0'}
+	};
+
+	unsigned long count = 1;
+	double interval = 0.;
+	bool all = false, raw = false, counted = false;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "ac:hi:rV", opts, NULL)) != -1)
+		switch (c)
+		{
+			case 'a':
+				all = true;
+				break;
+
+			case 'c':
+				count = strtoul (optarg, NULL, 10);
+				counted = true;
+				break;
+
+			case 'h':
+				return usage (argv[0]);
+
+			case 'i':
+				interval = strtod (optarg, NULL);
+				if (!(interval > 0.))
+				{
+					fprintf (stderr, _("Invalid interval: %s\n"), optarg);
+					return 1;
+				}
+				if (!counted)
+					count = 0;
+				break;
+
+			case 'r':
+				raw = true;
+				break;
+
+			case 'V':
+				return miredo_version ();
+
+			default:
+				return 1;
+		}
+
+	const char *name = (optind < argc) ? argv[optind++] : "miredo";
+	if (optind < argc)
+	{
+		fprintf (stderr, _("%s: unexpected extra parameter\n"), argv[optind]);
+		return 1;
+	}
+
+	/* A plain name designates the file of a daemon */
+	char path[strchr (name, '/') ? strlen (name) + 1
+	          : sizeof (LOCALSTATEDIR"/run/" ".stats") + strlen (name)];
+	if (strchr (name, '/'))
+		strcpy (path, name);
+	else
+		sprintf (path, LOCALSTATEDIR"/run/%s.stats", name);
+
+	stats_map m;
+	if (stats_open (&m, path))
+		return 1;
+
+	bool clear = (interval > 0.) && !raw && isatty (STDOUT_FILENO);
+	uint64_t *prev = NULL, last = 0;
+	uint32_t pid = 0;
+
+	for (unsigned long n = 0; (count == 0) || (n < count); n++)
+	{
+		if (n > 0)
+		{
+			struct timespec ts = {
+				.tv_sec = interval,
+				.tv_nsec = (interval - (time_t)interval) * 1e9,
+			};
+			nanosleep (&ts, NULL);
+
+			if (stats_replaced (&m, path))
+			{
+				stats_map nm;
+
+				if (stats_open (&nm, path) == 0)
+				{
+					stats_close (&m);
+					m = nm;
+				}
+			}
+		}
+
+		const teredo_stats_header *h = m.hdr;
+		uint64_t timestamp, *buf;
+
+		if (h->pid != pid)
+		{	/* Different process: no rates */
+			free (prev);
+			prev = NULL;
+			pid = h->pid;
+		}
+
+		buf = malloc (stats_values (h) * sizeof (*buf));
+		if (buf == NULL)
+			break;
+
+		stats_read (&m, buf, &timestamp);
+
+		if (clear)
+			fputs ("\033[H\033[2J", stdout);
+		stats_print (&m, buf, timestamp, prev, timestamp - last, raw, all);
+
+		free (prev);
+		prev = buf;
+		last = timestamp;
+	}
+
+	free (prev);
+	stats_close (&m);
+	return 0;
+}